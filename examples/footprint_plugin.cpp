@@ -0,0 +1,71 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// Example analysis plugin: memory footprint per function, i.e., the number of
+// distinct cache lines each function has accessed. Run an instrumented
+// program with
+//   CATS_PLUGINS=./libcats_footprint.so CATS_STORAGE=none CATS_DEDUP=none
+
+#include <cats_plugin.h>
+
+#include <cstdint>
+#include <iostream>
+#include <map>
+#include <string>
+#include <unordered_set>
+
+namespace {
+
+const uint64_t LINE_SIZE = 64;
+
+struct Footprint {
+  const cats_plugin_host *host;
+  std::map<std::string, std::unordered_set<uint64_t>> lines;
+};
+
+void *init(const cats_plugin_host *host) {
+  Footprint *footprint = new Footprint();
+  footprint->host = host;
+  return footprint;
+}
+
+void process(void *state, const cats_plugin_event *events, size_t n_events) {
+  Footprint *footprint = (Footprint *) state;
+  for (size_t i = 0; i < n_events; ++i) {
+    const cats_plugin_event &event = events[i];
+    if (event.event_type != CATS_EVENT_TYPE_ACCESS)
+      continue;
+    const cats_plugin_site *site = footprint->host->site(event.site);
+    uint64_t first = event.address / LINE_SIZE;
+    uint64_t last = (event.address + (event.size ? event.size - 1 : 0)) /
+                    LINE_SIZE;
+    auto &lines = footprint->lines[site->funcname];
+    for (uint64_t line = first; line <= last; ++line)
+      lines.insert(line);
+  }
+}
+
+void finish(void *state) {
+  Footprint *footprint = (Footprint *) state;
+  std::cout << "Footprint per function (bytes):" << std::endl;
+  for (auto &function : footprint->lines) {
+    std::cout << "  " << function.first << ": "
+              << function.second.size() * LINE_SIZE << std::endl;
+  }
+  delete footprint;
+}
+
+const cats_plugin plugin = {
+  CATS_PLUGIN_ABI_VERSION,
+  "footprint",
+  CATS_PLUGIN_MODE_CONSUMER,
+  init,
+  process,
+  finish,
+};
+
+} // namespace
+
+extern "C" __attribute__((visibility("default")))
+const cats_plugin *cats_plugin_entry(void) {
+  return &plugin;
+}
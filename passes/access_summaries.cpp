@@ -0,0 +1,458 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_passes.hpp"
+
+#include "llvm/Demangle/Demangle.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <cctype>
+#include <cstdlib>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+using namespace llvm;
+
+// Summaries of library functions whose memory accesses are not visible to
+// the load/store instrumentation. One function per line:
+//
+//   name: mode $arg extent; mode $arg extent; ...
+//
+// mode is r, w or rw, and extent is the number of bytes accessed through
+// argument $arg, an integer expression over the arguments of the call:
+//
+//   expr := cmp ['?' expr ':' expr]
+//   cmp  := sum [('==' | '!=') sum]
+//   sum  := prod {('+' | '-') prod}
+//   prod := atom {'*' atom}
+//   atom := NUMBER | $N | *$N | '(' expr ')' | max(expr, expr)
+//         | min(expr, expr) | abs(expr)
+//
+// $N is argument N (pointers as addresses, so `$1 - $0` is the length of a
+// range) and *$N the 32-bit integer it points to, as Fortran passes its
+// arguments. A '*' at the end of the name matches any suffix, a '?' is
+// expanded to the BLAS/LAPACK precisions s, d, c and z, with '%' in the
+// extents standing for the element size. An access is skipped if the call
+// does not pass a pointer as its $arg. More summaries can be given in the
+// file named by CATS_ACCESS_SUMMARIES.
+static const char *const builtin_summaries[] = {
+  // LLVM intrinsics, the type suffixes of the name are ignored
+  "llvm.memcpy: w $0 $2; r $1 $2",
+  "llvm.memcpy.inline: w $0 $2; r $1 $2",
+  "llvm.memmove: w $0 $2; r $1 $2",
+  "llvm.memset: w $0 $2",
+  "llvm.memset.inline: w $0 $2",
+
+  // C library
+  "memcpy: w $0 $2; r $1 $2",
+  "memmove: w $0 $2; r $1 $2",
+  "memset: w $0 $2",
+  "memcmp: r $0 $2; r $1 $2",
+  "memchr: r $0 $2",
+  "bzero: w $0 $1",
+  "explicit_bzero: w $0 $1",
+  "qsort: rw $0 $1 * $2",
+
+  // C++ algorithms on raw pointers and vector iterators, [first, last)
+  "_ZSt4sortIP*: rw $0 $1 - $0",
+  "_ZSt4sortIN9__gnu_cxx17__normal_iteratorIP*: rw $0 $1 - $0",
+  "_ZSt11stable_sortIP*: rw $0 $1 - $0",
+  "_ZSt11stable_sortIN9__gnu_cxx17__normal_iteratorIP*: rw $0 $1 - $0",
+  "_ZSt4copyIP*: r $0 $1 - $0; w $2 $1 - $0",
+  "_ZSt4fillIP*: w $0 $1 - $0",
+
+  // CBLAS, CblasColMajor = 102, CblasNoTrans = 111
+  "cblas_?gemm: "
+    "r $7 $8 * ($0 == 102 ? ($1 == 111 ? $5 : $3) : ($1 == 111 ? $3 : $5)) * %; "
+    "r $9 $10 * ($0 == 102 ? ($2 == 111 ? $4 : $5) : ($2 == 111 ? $5 : $4)) * %; "
+    "rw $12 $13 * ($0 == 102 ? $4 : $3) * %",
+  "cblas_?gemv: "
+    "r $5 $6 * ($0 == 102 ? $3 : $2) * %; "
+    "r $7 (abs($8) * (($1 == 111 ? $3 : $2) - 1) + 1) * %; "
+    "rw $10 (abs($11) * (($1 == 111 ? $2 : $3) - 1) + 1) * %",
+  "cblas_?axpy: r $2 (abs($3) * ($0 - 1) + 1) * %; "
+    "rw $4 (abs($5) * ($0 - 1) + 1) * %",
+  "cblas_?copy: r $1 (abs($2) * ($0 - 1) + 1) * %; "
+    "w $3 (abs($4) * ($0 - 1) + 1) * %",
+  "cblas_?scal: rw $2 (abs($3) * ($0 - 1) + 1) * %",
+  "cblas_sdot: r $1 (abs($2) * ($0 - 1) + 1) * 4; "
+    "r $3 (abs($4) * ($0 - 1) + 1) * 4",
+  "cblas_ddot: r $1 (abs($2) * ($0 - 1) + 1) * 8; "
+    "r $3 (abs($4) * ($0 - 1) + 1) * 8",
+
+  // Fortran BLAS and LAPACK. The transposition flags are characters, so
+  // both orientations are covered by the larger extent.
+  "?gemm_: r $6 *$7 * max(*$2, *$4) * %; r $8 *$9 * max(*$3, *$4) * %; "
+    "rw $11 *$12 * *$3 * %",
+  "?axpy_: r $2 (abs(*$3) * (*$0 - 1) + 1) * %; "
+    "rw $4 (abs(*$5) * (*$0 - 1) + 1) * %",
+  "?copy_: r $1 (abs(*$2) * (*$0 - 1) + 1) * %; "
+    "w $3 (abs(*$4) * (*$0 - 1) + 1) * %",
+  "?scal_: rw $2 (abs(*$3) * (*$0 - 1) + 1) * %",
+  "?gesv_: rw $2 *$3 * *$0 * %; w $4 *$0 * 4; rw $5 *$6 * *$1 * %",
+  "?getrf_: rw $2 *$3 * *$1 * %; w $4 min(*$0, *$1) * 4",
+  "?getrs_: r $3 *$4 * *$1 * %; r $5 *$1 * 4; rw $6 *$7 * *$2 * %",
+  "?potrf_: rw $2 *$3 * *$1 * %",
+};
+
+struct ExtentExpr {
+  enum Kind {
+    CONST, ARG, LOAD, ADD, SUB, MUL, EQ, NE, SELECT, MAX, MIN, ABS
+  };
+  Kind K = CONST;
+  int64_t Value = 0;    // Constant or argument number
+  std::vector<std::unique_ptr<ExtentExpr>> Ops;
+};
+
+namespace {
+
+class Extent_Parser {
+public:
+  explicit Extent_Parser(const std::string &Text) : Text(Text) {}
+
+  std::unique_ptr<ExtentExpr> parse() {
+    std::unique_ptr<ExtentExpr> E = expr();
+    skipSpace();
+    if (!E || Pos != Text.size())
+      return nullptr;
+    return E;
+  }
+
+private:
+  const std::string &Text;
+  size_t Pos = 0;
+
+  void skipSpace() {
+    while (Pos < Text.size() && std::isspace((unsigned char) Text[Pos]))
+      ++Pos;
+  }
+
+  bool accept(const char *Token) {
+    skipSpace();
+    size_t Len = std::char_traits<char>::length(Token);
+    if (Text.compare(Pos, Len, Token) != 0)
+      return false;
+    Pos += Len;
+    return true;
+  }
+
+  static std::unique_ptr<ExtentExpr> node(
+    ExtentExpr::Kind K, std::unique_ptr<ExtentExpr> A,
+    std::unique_ptr<ExtentExpr> B = nullptr,
+    std::unique_ptr<ExtentExpr> C = nullptr
+  ) {
+    if (!A || (K != ExtentExpr::ABS && !B) || (K == ExtentExpr::SELECT && !C))
+      return nullptr;
+    std::unique_ptr<ExtentExpr> E(new ExtentExpr());
+    E->K = K;
+    E->Ops.push_back(std::move(A));
+    if (B) E->Ops.push_back(std::move(B));
+    if (C) E->Ops.push_back(std::move(C));
+    return E;
+  }
+
+  std::unique_ptr<ExtentExpr> expr() {
+    std::unique_ptr<ExtentExpr> Cond = cmp();
+    if (!accept("?"))
+      return Cond;
+    std::unique_ptr<ExtentExpr> Then = expr();
+    if (!accept(":"))
+      return nullptr;
+    return node(ExtentExpr::SELECT, std::move(Cond), std::move(Then), expr());
+  }
+
+  std::unique_ptr<ExtentExpr> cmp() {
+    std::unique_ptr<ExtentExpr> Lhs = sum();
+    if (accept("=="))
+      return node(ExtentExpr::EQ, std::move(Lhs), sum());
+    if (accept("!="))
+      return node(ExtentExpr::NE, std::move(Lhs), sum());
+    return Lhs;
+  }
+
+  std::unique_ptr<ExtentExpr> sum() {
+    std::unique_ptr<ExtentExpr> Lhs = prod();
+    while (Lhs) {
+      if (accept("+"))
+        Lhs = node(ExtentExpr::ADD, std::move(Lhs), prod());
+      else if (accept("-"))
+        Lhs = node(ExtentExpr::SUB, std::move(Lhs), prod());
+      else
+        break;
+    }
+    return Lhs;
+  }
+
+  std::unique_ptr<ExtentExpr> prod() {
+    std::unique_ptr<ExtentExpr> Lhs = atom();
+    while (Lhs && accept("*"))
+      Lhs = node(ExtentExpr::MUL, std::move(Lhs), atom());
+    return Lhs;
+  }
+
+  std::unique_ptr<ExtentExpr> number(ExtentExpr::Kind K) {
+    skipSpace();
+    size_t Start = Pos;
+    while (Pos < Text.size() && std::isdigit((unsigned char) Text[Pos]))
+      ++Pos;
+    if (Pos == Start)
+      return nullptr;
+    std::unique_ptr<ExtentExpr> E(new ExtentExpr());
+    E->K = K;
+    E->Value = std::strtoll(Text.c_str() + Start, nullptr, 10);
+    return E;
+  }
+
+  std::unique_ptr<ExtentExpr> call(ExtentExpr::Kind K) {
+    if (!accept("("))
+      return nullptr;
+    std::unique_ptr<ExtentExpr> A = expr();
+    std::unique_ptr<ExtentExpr> B;
+    if (K != ExtentExpr::ABS && !(accept(",") && (B = expr())))
+      return nullptr;
+    if (!accept(")"))
+      return nullptr;
+    return node(K, std::move(A), std::move(B));
+  }
+
+  std::unique_ptr<ExtentExpr> atom() {
+    if (accept("("))  {
+      std::unique_ptr<ExtentExpr> E = expr();
+      return accept(")") ? std::move(E) : nullptr;
+    }
+    if (accept("*$"))
+      return number(ExtentExpr::LOAD);
+    if (accept("$"))
+      return number(ExtentExpr::ARG);
+    if (accept("max"))
+      return call(ExtentExpr::MAX);
+    if (accept("min"))
+      return call(ExtentExpr::MIN);
+    if (accept("abs"))
+      return call(ExtentExpr::ABS);
+    return number(ExtentExpr::CONST);
+  }
+};
+
+struct Summary_Database {
+  std::map<std::string, AccessSummary> exact;
+  // Names ending in '*', matched by prefix
+  std::vector<std::pair<std::string, AccessSummary>> prefixes;
+};
+
+} // namespace
+
+static bool parseSummary(const std::string &Line, std::string &Name,
+                         AccessSummary &Summary) {
+  size_t Colon = Line.find(':');
+  if (Colon == std::string::npos)
+    return false;
+  Name = Line.substr(0, Colon);
+  Name.erase(0, Name.find_first_not_of(" \t"));
+  Name.erase(Name.find_last_not_of(" \t") + 1);
+  if (Name.empty())
+    return false;
+
+  size_t Pos = Colon + 1;
+  while (Pos < Line.size()) {
+    size_t End = Line.find(';', Pos);
+    if (End == std::string::npos)
+      End = Line.size();
+    std::string Entry = Line.substr(Pos, End - Pos);
+    Pos = End + 1;
+
+    size_t Start = Entry.find_first_not_of(" \t");
+    if (Start == std::string::npos)
+      continue;
+    size_t ModeEnd = Entry.find_first_of(" \t", Start);
+    if (ModeEnd == std::string::npos)
+      return false;
+    std::string Mode = Entry.substr(Start, ModeEnd - Start);
+    size_t ArgStart = Entry.find_first_not_of(" \t", ModeEnd);
+    if (ArgStart == std::string::npos || Entry[ArgStart] != '$')
+      return false;
+    size_t ArgEnd = Entry.find_first_of(" \t", ArgStart);
+    if (ArgEnd == std::string::npos)
+      return false;
+
+    ArgumentAccess Access;
+    Access.IsRead = Mode == "r" || Mode == "rw";
+    Access.IsWrite = Mode == "w" || Mode == "rw";
+    Access.Arg = (unsigned) std::strtoul(
+      Entry.c_str() + ArgStart + 1, nullptr, 10
+    );
+    std::string Extent = Entry.substr(ArgEnd);
+    Access.Extent = std::shared_ptr<const ExtentExpr>(
+      Extent_Parser(Extent).parse()
+    );
+    if (!(Access.IsRead || Access.IsWrite) || !Access.Extent)
+      return false;
+    Summary.Accesses.push_back(std::move(Access));
+  }
+  return !Summary.Accesses.empty();
+}
+
+static void addSummary(Summary_Database &DB, const std::string &Line) {
+  std::string Name;
+  AccessSummary Summary;
+  if (!parseSummary(Line, Name, Summary)) {
+    errs() << "CATS: Ignoring invalid access summary \"" << Line << "\"\n";
+    return;
+  }
+  if (Name.back() == '*') {
+    Name.pop_back();
+    DB.prefixes.emplace_back(Name, std::move(Summary));
+  } else {
+    DB.exact[Name] = std::move(Summary);
+  }
+}
+
+static void addBuiltinSummary(Summary_Database &DB, const std::string &Line) {
+  static const std::pair<char, const char *> precisions[] = {
+    {'s', "4"}, {'d', "8"}, {'c', "8"}, {'z', "16"}
+  };
+  size_t Wildcard = Line.find('?');
+  if (Wildcard == std::string::npos || Wildcard > Line.find(':')) {
+    addSummary(DB, Line);
+    return;
+  }
+  for (const auto &Precision : precisions) {
+    std::string Expanded;
+    for (size_t I = 0; I < Line.size(); ++I) {
+      if (I == Wildcard)
+        Expanded += Precision.first;
+      else if (Line[I] == '%')
+        Expanded += Precision.second;
+      else
+        Expanded += Line[I];
+    }
+    addSummary(DB, Expanded);
+  }
+}
+
+static Summary_Database buildSummaryDatabase() {
+  Summary_Database DB;
+  for (const char *Line : builtin_summaries)
+    addBuiltinSummary(DB, Line);
+
+  if (const char *Path = std::getenv("CATS_ACCESS_SUMMARIES")) {
+    std::ifstream File(Path);
+    if (!File) {
+      errs() << "CATS: Cannot read access summaries from " << Path << "\n";
+    }
+    std::string Line;
+    while (std::getline(File, Line)) {
+      size_t Start = Line.find_first_not_of(" \t");
+      if (Start == std::string::npos || Line[Start] == '#')
+        continue;
+      addSummary(DB, Line);
+    }
+  }
+  return DB;
+}
+
+// Whether the std::copy `Mangled` outputs to a pointer. Class output
+// iterators like std::back_insert_iterator are passed as a pointer by the
+// ABI as well, but std::copy then writes to the container, not through
+// the argument. The output iterator is the return type.
+static bool copiesToPointer(StringRef Mangled) {
+  std::string Demangled = demangle(Mangled.str());
+  size_t Pos = Demangled.find(" std::copy<");
+  return Pos != std::string::npos && Pos > 0 && Demangled[Pos - 1] == '*';
+}
+
+const AccessSummary *findAccessSummary(StringRef Name) {
+  static const Summary_Database DB = buildSummaryDatabase();
+
+  if (Name.starts_with("_ZSt4copyI") && !copiesToPointer(Name))
+    return nullptr;
+
+  // Overloaded intrinsics carry their types as suffixes, which are
+  // dropped one by one, e.g. llvm.memcpy.p0.p0.i64
+  StringRef Key = Name;
+  while (true) {
+    auto It = DB.exact.find(Key.str());
+    if (It != DB.exact.end())
+      return &It->second;
+    if (!Key.starts_with("llvm.") || Key.count('.') < 2)
+      break;
+    Key = Key.rsplit('.').first;
+  }
+  for (const auto &Entry : DB.prefixes) {
+    if (Name.starts_with(Entry.first))
+      return &Entry.second;
+  }
+  return nullptr;
+}
+
+Value *buildExtent(const ExtentExpr &Extent, CallBase *Call,
+                   IRBuilderBase &Builder) {
+  Type *Int64Ty = Builder.getInt64Ty();
+  std::vector<Value *> Ops;
+  for (const auto &Op : Extent.Ops) {
+    Value *V = buildExtent(*Op, Call, Builder);
+    if (!V)
+      return nullptr;
+    Ops.push_back(V);
+  }
+
+  switch (Extent.K) {
+    case ExtentExpr::CONST:
+      return ConstantInt::get(Int64Ty, Extent.Value, true);
+    case ExtentExpr::ARG:
+    case ExtentExpr::LOAD: {
+      if ((uint64_t) Extent.Value >= Call->arg_size())
+        return nullptr;
+      Value *Arg = Call->getArgOperand(Extent.Value);
+      if (Extent.K == ExtentExpr::LOAD) {
+        if (!Arg->getType()->isPointerTy())
+          return nullptr;
+        LoadInst *Load = Builder.CreateLoad(Builder.getInt32Ty(), Arg);
+        // Not an access of the program, see LoadStoreTracker
+        Load->setMetadata(
+          "cats.summary_extent", MDNode::get(Load->getContext(), {})
+        );
+        Arg = Load;
+      }
+      if (Arg->getType()->isPointerTy())
+        return Builder.CreatePtrToInt(Arg, Int64Ty);
+      if (Arg->getType()->isIntegerTy())
+        return Builder.CreateSExtOrTrunc(Arg, Int64Ty);
+      return nullptr;
+    }
+    case ExtentExpr::ADD:
+      return Builder.CreateAdd(Ops[0], Ops[1]);
+    case ExtentExpr::SUB:
+      return Builder.CreateSub(Ops[0], Ops[1]);
+    case ExtentExpr::MUL:
+      return Builder.CreateMul(Ops[0], Ops[1]);
+    case ExtentExpr::EQ:
+      return Builder.CreateZExt(Builder.CreateICmpEQ(Ops[0], Ops[1]), Int64Ty);
+    case ExtentExpr::NE:
+      return Builder.CreateZExt(Builder.CreateICmpNE(Ops[0], Ops[1]), Int64Ty);
+    case ExtentExpr::SELECT:
+      return Builder.CreateSelect(
+        Builder.CreateICmpNE(Ops[0], ConstantInt::get(Int64Ty, 0)),
+        Ops[1], Ops[2]
+      );
+    case ExtentExpr::MAX:
+      return Builder.CreateSelect(
+        Builder.CreateICmpSGT(Ops[0], Ops[1]), Ops[0], Ops[1]
+      );
+    case ExtentExpr::MIN:
+      return Builder.CreateSelect(
+        Builder.CreateICmpSLT(Ops[0], Ops[1]), Ops[0], Ops[1]
+      );
+    case ExtentExpr::ABS:
+      return Builder.CreateSelect(
+        Builder.CreateICmpSLT(Ops[0], ConstantInt::get(Int64Ty, 0)),
+        Builder.CreateNeg(Ops[0]), Ops[0]
+      );
+  }
+  return nullptr;
+}
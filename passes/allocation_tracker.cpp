@@ -12,6 +12,7 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Passes/PassBuilder.h"
 
+#include <map>
 #include <set>
 
 // Debug records are available since LLVM 17
@@ -45,6 +46,140 @@ std::set<std::string> names = {
     "_Znwm",  "free",    "_ZdlPv", "_ZdaPv",
 };
 
+// Operands of the I/O calls passed to cats_trace_instrument_io. Indices are
+// argument numbers, IO_RESULT is the return value and IO_NONE means absent.
+static const int IO_NONE = -1;
+static const int IO_RESULT = -2;
+
+struct IOCall {
+  uint8_t Op;
+  int Fd;
+  int Stream;
+  int Buffer;
+  int Bytes;
+  int Scale; // Element size multiplied with Bytes
+  // Instrumented before the call, which invalidates the descriptor
+  bool Before;
+};
+
+// Op values are CATS_IO_* in cats_runtime.h. Opens and closes are only
+// reported to refresh the runtime's cached descriptor paths.
+std::map<std::string, IOCall> io_calls = {
+    {"read", {0, 0, IO_NONE, 1, IO_RESULT, IO_NONE, false}},
+    {"write", {1, 0, IO_NONE, 1, IO_RESULT, IO_NONE, false}},
+    {"pread", {2, 0, IO_NONE, 1, IO_RESULT, IO_NONE, false}},
+    {"pread64", {2, 0, IO_NONE, 1, IO_RESULT, IO_NONE, false}},
+    {"pwrite", {3, 0, IO_NONE, 1, IO_RESULT, IO_NONE, false}},
+    {"pwrite64", {3, 0, IO_NONE, 1, IO_RESULT, IO_NONE, false}},
+    {"fread", {4, IO_NONE, 3, 0, IO_RESULT, 1, false}},
+    {"fwrite", {5, IO_NONE, 3, 0, IO_RESULT, 1, false}},
+    {"mmap", {6, 4, IO_NONE, IO_RESULT, 1, IO_NONE, false}},
+    {"mmap64", {6, 4, IO_NONE, IO_RESULT, 1, IO_NONE, false}},
+    {"munmap", {7, IO_NONE, IO_NONE, 0, 1, IO_NONE, false}},
+    {"open", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"open64", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"openat", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"openat64", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"creat", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"creat64", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"dup", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"dup2", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"dup3", {8, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"fopen", {8, IO_NONE, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"fopen64", {8, IO_NONE, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"fdopen", {8, IO_NONE, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"freopen", {8, IO_NONE, IO_RESULT, IO_NONE, IO_NONE, IO_NONE, false}},
+    {"close", {9, 0, IO_NONE, IO_NONE, IO_NONE, IO_NONE, true}},
+    {"fclose", {9, IO_NONE, 0, IO_NONE, IO_NONE, IO_NONE, true}},
+};
+
+bool AllocationTracker::instrumentIOCall(
+  CallInst *Call, FunctionCallee InstrumentIOFunc
+) {
+  const IOCall &IO =
+      io_calls.at(std::string{Call->getCalledFunction()->getName()});
+  for (int Index : {IO.Fd, IO.Stream, IO.Buffer, IO.Bytes, IO.Scale}) {
+    if (Index >= 0 && (unsigned) Index >= Call->arg_size())
+      return false;
+  }
+
+  // Check if instrumented before
+  for (Instruction *Next = IO.Before ? Call->getPrevNode()
+                                     : Call->getNextNode();
+       Next; Next = IO.Before ? Next->getPrevNode() : Next->getNextNode()) {
+    if (CallInst *Call2 = dyn_cast<CallInst>(Next)) {
+      Function *Callee2 = Call2->getCalledFunction();
+      if (Callee2 && Callee2->getName() == "cats_trace_instrument_io")
+        return false;
+      break;
+    }
+  }
+
+  Module *M = Call->getModule();
+  LLVMContext &Ctx = M->getContext();
+  IRBuilder<> Builder(IO.Before ? Call : Call->getNextNode());
+
+  auto Operand = [&](int Index) -> Value * {
+    return Index == IO_RESULT ? Call : Call->getArgOperand(Index);
+  };
+
+  Value *Fd = IO.Fd == IO_NONE
+    ? ConstantInt::get(Type::getInt32Ty(Ctx), -1, true)
+    : Builder.CreateSExtOrTrunc(Operand(IO.Fd), Type::getInt32Ty(Ctx));
+  Value *Stream = IO.Stream == IO_NONE
+    ? ConstantPointerNull::get(PointerType::getUnqual(Ctx))
+    : Operand(IO.Stream);
+  Value *Buffer = IO.Buffer == IO_NONE
+    ? ConstantPointerNull::get(PointerType::getUnqual(Ctx))
+    : Operand(IO.Buffer);
+  Value *Bytes = IO.Bytes == IO_NONE
+    ? ConstantInt::get(Type::getInt64Ty(Ctx), 0)
+    : Builder.CreateSExtOrTrunc(Operand(IO.Bytes), Type::getInt64Ty(Ctx));
+  if (IO.Scale != IO_NONE) {
+    Bytes = Builder.CreateMul(Bytes, Builder.CreateZExtOrTrunc(
+      Operand(IO.Scale), Type::getInt64Ty(Ctx)
+    ));
+  }
+
+  // Get debug location information
+  const DebugLoc &DL = Call->getDebugLoc();
+  unsigned Line = 0;
+  unsigned Col = 0;
+  StringRef Filename = "unknown";
+  if (DL) {
+    Line = DL.getLine();
+    Col = DL.getCol();
+    if (const DILocation *DIL = DL.get()) {
+      Filename = DIL->getFilename();
+    }
+  }
+
+  Constant *FilenameStr = ConstantDataArray::getString(Ctx, Filename);
+  Constant *FuncnameStr = ConstantDataArray::getString(
+      Ctx, Call->getCalledFunction()->getName());
+  GlobalVariable *FilenameGV = new GlobalVariable(
+      *M, FilenameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FilenameStr, "filename");
+  GlobalVariable *FuncnameGV = new GlobalVariable(
+      *M, FuncnameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FuncnameStr, "funcname");
+  Constant *Zero = ConstantInt::get(Type::getInt32Ty(Ctx), 0);
+  Constant *Indices[] = {Zero, Zero};
+  Constant *FilenamePtr = ConstantExpr::getGetElementPtr(
+      FilenameStr->getType(), FilenameGV, Indices, true);
+  Constant *FuncnamePtr = ConstantExpr::getGetElementPtr(
+      FuncnameStr->getType(), FuncnameGV, Indices, true);
+
+  Value *Args[] = {
+      ConstantInt::get(Type::getInt64Ty(Ctx), generateUniqueInt64ID(), false),
+      ConstantInt::get(Type::getInt8Ty(Ctx), IO.Op),
+      Fd, Stream, Buffer, Bytes, FuncnamePtr, FilenamePtr,
+      ConstantInt::get(Type::getInt32Ty(Ctx), Line),
+      ConstantInt::get(Type::getInt32Ty(Ctx), Col)};
+  Builder.CreateCall(InstrumentIOFunc, Args);
+  return true;
+}
+
 bool AllocationTracker::runOnFunction(Function &F) {
   if (functionHasAnnotation(F, "cats_noinstrument")) {
     errs() << "Skipping function " << F.getName() << "\n";
@@ -77,14 +212,37 @@ bool AllocationTracker::runOnFunction(Function &F) {
                          Type::getInt32Ty(M->getContext()),       /*line*/
                          Type::getInt32Ty(M->getContext())},      /*col*/
                         false));
+  FunctionCallee InstrumentIOFunc = M->getOrInsertFunction(
+      "cats_trace_instrument_io",
+      FunctionType::get(Type::getVoidTy(M->getContext()),
+                        {Type::getInt64Ty(M->getContext()),       /*call_id*/
+                         Type::getInt8Ty(M->getContext()),        /*op*/
+                         Type::getInt32Ty(M->getContext()),       /*fd*/
+                         PointerType::getUnqual(M->getContext()), /*stream*/
+                         PointerType::getUnqual(M->getContext()), /*address*/
+                         Type::getInt64Ty(M->getContext()),       /*bytes*/
+                         PointerType::getUnqual(M->getContext()), /*funcname*/
+                         PointerType::getUnqual(M->getContext()), /*filename*/
+                         Type::getInt32Ty(M->getContext()),       /*line*/
+                         Type::getInt32Ty(M->getContext())},      /*col*/
+                        false));
 
   // Iterate through all instructions in the function
   for (auto &BB : F) {
     for (auto Inst = BB.begin(); Inst != BB.end(); ++Inst) {
       // Check if the instruction is a call instruction
       if (CallInst *Call = dyn_cast<CallInst>(&*Inst)) {
-        // Check if the callee is an alloc/dealloc function
+        // Check if the callee is a file or mmap I/O function. Instructions
+        // inserted after the call are visited next, which is harmless since
+        // they are not instrumented.
         Function *Callee = Call->getCalledFunction();
+        if (Callee &&
+            io_calls.find(std::string{Callee->getName()}) != io_calls.end()) {
+          Modified |= this->instrumentIOCall(Call, InstrumentIOFunc);
+          continue;
+        }
+
+        // Check if the callee is an alloc/dealloc function
         if (Callee &&
             names.find(std::string{Callee->getName()}) != names.end()) {
           // Create IRBuilder to insert the new call instruction after the
@@ -0,0 +1,112 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_passes.hpp"
+
+#include "llvm/Analysis/Delinearization.h"
+#include "llvm/Analysis/ScalarEvolution.h"
+#include "llvm/Analysis/ScalarEvolutionExpressions.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Operator.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "../runtime/cats_runtime.h"
+
+#include <string>
+
+using namespace llvm;
+
+static std::string printSCEV(const SCEV *S) {
+  std::string Str;
+  raw_string_ostream OS(Str);
+  S->print(OS);
+  return OS.str();
+}
+
+// Subscripts are written as affine expressions of the induction variables,
+// Ld being the one of the loop at depth d (1 is the outermost loop), e.g.
+// "n + 2*L3".
+static std::string describeSubscript(const SCEV *S, ScalarEvolution &SE) {
+  if (const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(S)) {
+    std::string Start = describeSubscript(AR->getStart(), SE);
+    std::string Term = "L" + std::to_string(AR->getLoop()->getLoopDepth());
+    const SCEV *Step = AR->getStepRecurrence(SE);
+    if (!Step->isOne())
+      Term = printSCEV(Step) + "*" + Term;
+    return Start == "0" ? Term : Start + " + " + Term;
+  }
+  return printSCEV(S);
+}
+
+static bool drivenBy(const SCEV *S, const Loop *L) {
+  return SCEVExprContains(S, [L](const SCEV *E) {
+    const SCEVAddRecExpr *AR = dyn_cast<SCEVAddRecExpr>(E);
+    return AR && AR->getLoop() == L;
+  });
+}
+
+bool inferArrayShape(Instruction *I, Value *Ptr, ScalarEvolution &SE,
+                     LoopInfo &LI, ArrayShape &Shape) {
+  Loop *L = LI.getLoopFor(I->getParent());
+  if (!L || !SE.isSCEVable(Ptr->getType()))
+    return false;
+
+  SmallVector<const SCEV *, 4> Subscripts;
+  SmallVector<std::string, 4> Sizes;
+  uint64_t ElementSize = 0;
+
+  // Parametric sizes, as in A[i * n + k]
+  const SCEV *AccessFn = SE.getSCEV(Ptr);
+  const SCEVUnknown *Base = dyn_cast<SCEVUnknown>(SE.getPointerBase(AccessFn));
+  const SCEV *ElementSizeSCEV = SE.getElementSize(I);
+  if (Base && ElementSizeSCEV) {
+    SmallVector<const SCEV *, 4> SizeSCEVs;
+    delinearize(
+      SE, SE.getMinusSCEV(AccessFn, Base), Subscripts, SizeSCEVs,
+      ElementSizeSCEV
+    );
+    if (Subscripts.size() >= 2 && SizeSCEVs.size() == Subscripts.size()) {
+      for (size_t D = 0; D + 1 < SizeSCEVs.size(); ++D)
+        Sizes.push_back(printSCEV(SizeSCEVs[D]));
+      if (const SCEVConstant *C = dyn_cast<SCEVConstant>(SizeSCEVs.back()))
+        ElementSize = C->getAPInt().getZExtValue();
+    } else {
+      Subscripts.clear();
+    }
+  }
+
+  // Fixed sizes, as in double A[100][100]
+  if (Subscripts.empty()) {
+    GetElementPtrInst *GEP = dyn_cast<GetElementPtrInst>(Ptr);
+    SmallVector<int, 4> FixedSizes;
+    if (!GEP ||
+        !getIndexExpressionsFromGEP(SE, GEP, Subscripts, FixedSizes) ||
+        Subscripts.size() < 2)
+      return false;
+    for (int Size : FixedSizes)
+      Sizes.push_back(std::to_string(Size));
+    ElementSize = I->getModule()->getDataLayout().getTypeAllocSize(
+      GEP->getResultElementType()
+    ).getKnownMinValue();
+  }
+
+  Shape.Shape = "[*]";
+  for (const std::string &Size : Sizes)
+    Shape.Shape += "[" + Size + "]";
+  Shape.Subscripts.clear();
+  for (const SCEV *Subscript : Subscripts)
+    Shape.Subscripts += "[" + describeSubscript(Subscript, SE) + "]";
+  Shape.ElementSize = ElementSize;
+
+  // Row traversal walks the contiguous last dimension in the innermost
+  // loop, column traversal only the outer, strided ones.
+  Shape.Traversal = CATS_TRAVERSAL_INVARIANT;
+  for (size_t D = 0; D < Subscripts.size(); ++D) {
+    if (!drivenBy(Subscripts[D], L))
+      continue;
+    if (D + 1 == Subscripts.size())
+      Shape.Traversal = CATS_TRAVERSAL_ROW;
+    else if (Shape.Traversal != CATS_TRAVERSAL_ROW)
+      Shape.Traversal = CATS_TRAVERSAL_COLUMN;
+  }
+  return true;
+}
@@ -3,6 +3,9 @@
 #include "cats_passes.hpp"
 
 #include "llvm/IR/Constants.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/InstIterator.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
@@ -10,6 +13,7 @@
 #include <sstream>
 #include <iomanip>
 #include <functional>
+#include <vector>
 
 using namespace llvm;
 
@@ -44,6 +48,174 @@ void insertCatsTraceSave(Module &M) {
   NMD->addOperand(MetaNode);
 }
 
+StructType *getSiteInfoType(LLVMContext &Ctx) {
+  if (StructType *SiteTy = StructType::getTypeByName(Ctx, "cats.site_info"))
+    return SiteTy;
+  return StructType::create(
+    Ctx,
+    {Type::getInt64Ty(Ctx),           /*call_id*/
+     PointerType::getUnqual(Ctx),     /*struct_name*/
+     Type::getInt32Ty(Ctx),           /*struct_size*/
+     Type::getInt32Ty(Ctx),           /*field_index*/
+     Type::getInt32Ty(Ctx),           /*field_offset*/
+     Type::getInt32Ty(Ctx),           /*field_size*/
+     PointerType::getUnqual(Ctx),     /*shape*/
+     PointerType::getUnqual(Ctx),     /*subscripts*/
+     Type::getInt32Ty(Ctx),           /*element_size*/
+     Type::getInt32Ty(Ctx),           /*traversal*/
+     PointerType::getUnqual(Ctx)},    /*mix*/
+    "cats.site_info"
+  );
+}
+
+static StructType *getSiteTableType(LLVMContext &Ctx) {
+  if (StructType *TableTy = StructType::getTypeByName(Ctx, "cats.site_table"))
+    return TableTy;
+  return StructType::create(
+    Ctx,
+    {PointerType::getUnqual(Ctx),     /*next*/
+     PointerType::getUnqual(Ctx),     /*sites*/
+     Type::getInt64Ty(Ctx)},          /*count*/
+    "cats.site_table"
+  );
+}
+
+// The registration call of the site table constructor. Looked up by its
+// callee, the constructor may have been instrumented by a pass that ran
+// before it was marked.
+static CallInst *findRegisterCall(Function *Ctor) {
+  if (!Ctor)
+    return nullptr;
+  for (Instruction &I : instructions(*Ctor)) {
+    CallInst *Call = dyn_cast<CallInst>(&I);
+    Function *Callee = Call ? Call->getCalledFunction() : nullptr;
+    if (Callee && Callee->getName() == "cats_trace_register_site_tables")
+      return Call;
+  }
+  return nullptr;
+}
+
+void appendSiteInfo(Module &M, ArrayRef<Constant *> Sites) {
+  LLVMContext &Ctx = M.getContext();
+  StructType *SiteTy = getSiteInfoType(Ctx);
+  PointerType *PtrTy = PointerType::getUnqual(Ctx);
+
+  // Every call adds a table in front of the chain that the constructor
+  // registers, so the work per function does not grow with the module and
+  // the runtime still receives all sites of the module at once.
+  ArrayType *SitesTy = ArrayType::get(SiteTy, Sites.size());
+  GlobalVariable *SitesGV = new GlobalVariable(
+    M, SitesTy, true, GlobalValue::PrivateLinkage,
+    ConstantArray::get(SitesTy, Sites), "cats.sites"
+  );
+
+  Function *Ctor = M.getFunction("cats.register_sites");
+  CallInst *Call = findRegisterCall(Ctor);
+  Constant *Next = Call ? cast<Constant>(Call->getArgOperand(0))
+                        : ConstantPointerNull::get(PtrTy);
+
+  StructType *TableTy = getSiteTableType(Ctx);
+  GlobalVariable *Table = new GlobalVariable(
+    M, TableTy, true, GlobalValue::PrivateLinkage,
+    ConstantStruct::get(TableTy, {
+      Next,
+      ConstantExpr::getPointerCast(SitesGV, PtrTy),
+      ConstantInt::get(Type::getInt64Ty(Ctx), Sites.size())
+    }),
+    "cats.site_table"
+  );
+  Constant *TablePtr = ConstantExpr::getPointerCast(Table, PtrTy);
+
+  if (Call) {
+    Call->setArgOperand(0, TablePtr);
+    return;
+  }
+  FunctionCallee RegisterFunc = M.getOrInsertFunction(
+    "cats_trace_register_site_tables",
+    FunctionType::get(Type::getVoidTy(Ctx), {PtrTy /*tables*/}, false)
+  );
+  Ctor = Function::Create(
+    FunctionType::get(Type::getVoidTy(Ctx), false),
+    GlobalValue::InternalLinkage, "cats.register_sites", M
+  );
+  IRBuilder<> Builder(BasicBlock::Create(Ctx, "entry", Ctor));
+  Builder.CreateCall(RegisterFunc, {TablePtr});
+  Builder.CreateRetVoid();
+  appendToGlobalCtors(M, Ctor, 0);
+}
+
+void countInstructionMix(const BasicBlock &BB, InstructionMix &Mix) {
+  for (const Instruction &I : BB) {
+    if (isa<DbgInfoIntrinsic>(I))
+      continue;
+    if (const CallBase *Call = dyn_cast<CallBase>(&I)) {
+      // Instrumentation is not part of the program
+      Function *Callee = Call->getCalledFunction();
+      if (Callee && Callee->getName().starts_with("cats_trace_"))
+        continue;
+    }
+
+    bool Vector = I.getType()->isVectorTy() ||
+      any_of(I.operands(), [](const Use &Op) {
+        return Op->getType()->isVectorTy();
+      });
+    if (Vector)
+      ++Mix.VectorOps;
+
+    if (isa<LoadInst>(I)) {
+      ++Mix.Loads;
+    } else if (isa<StoreInst>(I)) {
+      ++Mix.Stores;
+    } else if (isa<BranchInst>(I) || isa<SwitchInst>(I) ||
+               isa<IndirectBrInst>(I)) {
+      ++Mix.Branches;
+    } else if (const IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I)) {
+      if (II->getType()->isFPOrFPVectorTy())
+        ++Mix.FPOps;
+      else if (II->getType()->isIntOrIntVectorTy())
+        ++Mix.IntOps;
+    } else if (isa<CallBase>(I)) {
+      ++Mix.Calls;
+    } else if (isa<FCmpInst>(I) ||
+               ((I.isUnaryOp() || I.isBinaryOp()) &&
+                I.getType()->isFPOrFPVectorTy())) {
+      ++Mix.FPOps;
+    } else if (isa<ICmpInst>(I) ||
+               (I.isBinaryOp() && I.getType()->isIntOrIntVectorTy())) {
+      ++Mix.IntOps;
+    }
+  }
+}
+
+Constant *scopeSiteInfo(Module &M, Constant *CallID,
+                        const InstructionMix &Mix) {
+  LLVMContext &Ctx = M.getContext();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  StructType *MixTy = StructType::getTypeByName(Ctx, "cats.instruction_mix");
+  if (!MixTy)
+    MixTy = StructType::create(Ctx, SmallVector<Type *, 7>(7, Int32Ty),
+                               "cats.instruction_mix");
+  Constant *MixConst = ConstantStruct::get(MixTy, {
+    ConstantInt::get(Int32Ty, Mix.Loads),
+    ConstantInt::get(Int32Ty, Mix.Stores),
+    ConstantInt::get(Int32Ty, Mix.FPOps),
+    ConstantInt::get(Int32Ty, Mix.IntOps),
+    ConstantInt::get(Int32Ty, Mix.Branches),
+    ConstantInt::get(Int32Ty, Mix.Calls),
+    ConstantInt::get(Int32Ty, Mix.VectorOps)
+  });
+  GlobalVariable *MixGV = new GlobalVariable(
+    M, MixTy, true, GlobalValue::PrivateLinkage, MixConst, "cats.mix"
+  );
+
+  Constant *Null = ConstantPointerNull::get(PointerType::getUnqual(Ctx));
+  Constant *Zero = ConstantInt::get(Int32Ty, 0);
+  return ConstantStruct::get(getSiteInfoType(Ctx), {
+    CallID, Null, Zero, Zero, Zero, Zero, Null, Null, Zero, Zero,
+    ConstantExpr::getPointerCast(MixGV, PointerType::getUnqual(Ctx))
+  });
+}
+
 int getCurrentScopeID(Module &M, bool increment) {
   if (NamedMDNode *NMD = M.getNamedMetadata("cats.trace.current_scope_id")) {
     for (const MDNode *MD : NMD->operands()) {
@@ -169,6 +341,11 @@ int getCurrentCallID(Module &M, bool increment) {
 }
 
 bool functionHasAnnotation(Function &F, StringRef Annotation) {
+  // Functions created by the passes, like the site table constructor, are
+  // never instrumented
+  if (Annotation == "cats_noinstrument" && F.getName().starts_with("cats."))
+    return true;
+
   // Look for llvm.global.annotations which stores
   // __attribute__((annotate(...)))
   Module *M = F.getParent();
@@ -47,6 +47,12 @@ PassPluginLibraryInfo getCallTrackerPassPluginInfo() {
           } else if (Name == LOOP_SCOPE_TRACKER_PASS_NAME) {
             FPM.addPass(LoopScopeTrackerPass());
             return true;
+          } else if (Name == SYNC_TRACKER_PASS_NAME) {
+            FPM.addPass(SyncTrackerPass());
+            return true;
+          } else if (Name == FLOP_COUNTER_PASS_NAME) {
+            FPM.addPass(FlopCounterPass());
+            return true;
           }
 
           return false;
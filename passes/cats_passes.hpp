@@ -5,14 +5,19 @@
 
 
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/PassManager.h"
 #include "llvm/Pass.h"
 
 #include <cstdint>
+#include <memory>
 #include <set>
+#include <string>
+#include <vector>
 
 #define CATS_PASSES_VERSION "0.1.0"
 
@@ -21,9 +26,33 @@
 #define FUNCTION_SCOPE_TRACKER_PASS_NAME  "cats-function-scope-tracker"
 #define LOOP_SCOPE_TRACKER_PASS_NAME      "cats-loop-scope-tracker"
 #define PARALLEL_SCOPE_TRACKER_PASS_NAME  "cats-parallel-scope-tracker"
+#define SYNC_TRACKER_PASS_NAME            "cats-sync-tracker"
+#define FLOP_COUNTER_PASS_NAME            "cats-flop-counter"
 
 
 void insertCatsTraceSave(llvm::Module &M);
+// Type of the cats_site_info records in cats_runtime.h
+llvm::StructType *getSiteInfoType(llvm::LLVMContext &Ctx);
+// Adds cats_site_info records to the site tables that the module registers
+// with cats_trace_register_site_tables from a constructor.
+void appendSiteInfo(llvm::Module &M, llvm::ArrayRef<llvm::Constant *> Sites);
+
+// Static instruction mix, see cats_instruction_mix in cats_runtime.h
+struct InstructionMix {
+  uint32_t Loads = 0;
+  uint32_t Stores = 0;
+  uint32_t FPOps = 0;
+  uint32_t IntOps = 0;
+  uint32_t Branches = 0;
+  uint32_t Calls = 0;
+  uint32_t VectorOps = 0;
+};
+
+// Adds the instructions of BB to Mix, skipping the instrumentation calls.
+void countInstructionMix(const llvm::BasicBlock &BB, InstructionMix &Mix);
+// Site record of a scope entry call with the instruction mix of the scope.
+llvm::Constant *scopeSiteInfo(llvm::Module &M, llvm::Constant *CallID,
+                              const InstructionMix &Mix);
 int getCurrentScopeID(llvm::Module &M, bool increment = true);
 uint64_t generateUniqueInt64ID();
 int getCurrentCallID(llvm::Module &M, bool increment = true);
@@ -38,6 +67,11 @@ public:
 
 private:
 
+  // Instruments a call to a file or mmap I/O function in io_calls.
+  bool instrumentIOCall(
+    llvm::CallInst *Call, llvm::FunctionCallee InstrumentIOFunc
+  );
+
   void findVariableNamesFromDbgIntrinsics(
     llvm::Value *AllocValue, std::set<std::string> &Names
   );
@@ -77,12 +111,65 @@ struct AllocationTrackerPass : llvm::PassInfoMixin<AllocationTrackerPass> {
   static bool isRequired() { return true; }
 };
 
+// Extent expression of an access summary, see access_summaries.cpp
+struct ExtentExpr;
+
+// Memory a library call accesses through one of its pointer arguments.
+struct ArgumentAccess {
+  unsigned Arg = 0;
+  bool IsRead = false;
+  bool IsWrite = false;
+  std::shared_ptr<const ExtentExpr> Extent;  // Bytes
+};
+
+struct AccessSummary {
+  std::vector<ArgumentAccess> Accesses;
+};
+
+// Summary of the function or LLVM intrinsic `Name`, nullptr if unknown.
+const AccessSummary *findAccessSummary(llvm::StringRef Name);
+
+// Emits the computation of an extent at the builder's insertion point.
+// Returns nullptr if the arguments of the call do not fit the expression.
+llvm::Value *buildExtent(const ExtentExpr &Extent, llvm::CallBase *Call,
+                         llvm::IRBuilderBase &Builder);
+
+// Shape of a multi-dimensional array access recovered by delinearization.
+struct ArrayShape {
+  std::string Shape;        // Sizes in elements, outermost unknown: [*][%n]
+  std::string Subscripts;   // Per dimension, Ld is the loop at depth d
+  uint64_t ElementSize = 0;
+  uint8_t Traversal = 0;    // CATS_TRAVERSAL_*
+};
+
+// Infers the shape of the array accessed by I through Ptr, which must be in
+// a loop. Returns false if the access is not recognized as multi-dimensional.
+bool inferArrayShape(llvm::Instruction *I, llvm::Value *Ptr,
+                     llvm::ScalarEvolution &SE, llvm::LoopInfo &LI,
+                     ArrayShape &Shape);
+
 class LoadStoreTracker : public llvm::FunctionPass {
 public:
   static char ID;
   LoadStoreTracker() : llvm::FunctionPass(ID) {}
 
   bool runOnFunction(llvm::Function &F);
+
+  // Analyses for the array shape inference, which is skipped without them
+  llvm::ScalarEvolution *SE = nullptr;
+  llvm::LoopInfo *LI = nullptr;
+
+private:
+
+  // Instruments an atomicrmw or cmpxchg instruction.
+  bool instrumentAtomic(
+    llvm::Instruction *I, llvm::FunctionCallee InstrumentAtomicFunc
+  );
+
+  // Instruments a call with an access summary with range accesses.
+  bool instrumentSummarizedCall(
+    llvm::CallInst *Call, llvm::FunctionCallee InstrumentFunc
+  );
 };
 
 struct LoadStoreTrackerPass : llvm::PassInfoMixin<LoadStoreTrackerPass> {
@@ -90,9 +177,11 @@ struct LoadStoreTrackerPass : llvm::PassInfoMixin<LoadStoreTrackerPass> {
 
   llvm::PreservedAnalyses run(
     llvm::Function &M,
-    [[maybe_unused]] llvm::FunctionAnalysisManager &AM
+    llvm::FunctionAnalysisManager &AM
   ) {
     LoadStoreTracker LSTP;
+    LSTP.SE = &AM.getResult<llvm::ScalarEvolutionAnalysis>(M);
+    LSTP.LI = &AM.getResult<llvm::LoopAnalysis>(M);
 
     bool Changed = LSTP.runOnFunction(M);
     if (Changed)
@@ -106,6 +195,68 @@ struct LoadStoreTrackerPass : llvm::PassInfoMixin<LoadStoreTrackerPass> {
   static bool isRequired() { return true; }
 };
 
+// Brackets OpenMP critical sections, barriers and reductions as well as
+// pthread and OpenMP lock calls with cats_trace_instrument_sync_*.
+class SyncTracker : public llvm::FunctionPass {
+public:
+  static char ID;
+  SyncTracker() : llvm::FunctionPass(ID) {}
+
+  bool runOnFunction(llvm::Function &F);
+};
+
+struct SyncTrackerPass : llvm::PassInfoMixin<SyncTrackerPass> {
+  SyncTrackerPass() {}
+
+  llvm::PreservedAnalyses run(
+    llvm::Function &M,
+    [[maybe_unused]] llvm::FunctionAnalysisManager &AM
+  ) {
+    SyncTracker STP;
+
+    bool Changed = STP.runOnFunction(M);
+    if (Changed)
+      // Assuming conservatively that nothing is preserved
+      return llvm::PreservedAnalyses::none();
+
+    return llvm::PreservedAnalyses::all();
+  }
+
+  // for optnone
+  static bool isRequired() { return true; }
+};
+
+// Reports the floating-point operations of every basic block with
+// cats_trace_instrument_flops at its top.
+class FlopCounter : public llvm::FunctionPass {
+public:
+  static char ID;
+  FlopCounter() : llvm::FunctionPass(ID) {}
+
+  bool runOnFunction(llvm::Function &F);
+};
+
+struct FlopCounterPass : llvm::PassInfoMixin<FlopCounterPass> {
+  FlopCounterPass() {}
+
+  llvm::PreservedAnalyses run(
+    llvm::Function &M,
+    [[maybe_unused]] llvm::FunctionAnalysisManager &AM
+  ) {
+    FlopCounter FCP;
+
+    bool Changed = FCP.runOnFunction(M);
+    if (Changed)
+      // Assuming conservatively that nothing is preserved
+      return llvm::PreservedAnalyses::none();
+
+    return llvm::PreservedAnalyses::all();
+  }
+
+  // for optnone
+  static bool isRequired() { return true; }
+};
+
 class FunctionScopeTrackerPass : public llvm::PassInfoMixin<FunctionScopeTrackerPass> {
 public:
   FunctionScopeTrackerPass() {}
@@ -133,11 +284,28 @@ public:
 
 private:
   void processLoop(
-    llvm::Loop *L, llvm::FunctionCallee EntryFunc,
-    llvm::FunctionCallee ExitFunc
+    llvm::Loop *L, llvm::LoopInfo &LI, llvm::ScalarEvolution &SE,
+    llvm::FunctionCallee EntryFunc, llvm::FunctionCallee ExitFunc,
+    llvm::FunctionCallee TripsFunc, std::vector<llvm::Constant *> &Sites
   );
 };
 
+// OpenMP runtime call that assigns loop iterations to the calling thread.
+// The bounds are written through the pointer arguments Lower and Upper
+// (and Stride, if not -1), as integers of Bits bits.
+struct WorksharingCall {
+  uint8_t Schedule;   // CATS_WORKSHARE_*
+  int Lower;
+  int Upper;
+  int Stride;
+  bool HasResult;     // Nonzero result if a chunk was assigned
+  bool Inclusive;     // Upper bound is part of the chunk
+  unsigned Bits;
+  bool Unsigned;
+};
+
+const WorksharingCall *findWorksharingCall(llvm::StringRef Name);
+
 struct OMPScopeFinder : llvm::AnalysisInfoMixin<OMPScopeFinder> {
   OMPScopeFinder() {}
 
@@ -145,6 +313,7 @@ struct OMPScopeFinder : llvm::AnalysisInfoMixin<OMPScopeFinder> {
 
   struct Result {
     std::set<llvm::CallInst *> OmpForkCalls;
+    std::set<llvm::CallInst *> OmpWorksharingCalls;
     std::set<std::string> OutlinedFunctions;
   };
 
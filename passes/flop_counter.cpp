@@ -0,0 +1,112 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_passes.hpp"
+
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/IntrinsicInst.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+
+#include <vector>
+
+using namespace llvm;
+
+// Scalable vectors are counted with their minimum number of lanes
+static uint64_t lanes(Type *Ty) {
+  if (VectorType *VTy = dyn_cast<VectorType>(Ty))
+    return VTy->getElementCount().getKnownMinValue();
+  return 1;
+}
+
+static uint64_t countFlops(const Instruction &I) {
+  switch (I.getOpcode()) {
+    case Instruction::FAdd:
+    case Instruction::FSub:
+    case Instruction::FMul:
+    case Instruction::FDiv:
+    case Instruction::FRem:
+      return lanes(I.getType());
+    default:
+      break;
+  }
+
+  const IntrinsicInst *II = dyn_cast<IntrinsicInst>(&I);
+  if (!II)
+    return 0;
+  switch (II->getIntrinsicID()) {
+    case Intrinsic::fma:
+    case Intrinsic::fmuladd:
+      return 2 * lanes(II->getType());
+    case Intrinsic::sqrt:
+    case Intrinsic::sin:
+    case Intrinsic::cos:
+    case Intrinsic::exp:
+    case Intrinsic::exp2:
+    case Intrinsic::log:
+    case Intrinsic::log2:
+    case Intrinsic::log10:
+    case Intrinsic::pow:
+      return lanes(II->getType());
+    // The start value is one more operand of ordered reductions
+    case Intrinsic::vector_reduce_fadd:
+    case Intrinsic::vector_reduce_fmul:
+      return lanes(II->getArgOperand(1)->getType());
+    default:
+      return 0;
+  }
+}
+
+bool FlopCounter::runOnFunction(Function &F) {
+  if (functionHasAnnotation(F, "cats_noinstrument")) {
+    errs() << "Skipping function " << F.getName() << "\n";
+    return false;
+  }
+
+  Module *M = F.getParent();
+  LLVMContext &Ctx = M->getContext();
+
+  FunctionCallee FlopsFunc = M->getOrInsertFunction(
+      "cats_trace_instrument_flops",
+      FunctionType::get(Type::getVoidTy(Ctx),
+                        {Type::getInt64Ty(Ctx)},                  /*flops*/
+                        false));
+
+  // Collect first, the counters are inserted at the top of the blocks
+  std::vector<std::pair<BasicBlock *, uint64_t>> Blocks;
+  for (auto &BB : F) {
+    BasicBlock::iterator InsertPt = BB.getFirstInsertionPt();
+    if (InsertPt == BB.end())
+      continue;
+
+    // Check if counted before
+    if (CallInst *Call = dyn_cast<CallInst>(&*InsertPt)) {
+      Function *Callee = Call->getCalledFunction();
+      if (Callee && Callee->getName() == "cats_trace_instrument_flops")
+        continue;
+    }
+    // END of duplicate check
+
+    uint64_t Flops = 0;
+    for (auto &I : BB)
+      Flops += countFlops(I);
+    if (Flops > 0)
+      Blocks.emplace_back(&BB, Flops);
+  }
+
+  for (auto &Entry : Blocks) {
+    IRBuilder<> Builder(&*Entry.first->getFirstInsertionPt());
+    Builder.CreateCall(
+      FlopsFunc, {ConstantInt::get(Type::getInt64Ty(Ctx), Entry.second)}
+    );
+  }
+
+  if (!Blocks.empty()) {
+    insertCatsTraceSave(*M);
+  }
+
+  return !Blocks.empty();
+}
+
+char FlopCounter::ID = 3;
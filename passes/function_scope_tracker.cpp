@@ -2,6 +2,7 @@
 
 #include "cats_passes.hpp"
 
+#include "llvm/Analysis/LoopInfo.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Function.h"
@@ -46,7 +47,8 @@ void instrumentExit(IRBuilder<> &Builder, FunctionCallee ExitFunc,
   Builder.CreateCall(ExitFunc, ExitArgs);
 }
 
-bool processFunction(Module &M, Function &F) {
+bool processFunction(Module &M, Function &F, LoopInfo &LI,
+                     std::vector<Constant *> &Sites) {
   if (F.hasFnAttribute("cats_function_instrumented")) {
     errs() << "Function " << F.getName()
            << " is already instrumented, skipping.\n";
@@ -125,10 +127,20 @@ bool processFunction(Module &M, Function &F) {
   Constant *FuncnamePtr = ConstantExpr::getGetElementPtr(
       FilenameStr->getType(), FuncnameGV, Indices, true);
 
+  Constant *CallID = ConstantInt::get(
+    Type::getInt64Ty(Context), generateUniqueInt64ID(), false
+  );
+
+  // Instruction mix of one call, loops have their own
+  InstructionMix Mix;
+  for (BasicBlock &BB : F) {
+    if (!LI.getLoopFor(&BB))
+      countInstructionMix(BB, Mix);
+  }
+  Sites.push_back(scopeSiteInfo(M, CallID, Mix));
+
   Value *Args[] = {
-      ConstantInt::get(
-        Type::getInt64Ty(Context), generateUniqueInt64ID(), false
-      ),
+      CallID,
       ScopeID,
       ScopeType,
       FuncnamePtr,
@@ -206,7 +218,11 @@ PreservedAnalyses FunctionScopeTrackerPass::run(
   Module &M, ModuleAnalysisManager &MAM
 ) {
   auto &ModuleOMPRes = MAM.getResult<OMPScopeFinder>(M);
+  FunctionAnalysisManager &FAM =
+    MAM.getResult<FunctionAnalysisManagerModuleProxy>(M).getManager();
   bool Modified = false;
+  // Registered with the runtime, see appendSiteInfo
+  std::vector<Constant *> Sites;
   for (Function &F : M) {
     if (F.isDeclaration()) continue;
 
@@ -222,12 +238,15 @@ PreservedAnalyses FunctionScopeTrackerPass::run(
     }
 
     // Process function scopes
-    if (processFunction(M, F)) {
+    if (processFunction(M, F, FAM.getResult<LoopAnalysis>(F), Sites)) {
       // If we modified the function, we assume that nothing is preserved
       Modified = true;
     }
   }
 
+  if (!Sites.empty())
+    appendSiteInfo(M, Sites);
+
   if (Modified) {
     insertCatsTraceSave(M);
     // Assuming conservatively that nothing is preserved
@@ -5,6 +5,7 @@
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/GetElementPtrTypeIterator.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instructions.h"
 #include "llvm/IR/Module.h"
@@ -12,8 +13,288 @@
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Passes/PassBuilder.h"
 
+#include <vector>
+
 using namespace llvm;
 
+static Constant *stringPtr(Module &M, StringRef Str, const Twine &Name) {
+  LLVMContext &Ctx = M.getContext();
+  Constant *StrConst = ConstantDataArray::getString(Ctx, Str);
+  GlobalVariable *GV = new GlobalVariable(
+    M, StrConst->getType(), true, GlobalValue::PrivateLinkage, StrConst, Name
+  );
+  return ConstantExpr::getPointerCast(GV, PointerType::getUnqual(Ctx));
+}
+
+// Site information for an access through a GEP into a struct or into a
+// multi-dimensional array, nullptr for other accesses. The innermost struct
+// step names the field; array indices after it stay within the field.
+static Constant *siteInfo(Module &M, Constant *CallID, Value *Ptr,
+                          const ArrayShape *Shape) {
+  StructType *Struct = nullptr;
+  unsigned Field = 0;
+  if (GEPOperator *GEP = dyn_cast<GEPOperator>(Ptr)) {
+    for (gep_type_iterator GTI = gep_type_begin(GEP), E = gep_type_end(GEP);
+         GTI != E; ++GTI) {
+      if (StructType *STy = GTI.getStructTypeOrNull()) {
+        // Vector GEPs index structs with a splat, or with a different field
+        // per lane, which is not attributed
+        ConstantInt *Index = dyn_cast<ConstantInt>(GTI.getOperand());
+        if (!Index) {
+          if (Constant *Vector = dyn_cast<Constant>(GTI.getOperand()))
+            Index = dyn_cast_or_null<ConstantInt>(Vector->getSplatValue());
+        }
+        Struct = Index ? STy : nullptr;
+        Field = Index ? Index->getZExtValue() : 0;
+      }
+    }
+  }
+  if (Struct && Struct->isOpaque())
+    Struct = nullptr;
+  if (!Struct && !Shape)
+    return nullptr;
+
+  LLVMContext &Ctx = M.getContext();
+  const DataLayout &DL = M.getDataLayout();
+  Type *Int32Ty = Type::getInt32Ty(Ctx);
+  Constant *Null = ConstantPointerNull::get(PointerType::getUnqual(Ctx));
+
+  Constant *StructName = Null;
+  uint64_t StructSize = 0, FieldOffset = 0, FieldSize = 0;
+  if (Struct) {
+    StringRef Name = Struct->hasName() ? Struct->getName() : "$ANON$";
+    // One name string per struct type and module
+    std::string NameGVName = ("cats.struct." + Name).str();
+    GlobalVariable *NameGV = M.getNamedGlobal(NameGVName);
+    StructName = NameGV
+      ? ConstantExpr::getPointerCast(NameGV, PointerType::getUnqual(Ctx))
+      : stringPtr(M, Name, NameGVName);
+    StructSize = DL.getTypeAllocSize(Struct).getFixedValue();
+    FieldOffset = DL.getStructLayout(Struct)->getElementOffset(Field);
+    FieldSize =
+      DL.getTypeAllocSize(Struct->getElementType(Field)).getKnownMinValue();
+  }
+
+  return ConstantStruct::get(getSiteInfoType(Ctx), {
+    CallID,
+    StructName,
+    ConstantInt::get(Int32Ty, StructSize),
+    ConstantInt::get(Int32Ty, Field),
+    ConstantInt::get(Int32Ty, FieldOffset),
+    ConstantInt::get(Int32Ty, FieldSize),
+    Shape ? stringPtr(M, Shape->Shape, "cats.shape") : Null,
+    Shape ? stringPtr(M, Shape->Subscripts, "cats.subscripts") : Null,
+    ConstantInt::get(Int32Ty, Shape ? Shape->ElementSize : 0),
+    ConstantInt::get(Int32Ty, Shape ? Shape->Traversal : 0),
+    Null
+  });
+}
+
+// Operation codes are CATS_ATOMIC_* in cats_runtime.h
+static uint8_t atomicOp(const AtomicRMWInst *RMW) {
+  switch (RMW->getOperation()) {
+    case AtomicRMWInst::Xchg: return 1;
+    case AtomicRMWInst::Add:
+    case AtomicRMWInst::FAdd: return 2;
+    case AtomicRMWInst::Sub:
+    case AtomicRMWInst::FSub: return 3;
+    case AtomicRMWInst::And: return 4;
+    case AtomicRMWInst::Or: return 5;
+    case AtomicRMWInst::Xor: return 6;
+    case AtomicRMWInst::Min:
+    case AtomicRMWInst::UMin: return 7;
+    case AtomicRMWInst::Max:
+    case AtomicRMWInst::UMax: return 8;
+    default: return 9;
+  }
+}
+
+bool LoadStoreTracker::instrumentAtomic(
+  Instruction *I, FunctionCallee InstrumentAtomicFunc
+) {
+  Value *Ptr = nullptr;
+  Type *AccessTy = nullptr;
+  uint8_t Op = 0;
+  if (AtomicRMWInst *RMW = dyn_cast<AtomicRMWInst>(I)) {
+    Ptr = RMW->getPointerOperand();
+    AccessTy = RMW->getValOperand()->getType();
+    Op = atomicOp(RMW);
+  } else if (AtomicCmpXchgInst *CX = dyn_cast<AtomicCmpXchgInst>(I)) {
+    Ptr = CX->getPointerOperand();
+    AccessTy = CX->getNewValOperand()->getType();
+  } else {
+    return false;
+  }
+  if (isa<AllocaInst>(Ptr))
+    return false;
+
+  // Check if instrumented before
+  for (Instruction *Next = I->getNextNode(); Next;
+       Next = Next->getNextNode()) {
+    if (CallInst *Call2 = dyn_cast<CallInst>(Next)) {
+      Function *Callee2 = Call2->getCalledFunction();
+      if (Callee2 && Callee2->getName() == "cats_trace_instrument_atomic" &&
+          Call2->getArgOperand(1) == Ptr)
+        return false;
+      break;
+    }
+  }
+
+  Function &F = *I->getFunction();
+  Module *M = F.getParent();
+  LLVMContext &Ctx = M->getContext();
+  IRBuilder<> Builder(I->getNextNode());
+
+  // A failed compare-exchange is the contention we are after
+  Value *Success = ConstantInt::get(Type::getInt1Ty(Ctx), 1);
+  if (isa<AtomicCmpXchgInst>(I))
+    Success = Builder.CreateExtractValue(I, 1);
+
+  // Get debug location information
+  const DebugLoc &DL = I->getDebugLoc();
+  unsigned Line = 0;
+  unsigned Col = 0;
+  StringRef Filename = "unknown";
+  if (DL) {
+    Line = DL.getLine();
+    Col = DL.getCol();
+    if (const DILocation *DIL = DL.get()) {
+      Filename = DIL->getFilename();
+    }
+  }
+
+  Constant *FilenameStr = ConstantDataArray::getString(Ctx, Filename);
+  Constant *FuncnameStr = ConstantDataArray::getString(Ctx, F.getName());
+  GlobalVariable *FilenameGV = new GlobalVariable(
+      *M, FilenameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FilenameStr, "filename");
+  GlobalVariable *FuncnameGV = new GlobalVariable(
+      *M, FuncnameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FuncnameStr, "funcname");
+  Constant *Zero = ConstantInt::get(Type::getInt32Ty(Ctx), 0);
+  Constant *Indices[] = {Zero, Zero};
+  Constant *FilenamePtr = ConstantExpr::getGetElementPtr(
+    FilenameStr->getType(), FilenameGV, Indices, true
+  );
+  Constant *FuncnamePtr = ConstantExpr::getGetElementPtr(
+    FuncnameStr->getType(), FuncnameGV, Indices, true
+  );
+
+  uint64_t AccessSize =
+    M->getDataLayout().getTypeStoreSize(AccessTy).getKnownMinValue();
+
+  Value *Args[] = {
+    ConstantInt::get(Type::getInt64Ty(Ctx), generateUniqueInt64ID(), false),
+    Ptr,
+    ConstantInt::get(Type::getInt64Ty(Ctx), AccessSize),
+    ConstantInt::get(Type::getInt8Ty(Ctx), Op),
+    Success,
+    FuncnamePtr, FilenamePtr,
+    ConstantInt::get(Type::getInt32Ty(Ctx), Line),
+    ConstantInt::get(Type::getInt32Ty(Ctx), Col)
+  };
+  CallInst *Instrument = Builder.CreateCall(InstrumentAtomicFunc, Args);
+  Instrument->addParamAttr(4, Attribute::ZExt);
+  return true;
+}
+
+bool LoadStoreTracker::instrumentSummarizedCall(
+  CallInst *Call, FunctionCallee InstrumentFunc
+) {
+  Function *Callee = Call->getCalledFunction();
+  if (!Callee)
+    return false;
+  const AccessSummary *Summary = findAccessSummary(Callee->getName());
+  if (!Summary)
+    return false;
+
+  // Check if instrumented before
+  if (Call->getMetadata("cats.summary_instrumented"))
+    return false;
+
+  Function &F = *Call->getFunction();
+  Module *M = F.getParent();
+  LLVMContext &Ctx = M->getContext();
+
+  // Get debug location information
+  const DebugLoc &DL = Call->getDebugLoc();
+  unsigned Line = 0;
+  unsigned Col = 0;
+  StringRef Filename = "unknown";
+  if (DL) {
+    Line = DL.getLine();
+    Col = DL.getCol();
+    if (const DILocation *DIL = DL.get()) {
+      Filename = DIL->getFilename();
+    }
+  }
+
+  Constant *FilenameStr = ConstantDataArray::getString(Ctx, Filename);
+  Constant *FuncnameStr = ConstantDataArray::getString(Ctx, F.getName());
+  GlobalVariable *FilenameGV = new GlobalVariable(
+      *M, FilenameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FilenameStr, "filename");
+  GlobalVariable *FuncnameGV = new GlobalVariable(
+      *M, FuncnameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FuncnameStr, "funcname");
+  Constant *Zero = ConstantInt::get(Type::getInt32Ty(Ctx), 0);
+  Constant *Indices[] = {Zero, Zero};
+  Constant *FilenamePtr = ConstantExpr::getGetElementPtr(
+    FilenameStr->getType(), FilenameGV, Indices, true
+  );
+  Constant *FuncnamePtr = ConstantExpr::getGetElementPtr(
+    FuncnameStr->getType(), FuncnameGV, Indices, true
+  );
+
+  // The ranges are recorded before the call, while the arguments that
+  // Fortran passes by reference still hold their values
+  IRBuilder<> Builder(Call);
+  bool Modified = false;
+  for (const ArgumentAccess &Access : Summary->Accesses) {
+    if (Access.Arg >= Call->arg_size())
+      continue;
+    // Only pointer arguments are accessed. A name pattern may also match
+    // calls that pass an iterator object, e.g. the output iterator of
+    // std::copy, which must not be taken for an address.
+    Value *Ptr = Call->getArgOperand(Access.Arg);
+    if (!Ptr->getType()->isPointerTy())
+      continue;
+    Value *Extent = buildExtent(*Access.Extent, Call, Builder);
+    if (!Extent)
+      continue;
+
+    // Nothing is accessed for an empty range, the null pointer is not
+    // attributed to any buffer
+    Ptr = Builder.CreateSelect(
+      Builder.CreateICmpSGT(Extent, ConstantInt::get(Extent->getType(), 0)),
+      Ptr, ConstantPointerNull::get(cast<PointerType>(Ptr->getType()))
+    );
+
+    for (bool IsWrite : {false, true}) {
+      if (IsWrite ? !Access.IsWrite : !Access.IsRead)
+        continue;
+      Value *Args[] = {
+        ConstantInt::get(
+          Type::getInt64Ty(Ctx), generateUniqueInt64ID(), false
+        ),
+        Ptr,
+        Extent,
+        ConstantInt::get(Type::getInt1Ty(Ctx), IsWrite),
+        FuncnamePtr, FilenamePtr,
+        ConstantInt::get(Type::getInt32Ty(Ctx), Line),
+        ConstantInt::get(Type::getInt32Ty(Ctx), Col)
+      };
+      CallInst *Instrument = Builder.CreateCall(InstrumentFunc, Args);
+      Instrument->addParamAttr(3, Attribute::ZExt);
+      Modified = true;
+    }
+  }
+
+  if (Modified)
+    Call->setMetadata("cats.summary_instrumented", MDNode::get(Ctx, {}));
+  return Modified;
+}
+
 bool LoadStoreTracker::runOnFunction(Function &F) {
   if (functionHasAnnotation(F, "cats_noinstrument")) {
     errs() << "Skipping function " << F.getName() << "\n";
@@ -25,28 +306,70 @@ bool LoadStoreTracker::runOnFunction(Function &F) {
 
   // Create instrumentation function definitions
   FunctionCallee InstrumentFunc = M->getOrInsertFunction(
-      "cats_trace_instrument_access",
+      "cats_trace_instrument_access_sized",
       FunctionType::get(Type::getVoidTy(M->getContext()),
                         {Type::getInt64Ty(M->getContext()),       /*call_id*/
                          PointerType::getUnqual(M->getContext()), /*value*/
+                         Type::getInt64Ty(M->getContext()),       /*size*/
                          Type::getInt1Ty(M->getContext()),        /*is_write*/
                          PointerType::getUnqual(M->getContext()), /*funcname*/
                          PointerType::getUnqual(M->getContext()), /*filename*/
                          Type::getInt32Ty(M->getContext()),       /*line*/
                          Type::getInt32Ty(M->getContext())},      /*col*/
                         false));
+  FunctionCallee InstrumentAtomicFunc = M->getOrInsertFunction(
+      "cats_trace_instrument_atomic",
+      FunctionType::get(Type::getVoidTy(M->getContext()),
+                        {Type::getInt64Ty(M->getContext()),       /*call_id*/
+                         PointerType::getUnqual(M->getContext()), /*value*/
+                         Type::getInt64Ty(M->getContext()),       /*size*/
+                         Type::getInt8Ty(M->getContext()),        /*op*/
+                         Type::getInt1Ty(M->getContext()),        /*success*/
+                         PointerType::getUnqual(M->getContext()), /*funcname*/
+                         PointerType::getUnqual(M->getContext()), /*filename*/
+                         Type::getInt32Ty(M->getContext()),       /*line*/
+                         Type::getInt32Ty(M->getContext())},      /*col*/
+                        false));
+  // The C ABI expects bool arguments zero-extended by the caller
+  if (Function *Fn = dyn_cast<Function>(InstrumentFunc.getCallee()))
+    Fn->addParamAttr(3, Attribute::ZExt);
+  if (Function *Fn = dyn_cast<Function>(InstrumentAtomicFunc.getCallee()))
+    Fn->addParamAttr(4, Attribute::ZExt);
+
+  // Registered with the runtime, see appendSiteInfo
+  std::vector<Constant *> Sites;
 
   // Iterate through all instructions in the function
   for (auto &BB : F) {
     for (auto Inst = BB.begin(); Inst != BB.end(); ++Inst) {
+      // Atomics are traced with their operation instead of as accesses. The
+      // inserted instructions follow and are skipped below.
+      if (isa<AtomicRMWInst>(&*Inst) || isa<AtomicCmpXchgInst>(&*Inst)) {
+        Modified |= this->instrumentAtomic(&*Inst, InstrumentAtomicFunc);
+        continue;
+      }
+
+      // Library calls and memory intrinsics with a summary are traced as
+      // range accesses, inserted before the call
+      if (CallInst *Call = dyn_cast<CallInst>(&*Inst)) {
+        Modified |= this->instrumentSummarizedCall(Call, InstrumentFunc);
+        continue;
+      }
+
       // Check if the instruction is a load/store
       Value *val = nullptr;
+      Type *AccessTy = nullptr;
       bool is_write = false;
       if (LoadInst *linst = dyn_cast<LoadInst>(&*Inst)) {
+        // Extent of a summarized call, loaded by the instrumentation
+        if (linst->getMetadata("cats.summary_extent"))
+          continue;
         val = linst->getPointerOperand();
+        AccessTy = linst->getType();
       } else if (StoreInst *sinst = dyn_cast<StoreInst>(&*Inst)) {
         is_write = true;
         val = sinst->getPointerOperand();
+        AccessTy = sinst->getValueOperand()->getType();
       } else {
         continue;
       }
@@ -68,7 +391,9 @@ bool LoadStoreTracker::runOnFunction(Function &F) {
       // Check if called before
       if (CallInst *Call2 = dyn_cast<CallInst>(&*Inst)) {
         Function *Callee2 = Call2->getCalledFunction();
-        if (Callee2 && Callee2->getName() == "cats_trace_instrument_access") {
+        if (Callee2 &&
+            (Callee2->getName() == "cats_trace_instrument_access" ||
+             Callee2->getName() == "cats_trace_instrument_access_sized")) {
           --Inst;
           continue;
         }
@@ -135,16 +460,31 @@ bool LoadStoreTracker::runOnFunction(Function &F) {
         FilenameStr->getType(), FuncnameGV, Indices, true
       );
 
-      // Create a call to cats_trace_instrument_access with filename, line,
-      // and column numbers
+      // Number of bytes touched by the access (known minimum for scalable
+      // vectors)
+      uint64_t AccessSize =
+        M->getDataLayout().getTypeStoreSize(AccessTy).getKnownMinValue();
+
+      // Create a call to cats_trace_instrument_access_sized with filename,
+      // line, and column numbers
       Value *Args[] = {
         CallID,
-        val, ConstantInt::get(Type::getInt1Ty(M->getContext()), is_write),
+        val,
+        ConstantInt::get(Type::getInt64Ty(M->getContext()), AccessSize),
+        ConstantInt::get(Type::getInt1Ty(M->getContext()), is_write),
         FuncnamePtr, FilenamePtr,
         ConstantInt::get(Type::getInt32Ty(M->getContext()), Line),
         ConstantInt::get(Type::getInt32Ty(M->getContext()), Col)
       };
-      Builder.CreateCall(InstrumentFunc, Args);
+      CallInst *Instrument = Builder.CreateCall(InstrumentFunc, Args);
+      Instrument->addParamAttr(3, Attribute::ZExt);
+
+      ArrayShape Shape;
+      bool HasShape = this->SE && this->LI &&
+                      inferArrayShape(&*Inst, val, *this->SE, *this->LI, Shape);
+      if (Constant *Site = siteInfo(*M, CallID, val,
+                                    HasShape ? &Shape : nullptr))
+        Sites.push_back(Site);
 
       Modified = true;
 
@@ -156,6 +496,10 @@ bool LoadStoreTracker::runOnFunction(Function &F) {
     }
   }
 
+  if (!Sites.empty()) {
+    appendSiteInfo(*M, Sites);
+  }
+
   if (Modified) {
     insertCatsTraceSave(*M);
   }
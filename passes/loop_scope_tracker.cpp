@@ -3,6 +3,7 @@
 #include "cats_passes.hpp"
 
 #include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ScalarEvolution.h"
 #include "llvm/IR/DebugInfoMetadata.h"
 #include "llvm/IR/DebugLoc.h"
 #include "llvm/IR/Function.h"
@@ -11,6 +12,7 @@
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/Pass.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/ScalarEvolutionExpander.h"
 
 #include "../runtime/cats_runtime.h"
 
@@ -32,6 +34,7 @@ PreservedAnalyses LoopScopeTrackerPass::run(
   
   // Get the loop analysis information
   LoopInfo &LI = AM.getResult<LoopAnalysis>(F);
+  ScalarEvolution &SE = AM.getResult<ScalarEvolutionAnalysis>(F);
   Module *M = F.getParent();
   LLVMContext &Context = M->getContext();
 
@@ -60,13 +63,26 @@ PreservedAnalyses LoopScopeTrackerPass::run(
                        Type::getInt32Ty(Context)},      /*col*/
                        false)
   );
+  FunctionCallee TripsFunc = M->getOrInsertFunction(
+    "cats_trace_instrument_loop_trips",
+    FunctionType::get(Type::getVoidTy(Context),
+                      {Type::getInt64Ty(Context),       /*scope_id*/
+                       Type::getInt64Ty(Context)},      /*trips*/
+                       false)
+  );
+
+  // Registered with the runtime, see appendSiteInfo
+  std::vector<Constant *> Sites;
 
   // Process all loops
   for (Loop *L : LI) {
-    processLoop(L, EnterFunc, ExitFunc);
+    processLoop(L, LI, SE, EnterFunc, ExitFunc, TripsFunc, Sites);
     Modified = true;
   }
 
+  if (!Sites.empty())
+    appendSiteInfo(*M, Sites);
+
   if (Modified) {
     // If we modified the function, we assume that nothing is preserved
     return PreservedAnalyses::none();
@@ -75,7 +91,9 @@ PreservedAnalyses LoopScopeTrackerPass::run(
 }
 
 void LoopScopeTrackerPass::processLoop(
-  Loop *L, FunctionCallee EntryFunc, FunctionCallee ExitFunc
+  Loop *L, LoopInfo &LI, ScalarEvolution &SE, FunctionCallee EntryFunc,
+  FunctionCallee ExitFunc, FunctionCallee TripsFunc,
+  std::vector<Constant *> &Sites
 ) {
   // Get the preheader and exit blocks of the loop
   BasicBlock *Preheader = L->getLoopPreheader();
@@ -137,10 +155,20 @@ void LoopScopeTrackerPass::processLoop(
   Constant *FuncnamePtr = ConstantExpr::getGetElementPtr(
       FilenameStr->getType(), FuncnameGV, Indices, true);
 
+  Constant *CallID = ConstantInt::get(
+    Type::getInt64Ty(Context), generateUniqueInt64ID(), false
+  );
+
+  // Instruction mix of one iteration, inner loops have their own
+  InstructionMix Mix;
+  for (BasicBlock *BB : L->blocks()) {
+    if (LI.getLoopFor(BB) == L)
+      countInstructionMix(*BB, Mix);
+  }
+  Sites.push_back(scopeSiteInfo(*M, CallID, Mix));
+
   Value *Args[] = {
-      ConstantInt::get(
-        Type::getInt64Ty(Context), generateUniqueInt64ID(), false
-      ),
+      CallID,
       ScopeID,
       ScopeType,
       FuncnamePtr,
@@ -151,6 +179,22 @@ void LoopScopeTrackerPass::processLoop(
   // Insert the entry instrumentation at the end of the preheader
   IRBuilder<> Builder(Preheader->getTerminator());
   Builder.CreateCall(EntryFunc, Args);
+
+  // Report the trip count if it is known at the loop entry
+  const SCEV *BackedgeTaken = SE.getBackedgeTakenCount(L);
+  SCEVExpander Expander(SE, M->getDataLayout(), "cats.trips");
+  if (!isa<SCEVCouldNotCompute>(BackedgeTaken) &&
+      Expander.isSafeToExpandAt(BackedgeTaken, Preheader->getTerminator())) {
+    Value *Taken = Expander.expandCodeFor(
+      BackedgeTaken, BackedgeTaken->getType(), Preheader->getTerminator()
+    );
+    Builder.SetInsertPoint(Preheader->getTerminator());
+    Value *Trips = Builder.CreateAdd(
+      Builder.CreateZExtOrTrunc(Taken, Type::getInt64Ty(Context)),
+      ConstantInt::get(Type::getInt64Ty(Context), 1)
+    );
+    Builder.CreateCall(TripsFunc, {ScopeID, Trips});
+  }
   
   // Insert the exit instrumentation at the beginning of each exit block
   for (BasicBlock *ExitBlock : ExitBlocks) {
@@ -180,6 +224,6 @@ void LoopScopeTrackerPass::processLoop(
   
   // Process nested loops
   for (Loop *SubL : L->getSubLoops()) {
-    processLoop(SubL, EntryFunc, ExitFunc);
+    processLoop(SubL, LI, SE, EntryFunc, ExitFunc, TripsFunc, Sites);
   }
 }
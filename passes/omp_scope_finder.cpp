@@ -12,11 +12,69 @@
 #include "llvm/Pass.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
+#include "../runtime/cats_runtime.h"
+
+#include <map>
+
 
 using namespace llvm;
 
 AnalysisKey OMPScopeFinder::Key;
 
+static std::map<std::string, WorksharingCall> buildWorksharingCalls() {
+  std::map<std::string, WorksharingCall> Calls;
+
+  // libomp: inclusive bounds, the suffix gives the width and signedness
+  for (std::string Suffix : {"4", "4u", "8", "8u"}) {
+    unsigned Bits = Suffix[0] == '4' ? 32 : 64;
+    bool Unsigned = Suffix.size() > 1;
+    Calls["__kmpc_for_static_init_" + Suffix] = {
+      CATS_WORKSHARE_STATIC, 4, 5, 6, false, true, Bits, Unsigned
+    };
+    Calls["__kmpc_dispatch_next_" + Suffix] = {
+      CATS_WORKSHARE_DYNAMIC, 3, 4, 5, true, true, Bits, Unsigned
+    };
+  }
+
+  // libgomp: chunks are [istart, iend), the ull variants take an extra
+  // leading argument
+  for (std::string Schedule : {"static", "dynamic", "guided",
+                               "nonmonotonic_dynamic", "nonmonotonic_guided",
+                               "runtime", "nonmonotonic_runtime",
+                               "maybe_nonmonotonic_runtime"}) {
+    uint8_t Kind = Schedule == "static" ? CATS_WORKSHARE_STATIC
+                                        : CATS_WORKSHARE_DYNAMIC;
+    // Runtime schedules have no chunk size argument
+    int Start = Schedule.find("runtime") == std::string::npos ? 4 : 3;
+    Calls["GOMP_loop_" + Schedule + "_start"] = {
+      Kind, Start, Start + 1, -1, true, false, 64, false
+    };
+    Calls["GOMP_loop_" + Schedule + "_next"] = {
+      Kind, 0, 1, -1, true, false, 64, false
+    };
+    Calls["GOMP_loop_ull_" + Schedule + "_start"] = {
+      Kind, Start + 1, Start + 2, -1, true, false, 64, true
+    };
+    Calls["GOMP_loop_ull_" + Schedule + "_next"] = {
+      Kind, 0, 1, -1, true, false, 64, true
+    };
+  }
+  Calls["GOMP_loop_start"] = {
+    CATS_WORKSHARE_DYNAMIC, 5, 6, -1, true, false, 64, false
+  };
+  Calls["GOMP_loop_ull_start"] = {
+    CATS_WORKSHARE_DYNAMIC, 6, 7, -1, true, false, 64, true
+  };
+  return Calls;
+}
+
+const WorksharingCall *findWorksharingCall(StringRef Name) {
+  static const std::map<std::string, WorksharingCall> Calls =
+    buildWorksharingCalls();
+  auto It = Calls.find(Name.str());
+  return It == Calls.end() ? nullptr : &It->second;
+}
+
 OMPScopeFinder::Result OMPScopeFinder::run(
   Module &M, ModuleAnalysisManager &AM
 ) {
@@ -49,6 +107,11 @@ OMPScopeFinder::Result OMPScopeFinder::run(
               TargetFunction = CI->getArgOperand(2);
             }
             Res.OmpForkCalls.insert(CI);
+          } else if (const WorksharingCall *WS = findWorksharingCall(Name)) {
+            int Last = std::max(WS->Lower, std::max(WS->Upper, WS->Stride));
+            if (CI->arg_size() > (unsigned) Last) {
+              Res.OmpWorksharingCalls.insert(CI);
+            }
           }
           if (TargetFunction != nullptr) {
             // Strip away any bitcasts to get the actual function
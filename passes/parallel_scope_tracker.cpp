@@ -14,9 +14,129 @@
 
 #include "../runtime/cats_runtime.h"
 
+#include <vector>
 
 using namespace llvm;
 
+// Inserts a call to cats_trace_instrument_workshare after the runtime call
+// CI, which has written the bounds of the assigned chunk through its
+// pointer arguments.
+static bool instrumentWorksharingCall(
+  Module &M, Function &F, CallInst *CI, FunctionCallee WorkshareFunc
+) {
+  const WorksharingCall *WS =
+    findWorksharingCall(CI->getCalledFunction()->getName());
+  if (!WS) return false;
+
+  // Check if instrumented before
+  for (Instruction *I = CI->getNextNode(); I; I = I->getNextNode()) {
+    if (CallInst *Call = dyn_cast<CallInst>(I)) {
+      Function *Callee = Call->getCalledFunction();
+      if (Callee && Callee->getName() == "cats_trace_instrument_workshare")
+        return false;
+      break;
+    }
+  }
+  // END of duplicate check
+
+  LLVMContext &Context = M.getContext();
+
+  // Get debug location information
+  const DebugLoc &DL = CI->getDebugLoc();
+  unsigned Line = 0;
+  unsigned Col = 0;
+  StringRef Filename = "unknown";
+  if (DL) {
+    Line = DL.getLine();
+    Col = DL.getCol();
+    if (const DILocation *DIL = DL.get()) {
+      Filename = DIL->getFilename();
+    }
+  }
+
+  Constant *FilenameStr = ConstantDataArray::getString(Context, Filename);
+  Constant *FuncnameStr = ConstantDataArray::getString(Context, F.getName());
+  GlobalVariable *FilenameGV = new GlobalVariable(
+      M, FilenameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FilenameStr, "filename");
+  GlobalVariable *FuncnameGV = new GlobalVariable(
+      M, FuncnameStr->getType(), true, GlobalValue::PrivateLinkage,
+      FuncnameStr, "funcname");
+  Constant *Zero = ConstantInt::get(Type::getInt32Ty(Context), 0);
+  Constant *Indices[] = {Zero, Zero};
+  Constant *FilenamePtr = ConstantExpr::getGetElementPtr(
+      FilenameStr->getType(), FilenameGV, Indices, true);
+  Constant *FuncnamePtr = ConstantExpr::getGetElementPtr(
+      FuncnameStr->getType(), FuncnameGV, Indices, true);
+
+  IRBuilder<> Builder(CI->getNextNode());
+  Type *Int64Ty = Type::getInt64Ty(Context);
+  Type *BoundTy = Type::getIntNTy(Context, WS->Bits);
+  auto LoadBound = [&](int Arg) -> Value * {
+    Value *Bound = Builder.CreateLoad(BoundTy, CI->getArgOperand(Arg));
+    return WS->Unsigned ? Builder.CreateZExtOrTrunc(Bound, Int64Ty)
+                        : Builder.CreateSExtOrTrunc(Bound, Int64Ty);
+  };
+
+  Value *Lower = LoadBound(WS->Lower);
+  Value *Upper = LoadBound(WS->Upper);
+  if (WS->Inclusive)
+    Upper = Builder.CreateAdd(Upper, ConstantInt::get(Int64Ty, 1));
+  Value *Stride = WS->Stride < 0
+    ? (Value *) ConstantInt::get(Int64Ty, 0)
+    : LoadBound(WS->Stride);
+  if (WS->HasResult) {
+    // The bounds are undefined if no chunk was assigned, the runtime drops
+    // the empty range.
+    Value *Assigned = Builder.CreateICmpNE(
+      CI, Constant::getNullValue(CI->getType())
+    );
+    Upper = Builder.CreateSelect(Assigned, Upper, Lower);
+  }
+
+  Value *Args[] = {
+      ConstantInt::get(Int64Ty, generateUniqueInt64ID(), false),
+      ConstantInt::get(Type::getInt8Ty(Context), WS->Schedule),
+      Lower,
+      Upper,
+      Stride,
+      FuncnamePtr,
+      FilenamePtr,
+      ConstantInt::get(Type::getInt32Ty(Context), Line),
+      ConstantInt::get(Type::getInt32Ty(Context), Col)};
+  Builder.CreateCall(WorkshareFunc, Args);
+  return true;
+}
+
+// Brackets the outlined region of a parallel scope, which every team thread
+// executes, with calls to cats_trace_instrument_parallel_begin and _end.
+static bool instrumentOutlinedFunction(
+  Function &F, FunctionCallee BeginFunc, FunctionCallee EndFunc
+) {
+  // Check if instrumented before
+  Instruction *First = &*F.getEntryBlock().getFirstInsertionPt();
+  if (CallInst *Call = dyn_cast<CallInst>(First)) {
+    Function *Callee = Call->getCalledFunction();
+    if (Callee && Callee->getName() == "cats_trace_instrument_parallel_begin")
+      return false;
+  }
+  // END of duplicate check
+
+  std::vector<ReturnInst *> Returns;
+  for (BasicBlock &BB : F) {
+    if (ReturnInst *RI = dyn_cast<ReturnInst>(BB.getTerminator()))
+      Returns.push_back(RI);
+  }
+
+  IRBuilder<> Builder(First);
+  Builder.CreateCall(BeginFunc);
+  for (ReturnInst *RI : Returns) {
+    Builder.SetInsertPoint(RI);
+    Builder.CreateCall(EndFunc);
+  }
+  return true;
+}
+
 PreservedAnalyses ParallelScopeTrackerPass::run(
   Module &M, ModuleAnalysisManager &MAM
 ) {
@@ -48,6 +168,29 @@ PreservedAnalyses ParallelScopeTrackerPass::run(
                        Type::getInt32Ty(Context)},      /*col*/
                       false)
   );
+  FunctionCallee WorkshareFunc = M.getOrInsertFunction(
+    "cats_trace_instrument_workshare",
+    FunctionType::get(Type::getVoidTy(Context),
+                      {Type::getInt64Ty(Context),       /*call_id*/
+                       Type::getInt8Ty(Context),        /*schedule*/
+                       Type::getInt64Ty(Context),       /*lower*/
+                       Type::getInt64Ty(Context),       /*upper*/
+                       Type::getInt64Ty(Context),       /*stride*/
+                       PointerType::getUnqual(Context), /*funcname*/
+                       PointerType::getUnqual(Context), /*filename*/
+                       Type::getInt32Ty(Context),       /*line*/
+                       Type::getInt32Ty(Context)},      /*col*/
+                      false)
+  );
+
+  FunctionCallee ThreadBeginFunc = M.getOrInsertFunction(
+    "cats_trace_instrument_parallel_begin",
+    FunctionType::get(Type::getVoidTy(Context), false)
+  );
+  FunctionCallee ThreadEndFunc = M.getOrInsertFunction(
+    "cats_trace_instrument_parallel_end",
+    FunctionType::get(Type::getVoidTy(Context), false)
+  );
 
   for (Function &F : M) {
     if (F.isDeclaration()) continue;
@@ -58,6 +201,12 @@ PreservedAnalyses ParallelScopeTrackerPass::run(
       continue;
     }
 
+    if (ModuleOMPRes.OutlinedFunctions.count(F.getName().str())) {
+      Modified |= instrumentOutlinedFunction(
+        F, ThreadBeginFunc, ThreadEndFunc
+      );
+    }
+
     for (BasicBlock &BB : F) {
       for (auto Inst = BB.begin(); Inst != BB.end(); ++Inst) {
         if (CallInst *CI = dyn_cast<CallInst>(&*Inst)) {
@@ -137,6 +286,9 @@ PreservedAnalyses ParallelScopeTrackerPass::run(
             Builder.CreateCall(ExitFunc, ExitArgs);
             Inst--;
             Modified = true;
+          } else if (ModuleOMPRes.OmpWorksharingCalls.count(CI)) {
+            // Record the chunk the runtime assigned to this thread.
+            Modified |= instrumentWorksharingCall(M, F, CI, WorkshareFunc);
           }
         }
       }
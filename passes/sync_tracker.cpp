@@ -0,0 +1,175 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_passes.hpp"
+
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DebugLoc.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/IR/Instructions.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Pass.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Passes/PassBuilder.h"
+
+#include <map>
+#include <vector>
+
+using namespace llvm;
+
+// Kind and phase values are CATS_SYNC_* in cats_runtime.h
+static const uint8_t SYNC_CRITICAL = 0;
+static const uint8_t SYNC_BARRIER = 1;
+static const uint8_t SYNC_REDUCE = 2;
+static const uint8_t SYNC_MUTEX = 3;
+static const uint8_t SYNC_ACQUIRE = 0;
+static const uint8_t SYNC_RELEASE = 1;
+
+struct SyncCall {
+  uint8_t Kind;
+  uint8_t Phase;
+  int Object; // Argument with the lock, -1 if there is none
+};
+
+std::map<std::string, SyncCall> sync_calls = {
+    {"__kmpc_critical", {SYNC_CRITICAL, SYNC_ACQUIRE, 2}},
+    {"__kmpc_critical_with_hint", {SYNC_CRITICAL, SYNC_ACQUIRE, 2}},
+    {"__kmpc_end_critical", {SYNC_CRITICAL, SYNC_RELEASE, 2}},
+    {"__kmpc_barrier", {SYNC_BARRIER, SYNC_ACQUIRE, -1}},
+    {"__kmpc_reduce", {SYNC_REDUCE, SYNC_ACQUIRE, 6}},
+    {"__kmpc_reduce_nowait", {SYNC_REDUCE, SYNC_ACQUIRE, 6}},
+    {"__kmpc_end_reduce", {SYNC_REDUCE, SYNC_RELEASE, 2}},
+    {"__kmpc_end_reduce_nowait", {SYNC_REDUCE, SYNC_RELEASE, 2}},
+    {"pthread_mutex_lock", {SYNC_MUTEX, SYNC_ACQUIRE, 0}},
+    {"pthread_mutex_unlock", {SYNC_MUTEX, SYNC_RELEASE, 0}},
+    {"omp_set_lock", {SYNC_MUTEX, SYNC_ACQUIRE, 0}},
+    {"omp_unset_lock", {SYNC_MUTEX, SYNC_RELEASE, 0}},
+};
+
+bool SyncTracker::runOnFunction(Function &F) {
+  if (functionHasAnnotation(F, "cats_noinstrument")) {
+    errs() << "Skipping function " << F.getName() << "\n";
+    return false;
+  }
+
+  Module *M = F.getParent();
+  LLVMContext &Ctx = M->getContext();
+
+  // Create instrumentation function definitions
+  FunctionCallee BeginFunc = M->getOrInsertFunction(
+      "cats_trace_instrument_sync_begin",
+      FunctionType::get(Type::getVoidTy(Ctx),
+                        {Type::getInt64Ty(Ctx)},                  /*call_id*/
+                        false));
+  FunctionCallee EndFunc = M->getOrInsertFunction(
+      "cats_trace_instrument_sync_end",
+      FunctionType::get(Type::getVoidTy(Ctx),
+                        {Type::getInt64Ty(Ctx),                   /*call_id*/
+                         Type::getInt8Ty(Ctx),                    /*kind*/
+                         Type::getInt8Ty(Ctx),                    /*phase*/
+                         PointerType::getUnqual(Ctx),             /*object*/
+                         PointerType::getUnqual(Ctx),             /*funcname*/
+                         PointerType::getUnqual(Ctx),             /*filename*/
+                         Type::getInt32Ty(Ctx),                   /*line*/
+                         Type::getInt32Ty(Ctx)},                  /*col*/
+                        false));
+
+  // Collect first, instrumenting inserts calls around the collected ones
+  std::vector<std::pair<CallInst *, SyncCall>> Calls;
+  for (auto &BB : F) {
+    for (auto &I : BB) {
+      CallInst *Call = dyn_cast<CallInst>(&I);
+      if (!Call)
+        continue;
+      Function *Callee = Call->getCalledFunction();
+      if (!Callee)
+        continue;
+      auto It = sync_calls.find(std::string{Callee->getName()});
+      if (It == sync_calls.end())
+        continue;
+      if (It->second.Object >= 0 &&
+          (unsigned) It->second.Object >= Call->arg_size())
+        continue;
+
+      // Check if called before
+      if (CallInst *Call2 = dyn_cast_or_null<CallInst>(Call->getNextNode())) {
+        Function *Callee2 = Call2->getCalledFunction();
+        if (Callee2 && Callee2->getName() == "cats_trace_instrument_sync_end")
+          continue;
+      }
+      // END of duplicate check
+
+      Calls.emplace_back(Call, It->second);
+    }
+  }
+
+  for (auto &Entry : Calls) {
+    CallInst *Call = Entry.first;
+    const SyncCall &Sync = Entry.second;
+
+    // Get debug location information
+    const DebugLoc &DL = Call->getDebugLoc();
+    unsigned Line = 0;
+    unsigned Col = 0;
+    StringRef Filename = "unknown";
+    if (DL) {
+      Line = DL.getLine();
+      Col = DL.getCol();
+      if (const DILocation *DIL = DL.get()) {
+        Filename = DIL->getFilename();
+      }
+    }
+
+    // The call ID is shared by the begin and end hooks
+    Constant *CallID = ConstantInt::get(
+      Type::getInt64Ty(Ctx), generateUniqueInt64ID(), false
+    );
+
+    Constant *FilenameStr = ConstantDataArray::getString(Ctx, Filename);
+    Constant *FuncnameStr = ConstantDataArray::getString(Ctx, F.getName());
+    GlobalVariable *FilenameGV = new GlobalVariable(
+        *M, FilenameStr->getType(), true, GlobalValue::PrivateLinkage,
+        FilenameStr, "filename");
+    GlobalVariable *FuncnameGV = new GlobalVariable(
+        *M, FuncnameStr->getType(), true, GlobalValue::PrivateLinkage,
+        FuncnameStr, "funcname");
+    Constant *Zero = ConstantInt::get(Type::getInt32Ty(Ctx), 0);
+    Constant *Indices[] = {Zero, Zero};
+    Constant *FilenamePtr = ConstantExpr::getGetElementPtr(
+      FilenameStr->getType(), FilenameGV, Indices, true
+    );
+    Constant *FuncnamePtr = ConstantExpr::getGetElementPtr(
+      FuncnameStr->getType(), FuncnameGV, Indices, true
+    );
+
+    // Blocking calls are timed from right before the call
+    if (Sync.Phase == SYNC_ACQUIRE) {
+      IRBuilder<> BeginBuilder(Call);
+      BeginBuilder.CreateCall(BeginFunc, {CallID});
+    }
+
+    Value *Object = Sync.Object < 0
+      ? (Value *) ConstantPointerNull::get(PointerType::getUnqual(Ctx))
+      : Call->getArgOperand(Sync.Object);
+
+    IRBuilder<> Builder(Call->getNextNode());
+    Value *Args[] = {
+      CallID,
+      ConstantInt::get(Type::getInt8Ty(Ctx), Sync.Kind),
+      ConstantInt::get(Type::getInt8Ty(Ctx), Sync.Phase),
+      Object,
+      FuncnamePtr, FilenamePtr,
+      ConstantInt::get(Type::getInt32Ty(Ctx), Line),
+      ConstantInt::get(Type::getInt32Ty(Ctx), Col)
+    };
+    Builder.CreateCall(EndFunc, Args);
+  }
+
+  if (!Calls.empty()) {
+    insertCatsTraceSave(*M);
+  }
+
+  return !Calls.empty();
+}
+
+char SyncTracker::ID = 2;
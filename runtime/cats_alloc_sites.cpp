@@ -0,0 +1,280 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_alloc_sites.hpp"
+#include "cats_config.hpp"
+#include "cats_runtime.h"
+
+#include <algorithm>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef CATS_ALLOC_SITES_MIN_SIZE
+#define CATS_ALLOC_SITES_MIN_SIZE                   4096
+#endif
+
+// Allocations inside loops from which a site is reported as a pooling
+// candidate
+#ifndef CATS_ALLOC_SITES_POOL_COUNT
+#define CATS_ALLOC_SITES_POOL_COUNT                 1000
+#endif
+
+namespace cats {
+
+static const int HISTOGRAM_BUCKETS = 65;
+
+struct Alloc_Site_Stats {
+  const char *name = nullptr;
+  const char *funcname = nullptr;
+  const char *filename = nullptr;
+  uint32_t line = 0;
+  uint64_t count = 0;
+  uint64_t bytes = 0;
+  uint64_t min_size = UINT64_MAX;
+  uint64_t max_size = 0;
+  // Allocations smaller than the threshold
+  uint64_t untracked = 0;
+  uint64_t in_loop = 0;
+  uint64_t freed = 0;
+  uint64_t live = 0;
+  uint64_t max_live = 0;
+  uint64_t sizes[HISTOGRAM_BUCKETS] = {};
+  uint64_t lifetimes[HISTOGRAM_BUCKETS] = {};
+};
+
+struct Live_Allocation {
+  Alloc_Site_Stats *site;
+  uint64_t ts;
+  bool tracked;
+};
+
+// Scope stack of one thread, only touched by the thread.
+struct Thread_Scopes {
+  std::vector<std::pair<uint64_t, bool>> stack;
+  uint32_t loops = 0;
+};
+
+struct Alloc_Sites_State {
+  bool enabled = config::get_bool("CATS_ALLOC_SITES", false);
+  uint64_t min_size = config::get_u64("CATS_ALLOC_SITES_MIN_SIZE",
+                                      CATS_ALLOC_SITES_MIN_SIZE);
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_Scopes>> threads;
+
+  std::mutex mutex;
+  std::unordered_map<uint64_t, Alloc_Site_Stats> sites;
+  std::unordered_map<uintptr_t, Live_Allocation> allocations;
+};
+
+static Alloc_Sites_State &state() {
+  return leaked_instance<Alloc_Sites_State>();
+}
+
+static thread_local Thread_Scopes *t_scopes = nullptr;
+
+static Thread_Scopes &thread_scopes() {
+  if (!t_scopes) {
+    Alloc_Sites_State &s = state();
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    s.threads.emplace_back(new Thread_Scopes());
+    t_scopes = s.threads.back().get();
+  }
+  return *t_scopes;
+}
+
+static uint64_t now_ns(const Alloc_Sites_State &s) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - s.start
+  ).count();
+}
+
+// Bucket k > 0 holds the values in [2^(k-1), 2^k)
+static int bucket(uint64_t value) {
+  return value ? 64 - __builtin_clzll(value) : 0;
+}
+
+bool alloc_sites_enabled() {
+  return state().enabled;
+}
+
+bool alloc_sites_alloc(uint64_t call_id, const char *buffer_name,
+                       void *address, size_t size, const char *funcname,
+                       const char *filename, uint32_t line) {
+  Alloc_Sites_State &s = state();
+  if (!s.enabled)
+    return true;
+  bool in_loop = thread_scopes().loops > 0;
+  bool tracked = size >= s.min_size;
+  uint64_t ts = now_ns(s);
+
+  std::lock_guard<std::mutex> guard(s.mutex);
+  Alloc_Site_Stats &site = s.sites[call_id];
+  if (site.count == 0) {
+    site.name = buffer_name;
+    site.funcname = funcname;
+    site.filename = filename;
+    site.line = line;
+  }
+  ++site.count;
+  site.bytes += size;
+  site.min_size = std::min(site.min_size, (uint64_t) size);
+  site.max_size = std::max(site.max_size, (uint64_t) size);
+  ++site.sizes[bucket(size)];
+  if (!tracked)
+    ++site.untracked;
+  if (in_loop)
+    ++site.in_loop;
+  site.max_live = std::max(site.max_live, ++site.live);
+
+  Live_Allocation &allocation = s.allocations[(uintptr_t) address];
+  // An address allocated twice without a free in between was released by
+  // an untraced call, its lifetime is unknown
+  if (allocation.site)
+    --allocation.site->live;
+  allocation = {&site, ts, tracked};
+  return tracked;
+}
+
+bool alloc_sites_dealloc(void *address) {
+  Alloc_Sites_State &s = state();
+  if (!s.enabled)
+    return true;
+  uint64_t ts = now_ns(s);
+
+  std::lock_guard<std::mutex> guard(s.mutex);
+  auto it = s.allocations.find((uintptr_t) address);
+  if (it == s.allocations.end())
+    return true;
+  Live_Allocation allocation = it->second;
+  s.allocations.erase(it);
+  Alloc_Site_Stats &site = *allocation.site;
+  ++site.freed;
+  --site.live;
+  ++site.lifetimes[bucket(ts - allocation.ts)];
+  return allocation.tracked;
+}
+
+void alloc_sites_scope_entry(uint64_t scope_id, uint8_t type) {
+  if (!state().enabled)
+    return;
+  Thread_Scopes &t = thread_scopes();
+  bool loop = type == CATS_SCOPE_TYPE_LOOP;
+  t.stack.emplace_back(scope_id, loop);
+  t.loops += loop;
+}
+
+void alloc_sites_scope_exit(uint64_t scope_id) {
+  if (!state().enabled)
+    return;
+  Thread_Scopes &t = thread_scopes();
+  auto it = std::find_if(t.stack.rbegin(), t.stack.rend(),
+                         [scope_id](const std::pair<uint64_t, bool> &frame) {
+    return frame.first == scope_id;
+  });
+  if (it == t.stack.rend())
+    return;
+  // Scopes left without their exit are closed with the enclosing one
+  while (true) {
+    std::pair<uint64_t, bool> frame = t.stack.back();
+    t.stack.pop_back();
+    t.loops -= frame.second;
+    if (frame.first == scope_id)
+      break;
+  }
+}
+
+static void write_histogram(std::ostream &os, const uint64_t *buckets) {
+  os << "[";
+  bool first = true;
+  for (int k = 0; k < HISTOGRAM_BUCKETS; ++k) {
+    if (!buckets[k])
+      continue;
+    if (!first)
+      os << ", ";
+    first = false;
+    uint64_t lower = k ? (uint64_t) 1 << (k - 1) : 0;
+    os << "[" << lower << ", " << buckets[k] << "]";
+  }
+  os << "]";
+}
+
+// Zeroes the counters of a site once they are written. The site stays in
+// the map, its live allocations point to it.
+static void release_site(Alloc_Site_Stats &site) {
+  Alloc_Site_Stats released;
+  released.name = site.name;
+  released.funcname = site.funcname;
+  released.filename = site.filename;
+  released.line = site.line;
+  released.live = site.live;
+  released.max_live = site.live;
+  site = released;
+}
+
+void write_alloc_sites_profile(std::ostream &os, bool release) {
+  Alloc_Sites_State &s = state();
+  if (!s.enabled)
+    return;
+  std::vector<std::pair<uint64_t, Alloc_Site_Stats>> sites;
+  {
+    std::lock_guard<std::mutex> guard(s.mutex);
+    for (auto &entry : s.sites) {
+      // Nothing allocated or freed since the previous segment
+      if (entry.second.count == 0 && entry.second.freed == 0)
+        continue;
+      sites.emplace_back(entry.first, entry.second);
+      if (release)
+        release_site(entry.second);
+    }
+  }
+  if (sites.empty())
+    return;
+  std::sort(sites.begin(), sites.end(), [](const auto &a, const auto &b) {
+    if (a.second.count != b.second.count)
+      return a.second.count > b.second.count;
+    return a.first < b.first;
+  });
+
+  os << "," << std::endl;
+  os << "  \"alloc_sites\": [" << std::endl;
+  for (size_t i = 0; i < sites.size(); ++i) {
+    const Alloc_Site_Stats &site = sites[i].second;
+    os << "    {\"call_id\": " << sites[i].first << ", ";
+    os << "\"buffer_name\": \"" << (site.name ? site.name : "$UNKNOWN$")
+       << "\", ";
+    os << "\"funcname\": \"" << (site.funcname ? site.funcname : "")
+       << "\", ";
+    os << "\"filename\": \"" << (site.filename ? site.filename : "")
+       << "\", ";
+    os << "\"line\": " << site.line << ", ";
+    os << "\"count\": " << site.count << ", ";
+    os << "\"bytes\": " << site.bytes << ", ";
+    os << "\"min_size\": " << (site.count ? site.min_size : 0) << ", ";
+    os << "\"max_size\": " << site.max_size << ", ";
+    os << "\"untracked\": " << site.untracked << ", ";
+    os << "\"in_loop\": " << site.in_loop << ", ";
+    os << "\"freed\": " << site.freed << ", ";
+    os << "\"max_live\": " << site.max_live << ", ";
+    os << "\"size_histogram\": ";
+    write_histogram(os, site.sizes);
+    os << ", \"lifetime_histogram_ns\": ";
+    write_histogram(os, site.lifetimes);
+    // A site that never has two buffers live at once can reuse a single
+    // buffer allocated before the loop
+    if (site.in_loop >= CATS_ALLOC_SITES_POOL_COUNT)
+      os << ", \"hint\": \"" << (site.max_live <= 1 ? "hoist" : "pool")
+         << "\"";
+    os << "}";
+    if (i + 1 < sites.size())
+      os << ",";
+    os << std::endl;
+  }
+  os << "  ]";
+}
+
+} // namespace cats
@@ -0,0 +1,42 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_ALLOC_SITES_HPP__
+#define __CATS_ALLOC_SITES_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace cats {
+
+// Allocation site aggregation, enabled with CATS_ALLOC_SITES=1. Every
+// allocation is counted for its site (call_id) with log2 histograms of the
+// requested sizes and of the lifetimes, and with the number of allocations
+// made while a loop scope was open on the allocating thread. Allocations
+// smaller than CATS_ALLOC_SITES_MIN_SIZE bytes are only counted: they are
+// neither traced nor attributed as buffers.
+
+bool alloc_sites_enabled();
+
+// Counts the allocation and returns whether the buffer is tracked
+// individually.
+bool alloc_sites_alloc(uint64_t call_id, const char *buffer_name,
+                       void *address, size_t size, const char *funcname,
+                       const char *filename, uint32_t line);
+// Returns whether the freed buffer was tracked individually.
+bool alloc_sites_dealloc(void *address);
+
+void alloc_sites_scope_entry(uint64_t scope_id, uint8_t type);
+void alloc_sites_scope_exit(uint64_t scope_id);
+
+// Appends the "alloc_sites" section of the trace, a record per allocation
+// site with the most allocations first. Sites that allocate often inside
+// loops carry a pooling hint. With `release` the counts are reset after
+// they are written, so that each segment only covers the allocations and
+// frees since the previous one. Writes nothing if the mode is disabled or
+// nothing was allocated.
+void write_alloc_sites_profile(std::ostream &os, bool release);
+
+} // namespace cats
+
+#endif // __CATS_ALLOC_SITES_HPP__
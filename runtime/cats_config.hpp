@@ -0,0 +1,95 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_CONFIG_HPP__
+#define __CATS_CONFIG_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+namespace cats {
+namespace config {
+
+// Runtime options are read from the environment once at startup. Unknown
+// values are reported and replaced by the default so that a typo never
+// silently changes the trace semantics.
+
+inline const char *get_string(const char *name, const char *fallback) {
+  const char *value = std::getenv(name);
+  if (!value || !*value)
+    return fallback;
+  return value;
+}
+
+inline bool get_bool(const char *name, bool fallback) {
+  const char *value = std::getenv(name);
+  if (!value || !*value)
+    return fallback;
+  return !(strcmp(value, "0") == 0 || strcmp(value, "false") == 0 ||
+           strcmp(value, "off") == 0 || strcmp(value, "no") == 0);
+}
+
+inline uint64_t get_u64(const char *name, uint64_t fallback) {
+  const char *value = std::getenv(name);
+  if (!value || !*value)
+    return fallback;
+  char *end = nullptr;
+  unsigned long long parsed = std::strtoull(value, &end, 0);
+  if (end == value || *end != '\0') {
+    std::cerr << "CATS: Ignoring invalid value '" << value << "' for "
+              << name << std::endl;
+    return fallback;
+  }
+  return parsed;
+}
+
+inline double get_double(const char *name, double fallback) {
+  const char *value = std::getenv(name);
+  if (!value || !*value)
+    return fallback;
+  char *end = nullptr;
+  double parsed = std::strtod(value, &end);
+  if (end == value || *end != '\0') {
+    std::cerr << "CATS: Ignoring invalid value '" << value << "' for "
+              << name << std::endl;
+    return fallback;
+  }
+  return parsed;
+}
+
+// Returns the index of the value of `name` in `choices`, or `fallback` if
+// the variable is unset or holds an unknown value.
+inline size_t get_choice(const char *name, const char *const *choices,
+                         size_t n_choices, size_t fallback) {
+  const char *value = std::getenv(name);
+  if (!value || !*value)
+    return fallback;
+  for (size_t i = 0; i < n_choices; ++i) {
+    if (strcmp(value, choices[i]) == 0)
+      return i;
+  }
+  std::cerr << "CATS: Unknown value '" << value << "' for " << name
+            << ", expected one of:";
+  for (size_t i = 0; i < n_choices; ++i)
+    std::cerr << " " << choices[i];
+  std::cerr << std::endl;
+  return fallback;
+}
+
+} // namespace config
+
+// The instance of `T`, created on first use and never destroyed. The state
+// of the runtime modules is kept this way: the runtime is set up from a
+// static initializer of another translation unit, and the hooks may still
+// be called from global destructors after a static object would be gone.
+template <typename T>
+T &leaked_instance() {
+  static T *instance = new T();
+  return *instance;
+}
+
+} // namespace cats
+
+#endif // __CATS_CONFIG_HPP__
@@ -0,0 +1,54 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_fd_paths.hpp"
+#include "cats_config.hpp"
+
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+
+#include <unistd.h>
+
+namespace cats {
+
+struct Fd_Paths {
+  std::mutex mutex;
+  std::unordered_map<int, const char *> paths;
+  // Every path seen, the cache points into it
+  std::unordered_set<std::string> strings;
+};
+
+static Fd_Paths &state() {
+  return leaked_instance<Fd_Paths>();
+}
+
+const char *fd_path(int fd) {
+  if (fd < 0)
+    return "";
+  Fd_Paths &s = state();
+  std::lock_guard<std::mutex> guard(s.mutex);
+  auto it = s.paths.find(fd);
+  if (it != s.paths.end())
+    return it->second;
+
+  char link[32];
+  char path[4096];
+  snprintf(link, sizeof(link), "/proc/self/fd/%d", fd);
+  ssize_t length = readlink(link, path, sizeof(path) - 1);
+  path[length > 0 ? length : 0] = '\0';
+  const char *interned = s.strings.emplace(path).first->c_str();
+  s.paths.emplace(fd, interned);
+  return interned;
+}
+
+void forget_fd_path(int fd) {
+  if (fd < 0)
+    return;
+  Fd_Paths &s = state();
+  std::lock_guard<std::mutex> guard(s.mutex);
+  s.paths.erase(fd);
+}
+
+} // namespace cats
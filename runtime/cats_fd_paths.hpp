@@ -0,0 +1,18 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_FD_PATHS_HPP__
+#define __CATS_FD_PATHS_HPP__
+
+namespace cats {
+
+// Path of an open file descriptor, an empty string if it has none. The path
+// is resolved once per descriptor; the returned string is never freed, and
+// descriptors with the same path return the same pointer.
+const char *fd_path(int fd);
+
+// Drops the cached path of `fd`, called when it is opened or closed.
+void forget_fd_path(int fd);
+
+} // namespace cats
+
+#endif // __CATS_FD_PATHS_HPP__
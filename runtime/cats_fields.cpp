@@ -0,0 +1,196 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_fields.hpp"
+#include "cats_config.hpp"
+
+#include <algorithm>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+// Fields with less than this share of the accesses to their struct are
+// reported as cold.
+#ifndef CATS_FIELD_COLD_SHARE
+#define CATS_FIELD_COLD_SHARE                       0.05
+#endif
+
+namespace cats {
+
+struct Field_Stats {
+  uint32_t offset = 0;
+  uint32_t size = 0;
+  uint64_t reads = 0;
+  uint64_t writes = 0;
+};
+
+struct Struct_Stats {
+  std::string buffer_name;
+  uint32_t struct_size = 0;
+  std::map<uint32_t, Field_Stats> fields;
+};
+
+// Struct names are compared by pointer while recording; modules have their
+// own copies of the names, which are merged when the profile is written.
+struct Field_Key {
+  uint64_t buffer_id;
+  uint64_t loop_scope;
+  const char *struct_name;
+
+  bool operator==(const Field_Key &other) const {
+    return this->buffer_id == other.buffer_id &&
+           this->loop_scope == other.loop_scope &&
+           this->struct_name == other.struct_name;
+  }
+};
+
+struct Field_Key_Hash {
+  size_t operator()(const Field_Key &key) const {
+    size_t h = std::hash<uint64_t>()(key.buffer_id);
+    h = h * 31 + std::hash<uint64_t>()(key.loop_scope);
+    return h * 31 + std::hash<const void *>()(key.struct_name);
+  }
+};
+
+// Profile of one thread. The mutex is only contended while the profile is
+// written out.
+struct Thread_Fields {
+  std::mutex mutex;
+  std::unordered_map<Field_Key, Struct_Stats, Field_Key_Hash> structs;
+};
+
+struct Fields_State {
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_Fields>> threads;
+};
+
+static Fields_State &state() {
+  return leaked_instance<Fields_State>();
+}
+
+static thread_local Thread_Fields *t_fields = nullptr;
+
+static Thread_Fields &thread_fields() {
+  if (!t_fields) {
+    Fields_State &s = state();
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    s.threads.emplace_back(new Thread_Fields());
+    t_fields = s.threads.back().get();
+  }
+  return *t_fields;
+}
+
+void field_accessed(const cats_site_info &site, uint64_t buffer_id,
+                    const char *buffer_name, uint64_t loop_scope,
+                    bool is_write) {
+  Thread_Fields &profile = thread_fields();
+  std::lock_guard<std::mutex> guard(profile.mutex);
+  Field_Key key = {buffer_id, loop_scope, site.struct_name};
+  auto it = profile.structs.find(key);
+  if (it == profile.structs.end()) {
+    it = profile.structs.emplace(key, Struct_Stats()).first;
+    it->second.buffer_name = buffer_name;
+    it->second.struct_size = site.struct_size;
+  }
+  Field_Stats &field = it->second.fields[site.field_index];
+  field.offset = site.field_offset;
+  field.size = site.field_size;
+  if (is_write)
+    ++field.writes;
+  else
+    ++field.reads;
+}
+
+void write_field_profile(std::ostream &os, bool release) {
+  std::map<std::tuple<uint64_t, std::string, uint64_t>, Struct_Stats> merged;
+  Fields_State &s = state();
+  {
+    std::lock_guard<std::mutex> threads_guard(s.threads_mutex);
+    for (auto &profile : s.threads) {
+      std::lock_guard<std::mutex> guard(profile->mutex);
+      for (const auto &entry : profile->structs) {
+        const Field_Key &key = entry.first;
+        auto it = merged.find(
+          std::make_tuple(key.buffer_id, key.struct_name, key.loop_scope)
+        );
+        if (it == merged.end()) {
+          merged.emplace(
+            std::make_tuple(key.buffer_id, key.struct_name, key.loop_scope),
+            entry.second
+          );
+          continue;
+        }
+        for (const auto &field : entry.second.fields) {
+          Field_Stats &stats = it->second.fields[field.first];
+          stats.offset = field.second.offset;
+          stats.size = field.second.size;
+          stats.reads += field.second.reads;
+          stats.writes += field.second.writes;
+        }
+      }
+      if (release)
+        profile->structs.clear();
+    }
+  }
+  if (merged.empty())
+    return;
+
+  os << "," << std::endl;
+  os << "  \"fields\": [" << std::endl;
+  size_t n = 0;
+  for (const auto &entry : merged) {
+    const Struct_Stats &stats = entry.second;
+    uint64_t accesses = 0;
+    for (const auto &field : stats.fields)
+      accesses += field.second.reads + field.second.writes;
+
+    // Hottest fields first
+    std::vector<std::pair<uint32_t, const Field_Stats *>> fields;
+    for (const auto &field : stats.fields)
+      fields.emplace_back(field.first, &field.second);
+    std::stable_sort(fields.begin(), fields.end(), [](const auto &a,
+                                                      const auto &b) {
+      return a.second->reads + a.second->writes >
+             b.second->reads + b.second->writes;
+    });
+
+    uint64_t used_bytes = 0;
+    os << "    {\"buffer_id\": " << std::get<0>(entry.first) << ", ";
+    os << "\"buffer_name\": \"" << stats.buffer_name << "\", ";
+    os << "\"struct\": \"" << std::get<1>(entry.first) << "\", ";
+    os << "\"struct_size\": " << stats.struct_size << ", ";
+    os << "\"loop_scope\": " << std::get<2>(entry.first) << ", ";
+    os << "\"accesses\": " << accesses << ", ";
+    os << "\"fields\": [";
+    for (size_t i = 0; i < fields.size(); ++i) {
+      const Field_Stats &field = *fields[i].second;
+      double share =
+        accesses ? (double) (field.reads + field.writes) / accesses : 0.0;
+      used_bytes += field.size;
+      if (i > 0)
+        os << ", ";
+      os << "{\"index\": " << fields[i].first << ", ";
+      os << "\"offset\": " << field.offset << ", ";
+      os << "\"size\": " << field.size << ", ";
+      os << "\"reads\": " << field.reads << ", ";
+      os << "\"writes\": " << field.writes << ", ";
+      os << "\"share\": " << share << ", ";
+      os << "\"cold\": " << (share < CATS_FIELD_COLD_SHARE ? "true" : "false")
+         << "}";
+    }
+    os << "], ";
+    os << "\"used_bytes\": " << used_bytes << ", ";
+    os << "\"utilization\": "
+       << (stats.struct_size ? (double) used_bytes / stats.struct_size : 0.0)
+       << "}";
+    if (++n < merged.size())
+      os << ",";
+    os << std::endl;
+  }
+  os << "  ]";
+}
+
+} // namespace cats
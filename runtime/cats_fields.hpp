@@ -0,0 +1,29 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_FIELDS_HPP__
+#define __CATS_FIELDS_HPP__
+
+#include "cats_runtime.h"
+
+#include <cstdint>
+#include <ostream>
+
+namespace cats {
+
+// Struct field profile. Accesses from sites that the passes registered as
+// struct field accesses are counted per buffer, struct type and innermost
+// loop, before deduplication, so that the counts reflect every execution.
+void field_accessed(const cats_site_info &site, uint64_t buffer_id,
+                    const char *buffer_name, uint64_t loop_scope,
+                    bool is_write);
+
+// Appends the "fields" section of the trace: for each buffer, struct type
+// and loop the accesses per field, the fields that are cold and the share
+// of each element's bytes that is used. With `release` the counts are
+// reset after they are written, so that each segment only covers its own
+// accesses. Writes nothing if no field access was counted.
+void write_field_profile(std::ostream &os, bool release);
+
+} // namespace cats
+
+#endif // __CATS_FIELDS_HPP__
@@ -0,0 +1,164 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_filter.hpp"
+#include "cats_config.hpp"
+#include "cats_runtime.h"
+
+#include <cstring>
+#include <iostream>
+
+#include <fnmatch.h>
+
+#ifndef CATS_FILTER_SITES
+#define CATS_FILTER_SITES                           65536
+#endif
+
+namespace cats {
+
+static const uint32_t ALL_SCOPES = ~0u;
+
+// The bit of a scope type in the scope mask. Types beyond the mask have
+// no bit, so only a filter without a scope term records them.
+static uint32_t scope_bit(int scope_type) {
+  if (scope_type < 0 || scope_type >= 32)
+    return 0;
+  return 1u << scope_type;
+}
+
+static std::vector<std::string> split(const std::string &value, char sep) {
+  std::vector<std::string> parts;
+  size_t begin = 0;
+  while (begin <= value.size()) {
+    size_t end = value.find(sep, begin);
+    if (end == std::string::npos)
+      end = value.size();
+    if (end > begin)
+      parts.push_back(value.substr(begin, end - begin));
+    begin = end + 1;
+  }
+  return parts;
+}
+
+static bool parse_size(const std::string &value, size_t &out) {
+  char *end = nullptr;
+  unsigned long long parsed = std::strtoull(value.c_str(), &end, 0);
+  if (end == value.c_str())
+    return false;
+  switch (*end) {
+    case 'k': case 'K': parsed <<= 10; ++end; break;
+    case 'm': case 'M': parsed <<= 20; ++end; break;
+    case 'g': case 'G': parsed <<= 30; ++end; break;
+  }
+  if (*end != '\0')
+    return false;
+  out = parsed;
+  return true;
+}
+
+static bool parse_scopes(const std::string &value, uint32_t &mask) {
+  static const char *const names[] = {
+    "func", "loop", "cond", "para", "unst"
+  };
+  static const int types[] = {
+    CATS_SCOPE_TYPE_FUNCTION, CATS_SCOPE_TYPE_LOOP,
+    CATS_SCOPE_TYPE_CONDITIONAL, CATS_SCOPE_TYPE_PARALLEL,
+    CATS_SCOPE_TYPE_UNSTRUCTURED
+  };
+  mask = 0;
+  for (auto &name : split(value, ',')) {
+    size_t i = 0;
+    while (i < sizeof(names) / sizeof(names[0]) && name != names[i])
+      ++i;
+    if (i == sizeof(names) / sizeof(names[0]))
+      return false;
+    mask |= scope_bit(types[i]);
+  }
+  return true;
+}
+
+static Filter_Config parse_filter(const char *spec) {
+  Filter_Config c;
+  c.enabled = false;
+  c.scope_mask = ALL_SCOPES;
+  c.max_depth = 0;
+  c.min_alloc = 0;
+  if (!spec)
+    return c;
+
+  for (auto &term : split(spec, ';')) {
+    size_t eq = term.find('=');
+    std::string key = term.substr(0, eq);
+    std::string value = eq == std::string::npos ? "" : term.substr(eq + 1);
+    bool valid = !value.empty();
+    if (!valid) {
+      // Reported below.
+    } else if (key == "buffer") {
+      c.buffers = split(value, ',');
+    } else if (key == "func") {
+      c.funcs = split(value, ',');
+    } else if (key == "file") {
+      c.files = split(value, ',');
+    } else if (key == "scope") {
+      valid = parse_scopes(value, c.scope_mask);
+    } else if (key == "depth") {
+      valid = parse_size(value, c.max_depth);
+    } else if (key == "min_alloc") {
+      valid = parse_size(value, c.min_alloc);
+    } else {
+      valid = false;
+    }
+    if (!valid) {
+      std::cerr << "CATS: Ignoring invalid term '" << term
+                << "' in CATS_FILTER" << std::endl;
+      continue;
+    }
+    c.enabled = true;
+  }
+  return c;
+}
+
+const Filter_Config &filter_config() {
+  static const Filter_Config config = parse_filter(
+    config::get_string("CATS_FILTER", nullptr)
+  );
+  return config;
+}
+
+static bool matches(const std::vector<std::string> &globs, const char *name) {
+  if (globs.empty())
+    return true;
+  if (!name)
+    name = "";
+  for (auto &glob : globs) {
+    if (fnmatch(glob.c_str(), name, 0) == 0)
+      return true;
+  }
+  return false;
+}
+
+Site_Filter::Site_Filter()
+  : _config(filter_config()), _capacity(0) {
+  if (!this->_config.enabled)
+    return;
+  size_t sites = config::get_u64("CATS_FILTER_SITES", CATS_FILTER_SITES);
+  this->_capacity = 1;
+  while (this->_capacity < sites)
+    this->_capacity <<= 1;
+  this->_slots.reset(new Slot[this->_capacity]);
+}
+
+uint8_t Site_Filter::classify(const char *funcname, const char *filename,
+                              int scope_type, const char *buffer_name) const {
+  uint8_t verdict = SITE_CLASSIFIED;
+  bool record = matches(this->_config.funcs, funcname) &&
+                matches(this->_config.files, filename);
+  if (scope_type >= 0 && this->_config.scope_mask != ALL_SCOPES)
+    record = record && (this->_config.scope_mask & scope_bit(scope_type));
+  if (record)
+    verdict |= SITE_RECORD;
+  if (buffer_name && matches(this->_config.buffers, buffer_name))
+    verdict |= SITE_BUFFER;
+  return verdict;
+}
+
+} // namespace cats
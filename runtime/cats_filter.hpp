@@ -0,0 +1,114 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_FILTER_HPP__
+#define __CATS_FILTER_HPP__
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace cats {
+
+// Event filter, read once from CATS_FILTER. The value is a list of
+// `key=value` terms separated by ';', e.g.
+//   CATS_FILTER="buffer=u,v*;func=solve*;scope=loop,para;depth=4"
+// Terms:
+//   buffer=GLOB,...  only trace buffers whose name matches one of the globs
+//   func=GLOB,...    only record events of matching functions
+//   file=GLOB,...    only record events of matching source files
+//   scope=TYPE,...   only record entries/exits of these scope types
+//                    (func, loop, cond, para, unst)
+//   depth=N          drop events nested deeper than N scopes
+//   min_alloc=N      only trace buffers of at least N bytes
+// Accesses and deallocations of buffers that are not traced are dropped.
+struct Filter_Config {
+  bool enabled;
+  std::vector<std::string> buffers;
+  std::vector<std::string> funcs;
+  std::vector<std::string> files;
+  uint32_t scope_mask;
+  size_t max_depth;
+  size_t min_alloc;
+};
+
+const Filter_Config &filter_config();
+
+// Per-site verdicts of the static filter terms. A site is classified the
+// first time it is seen and the verdict is cached by its call ID, so the
+// hooks of rejected sites return after a table lookup and a bit test.
+class Site_Filter {
+public:
+  enum : uint8_t {
+    SITE_CLASSIFIED = 1 << 0,
+    // func, file and scope terms match
+    SITE_RECORD     = 1 << 1,
+    // buffer term matches (allocation sites only)
+    SITE_BUFFER     = 1 << 2,
+  };
+
+  Site_Filter();
+
+  bool enabled() const { return this->_config.enabled; }
+
+  // `scope_type` is -1 for sites that are not scope entries or exits,
+  // `buffer_name` is null for sites that are not allocations.
+  uint8_t site(uint64_t call_id, const char *funcname, const char *filename,
+               int scope_type, const char *buffer_name) {
+    if (!this->_slots)
+      return this->classify(funcname, filename, scope_type, buffer_name);
+
+    size_t mask = this->_capacity - 1;
+    size_t i = (size_t) ((call_id * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+    for (size_t probe = 0; probe < this->_capacity; ++probe) {
+      Slot &slot = this->_slots[(i + probe) & mask];
+      uint64_t key = slot.call_id.load(std::memory_order_acquire);
+      if (key == 0 && call_id != 0) {
+        if (slot.call_id.compare_exchange_strong(
+              key, call_id, std::memory_order_acq_rel)) {
+          uint8_t verdict = this->classify(
+            funcname, filename, scope_type, buffer_name
+          );
+          slot.verdict.store(verdict, std::memory_order_release);
+          return verdict;
+        }
+      }
+      if (key == call_id) {
+        uint8_t verdict = slot.verdict.load(std::memory_order_acquire);
+        if (verdict & SITE_CLASSIFIED)
+          return verdict;
+        // Another thread is classifying the site right now.
+        return this->classify(funcname, filename, scope_type, buffer_name);
+      }
+    }
+    // The table is full, fall back to classifying on every call.
+    return this->classify(funcname, filename, scope_type, buffer_name);
+  }
+
+  bool accept_depth(size_t depth) const {
+    return !this->_config.max_depth || depth <= this->_config.max_depth;
+  }
+
+  bool accept_size(size_t size) const {
+    return size >= this->_config.min_alloc;
+  }
+
+private:
+  struct Slot {
+    std::atomic<uint64_t> call_id{0};
+    std::atomic<uint8_t> verdict{0};
+  };
+
+  uint8_t classify(const char *funcname, const char *filename,
+                   int scope_type, const char *buffer_name) const;
+
+  const Filter_Config &_config;
+  size_t _capacity;
+  std::unique_ptr<Slot[]> _slots;
+};
+
+} // namespace cats
+
+#endif // __CATS_FILTER_HPP__
@@ -0,0 +1,155 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_flight_recorder.hpp"
+#include "cats_config.hpp"
+
+#include <atomic>
+#include <csignal>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <thread>
+
+#include <semaphore.h>
+#include <unistd.h>
+
+#ifndef CATS_RING_DEFAULT_EVENTS
+#define CATS_RING_DEFAULT_EVENTS                    16384
+#endif
+
+namespace cats {
+
+static int parse_signal(const char *name) {
+  if (!name)
+    return 0;
+  if (*name >= '0' && *name <= '9')
+    return atoi(name);
+  if (strncmp(name, "SIG", 3) == 0)
+    name += 3;
+  if (strcmp(name, "USR1") == 0)
+    return SIGUSR1;
+  if (strcmp(name, "USR2") == 0)
+    return SIGUSR2;
+  if (strcmp(name, "HUP") == 0)
+    return SIGHUP;
+  if (strcmp(name, "QUIT") == 0)
+    return SIGQUIT;
+  std::cerr << "CATS: Unknown signal '" << name << "' for CATS_RING_SIGNAL"
+            << std::endl;
+  return 0;
+}
+
+const Ring_Config &ring_config() {
+  static const Ring_Config config = []() {
+    Ring_Config c;
+    c.capacity = config::get_u64("CATS_RING_EVENTS", CATS_RING_DEFAULT_EVENTS);
+    if (c.capacity == 0)
+      c.capacity = 1;
+    c.window_ns = (uint64_t) (
+      config::get_double("CATS_RING_SECONDS", 0.0) * 1e9
+    );
+    c.dump_signal = parse_signal(
+      config::get_string("CATS_RING_SIGNAL", nullptr)
+    );
+    c.dump_on_crash = config::get_bool("CATS_RING_DUMP_ON_CRASH", true);
+    c.dump_prefix = config::get_string("CATS_RING_DUMP_PREFIX", "cats_trace");
+    return c;
+  }();
+  return config;
+}
+
+static void (*g_dump)(const char *) = nullptr;
+static void (*g_crash_dump)(const char *) = nullptr;
+static sem_t g_dump_request;
+static char g_crash_path[512];
+static std::atomic<bool> g_crashing(false);
+
+static const int g_crash_signals[] = {
+  SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT
+};
+static const size_t g_n_crash_signals =
+  sizeof(g_crash_signals) / sizeof(g_crash_signals[0]);
+
+// Handlers installed before the flight recorder, called after the dump.
+static struct sigaction g_previous[g_n_crash_signals];
+
+static void on_dump_signal(int) {
+  // sem_post is async-signal-safe, the dump itself happens on the dumper
+  // thread.
+  sem_post(&g_dump_request);
+}
+
+static void on_crash_signal(int sig, siginfo_t *info, void *context) {
+  if (!g_crashing.exchange(true)) {
+    static const char msg[] = "CATS: Fatal signal, dumping flight recorder\n";
+    ssize_t ignored = write(STDERR_FILENO, msg, sizeof(msg) - 1);
+    (void) ignored;
+    g_crash_dump(g_crash_path);
+  }
+
+  // Hand the signal on to the previous handler. With the default action the
+  // signal is raised again to terminate with it.
+  size_t i = 0;
+  while (i < g_n_crash_signals && g_crash_signals[i] != sig)
+    ++i;
+  if (i == g_n_crash_signals)
+    return;
+  const struct sigaction &previous = g_previous[i];
+  sigaction(sig, &previous, nullptr);
+  if (previous.sa_flags & SA_SIGINFO) {
+    previous.sa_sigaction(sig, info, context);
+  } else if (previous.sa_handler != SIG_DFL &&
+             previous.sa_handler != SIG_IGN) {
+    previous.sa_handler(sig);
+  } else {
+    raise(sig);
+  }
+}
+
+static void dumper_thread() {
+  unsigned long n_dumps = 0;
+  const Ring_Config &config = ring_config();
+  char path[512];
+  while (true) {
+    if (sem_wait(&g_dump_request) != 0)
+      continue;
+    snprintf(path, sizeof(path), "%s.%ld.%lu.cats", config.dump_prefix,
+             (long) getpid(), n_dumps++);
+    g_dump(path);
+    std::cerr << "CATS: Flight recorder dumped to " << path << std::endl;
+  }
+}
+
+void install_flight_recorder(void (*dump)(const char *),
+                             void (*crash_dump)(const char *)) {
+  const Ring_Config &config = ring_config();
+  g_dump = dump;
+  g_crash_dump = crash_dump;
+
+  if (config.dump_signal) {
+    sem_init(&g_dump_request, 0, 0);
+    std::thread(dumper_thread).detach();
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_dump_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_RESTART;
+    sigaction(config.dump_signal, &sa, nullptr);
+  }
+
+  if (config.dump_on_crash) {
+    snprintf(g_crash_path, sizeof(g_crash_path), "%s.%ld.crash.cats",
+             config.dump_prefix, (long) getpid());
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = on_crash_signal;
+    sigemptyset(&sa.sa_mask);
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    for (size_t i = 0; i < g_n_crash_signals; ++i)
+      sigaction(g_crash_signals[i], &sa, &g_previous[i]);
+  }
+}
+
+} // namespace cats
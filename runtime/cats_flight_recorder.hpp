@@ -0,0 +1,36 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_FLIGHT_RECORDER_HPP__
+#define __CATS_FLIGHT_RECORDER_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cats {
+
+// Flight-recorder settings, read once from the environment:
+//   CATS_RING_EVENTS         ring capacity per recording thread
+//   CATS_RING_SECONDS        only dump events of the last T seconds
+//   CATS_RING_SIGNAL         signal requesting a dump (e.g. USR1)
+//   CATS_RING_DUMP_ON_CRASH  dump on SIGSEGV, SIGBUS, SIGFPE, SIGILL, SIGABRT
+//                            (on by default)
+//   CATS_RING_DUMP_PREFIX    prefix of the dump files
+struct Ring_Config {
+  size_t capacity;
+  uint64_t window_ns;
+  int dump_signal;
+  bool dump_on_crash;
+  const char *dump_prefix;
+};
+
+const Ring_Config &ring_config();
+
+// Installs the dump-on-demand signal and the crash handlers. `dump` may be
+// called from a helper thread while the application keeps recording,
+// `crash_dump` is called from a fatal signal handler on the crashing thread.
+void install_flight_recorder(void (*dump)(const char *filepath),
+                             void (*crash_dump)(const char *filepath));
+
+} // namespace cats
+
+#endif // __CATS_FLIGHT_RECORDER_HPP__
@@ -0,0 +1,227 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_heatmap.hpp"
+#include "cats_config.hpp"
+
+#include <algorithm>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+#ifndef CATS_HEATMAP_DEFAULT_PAGE
+#define CATS_HEATMAP_DEFAULT_PAGE                   4096
+#endif
+
+#ifndef CATS_HEATMAP_DEFAULT_MIN_SIZE
+#define CATS_HEATMAP_DEFAULT_MIN_SIZE               65536
+#endif
+
+#ifndef CATS_HEATMAP_DEFAULT_MAX_BINS
+#define CATS_HEATMAP_DEFAULT_MAX_BINS               1024
+#endif
+
+namespace cats {
+
+struct Heatmap_Config {
+  bool enabled = false;
+  uint64_t page = CATS_HEATMAP_DEFAULT_PAGE;
+  uint64_t min_size = CATS_HEATMAP_DEFAULT_MIN_SIZE;
+  uint64_t max_bins = CATS_HEATMAP_DEFAULT_MAX_BINS;
+};
+
+static const Heatmap_Config &heatmap_config() {
+  static const Heatmap_Config config = []() {
+    Heatmap_Config c;
+    c.enabled = config::get_bool("CATS_HEATMAP", false);
+    c.page = config::get_u64("CATS_HEATMAP_PAGE", CATS_HEATMAP_DEFAULT_PAGE);
+    if (c.page == 0)
+      c.page = CATS_HEATMAP_DEFAULT_PAGE;
+    c.min_size = config::get_u64(
+      "CATS_HEATMAP_MIN_SIZE", CATS_HEATMAP_DEFAULT_MIN_SIZE
+    );
+    c.max_bins = config::get_u64(
+      "CATS_HEATMAP_MAX_BINS", CATS_HEATMAP_DEFAULT_MAX_BINS
+    );
+    if (c.max_bins == 0)
+      c.max_bins = 1;
+    return c;
+  }();
+  return config;
+}
+
+// Counters saturate instead of wrapping around.
+struct Heatmap {
+  std::string buffer_name;
+  // Start of the page holding the first byte of the buffer, where the
+  // first bin starts
+  uint64_t base = 0;
+  uint64_t bin_size = 0;
+  std::vector<uint32_t> reads;
+  std::vector<uint32_t> writes;
+};
+
+// A buffer ID is the address of the buffer and may be reused after a free;
+// allocations of the same size at the same address share their heatmap.
+typedef std::tuple<uint64_t, uint64_t, uint64_t> Heatmap_Key;
+
+struct Heatmap_Key_Hash {
+  size_t operator()(const Heatmap_Key &key) const {
+    size_t h = std::hash<uint64_t>()(std::get<0>(key));
+    h = h * 31 + std::hash<uint64_t>()(std::get<1>(key));
+    return h * 31 + std::hash<uint64_t>()(std::get<2>(key));
+  }
+};
+
+// Profile of one thread. The mutex is only contended while the profile is
+// written out.
+struct Thread_Heatmaps {
+  std::mutex mutex;
+  std::unordered_map<Heatmap_Key, Heatmap, Heatmap_Key_Hash> heatmaps;
+};
+
+struct Heatmap_State {
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_Heatmaps>> threads;
+};
+
+static Heatmap_State &state() {
+  return leaked_instance<Heatmap_State>();
+}
+
+static thread_local Thread_Heatmaps *t_heatmaps = nullptr;
+
+static Thread_Heatmaps &thread_heatmaps() {
+  if (!t_heatmaps) {
+    Heatmap_State &s = state();
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    s.threads.emplace_back(new Thread_Heatmaps());
+    t_heatmaps = s.threads.back().get();
+  }
+  return *t_heatmaps;
+}
+
+static void add(std::vector<uint32_t> &bins, uint64_t first, uint64_t last,
+                uint64_t count) {
+  for (uint64_t bin = first; bin <= last; ++bin) {
+    uint64_t sum = bins[bin] + count;
+    bins[bin] = (uint32_t) std::min<uint64_t>(
+      sum, std::numeric_limits<uint32_t>::max()
+    );
+  }
+}
+
+bool heatmap_enabled() {
+  return heatmap_config().enabled;
+}
+
+void heatmap_access(uint64_t buffer_id, const char *buffer_name,
+                    size_t buffer_size, uint64_t parallel_scope,
+                    uint64_t offset, size_t size, bool is_write) {
+  const Heatmap_Config &c = heatmap_config();
+  if (buffer_size < c.min_size)
+    return;
+
+  Thread_Heatmaps &profile = thread_heatmaps();
+  std::lock_guard<std::mutex> guard(profile.mutex);
+  Heatmap_Key key(buffer_id, buffer_size, parallel_scope);
+  auto it = profile.heatmaps.find(key);
+  if (it == profile.heatmaps.end()) {
+    // Bins follow the pages of the address space, a buffer that does not
+    // start on a page boundary shares its first page with other data.
+    Heatmap heatmap;
+    heatmap.buffer_name = buffer_name;
+    heatmap.base = buffer_id - buffer_id % c.page;
+    uint64_t span = buffer_id + buffer_size - heatmap.base;
+    uint64_t pages = (span + c.page - 1) / c.page;
+    uint64_t pages_per_bin = (pages + c.max_bins - 1) / c.max_bins;
+    heatmap.bin_size = pages_per_bin * c.page;
+    uint64_t bins = (span + heatmap.bin_size - 1) / heatmap.bin_size;
+    heatmap.reads.resize(bins);
+    heatmap.writes.resize(bins);
+    it = profile.heatmaps.emplace(key, std::move(heatmap)).first;
+  }
+
+  Heatmap &heatmap = it->second;
+  uint64_t position = buffer_id + offset - heatmap.base;
+  uint64_t last_bin = heatmap.reads.size() - 1;
+  uint64_t first = std::min(position / heatmap.bin_size, last_bin);
+  uint64_t last = std::min(
+    (position + (size ? size - 1 : 0)) / heatmap.bin_size, last_bin
+  );
+  add(is_write ? heatmap.writes : heatmap.reads, first, last, 1);
+}
+
+static void write_bins(std::ostream &os, const std::vector<uint32_t> &bins) {
+  os << "[";
+  for (size_t i = 0; i < bins.size(); ++i) {
+    if (i > 0)
+      os << ", ";
+    os << bins[i];
+  }
+  os << "]";
+}
+
+void write_heatmap_profile(std::ostream &os, bool release) {
+  std::map<Heatmap_Key, Heatmap> merged;
+  Heatmap_State &s = state();
+  {
+    std::lock_guard<std::mutex> threads_guard(s.threads_mutex);
+    for (auto &profile : s.threads) {
+      std::lock_guard<std::mutex> guard(profile->mutex);
+      for (const auto &entry : profile->heatmaps) {
+        auto it = merged.find(entry.first);
+        if (it == merged.end()) {
+          merged.emplace(entry.first, entry.second);
+          continue;
+        }
+        Heatmap &heatmap = it->second;
+        for (size_t i = 0; i < heatmap.reads.size(); ++i) {
+          add(heatmap.reads, i, i, entry.second.reads[i]);
+          add(heatmap.writes, i, i, entry.second.writes[i]);
+        }
+      }
+      if (release)
+        profile->heatmaps.clear();
+    }
+  }
+  if (merged.empty())
+    return;
+
+  os << "," << std::endl;
+  os << "  \"heatmaps\": [" << std::endl;
+  size_t n = 0;
+  for (const auto &entry : merged) {
+    const Heatmap &heatmap = entry.second;
+    uint64_t reads = 0, writes = 0, touched = 0;
+    for (size_t i = 0; i < heatmap.reads.size(); ++i) {
+      reads += heatmap.reads[i];
+      writes += heatmap.writes[i];
+      touched += heatmap.reads[i] || heatmap.writes[i];
+    }
+    os << "    {\"buffer_id\": " << std::get<0>(entry.first) << ", ";
+    os << "\"buffer_name\": \"" << heatmap.buffer_name << "\", ";
+    os << "\"size\": " << std::get<1>(entry.first) << ", ";
+    os << "\"parallel_scope\": " << std::get<2>(entry.first) << ", ";
+    os << "\"base_address\": " << heatmap.base << ", ";
+    os << "\"bin_size\": " << heatmap.bin_size << ", ";
+    os << "\"reads\": " << reads << ", ";
+    os << "\"writes\": " << writes << ", ";
+    os << "\"touched_bins\": " << touched << ", ";
+    os << "\"read_bins\": ";
+    write_bins(os, heatmap.reads);
+    os << ", \"write_bins\": ";
+    write_bins(os, heatmap.writes);
+    os << "}";
+    if (++n < merged.size())
+      os << ",";
+    os << std::endl;
+  }
+  os << "  ]";
+}
+
+} // namespace cats
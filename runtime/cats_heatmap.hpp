@@ -0,0 +1,37 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_HEATMAP_HPP__
+#define __CATS_HEATMAP_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace cats {
+
+// Page access heatmaps, enabled with CATS_HEATMAP=1. Accesses to traced
+// buffers of at least CATS_HEATMAP_MIN_SIZE bytes are counted per page of
+// CATS_HEATMAP_PAGE bytes, split into reads and writes and by the enclosing
+// parallel scope, before deduplication. The bins are aligned to pages of the
+// address space, starting at the page of the first byte of the buffer.
+// Buffers spanning more pages than CATS_HEATMAP_MAX_BINS are counted in bins
+// of several pages. All threads are counted, also those whose events the
+// master-only mode drops.
+
+bool heatmap_enabled();
+
+// `offset` is the offset of the access into the buffer, sized accesses are
+// counted on every page they touch.
+void heatmap_access(uint64_t buffer_id, const char *buffer_name,
+                    size_t buffer_size, uint64_t parallel_scope,
+                    uint64_t offset, size_t size, bool is_write);
+
+// Appends the "heatmaps" section of the trace, a record per buffer and
+// parallel scope with the read and write counts of every bin. With `release`
+// the counts are reset after they are written, so that each segment only
+// covers its own accesses. Writes nothing if no access was counted.
+void write_heatmap_profile(std::ostream &os, bool release);
+
+} // namespace cats
+
+#endif // __CATS_HEATMAP_HPP__
@@ -0,0 +1,563 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_introspect.hpp"
+#include "cats_config.hpp"
+#include "cats_runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#ifndef CATS_INTROSPECT_MAX_DEPTH
+#define CATS_INTROSPECT_MAX_DEPTH                   256
+#endif
+#ifndef CATS_INTROSPECT_SITES
+#define CATS_INTROSPECT_SITES                       4096
+#endif
+
+namespace cats {
+
+static const int N_EVENT_TYPES = 9;
+static const char *const g_event_names[N_EVENT_TYPES] = {
+  "allocation", "deallocation", "access", "scope_entry", "scope_exit", "io",
+  "atomic", "sync", "workshare"
+};
+static const char *const g_scope_names[] = {
+  "func", "loop", "cond", "para", "unst"
+};
+
+struct Frame {
+  uint64_t scope_id;
+  const char *funcname;
+  const char *filename;
+  uint32_t line;
+  uint8_t type;
+};
+
+// Event count of one site. Only the owning thread writes, the key is
+// published last so that readers see complete site information.
+struct Site_Count {
+  std::atomic<uint64_t> call_id{0};
+  const char *funcname;
+  const char *filename;
+  uint32_t line;
+  uint32_t col;
+  uint8_t event_type;
+  std::atomic<uint64_t> count{0};
+};
+
+struct Live_Alloc {
+  std::string buffer_name;
+  size_t size;
+  const char *funcname;
+  uint32_t line;
+};
+
+// State of one recording thread as seen by the server. The scope stack is
+// protected by a sequence number that is odd while it is being modified.
+// The live allocations of the thread are only contended while the server
+// copies them or another thread frees one of them.
+struct Thread_View {
+  uint32_t thread;
+  std::atomic<uint64_t> counts[N_EVENT_TYPES];
+  std::atomic<uint64_t> seq{0};
+  uint32_t depth = 0;
+  Frame frames[CATS_INTROSPECT_MAX_DEPTH];
+  Site_Count sites[CATS_INTROSPECT_SITES];
+  std::atomic<uint64_t> other_sites{0};
+  std::mutex allocations_mutex;
+  std::unordered_map<uintptr_t, Live_Alloc> allocations;
+
+  Thread_View() {
+    for (auto &count : this->counts)
+      count.store(0, std::memory_order_relaxed);
+  }
+};
+
+struct Introspect_State {
+  std::string path;
+  int listen_fd = -1;
+
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_View>> threads;
+};
+
+static Introspect_State &state() {
+  return leaked_instance<Introspect_State>();
+}
+
+static thread_local Thread_View *t_view = nullptr;
+
+static Thread_View &thread_view() {
+  if (!t_view) {
+    Introspect_State &s = state();
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    s.threads.emplace_back(new Thread_View());
+    t_view = s.threads.back().get();
+    t_view->thread = (uint32_t) (s.threads.size() - 1);
+  }
+  return *t_view;
+}
+
+static void count_event(Thread_View &view, uint64_t call_id,
+                        uint8_t event_type, const char *funcname,
+                        const char *filename, uint32_t line, uint32_t col) {
+  std::atomic<uint64_t> &total = view.counts[event_type];
+  total.store(
+    total.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed
+  );
+
+  const size_t mask = CATS_INTROSPECT_SITES - 1;
+  size_t i = (size_t) ((call_id * 0x9E3779B97F4A7C15ull) >> 32) & mask;
+  for (size_t probe = 0; probe < 16; ++probe) {
+    Site_Count &site = view.sites[(i + probe) & mask];
+    uint64_t key = site.call_id.load(std::memory_order_relaxed);
+    if (key == 0) {
+      site.funcname = funcname;
+      site.filename = filename;
+      site.line = line;
+      site.col = col;
+      site.event_type = event_type;
+      site.count.store(1, std::memory_order_relaxed);
+      site.call_id.store(call_id, std::memory_order_release);
+      return;
+    }
+    if (key == call_id) {
+      site.count.store(
+        site.count.load(std::memory_order_relaxed) + 1,
+        std::memory_order_relaxed
+      );
+      return;
+    }
+  }
+  view.other_sites.store(
+    view.other_sites.load(std::memory_order_relaxed) + 1,
+    std::memory_order_relaxed
+  );
+}
+
+static void add_allocation(Thread_View &view, void *address,
+                           Live_Alloc alloc) {
+  std::lock_guard<std::mutex> guard(view.allocations_mutex);
+  view.allocations[(uintptr_t) address] = std::move(alloc);
+}
+
+static void remove_allocation(Thread_View &view, void *address) {
+  {
+    std::lock_guard<std::mutex> guard(view.allocations_mutex);
+    if (view.allocations.erase((uintptr_t) address))
+      return;
+  }
+  // Allocated by another thread
+  Introspect_State &s = state();
+  std::lock_guard<std::mutex> threads_guard(s.threads_mutex);
+  for (auto &other : s.threads) {
+    std::lock_guard<std::mutex> guard(other->allocations_mutex);
+    if (other->allocations.erase((uintptr_t) address))
+      return;
+  }
+}
+
+void introspect_alloc(uint64_t call_id, const char *buffer_name,
+                      void *address, size_t size, const char *funcname,
+                      const char *filename, uint32_t line, uint32_t col) {
+  Thread_View &view = thread_view();
+  count_event(
+    view, call_id, CATS_EVENT_TYPE_ALLOCATION, funcname, filename, line, col
+  );
+  add_allocation(view, address, {
+    buffer_name && *buffer_name ? buffer_name : "$UNKNOWN$",
+    size, funcname, line
+  });
+}
+
+void introspect_dealloc(uint64_t call_id, void *address,
+                        const char *funcname, const char *filename,
+                        uint32_t line, uint32_t col) {
+  Thread_View &view = thread_view();
+  count_event(
+    view, call_id, CATS_EVENT_TYPE_DEALLOCATION, funcname, filename, line,
+    col
+  );
+  remove_allocation(view, address);
+}
+
+void introspect_access(uint64_t call_id, const char *funcname,
+                       const char *filename, uint32_t line, uint32_t col) {
+  count_event(
+    thread_view(), call_id, CATS_EVENT_TYPE_ACCESS, funcname, filename,
+    line, col
+  );
+}
+
+void introspect_event(uint64_t call_id, uint8_t event_type,
+                      const char *funcname, const char *filename,
+                      uint32_t line, uint32_t col) {
+  count_event(
+    thread_view(), call_id, event_type, funcname, filename, line, col
+  );
+}
+
+void introspect_io(uint64_t call_id, uint8_t op, void *address,
+                   int64_t bytes, const char *funcname, const char *filename,
+                   uint32_t line, uint32_t col) {
+  Thread_View &view = thread_view();
+  count_event(
+    view, call_id, CATS_EVENT_TYPE_IO, funcname, filename, line, col
+  );
+  if (op == CATS_IO_MUNMAP)
+    remove_allocation(view, address);
+  else if (op == CATS_IO_MMAP && address != (void *) -1)
+    add_allocation(view, address, {"mmap", (size_t) bytes, funcname, line});
+}
+
+void introspect_scope_entry(uint64_t call_id, uint64_t scope_id,
+                            uint8_t scope_type, const char *funcname,
+                            const char *filename, uint32_t line,
+                            uint32_t col) {
+  Thread_View &view = thread_view();
+  count_event(
+    view, call_id, CATS_EVENT_TYPE_SCOPE_ENTRY, funcname, filename, line,
+    col
+  );
+  uint64_t seq = view.seq.load(std::memory_order_relaxed);
+  view.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  if (view.depth < CATS_INTROSPECT_MAX_DEPTH) {
+    view.frames[view.depth] = {
+      scope_id, funcname, filename, line, scope_type
+    };
+  }
+  ++view.depth;
+  view.seq.store(seq + 2, std::memory_order_release);
+}
+
+void introspect_scope_exit(uint64_t call_id, uint64_t scope_id,
+                           const char *funcname, const char *filename,
+                           uint32_t line, uint32_t col) {
+  Thread_View &view = thread_view();
+  count_event(
+    view, call_id, CATS_EVENT_TYPE_SCOPE_EXIT, funcname, filename, line, col
+  );
+  uint32_t depth;
+  if (view.depth > CATS_INTROSPECT_MAX_DEPTH) {
+    // Beyond the recorded frames, only the depth is tracked.
+    depth = view.depth - 1;
+  } else {
+    // Like the trace, exiting a scope also exits the scopes nested in it.
+    uint32_t i = view.depth;
+    while (i > 0 && view.frames[i - 1].scope_id != scope_id)
+      --i;
+    if (i == 0)
+      return;
+    depth = i - 1;
+  }
+
+  uint64_t seq = view.seq.load(std::memory_order_relaxed);
+  view.seq.store(seq + 1, std::memory_order_relaxed);
+  std::atomic_thread_fence(std::memory_order_release);
+  view.depth = depth;
+  view.seq.store(seq + 2, std::memory_order_release);
+}
+
+// ---------------------------------------------------------------------------
+// Queries
+// ---------------------------------------------------------------------------
+
+static void query_counts(std::ostream &os) {
+  Introspect_State &s = state();
+  uint64_t totals[N_EVENT_TYPES] = {0};
+  os << "{\"threads\": [";
+  std::lock_guard<std::mutex> guard(s.threads_mutex);
+  for (size_t t = 0; t < s.threads.size(); ++t) {
+    const Thread_View &view = *s.threads[t];
+    os << (t ? ", " : "") << "{\"thread\": " << view.thread;
+    for (int i = 0; i < N_EVENT_TYPES; ++i) {
+      uint64_t count = view.counts[i].load(std::memory_order_relaxed);
+      totals[i] += count;
+      os << ", \"" << g_event_names[i] << "\": " << count;
+    }
+    os << "}";
+  }
+  os << "], \"total\": {";
+  for (int i = 0; i < N_EVENT_TYPES; ++i)
+    os << (i ? ", " : "") << "\"" << g_event_names[i] << "\": " << totals[i];
+  os << "}}";
+}
+
+static void query_stacks(std::ostream &os) {
+  Introspect_State &s = state();
+  os << "{\"threads\": [";
+  std::lock_guard<std::mutex> guard(s.threads_mutex);
+  std::vector<Frame> frames(CATS_INTROSPECT_MAX_DEPTH);
+  for (size_t t = 0; t < s.threads.size(); ++t) {
+    const Thread_View &view = *s.threads[t];
+    uint32_t depth = 0;
+    bool consistent = false;
+    // Give up after a few attempts on a thread that keeps changing its
+    // stack, and report that the snapshot is torn.
+    for (int attempt = 0; attempt < 100 && !consistent; ++attempt) {
+      uint64_t before = view.seq.load(std::memory_order_acquire);
+      if (before & 1)
+        continue;
+      depth = view.depth;
+      uint32_t n = std::min<uint32_t>(depth, CATS_INTROSPECT_MAX_DEPTH);
+      memcpy((void *) frames.data(), (const void *) view.frames,
+             n * sizeof(Frame));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      consistent = view.seq.load(std::memory_order_relaxed) == before;
+    }
+    os << (t ? ", " : "") << "{\"thread\": " << view.thread
+       << ", \"depth\": " << depth
+       << ", \"consistent\": " << (consistent ? "true" : "false")
+       << ", \"stack\": [";
+    uint32_t n = std::min<uint32_t>(depth, CATS_INTROSPECT_MAX_DEPTH);
+    for (uint32_t i = 0; i < n; ++i) {
+      const Frame &frame = frames[i];
+      os << (i ? ", " : "") << "{\"id\": " << frame.scope_id
+         << ", \"scope_type\": \""
+         << (frame.type < 5 ? g_scope_names[frame.type] : "n/a") << "\""
+         << ", \"funcname\": \"" << (frame.funcname ? frame.funcname : "")
+         << "\", \"filename\": \"" << (frame.filename ? frame.filename : "")
+         << "\", \"line\": " << frame.line << "}";
+    }
+    os << "]}";
+  }
+  os << "]}";
+}
+
+static void query_allocations(std::ostream &os, size_t limit) {
+  Introspect_State &s = state();
+  std::vector<std::pair<uintptr_t, Live_Alloc>> live;
+  {
+    std::lock_guard<std::mutex> threads_guard(s.threads_mutex);
+    for (auto &view : s.threads) {
+      std::lock_guard<std::mutex> guard(view->allocations_mutex);
+      live.insert(live.end(), view->allocations.begin(),
+                  view->allocations.end());
+    }
+  }
+  size_t bytes = 0;
+  for (auto &alloc : live)
+    bytes += alloc.second.size;
+  std::sort(live.begin(), live.end(), [](const auto &a, const auto &b) {
+    return a.second.size > b.second.size;
+  });
+  os << "{\"count\": " << live.size() << ", \"bytes\": " << bytes
+     << ", \"allocations\": [";
+  for (size_t i = 0; i < live.size() && i < limit; ++i) {
+    const Live_Alloc &alloc = live[i].second;
+    os << (i ? ", " : "") << "{\"buffer_name\": \"" << alloc.buffer_name
+       << "\", \"buffer_id\": " << live[i].first
+       << ", \"size\": " << alloc.size
+       << ", \"funcname\": \"" << (alloc.funcname ? alloc.funcname : "")
+       << "\", \"line\": " << alloc.line << "}";
+  }
+  os << "]}";
+}
+
+static void query_top(std::ostream &os, size_t limit) {
+  struct Entry {
+    uint64_t call_id;
+    const char *funcname;
+    const char *filename;
+    uint32_t line;
+    uint32_t col;
+    uint8_t event_type;
+    uint64_t count;
+  };
+  Introspect_State &s = state();
+  std::map<uint64_t, Entry> merged;
+  uint64_t other = 0;
+  {
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    for (auto &view : s.threads) {
+      for (auto &site : view->sites) {
+        uint64_t call_id = site.call_id.load(std::memory_order_acquire);
+        if (!call_id)
+          continue;
+        uint64_t count = site.count.load(std::memory_order_relaxed);
+        auto it = merged.find(call_id);
+        if (it == merged.end()) {
+          merged[call_id] = {
+            call_id, site.funcname, site.filename, site.line, site.col,
+            site.event_type, count
+          };
+        } else {
+          it->second.count += count;
+        }
+      }
+      other += view->other_sites.load(std::memory_order_relaxed);
+    }
+  }
+  std::vector<Entry> sites;
+  for (auto &entry : merged)
+    sites.push_back(entry.second);
+  std::sort(sites.begin(), sites.end(), [](const Entry &a, const Entry &b) {
+    return a.count > b.count;
+  });
+  os << "{\"untracked\": " << other << ", \"sites\": [";
+  for (size_t i = 0; i < sites.size() && i < limit; ++i) {
+    const Entry &site = sites[i];
+    os << (i ? ", " : "") << "{\"call_id\": " << site.call_id
+       << ", \"type\": \"" << g_event_names[site.event_type]
+       << "\", \"funcname\": \"" << (site.funcname ? site.funcname : "")
+       << "\", \"filename\": \"" << (site.filename ? site.filename : "")
+       << "\", \"line\": " << site.line << ", \"col\": " << site.col
+       << ", \"events\": " << site.count << "}";
+  }
+  os << "]}";
+}
+
+static std::string answer(const std::string &line) {
+  std::istringstream is(line);
+  std::string command;
+  is >> command;
+  size_t limit = 20;
+  is >> limit;
+
+  std::ostringstream os;
+  if (command == "counts") {
+    query_counts(os);
+  } else if (command == "stacks") {
+    query_stacks(os);
+  } else if (command == "allocations") {
+    query_allocations(os, limit);
+  } else if (command == "top") {
+    query_top(os, limit);
+  } else {
+    os << "{\"error\": \"unknown query '" << command << "'\", "
+       << "\"queries\": [\"counts\", \"stacks\", \"allocations [N]\", "
+       << "\"top [N]\"]}";
+  }
+  os << "\n";
+  return os.str();
+}
+
+static void serve(int fd) {
+  std::string pending;
+  char buffer[256];
+  while (true) {
+    ssize_t n = read(fd, buffer, sizeof(buffer));
+    if (n <= 0)
+      break;
+    pending.append(buffer, n);
+    size_t newline;
+    while ((newline = pending.find('\n')) != std::string::npos) {
+      std::string response = answer(pending.substr(0, newline));
+      pending.erase(0, newline + 1);
+      const char *data = response.data();
+      size_t left = response.size();
+      while (left > 0) {
+        ssize_t written = write(fd, data, left);
+        if (written <= 0)
+          return;
+        data += written;
+        left -= written;
+      }
+    }
+  }
+}
+
+static void server_thread(int listen_fd) {
+  while (true) {
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) {
+      if (errno == EINTR)
+        continue;
+      // The socket was shut down by stop_introspection.
+      return;
+    }
+    serve(fd);
+    close(fd);
+  }
+}
+
+// Removes a socket left behind at `addr` by a process that is gone. Fails
+// if the path is anything else or a process still listens on it.
+static bool remove_stale_socket(const struct sockaddr_un &addr) {
+  const char *path = addr.sun_path;
+  struct stat st;
+  if (lstat(path, &st) != 0)
+    return errno == ENOENT;
+  if (!S_ISSOCK(st.st_mode)) {
+    std::cerr << "CATS: Introspection socket path exists and is not a "
+              << "socket: " << path << std::endl;
+    return false;
+  }
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (probe < 0)
+    return false;
+  bool live = connect(probe, (const struct sockaddr *) &addr,
+                      sizeof(addr)) == 0;
+  close(probe);
+  if (live) {
+    std::cerr << "CATS: Introspection socket in use: " << path << std::endl;
+    return false;
+  }
+  return unlink(path) == 0;
+}
+
+bool start_introspection() {
+  const char *path = config::get_string("CATS_INTROSPECT_SOCKET", nullptr);
+  if (!path)
+    return false;
+
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    std::cerr << "CATS: Introspection socket path too long: " << path
+              << std::endl;
+    return false;
+  }
+  strcpy(addr.sun_path, path);
+
+  if (!remove_stale_socket(addr))
+    return false;
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd < 0)
+    return false;
+  if (bind(fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+      listen(fd, 4) != 0) {
+    std::cerr << "CATS: Cannot listen on " << path << ": "
+              << strerror(errno) << std::endl;
+    close(fd);
+    return false;
+  }
+
+  Introspect_State &s = state();
+  s.path = path;
+  s.listen_fd = fd;
+  std::thread(server_thread, fd).detach();
+  std::cerr << "CATS: Introspection socket at " << path << std::endl;
+  return true;
+}
+
+void stop_introspection() {
+  Introspect_State &s = state();
+  if (s.listen_fd < 0)
+    return;
+  shutdown(s.listen_fd, SHUT_RDWR);
+  unlink(s.path.c_str());
+  s.listen_fd = -1;
+}
+
+} // namespace cats
@@ -0,0 +1,50 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_INTROSPECT_HPP__
+#define __CATS_INTROSPECT_HPP__
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cats {
+
+// Live introspection over a Unix domain socket. If CATS_INTROSPECT_SOCKET
+// names a path, a server thread answers one-line queries there while the
+// application runs:
+//   counts             events per thread and type
+//   stacks             current scope stack of every thread
+//   allocations [N]    live allocations, largest first
+//   top [N]            sites with the most events
+// The hooks below publish the counts and stacks with per-thread counters
+// and seqlocks, which a query never blocks. The live allocations are kept
+// per thread under a lock that only an allocations query or a free from
+// another thread contends.
+bool start_introspection();
+void stop_introspection();
+
+void introspect_alloc(uint64_t call_id, const char *buffer_name,
+                      void *address, size_t size, const char *funcname,
+                      const char *filename, uint32_t line, uint32_t col);
+void introspect_dealloc(uint64_t call_id, void *address,
+                        const char *funcname, const char *filename,
+                        uint32_t line, uint32_t col);
+void introspect_access(uint64_t call_id, const char *funcname,
+                       const char *filename, uint32_t line, uint32_t col);
+// Events that only need to be counted
+void introspect_event(uint64_t call_id, uint8_t event_type,
+                      const char *funcname, const char *filename,
+                      uint32_t line, uint32_t col);
+void introspect_io(uint64_t call_id, uint8_t op, void *address,
+                   int64_t bytes, const char *funcname, const char *filename,
+                   uint32_t line, uint32_t col);
+void introspect_scope_entry(uint64_t call_id, uint64_t scope_id,
+                            uint8_t scope_type, const char *funcname,
+                            const char *filename, uint32_t line,
+                            uint32_t col);
+void introspect_scope_exit(uint64_t call_id, uint64_t scope_id,
+                           const char *funcname, const char *filename,
+                           uint32_t line, uint32_t col);
+
+} // namespace cats
+
+#endif // __CATS_INTROSPECT_HPP__
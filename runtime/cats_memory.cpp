@@ -0,0 +1,315 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_memory.hpp"
+#include "cats_config.hpp"
+#include "cats_runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#ifndef CATS_MEMORY_MAX_TIMELINE
+#define CATS_MEMORY_MAX_TIMELINE                    100000
+#endif
+
+#ifndef CATS_MEMORY_MAX_PEAK_BUFFERS
+#define CATS_MEMORY_MAX_PEAK_BUFFERS                100
+#endif
+
+namespace cats {
+
+struct Live_Buffer {
+  uint64_t call_id = 0;
+  const char *name = nullptr;
+  uintptr_t address = 0;
+  size_t size = 0;
+  // Order of the allocation
+  uint64_t seq = 0;
+};
+
+struct Timeline_Point {
+  uint64_t ts;
+  uint32_t thread;
+  bool exit;
+  uint64_t scope_id;
+  uint64_t live;
+  uint64_t max;
+};
+
+struct Memory_Frame {
+  uint64_t scope_id;
+  uint8_t type;
+  const char *funcname;
+  uint32_t line;
+  // High-water mark of the live bytes while the instance is open
+  uint64_t max;
+};
+
+// Scope stack of one thread, only touched by the thread.
+struct Thread_Memory {
+  uint32_t thread = 0;
+  std::vector<Memory_Frame> stack;
+};
+
+struct Memory_State {
+  std::chrono::steady_clock::time_point start =
+    std::chrono::steady_clock::now();
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_Memory>> threads;
+
+  std::mutex mutex;
+  std::unordered_map<uintptr_t, Live_Buffer> buffers;
+  std::atomic<uint64_t> live{0};
+  uint64_t seq = 0;
+
+  uint64_t peak = 0;
+  uint64_t peak_ts = 0;
+  uint64_t peak_seq = 0;
+  uint32_t peak_thread = 0;
+  std::string peak_path;
+  // Buffers that were live at the peak and have been freed since
+  std::vector<Live_Buffer> freed_since_peak;
+
+  std::vector<Timeline_Point> timeline;
+  // Live bytes of the last timeline point
+  std::atomic<uint64_t> last_live{0};
+};
+
+static Memory_State &state() {
+  return leaked_instance<Memory_State>();
+}
+
+static thread_local Thread_Memory *t_memory = nullptr;
+
+static Thread_Memory &thread_memory() {
+  if (!t_memory) {
+    Memory_State &s = state();
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    s.threads.emplace_back(new Thread_Memory());
+    t_memory = s.threads.back().get();
+    t_memory->thread = (uint32_t) (s.threads.size() - 1);
+  }
+  return *t_memory;
+}
+
+static uint64_t now_ns(const Memory_State &s) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - s.start
+  ).count();
+}
+
+// Folded scope path, as written by cats-fold
+static std::string scope_path(const Thread_Memory &t) {
+  std::string path;
+  for (const Memory_Frame &frame : t.stack) {
+    if (!path.empty())
+      path += ';';
+    std::string line = std::to_string(frame.line);
+    switch (frame.type) {
+      case CATS_SCOPE_TYPE_FUNCTION:
+        path += frame.funcname ? frame.funcname : "$UNKNOWN$";
+        break;
+      case CATS_SCOPE_TYPE_LOOP:
+        path += "loop@" + line;
+        break;
+      case CATS_SCOPE_TYPE_PARALLEL:
+        path += "parallel@" + line;
+        break;
+      case CATS_SCOPE_TYPE_CONDITIONAL:
+        path += "cond@" + line;
+        break;
+      default:
+        path += "scope@" + line;
+        break;
+    }
+  }
+  return path;
+}
+
+// Appends a timeline point, the caller holds the mutex. A full timeline is
+// halved by keeping the higher point of each pair, so that it keeps
+// covering the whole run.
+static void add_point(Memory_State &s, const Timeline_Point &point) {
+  if (s.timeline.size() >= CATS_MEMORY_MAX_TIMELINE) {
+    size_t kept = 0;
+    for (size_t i = 0; i + 1 < s.timeline.size(); i += 2) {
+      const Timeline_Point &a = s.timeline[i];
+      const Timeline_Point &b = s.timeline[i + 1];
+      s.timeline[kept++] =
+        std::max(a.live, a.max) >= std::max(b.live, b.max) ? a : b;
+    }
+    s.timeline.resize(kept);
+  }
+  s.timeline.push_back(point);
+  s.last_live.store(point.live, std::memory_order_relaxed);
+}
+
+bool memory_profile_enabled() {
+  static const bool enabled = config::get_bool("CATS_MEMORY_PROFILE", false);
+  return enabled;
+}
+
+void memory_alloc(uint64_t call_id, const char *buffer_name, void *address,
+                  size_t size) {
+  Thread_Memory &t = thread_memory();
+  Memory_State &s = state();
+  std::lock_guard<std::mutex> guard(s.mutex);
+
+  uint64_t live = s.live.load(std::memory_order_relaxed);
+  Live_Buffer &buffer = s.buffers[(uintptr_t) address];
+  // An address allocated twice without a free in between was released by
+  // an untraced call
+  if (buffer.seq && buffer.seq <= s.peak_seq)
+    s.freed_since_peak.push_back(buffer);
+  live -= buffer.size;
+  buffer.call_id = call_id;
+  buffer.name = buffer_name;
+  buffer.address = (uintptr_t) address;
+  buffer.size = size;
+  buffer.seq = ++s.seq;
+  live += size;
+  s.live.store(live, std::memory_order_relaxed);
+
+  if (!t.stack.empty())
+    t.stack.back().max = std::max(t.stack.back().max, live);
+  if (live > s.peak) {
+    s.peak = live;
+    s.peak_ts = now_ns(s);
+    s.peak_seq = s.seq;
+    s.peak_thread = t.thread;
+    s.peak_path = scope_path(t);
+    s.freed_since_peak.clear();
+  }
+}
+
+void memory_dealloc(void *address) {
+  Memory_State &s = state();
+  std::lock_guard<std::mutex> guard(s.mutex);
+  auto it = s.buffers.find((uintptr_t) address);
+  if (it == s.buffers.end())
+    return;
+  if (it->second.seq <= s.peak_seq)
+    s.freed_since_peak.push_back(it->second);
+  s.live.store(
+    s.live.load(std::memory_order_relaxed) - it->second.size,
+    std::memory_order_relaxed
+  );
+  s.buffers.erase(it);
+}
+
+void memory_scope_entry(uint64_t scope_id, uint8_t type,
+                        const char *funcname, uint32_t line) {
+  Thread_Memory &t = thread_memory();
+  Memory_State &s = state();
+  uint64_t live = s.live.load(std::memory_order_relaxed);
+  t.stack.push_back({scope_id, type, funcname, line, live});
+  if (live == s.last_live.load(std::memory_order_relaxed))
+    return;
+  std::lock_guard<std::mutex> guard(s.mutex);
+  add_point(s, {now_ns(s), t.thread, false, scope_id, live, live});
+}
+
+void memory_scope_exit(uint64_t scope_id) {
+  Thread_Memory &t = thread_memory();
+  auto it = std::find_if(t.stack.rbegin(), t.stack.rend(),
+                         [scope_id](const Memory_Frame &frame) {
+    return frame.scope_id == scope_id;
+  });
+  if (it == t.stack.rend())
+    return;
+
+  // Scopes left without their exit are closed with the enclosing one
+  uint64_t max = 0;
+  while (t.stack.back().scope_id != scope_id) {
+    max = std::max(max, t.stack.back().max);
+    t.stack.pop_back();
+  }
+  max = std::max(max, t.stack.back().max);
+  t.stack.pop_back();
+  if (!t.stack.empty())
+    t.stack.back().max = std::max(t.stack.back().max, max);
+
+  Memory_State &s = state();
+  uint64_t live = s.live.load(std::memory_order_relaxed);
+  if (live == s.last_live.load(std::memory_order_relaxed) && max <= live)
+    return;
+  std::lock_guard<std::mutex> guard(s.mutex);
+  add_point(s, {now_ns(s), t.thread, true, scope_id, live, max});
+}
+
+void write_memory_profile(std::ostream &os, bool release) {
+  Memory_State &s = state();
+  std::vector<Live_Buffer> at_peak;
+  std::vector<Timeline_Point> timeline;
+  uint64_t peak, peak_ts;
+  uint32_t peak_thread;
+  std::string peak_path;
+  {
+    std::lock_guard<std::mutex> guard(s.mutex);
+    if (s.seq == 0)
+      return;
+    at_peak = s.freed_since_peak;
+    for (const auto &buffer : s.buffers) {
+      if (buffer.second.seq <= s.peak_seq)
+        at_peak.push_back(buffer.second);
+    }
+    timeline = s.timeline;
+    peak = s.peak;
+    peak_ts = s.peak_ts;
+    peak_thread = s.peak_thread;
+    peak_path = s.peak_path;
+    if (release) {
+      // The next segment starts from the bytes live now, reached outside
+      // of any scope it covers
+      s.timeline.clear();
+      s.peak = s.live.load(std::memory_order_relaxed);
+      s.peak_ts = now_ns(s);
+      s.peak_seq = s.seq;
+      s.peak_thread = 0;
+      s.peak_path.clear();
+      s.freed_since_peak.clear();
+    }
+  }
+  std::sort(at_peak.begin(), at_peak.end(), [](const Live_Buffer &a,
+                                               const Live_Buffer &b) {
+    return a.size != b.size ? a.size > b.size : a.seq < b.seq;
+  });
+
+  os << "," << std::endl;
+  os << "  \"memory\": [" << std::endl;
+  os << "    {\"type\": \"peak\", ";
+  os << "\"peak_bytes\": " << peak << ", ";
+  os << "\"ts\": " << peak_ts << ", ";
+  os << "\"thread\": " << peak_thread << ", ";
+  os << "\"path\": \"" << peak_path << "\", ";
+  os << "\"live_buffers\": " << at_peak.size() << "}";
+  for (size_t i = 0;
+       i < at_peak.size() && i < CATS_MEMORY_MAX_PEAK_BUFFERS; ++i) {
+    const Live_Buffer &buffer = at_peak[i];
+    os << "," << std::endl;
+    os << "    {\"type\": \"peak_buffer\", ";
+    os << "\"buffer_name\": \"" << (buffer.name ? buffer.name : "$UNKNOWN$")
+       << "\", ";
+    os << "\"buffer_id\": " << buffer.address << ", ";
+    os << "\"call_id\": " << buffer.call_id << ", ";
+    os << "\"size\": " << buffer.size << "}";
+  }
+  for (const Timeline_Point &point : timeline) {
+    os << "," << std::endl;
+    os << "    {\"type\": \"timeline\", ";
+    os << "\"ts\": " << point.ts << ", ";
+    os << "\"thread\": " << point.thread << ", ";
+    os << "\"boundary\": \"" << (point.exit ? "exit" : "entry") << "\", ";
+    os << "\"scope_id\": " << point.scope_id << ", ";
+    os << "\"live_bytes\": " << point.live << ", ";
+    os << "\"max_bytes\": " << point.max << "}";
+  }
+  os << std::endl << "  ]";
+}
+
+} // namespace cats
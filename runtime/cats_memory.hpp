@@ -0,0 +1,40 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_MEMORY_HPP__
+#define __CATS_MEMORY_HPP__
+
+#include <cstddef>
+#include <cstdint>
+#include <ostream>
+
+namespace cats {
+
+// Live-memory profile, enabled with CATS_MEMORY_PROFILE=1. The running total
+// of live bytes is kept from every allocation and deallocation,
+// independently of deduplication and site filters. Each scope instance
+// records the highest total seen by the allocations of its thread while it
+// was open, and the peak of the whole run remembers the scope path of the
+// allocating thread and the buffers live at that moment.
+
+bool memory_profile_enabled();
+
+void memory_alloc(uint64_t call_id, const char *buffer_name, void *address,
+                  size_t size);
+void memory_dealloc(void *address);
+
+void memory_scope_entry(uint64_t scope_id, uint8_t type,
+                        const char *funcname, uint32_t line);
+void memory_scope_exit(uint64_t scope_id);
+
+// Appends the "memory" section of the trace: a "peak" record with the peak
+// live bytes and the scope path that reached it, a "peak_buffer" record per
+// buffer live at the peak and "timeline" records of the live bytes at scope
+// boundaries where they changed, with the high-water mark of the instance at
+// its exit. With `release` the peak and the timeline restart from the bytes
+// live once written, so that each segment only covers its own allocations.
+// Writes nothing if nothing was allocated.
+void write_memory_profile(std::ostream &os, bool release);
+
+} // namespace cats
+
+#endif // __CATS_MEMORY_HPP__
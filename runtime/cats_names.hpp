@@ -0,0 +1,50 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_NAMES_HPP__
+#define __CATS_NAMES_HPP__
+
+// Names of the CATS_IO_*, CATS_ATOMIC_* and CATS_SYNC_* values in a trace,
+// shared by the in-process trace and cats-collectd so that both write the
+// same names.
+
+#include "cats_runtime.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cats {
+
+template <size_t N>
+inline const char *name_of(const char *const (&names)[N], uint8_t value) {
+  return value < N ? names[value] : "n/a";
+}
+
+inline const char *io_op_name(uint8_t op) {
+  static const char *const names[] = {
+    "read", "write", "pread", "pwrite", "fread", "fwrite", "mmap", "munmap",
+    "open", "close"
+  };
+  return name_of(names, op);
+}
+
+inline const char *atomic_op_name(uint8_t op) {
+  static const char *const names[] = {
+    "cmpxchg", "xchg", "add", "sub", "and", "or", "xor", "min", "max", "other"
+  };
+  return name_of(names, op);
+}
+
+inline const char *sync_kind_name(uint8_t kind) {
+  static const char *const names[] = {
+    "critical", "barrier", "reduce", "mutex"
+  };
+  return name_of(names, kind);
+}
+
+inline const char *sync_phase_name(uint8_t phase) {
+  return phase == CATS_SYNC_ACQUIRE ? "acquire" : "release";
+}
+
+} // namespace cats
+
+#endif // __CATS_NAMES_HPP__
@@ -0,0 +1,226 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_parallel.hpp"
+#include "cats_config.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iostream>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+#include <omp.h>
+
+#ifndef CATS_PARALLEL_MAX_INSTANCES
+#define CATS_PARALLEL_MAX_INSTANCES                 10000
+#endif
+
+namespace cats {
+
+struct Thread_Time {
+  uint32_t thread = 0;
+  uint64_t begin_ns = 0;
+  uint64_t end_ns = 0;
+  uint64_t barrier_ns = 0;
+};
+
+struct Parallel_Instance {
+  uint64_t scope_id = 0;
+  // Number of earlier instances of the scope
+  uint64_t index = 0;
+  const char *funcname = nullptr;
+  const char *filename = nullptr;
+  uint32_t line = 0;
+  uint64_t begin_ns = 0;
+  uint64_t end_ns = 0;
+  std::vector<Thread_Time> threads;
+};
+
+struct Parallel_State {
+  std::mutex mutex;
+  Parallel_Instance current;
+  bool active = false;
+  // Incremented for every instance, so that threads of an instance that was
+  // not profiled are not attributed to the next one
+  std::atomic<uint64_t> generation{0};
+  std::vector<Parallel_Instance> finished;
+  std::unordered_map<uint64_t, uint64_t> instances;
+  uint64_t dropped = 0;
+};
+
+static Parallel_State &state() {
+  return leaked_instance<Parallel_State>();
+}
+
+// Team thread inside a profiled instance, begin_ns is 0 outside of it
+struct Thread_Region {
+  uint64_t generation = 0;
+  uint64_t begin_ns = 0;
+  uint64_t barrier_ns = 0;
+};
+
+static thread_local Thread_Region t_region;
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+bool parallel_profile_enabled() {
+  static const bool enabled = config::get_bool("CATS_PARALLEL_PROFILE", false);
+  return enabled;
+}
+
+void parallel_region_begin(uint64_t scope_id, const char *funcname,
+                           const char *filename, uint32_t line) {
+  if (omp_get_level() != 0)
+    return;
+  Parallel_State &s = state();
+  std::lock_guard<std::mutex> guard(s.mutex);
+  // Concurrent forks from threads outside of OpenMP are not profiled
+  if (s.active)
+    return;
+  s.active = true;
+  s.generation.fetch_add(1, std::memory_order_relaxed);
+  s.current = Parallel_Instance();
+  s.current.scope_id = scope_id;
+  s.current.index = s.instances[scope_id]++;
+  s.current.funcname = funcname;
+  s.current.filename = filename;
+  s.current.line = line;
+  s.current.begin_ns = now_ns();
+}
+
+void parallel_region_end(uint64_t scope_id) {
+  if (omp_get_level() != 0)
+    return;
+  uint64_t now = now_ns();
+  Parallel_State &s = state();
+  std::lock_guard<std::mutex> guard(s.mutex);
+  if (!s.active || s.current.scope_id != scope_id)
+    return;
+  s.active = false;
+  if (s.finished.size() >= CATS_PARALLEL_MAX_INSTANCES) {
+    if (s.dropped++ == 0) {
+      std::cerr << "CATS: More than " << CATS_PARALLEL_MAX_INSTANCES
+                << " parallel scope instances, dropping the rest from the "
+                << "load-imbalance profile" << std::endl;
+    }
+    return;
+  }
+  s.current.end_ns = now;
+  std::sort(s.current.threads.begin(), s.current.threads.end(),
+            [](const Thread_Time &a, const Thread_Time &b) {
+    return a.thread < b.thread;
+  });
+  s.finished.push_back(std::move(s.current));
+}
+
+void parallel_thread_begin() {
+  if (omp_get_level() != 1)
+    return;
+  t_region.generation =
+    state().generation.load(std::memory_order_relaxed);
+  t_region.begin_ns = now_ns();
+  t_region.barrier_ns = 0;
+}
+
+void parallel_thread_end() {
+  if (!t_region.begin_ns || omp_get_level() != 1)
+    return;
+  Thread_Time time;
+  time.thread = (uint32_t) omp_get_thread_num();
+  time.begin_ns = t_region.begin_ns;
+  time.end_ns = now_ns();
+  time.barrier_ns = t_region.barrier_ns;
+  t_region.begin_ns = 0;
+
+  Parallel_State &s = state();
+  std::lock_guard<std::mutex> guard(s.mutex);
+  if (s.active &&
+      t_region.generation == s.generation.load(std::memory_order_relaxed))
+    s.current.threads.push_back(time);
+}
+
+void parallel_barrier_wait(uint64_t duration) {
+  if (t_region.begin_ns)
+    t_region.barrier_ns += duration;
+}
+
+static void write_instance(std::ostream &os,
+                           const Parallel_Instance &instance) {
+  uint64_t wall_ns = instance.end_ns - instance.begin_ns;
+  os << "    {\"scope_id\": " << instance.scope_id << ", ";
+  os << "\"instance\": " << instance.index << ", ";
+  os << "\"funcname\": \"" << (instance.funcname ? instance.funcname : "")
+     << "\", ";
+  os << "\"filename\": \"" << (instance.filename ? instance.filename : "")
+     << "\", ";
+  os << "\"line\": " << instance.line << ", ";
+  os << "\"wall_ns\": " << wall_ns << ", ";
+
+  // Busy time excludes barrier waits inside the region, the join wait is
+  // the implicit barrier at its end
+  uint64_t total_busy = 0;
+  uint64_t max_busy = 0;
+  uint32_t slowest = 0;
+  os << "\"threads\": [";
+  for (size_t i = 0; i < instance.threads.size(); ++i) {
+    const Thread_Time &time = instance.threads[i];
+    uint64_t in_region = time.end_ns - time.begin_ns;
+    uint64_t busy = in_region - std::min(time.barrier_ns, in_region);
+    uint64_t join = instance.end_ns > time.end_ns
+                      ? instance.end_ns - time.end_ns : 0;
+    total_busy += busy;
+    if (i == 0 || busy > max_busy) {
+      max_busy = busy;
+      slowest = time.thread;
+    }
+    if (i > 0)
+      os << ", ";
+    os << "{\"thread\": " << time.thread << ", ";
+    os << "\"busy_ns\": " << busy << ", ";
+    os << "\"barrier_ns\": " << time.barrier_ns << ", ";
+    os << "\"join_ns\": " << join << "}";
+  }
+  os << "]";
+
+  size_t n = instance.threads.size();
+  if (n > 0 && total_busy > 0 && wall_ns > 0) {
+    double mean = (double) total_busy / n;
+    double idle = 1.0 - (double) total_busy / ((double) n * wall_ns);
+    os << ", \"imbalance\": " << max_busy / mean;
+    os << ", \"idle_fraction\": " << std::max(idle, 0.0);
+    os << ", \"slowest_thread\": " << slowest;
+  }
+  os << "}";
+}
+
+void write_parallel_profile(std::ostream &os, bool release) {
+  std::vector<Parallel_Instance> instances;
+  Parallel_State &s = state();
+  {
+    std::lock_guard<std::mutex> guard(s.mutex);
+    if (release)
+      instances.swap(s.finished);
+    else
+      instances = s.finished;
+  }
+  if (instances.empty())
+    return;
+
+  os << "," << std::endl;
+  os << "  \"parallel\": [" << std::endl;
+  for (size_t i = 0; i < instances.size(); ++i) {
+    write_instance(os, instances[i]);
+    if (i + 1 < instances.size())
+      os << ",";
+    os << std::endl;
+  }
+  os << "  ]";
+}
+
+} // namespace cats
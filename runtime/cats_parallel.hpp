@@ -0,0 +1,40 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_PARALLEL_HPP__
+#define __CATS_PARALLEL_HPP__
+
+#include <cstdint>
+#include <ostream>
+
+namespace cats {
+
+// Load-imbalance profile of OpenMP parallel scopes, enabled with
+// CATS_PARALLEL_PROFILE=1. Only outermost parallel regions are profiled; an
+// instance lasts from the parallel scope entry to its exit on the forking
+// thread, and each team thread reports when it starts and finishes the
+// outlined region.
+
+bool parallel_profile_enabled();
+
+// Called by the forking thread around the fork.
+void parallel_region_begin(uint64_t scope_id, const char *funcname,
+                           const char *filename, uint32_t line);
+void parallel_region_end(uint64_t scope_id);
+
+// Called by every team thread at the entry and exit of the outlined region.
+void parallel_thread_begin();
+void parallel_thread_end();
+
+// Adds the wait time of a barrier inside the region to the calling thread.
+void parallel_barrier_wait(uint64_t duration);
+
+// Appends the "parallel" section of the trace, a record per finished
+// instance with the time of every thread and the imbalance metrics. With
+// `release` the written instances are dropped, so that each segment only
+// lists the instances that finished since the previous one. Writes nothing
+// if there is no instance.
+void write_parallel_profile(std::ostream &os, bool release);
+
+} // namespace cats
+
+#endif // __CATS_PARALLEL_HPP__
@@ -0,0 +1,88 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_PLUGIN_H__
+#define __CATS_PLUGIN_H__
+
+// Online analysis plugins.
+//
+// A plugin is a shared library listed in CATS_PLUGINS (separated by ':') that
+// exports `cats_plugin_entry`. The runtime hands it every instrumented event
+// in batches, before deduplication and from all threads, so analyses can run
+// without the trace being stored (see CATS_STORAGE=none). Event and scope
+// types are the CATS_EVENT_TYPE_* and CATS_SCOPE_TYPE_* values.
+
+#include "cats_runtime.h"
+
+#ifdef __cplusplus
+#include <cstddef>
+#include <cstdint>
+
+extern "C" {
+#else
+#include <stddef.h>
+#include <stdint.h>
+#endif
+
+#define CATS_PLUGIN_ABI_VERSION         1
+
+// `process` is called on the recording thread that filled the batch. With a
+// multithreaded application it is called concurrently.
+#define CATS_PLUGIN_MODE_INLINE         0
+// `process` is called on a single consumer thread owned by the runtime.
+#define CATS_PLUGIN_MODE_CONSUMER       1
+
+typedef struct cats_plugin_event {
+  uint64_t timestamp;     // ns since the plugins were loaded
+  uint64_t address;       // allocation, deallocation, access, io, atomic,
+                          // sync object, workshare lower bound
+  uint64_t size;          // allocation, access (0 if unknown), io bytes,
+                          // atomic, sync wait or hold ns, workshare upper
+                          // bound
+  uint64_t scope_id;      // scope entry, scope exit, io file descriptor,
+                          // workshare stride
+  uint32_t site;          // index for cats_plugin_host::site
+  uint32_t thread;        // index of the recording thread
+  uint8_t event_type;
+  uint8_t scope_type;     // scope entry, scope exit, io CATS_IO_* op,
+                          // atomic CATS_ATOMIC_* op, sync CATS_SYNC_* kind,
+                          // workshare CATS_WORKSHARE_* schedule
+  uint8_t is_write;       // access, atomic success, sync phase
+} cats_plugin_event;
+
+typedef struct cats_plugin_site {
+  uint64_t call_id;
+  const char *funcname;
+  const char *filename;
+  uint32_t line;
+  uint32_t col;
+  const char *buffer_name;  // allocation sites, NULL otherwise
+} cats_plugin_site;
+
+typedef struct cats_plugin_host {
+  uint32_t abi_version;
+  // Source information of a site. The returned pointer stays valid until
+  // the process exits.
+  const cats_plugin_site *(*site)(uint32_t site);
+} cats_plugin_host;
+
+typedef struct cats_plugin {
+  uint32_t abi_version;   // CATS_PLUGIN_ABI_VERSION
+  const char *name;
+  uint32_t mode;          // CATS_PLUGIN_MODE_*
+  // Returns the plugin state passed to the other callbacks.
+  void *(*init)(const cats_plugin_host *host);
+  void (*process)(void *state, const cats_plugin_event *events,
+                  size_t n_events);
+  // Called once from cats_trace_save after the last batch.
+  void (*finish)(void *state);
+} cats_plugin;
+
+#define CATS_PLUGIN_ENTRY "cats_plugin_entry"
+
+typedef const cats_plugin *(*cats_plugin_entry_fn)(void);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // __CATS_PLUGIN_H__
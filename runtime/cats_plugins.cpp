@@ -0,0 +1,310 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_plugins.hpp"
+#include "cats_config.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <dlfcn.h>
+
+#ifndef CATS_PLUGIN_DEFAULT_BATCH
+#define CATS_PLUGIN_DEFAULT_BATCH                   4096
+#endif
+#ifndef CATS_PLUGIN_DEFAULT_QUEUE
+#define CATS_PLUGIN_DEFAULT_QUEUE                   64
+#endif
+
+namespace cats {
+
+typedef std::vector<cats_plugin_event> Plugin_Batch;
+
+struct Loaded_Plugin {
+  const cats_plugin *plugin;
+  void *state;
+};
+
+struct Site_Entry {
+  std::string funcname;
+  std::string filename;
+  std::string buffer_name;
+  cats_plugin_site site;
+};
+
+// Events of one recording thread that have not been handed out yet. Owned by
+// the host so that batches of exited threads are still delivered. The mutex
+// is only contended when the batches are flushed at the end of the run,
+// while the thread may still be recording.
+struct Thread_Batch {
+  std::mutex mutex;
+  uint32_t thread;
+  Plugin_Batch events;
+  std::unordered_map<uint64_t, uint32_t> sites;
+};
+
+// All host state lives in one object, see leaked_instance().
+struct Plugin_Host {
+  std::vector<Loaded_Plugin> inline_plugins;
+  std::vector<Loaded_Plugin> consumer_plugins;
+  size_t batch_size = CATS_PLUGIN_DEFAULT_BATCH;
+  size_t queue_size = CATS_PLUGIN_DEFAULT_QUEUE;
+  std::chrono::steady_clock::time_point start;
+  std::atomic<bool> finished{false};
+
+  std::mutex sites_mutex;
+  std::deque<Site_Entry> sites;
+  std::unordered_map<uint64_t, uint32_t> site_ids;
+
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_Batch>> threads;
+
+  std::mutex queue_mutex;
+  std::condition_variable queue_changed;
+  std::deque<Plugin_Batch> queue;
+  bool consumer_busy = false;
+};
+
+static Plugin_Host &host() {
+  return leaked_instance<Plugin_Host>();
+}
+
+static thread_local Thread_Batch *t_batch = nullptr;
+
+static const cats_plugin_site *lookup_site(uint32_t site) {
+  Plugin_Host &h = host();
+  std::lock_guard<std::mutex> guard(h.sites_mutex);
+  if (site >= h.sites.size())
+    return nullptr;
+  return &h.sites[site].site;
+}
+
+static const cats_plugin_host g_host = {
+  CATS_PLUGIN_ABI_VERSION,
+  lookup_site,
+};
+
+static uint32_t intern_site(uint64_t call_id, const char *buffer_name,
+                            const char *funcname, const char *filename,
+                            uint32_t line, uint32_t col) {
+  Plugin_Host &h = host();
+  std::lock_guard<std::mutex> guard(h.sites_mutex);
+  auto it = h.site_ids.find(call_id);
+  if (it != h.site_ids.end())
+    return it->second;
+
+  uint32_t id = (uint32_t) h.sites.size();
+  h.sites.emplace_back();
+  Site_Entry &entry = h.sites.back();
+  entry.funcname = funcname ? funcname : "$UNKNOWN$";
+  entry.filename = filename ? filename : "$UNKNOWN$";
+  entry.site.call_id = call_id;
+  entry.site.funcname = entry.funcname.c_str();
+  entry.site.filename = entry.filename.c_str();
+  entry.site.line = line;
+  entry.site.col = col;
+  entry.site.buffer_name = nullptr;
+  if (buffer_name) {
+    entry.buffer_name = buffer_name;
+    entry.site.buffer_name = entry.buffer_name.c_str();
+  }
+  h.site_ids.emplace(call_id, id);
+  return id;
+}
+
+static void consumer_thread() {
+  Plugin_Host &h = host();
+  std::unique_lock<std::mutex> lock(h.queue_mutex);
+  while (true) {
+    h.queue_changed.wait(lock, [&]() { return !h.queue.empty(); });
+    Plugin_Batch batch = std::move(h.queue.front());
+    h.queue.pop_front();
+    h.consumer_busy = true;
+    h.queue_changed.notify_all();
+    lock.unlock();
+
+    for (auto &loaded : h.consumer_plugins)
+      loaded.plugin->process(loaded.state, batch.data(), batch.size());
+
+    lock.lock();
+    h.consumer_busy = false;
+    h.queue_changed.notify_all();
+  }
+}
+
+static void flush(Thread_Batch &batch) {
+  Plugin_Host &h = host();
+  if (batch.events.empty())
+    return;
+
+  for (auto &loaded : h.inline_plugins) {
+    loaded.plugin->process(
+      loaded.state, batch.events.data(), batch.events.size()
+    );
+  }
+
+  if (!h.consumer_plugins.empty()) {
+    std::unique_lock<std::mutex> lock(h.queue_mutex);
+    // Block rather than drop: the analyses must see every event.
+    h.queue_changed.wait(
+      lock, [&]() { return h.queue.size() < h.queue_size; }
+    );
+    h.queue.push_back(std::move(batch.events));
+    h.queue_changed.notify_all();
+    batch.events = Plugin_Batch();
+    batch.events.reserve(h.batch_size);
+  } else {
+    batch.events.clear();
+  }
+}
+
+static Thread_Batch &thread_batch() {
+  Plugin_Host &h = host();
+  if (!t_batch) {
+    std::lock_guard<std::mutex> guard(h.threads_mutex);
+    h.threads.emplace_back(new Thread_Batch());
+    t_batch = h.threads.back().get();
+    t_batch->thread = (uint32_t) (h.threads.size() - 1);
+    t_batch->events.reserve(h.batch_size);
+  }
+  return *t_batch;
+}
+
+bool load_plugins() {
+  Plugin_Host &h = host();
+  const char *list = config::get_string("CATS_PLUGINS", nullptr);
+  if (!list)
+    return false;
+
+  h.batch_size = config::get_u64(
+    "CATS_PLUGIN_BATCH", CATS_PLUGIN_DEFAULT_BATCH
+  );
+  if (h.batch_size == 0)
+    h.batch_size = 1;
+  h.queue_size = config::get_u64(
+    "CATS_PLUGIN_QUEUE", CATS_PLUGIN_DEFAULT_QUEUE
+  );
+  if (h.queue_size == 0)
+    h.queue_size = 1;
+  h.start = std::chrono::steady_clock::now();
+
+  std::string paths(list);
+  size_t begin = 0;
+  while (begin < paths.size()) {
+    size_t end = paths.find(':', begin);
+    if (end == std::string::npos)
+      end = paths.size();
+    std::string path = paths.substr(begin, end - begin);
+    begin = end + 1;
+    if (path.empty())
+      continue;
+
+    void *handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+    if (!handle) {
+      std::cerr << "CATS: Cannot load plugin " << path << ": " << dlerror()
+                << std::endl;
+      continue;
+    }
+    auto entry = (cats_plugin_entry_fn) dlsym(handle, CATS_PLUGIN_ENTRY);
+    const cats_plugin *plugin = entry ? entry() : nullptr;
+    if (!plugin || plugin->abi_version != CATS_PLUGIN_ABI_VERSION ||
+        !plugin->process) {
+      std::cerr << "CATS: " << path << " is not a compatible CATS plugin"
+                << std::endl;
+      dlclose(handle);
+      continue;
+    }
+    if (plugin->mode != CATS_PLUGIN_MODE_INLINE &&
+        plugin->mode != CATS_PLUGIN_MODE_CONSUMER) {
+      std::cerr << "CATS: Unknown mode " << plugin->mode << " of plugin "
+                << path << ", expected inline (0) or consumer (1)"
+                << std::endl;
+      dlclose(handle);
+      continue;
+    }
+
+    Loaded_Plugin loaded;
+    loaded.plugin = plugin;
+    loaded.state = plugin->init ? plugin->init(&g_host) : nullptr;
+    if (plugin->mode == CATS_PLUGIN_MODE_CONSUMER)
+      h.consumer_plugins.push_back(loaded);
+    else
+      h.inline_plugins.push_back(loaded);
+    std::cerr << "CATS: Loaded plugin "
+              << (plugin->name ? plugin->name : path.c_str()) << std::endl;
+  }
+
+  if (!h.consumer_plugins.empty())
+    std::thread(consumer_thread).detach();
+  return !h.inline_plugins.empty() || !h.consumer_plugins.empty();
+}
+
+void plugin_event(cats_plugin_event &event, uint64_t call_id,
+                  const char *buffer_name, const char *funcname,
+                  const char *filename, uint32_t line, uint32_t col) {
+  Plugin_Host &h = host();
+  if (h.finished.load(std::memory_order_relaxed))
+    return;
+
+  Thread_Batch &batch = thread_batch();
+  std::lock_guard<std::mutex> guard(batch.mutex);
+  // Events recorded after the batch was flushed for the last time are not
+  // delivered
+  if (h.finished.load(std::memory_order_relaxed))
+    return;
+  auto it = batch.sites.find(call_id);
+  if (it == batch.sites.end()) {
+    it = batch.sites.emplace(call_id, intern_site(
+      call_id, buffer_name, funcname, filename, line, col
+    )).first;
+  }
+
+  event.site = it->second;
+  event.thread = batch.thread;
+  event.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - h.start
+  ).count();
+  batch.events.push_back(event);
+  if (batch.events.size() >= h.batch_size)
+    flush(batch);
+}
+
+void finish_plugins() {
+  Plugin_Host &h = host();
+  if (h.finished.exchange(true))
+    return;
+
+  {
+    std::lock_guard<std::mutex> guard(h.threads_mutex);
+    for (auto &batch : h.threads) {
+      std::lock_guard<std::mutex> batch_guard(batch->mutex);
+      flush(*batch);
+    }
+  }
+
+  if (!h.consumer_plugins.empty()) {
+    std::unique_lock<std::mutex> lock(h.queue_mutex);
+    h.queue_changed.wait(
+      lock, [&]() { return h.queue.empty() && !h.consumer_busy; }
+    );
+  }
+
+  for (auto &loaded : h.inline_plugins) {
+    if (loaded.plugin->finish)
+      loaded.plugin->finish(loaded.state);
+  }
+  for (auto &loaded : h.consumer_plugins) {
+    if (loaded.plugin->finish)
+      loaded.plugin->finish(loaded.state);
+  }
+}
+
+} // namespace cats
@@ -0,0 +1,33 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_PLUGINS_HPP__
+#define __CATS_PLUGINS_HPP__
+
+#include "cats_plugin.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cats {
+
+// Loads the plugins listed in CATS_PLUGINS. Returns false if none could be
+// loaded, in which case the other functions must not be called.
+//   CATS_PLUGINS       ':' separated list of plugin libraries
+//   CATS_PLUGIN_BATCH  events per batch handed to the plugins
+//   CATS_PLUGIN_QUEUE  batches queued for the consumer thread before the
+//                      recording threads block
+bool load_plugins();
+
+// Appends `event` to the batch of the calling thread. The site and thread
+// index and the timestamp are filled in here.
+void plugin_event(cats_plugin_event &event, uint64_t call_id,
+                  const char *buffer_name, const char *funcname,
+                  const char *filename, uint32_t line, uint32_t col);
+
+// Hands all pending batches to the plugins and finishes them. Must not race
+// with recording threads. Later events are ignored.
+void finish_plugins();
+
+} // namespace cats
+
+#endif // __CATS_PLUGINS_HPP__
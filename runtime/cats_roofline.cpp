@@ -0,0 +1,289 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_roofline.hpp"
+#include "cats_config.hpp"
+#include "cats_runtime.h"
+#include "cats_sites.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef CATS_ROOFLINE_MAX_DEPTH
+#define CATS_ROOFLINE_MAX_DEPTH                     4096
+#endif
+
+namespace cats {
+
+struct Scope_Stats {
+  const char *funcname = nullptr;
+  const char *filename = nullptr;
+  uint32_t line = 0;
+  uint8_t type = 0;
+  uint64_t threads = 0;
+  uint64_t count = 0;
+  uint64_t flops = 0;
+  uint64_t bytes = 0;
+  // Sum over threads, and the longest of a single thread once merged
+  uint64_t thread_ns = 0;
+  uint64_t time_ns = 0;
+  const cats_instruction_mix *mix = nullptr;
+  // Loop iterations of the instances with a reported trip count
+  uint64_t iterations = 0;
+  uint64_t counted = 0;
+};
+
+struct Thread_Scope {
+  Scope_Stats stats;
+  // Open instances on the thread, only the outermost one of a recursion is
+  // credited. Only used by the thread.
+  uint32_t active = 0;
+};
+
+struct Scope_Frame {
+  uint64_t scope_id;
+  Thread_Scope *scope;
+  uint64_t begin_ns;
+  uint64_t flops;
+  uint64_t bytes;
+};
+
+// Profile of one thread. The counters and the stack are only touched by the
+// thread, the mutex guards the scopes while the profile is written out. The
+// thread looks scopes up without it and only takes it to change them.
+struct Thread_Profile {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, Thread_Scope> scopes;
+  std::vector<Scope_Frame> stack;
+  uint64_t flops = 0;
+  uint64_t bytes = 0;
+};
+
+struct Roofline_State {
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_Profile>> threads;
+};
+
+static Roofline_State &state() {
+  return leaked_instance<Roofline_State>();
+}
+
+static thread_local Thread_Profile *t_profile = nullptr;
+
+static Thread_Profile &thread_profile() {
+  if (!t_profile) {
+    Roofline_State &s = state();
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    s.threads.emplace_back(new Thread_Profile());
+    t_profile = s.threads.back().get();
+  }
+  return *t_profile;
+}
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+bool roofline_enabled() {
+  static const bool enabled = config::get_bool("CATS_ROOFLINE", false);
+  return enabled;
+}
+
+void roofline_scope_entry(uint64_t call_id, uint64_t scope_id, uint8_t type,
+                          const char *funcname, const char *filename,
+                          uint32_t line) {
+  Thread_Profile &profile = thread_profile();
+  if (profile.stack.size() >= CATS_ROOFLINE_MAX_DEPTH)
+    return;
+
+  auto it = profile.scopes.find(scope_id);
+  if (it == profile.scopes.end()) {
+    Scope_Stats stats;
+    stats.funcname = funcname;
+    stats.filename = filename;
+    stats.line = line;
+    stats.type = type;
+    stats.threads = 1;
+    const cats_site_info *site = find_site(call_id);
+    if (site)
+      stats.mix = site->mix;
+    std::lock_guard<std::mutex> guard(profile.mutex);
+    it = profile.scopes.emplace(scope_id, Thread_Scope{stats, 0}).first;
+  }
+  Thread_Scope *scope = &it->second;
+  ++scope->active;
+  profile.stack.push_back(
+    {scope_id, scope, now_ns(), profile.flops, profile.bytes}
+  );
+}
+
+void roofline_scope_exit(uint64_t scope_id) {
+  Thread_Profile &profile = thread_profile();
+  // Scopes left without their exit (longjmp, exceptions) are closed with
+  // the enclosing one
+  auto it = std::find_if(profile.stack.rbegin(), profile.stack.rend(),
+                         [scope_id](const Scope_Frame &frame) {
+    return frame.scope_id == scope_id;
+  });
+  if (it == profile.stack.rend())
+    return;
+
+  uint64_t now = now_ns();
+  std::lock_guard<std::mutex> guard(profile.mutex);
+  while (!profile.stack.empty()) {
+    Scope_Frame frame = profile.stack.back();
+    profile.stack.pop_back();
+    Scope_Stats &stats = frame.scope->stats;
+    ++stats.count;
+    if (--frame.scope->active == 0) {
+      stats.flops += profile.flops - frame.flops;
+      stats.bytes += profile.bytes - frame.bytes;
+      stats.thread_ns += now - frame.begin_ns;
+    }
+    if (frame.scope_id == scope_id)
+      break;
+  }
+}
+
+void roofline_loop_trips(uint64_t scope_id, uint64_t trips) {
+  Thread_Profile &profile = thread_profile();
+  if (profile.stack.empty() || profile.stack.back().scope_id != scope_id)
+    return;
+  std::lock_guard<std::mutex> guard(profile.mutex);
+  Scope_Stats &stats = profile.stack.back().scope->stats;
+  stats.iterations += trips;
+  ++stats.counted;
+}
+
+static void write_mix(std::ostream &os, const cats_instruction_mix &mix,
+                      uint64_t weight) {
+  os << "{\"loads\": " << mix.loads * weight << ", ";
+  os << "\"stores\": " << mix.stores * weight << ", ";
+  os << "\"fp_ops\": " << mix.fp_ops * weight << ", ";
+  os << "\"int_ops\": " << mix.int_ops * weight << ", ";
+  os << "\"branches\": " << mix.branches * weight << ", ";
+  os << "\"calls\": " << mix.calls * weight << ", ";
+  os << "\"vector_ops\": " << mix.vector_ops * weight << "}";
+}
+
+void roofline_flops(uint64_t flops) {
+  thread_profile().flops += flops;
+}
+
+void roofline_bytes(uint64_t bytes) {
+  thread_profile().bytes += bytes;
+}
+
+// Zeroes the counters of a scope once they are written. The scope stays in
+// the map, the thread looks it up without the lock and its open frames
+// point to it.
+static void release_scope(Scope_Stats &stats) {
+  stats.count = 0;
+  stats.flops = 0;
+  stats.bytes = 0;
+  stats.thread_ns = 0;
+  stats.iterations = 0;
+  stats.counted = 0;
+}
+
+void write_roofline_profile(std::ostream &os, bool release) {
+  std::map<uint64_t, Scope_Stats> merged;
+  Roofline_State &s = state();
+  {
+    std::lock_guard<std::mutex> threads_guard(s.threads_mutex);
+    for (auto &profile : s.threads) {
+      std::lock_guard<std::mutex> guard(profile->mutex);
+      for (auto &entry : profile->scopes) {
+        uint64_t scope_id = entry.first;
+        Scope_Stats thread_stats = entry.second.stats;
+        // Not exited since the previous segment
+        if (thread_stats.count == 0)
+          continue;
+        if (release)
+          release_scope(entry.second.stats);
+        auto it = merged.find(scope_id);
+        if (it == merged.end()) {
+          it = merged.emplace(scope_id, thread_stats).first;
+          it->second.time_ns = thread_stats.thread_ns;
+          continue;
+        }
+        Scope_Stats &stats = it->second;
+        stats.threads += 1;
+        stats.count += thread_stats.count;
+        stats.flops += thread_stats.flops;
+        stats.bytes += thread_stats.bytes;
+        stats.thread_ns += thread_stats.thread_ns;
+        stats.time_ns = std::max(stats.time_ns, thread_stats.thread_ns);
+        stats.iterations += thread_stats.iterations;
+        stats.counted += thread_stats.counted;
+      }
+    }
+  }
+
+  // Scopes with the most floating-point operations first
+  std::vector<std::pair<uint64_t, const Scope_Stats *>> scopes;
+  for (const auto &scope : merged) {
+    if (scope.second.flops > 0 || scope.second.mix)
+      scopes.emplace_back(scope.first, &scope.second);
+  }
+  if (scopes.empty())
+    return;
+  std::stable_sort(scopes.begin(), scopes.end(), [](const auto &a,
+                                                    const auto &b) {
+    if (a.second->flops != b.second->flops)
+      return a.second->flops > b.second->flops;
+    return a.second->time_ns > b.second->time_ns;
+  });
+
+  os << "," << std::endl;
+  os << "  \"scope_profiles\": [" << std::endl;
+  for (size_t i = 0; i < scopes.size(); ++i) {
+    const Scope_Stats &stats = *scopes[i].second;
+    os << "    {\"scope_id\": " << scopes[i].first << ", ";
+    os << "\"scope_type\": \""
+       << (stats.type == CATS_SCOPE_TYPE_LOOP ? "loop" : "func") << "\", ";
+    os << "\"funcname\": \"" << (stats.funcname ? stats.funcname : "")
+       << "\", ";
+    os << "\"filename\": \"" << (stats.filename ? stats.filename : "")
+       << "\", ";
+    os << "\"line\": " << stats.line << ", ";
+    os << "\"threads\": " << stats.threads << ", ";
+    os << "\"count\": " << stats.count << ", ";
+    os << "\"flops\": " << stats.flops << ", ";
+    os << "\"bytes\": " << stats.bytes << ", ";
+    os << "\"time_ns\": " << stats.time_ns << ", ";
+    os << "\"thread_ns\": " << stats.thread_ns;
+    if (stats.bytes > 0)
+      os << ", \"arithmetic_intensity\": "
+         << (double) stats.flops / stats.bytes;
+    // FLOP per ns are GFLOP/s
+    if (stats.time_ns > 0)
+      os << ", \"gflops\": " << (double) stats.flops / stats.time_ns;
+    if (stats.mix) {
+      // Loops whose trip count was not always known are weighted by their
+      // instances, like functions
+      bool iterations = stats.type == CATS_SCOPE_TYPE_LOOP &&
+                        stats.count > 0 && stats.counted >= stats.count;
+      if (iterations)
+        os << ", \"iterations\": " << stats.iterations;
+      os << ", \"mix_weight\": \""
+         << (iterations ? "iterations" : "instances") << "\"";
+      os << ", \"mix\": ";
+      write_mix(os, *stats.mix, iterations ? stats.iterations : stats.count);
+    }
+    os << "}";
+    if (i + 1 < scopes.size())
+      os << ",";
+    os << std::endl;
+  }
+  os << "  ]";
+}
+
+} // namespace cats
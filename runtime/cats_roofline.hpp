@@ -0,0 +1,43 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_ROOFLINE_HPP__
+#define __CATS_ROOFLINE_HPP__
+
+#include <cstdint>
+#include <ostream>
+
+namespace cats {
+
+// Roofline profile of function and loop scopes, enabled with
+// CATS_ROOFLINE=1. Every thread counts the floating-point operations
+// reported by the blocks instrumented by cats-flop-counter and the bytes of
+// the instrumented accesses; a scope is credited with what its thread
+// counted between its entry and exit, including nested scopes and callees.
+// The static instruction mix that the passes register for the scope entry
+// site is weighted by the number of instances of the scope, or by the
+// iterations of a loop if its trip count was reported for every instance.
+
+bool roofline_enabled();
+
+void roofline_scope_entry(uint64_t call_id, uint64_t scope_id, uint8_t type,
+                          const char *funcname, const char *filename,
+                          uint32_t line);
+void roofline_scope_exit(uint64_t scope_id);
+
+// Iterations of the loop scope entered last on the calling thread.
+void roofline_loop_trips(uint64_t scope_id, uint64_t trips);
+
+void roofline_flops(uint64_t flops);
+void roofline_bytes(uint64_t bytes);
+
+// Appends the "scope_profiles" section of the trace, a record per scope
+// with the totals of all threads, its arithmetic intensity, achieved
+// GFLOP/s and weighted instruction mix. With `release` the totals are reset
+// after they are written, so that each segment only covers the instances
+// that exited since the previous one. Writes nothing if no scope performed
+// floating-point operations or has an instruction mix.
+void write_roofline_profile(std::ostream &os, bool release);
+
+} // namespace cats
+
+#endif // __CATS_ROOFLINE_HPP__
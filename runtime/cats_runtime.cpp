@@ -1,691 +1,1271 @@
 // Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
 
 #include "cats_runtime.h"
-
+#include "cats_alloc_sites.hpp"
+#include "cats_config.hpp"
+#include "cats_fd_paths.hpp"
+#include "cats_flight_recorder.hpp"
+#include "cats_heatmap.hpp"
+#include "cats_introspect.hpp"
+#include "cats_memory.hpp"
+#include "cats_parallel.hpp"
+#include "cats_plugins.hpp"
+#include "cats_roofline.hpp"
+#include "cats_shm_transport.hpp"
+#include "cats_sites.hpp"
+#include "cats_sync.hpp"
+#include "cats_trace.hpp"
+
+#include <atomic>
 #include <cstddef>
 #include <cstdint>
-#include <cstring>
-#include <deque>
-#include <fstream>
 #include <iostream>
-#include <map>
-#include <unordered_set>
 #include <mutex>
-#include <sstream>
-#include <vector>
-
-#include <omp.h>
 
 #define CATS_STACK_IDENTIFIER_STRATEGY_DEFAULT      0
 #define CATS_STACK_IDENTIFIER_STRATEGY_FAST         1
 #define CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST    2
 
+// Compile-time default, can be overridden at startup with CATS_STACK_ID.
 #ifndef CATS_STACK_IDENTIFIER_STRATEGY
 #define CATS_STACK_IDENTIFIER_STRATEGY CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
 #endif
 
-#ifndef CATS_RUNTIME_DEBUG
-#define CATS_RUNTIME_DEBUG                          0
-#endif
-#ifndef CATS_RUNTIME_PRINT_ALLOCATIONS
-#define CATS_RUNTIME_PRINT_ALLOCATIONS              0
-#endif
-#ifndef CATS_RUNTIME_PRINT_ACCESSES
-#define CATS_RUNTIME_PRINT_ACCESSES                 0
-#endif
-#ifndef CATS_RUNTIME_PRINT_SCOPES
-#define CATS_RUNTIME_PRINT_SCOPES                   0
-#endif
+namespace cats {
 
-#ifndef CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
-#define CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND   0
-#endif
+// Table of hook implementations for one instantiation of CATS_Trace. The C
+// entry points forward through the selected table, so the mode is chosen once
+// at startup and never checked again on the event path.
+struct CATS_Dispatch {
+  void (*reset)();
+  void (*alloc)(
+    uint64_t call_id, const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*dealloc)(
+    uint64_t call_id, void *address,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*access)(
+    uint64_t call_id, void *address, size_t size, bool is_write,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*scope_entry)(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*scope_exit)(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*io)(
+    uint64_t call_id, uint8_t op, int32_t fd, void *stream, void *address,
+    int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*atomic)(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*sync)(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  void (*workshare)(
+    uint64_t call_id, uint8_t schedule, int64_t lower, int64_t upper,
+    int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+  // Entry and exit of a team thread in an outlined parallel region
+  void (*parallel_begin)();
+  void (*parallel_end)();
+  // Trip count of the loop scope just entered, and floating-point operations
+  void (*loop_trips)(uint64_t scope_id, uint64_t trips);
+  void (*flops)(uint64_t flops);
+  void (*save)(const char *filepath);
+  void (*dump)(const char *filepath);
+  void (*crash_dump)(const char *filepath);
+  void (*checkpoint)(const char *filepath);
+};
 
-#ifndef CATS_TRACE_FILE_NAME_SIZE
-#define CATS_TRACE_FILE_NAME_SIZE                   256
-#endif
-#ifndef CATS_TRACE_FUNC_NAME_SIZE
-#define CATS_TRACE_FUNC_NAME_SIZE                   64
-#endif
-#ifndef CATS_TRACE_BUFFER_NAME_SIZE
-#define CATS_TRACE_BUFFER_NAME_SIZE                 64
-#endif
+template <class Trace>
+struct Dispatch_For {
+  static Trace *trace;
+  static const CATS_Dispatch table;
 
-namespace cats {
+  static void reset() {
+    trace->reset();
+  }
 
-struct CATS_Debug_Info {
-  char funcname[CATS_TRACE_FUNC_NAME_SIZE];
-  char filename[CATS_TRACE_FILE_NAME_SIZE];
-  uint32_t line;
-  uint32_t col;
-};
+  static void alloc(
+    uint64_t call_id, const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_alloc(
+      call_id, buffer_name, address, size, funcname, filename, line, col
+    );
+  }
 
-struct CATS_Event {
-#if CATS_RUNTIME_DEBUG
-  uint64_t call_id;
-#endif
-  uint8_t event_type;
-  CATS_Debug_Info debug_info;
-  const void *args;
-};
+  static void dealloc(
+    uint64_t call_id, void *address,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_dealloc(
+      call_id, address, funcname, filename, line, col
+    );
+  }
 
-struct Allocation_Event_Args {
-  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
-  uint64_t buffer_id;
-  size_t size;
-};
+  static void access(
+    uint64_t call_id, void *address, size_t size, bool is_write,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_access(
+      call_id, address, size, is_write, funcname, filename, line, col
+    );
+  }
 
-struct Deallocation_Event_Args {
-  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
-  uint64_t buffer_id;
-};
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
 
-struct Access_Event_Args {
-  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
-  uint64_t buffer_id;
-  bool is_write;
-};
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
+
+  static void io(
+    uint64_t call_id, uint8_t op, int32_t fd, void *stream, void *address,
+    int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_io(
+      call_id, op, fd, stream, address, bytes, funcname, filename, line, col
+    );
+  }
+
+  static void atomic(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_atomic(
+      call_id, address, size, op, success, funcname, filename, line, col
+    );
+  }
+
+  static void sync(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_sync(
+      call_id, kind, phase, object, duration, funcname, filename, line,
+      col
+    );
+  }
+
+  static void workshare(
+    uint64_t call_id, uint8_t schedule, int64_t lower, int64_t upper,
+    int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    trace->instrument_workshare(
+      call_id, schedule, lower, upper, stride, funcname, filename, line,
+      col
+    );
+  }
 
-struct Scope_Entry_Event_Args {
-  uint64_t scope_id;
-  uint8_t type;
+  // Only used by the profiles.
+  static void parallel_begin() {}
+  static void parallel_end() {}
+  static void loop_trips(uint64_t, uint64_t) {}
+  static void flops(uint64_t) {}
+
+  static void save(const char *filepath) {
+    trace->save(filepath);
+  }
+
+  static void dump(const char *filepath) {
+    trace->dump(filepath);
+  }
+
+  static void crash_dump(const char *filepath) {
+    trace->crash_dump(filepath);
+  }
+
+  static void checkpoint(const char *filepath) {
+    trace->checkpoint(filepath);
+  }
+
+  // The trace is intentionally never destroyed: cats_trace_save is run from
+  // the application's global destructors, which may execute after the static
+  // destructors of this library.
+  static const CATS_Dispatch *create() {
+    trace = new Trace();
+    return &table;
+  }
 };
 
-struct Scope_Exit_Event_Args {
-  uint64_t scope_id;
+template <class Trace>
+Trace *Dispatch_For<Trace>::trace = nullptr;
+
+template <class Trace>
+const CATS_Dispatch Dispatch_For<Trace>::table = {
+  Dispatch_For<Trace>::reset,
+  Dispatch_For<Trace>::alloc,
+  Dispatch_For<Trace>::dealloc,
+  Dispatch_For<Trace>::access,
+  Dispatch_For<Trace>::scope_entry,
+  Dispatch_For<Trace>::scope_exit,
+  Dispatch_For<Trace>::io,
+  Dispatch_For<Trace>::atomic,
+  Dispatch_For<Trace>::sync,
+  Dispatch_For<Trace>::workshare,
+  Dispatch_For<Trace>::parallel_begin,
+  Dispatch_For<Trace>::parallel_end,
+  Dispatch_For<Trace>::loop_trips,
+  Dispatch_For<Trace>::flops,
+  Dispatch_For<Trace>::save,
+  Dispatch_For<Trace>::dump,
+  Dispatch_For<Trace>::crash_dump,
+  Dispatch_For<Trace>::checkpoint,
 };
 
-struct CATS_Alloc_Info {
-  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
-  uint64_t buffer_id;
-  size_t size;
+enum Dedup_Mode { DEDUP_STACK, DEDUP_NONE };
+enum Threading_Mode {
+  THREADING_MASTER, THREADING_SERIAL, THREADING_PER_THREAD
 };
+enum Storage_Mode { STORAGE_DEQUE, STORAGE_RING, STORAGE_NONE };
+enum Transport_Mode { TRANSPORT_LOCAL, TRANSPORT_SHM };
+
+template <class Dedup, class Threading>
+static const CATS_Dispatch *select_storage(Storage_Mode storage) {
+  switch (storage) {
+    case STORAGE_RING:
+      return Dispatch_For<
+        CATS_Trace<Dedup, Threading, RingStorage>
+      >::create();
+    case STORAGE_NONE:
+      return Dispatch_For<
+        CATS_Trace<Dedup, Threading, DiscardStorage>
+      >::create();
+    case STORAGE_DEQUE:
+    default:
+      return Dispatch_For<
+        CATS_Trace<
+          Dedup, Threading, DequeStorage<typename Threading::storage_mutex>
+        >
+      >::create();
+  }
+}
 
-class CATS_Trace {
-protected:
-    uint64_t n_events = 0;
-
-    std::mutex _mutex;
-
-    std::deque<uint64_t> _scope_stack;
-    std::unordered_set<uint64_t> _scope_ids;
-    std::map<const void *, CATS_Alloc_Info> _allocations;
-#if CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
-    std::map<uint64_t, std::unordered_set<uint64_t>> _recorded_calls;
-    uint64_t stack_id = 0;
-#elif CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_FAST
-    std::map<uint64_t, std::unordered_set<uint64_t>> _recorded_calls;
-#else
-    std::map<uint64_t, std::vector<std::string>> _recorded_calls;
-#endif
-    std::deque<CATS_Event *> _events;
-
-    std::string get_stack_identifier() {
-      std::stringstream ss;
-      auto it = this->_scope_stack.begin();
-      while (it != this->_scope_stack.end()) {
-        ss << *it;
-        ++it;
-        if (it != this->_scope_stack.end()) {
-          ss << ",";
-        }
-      }
-      return ss.str();
-    }
+template <class Dedup>
+static const CATS_Dispatch *select_threading(Threading_Mode threading,
+                                             Storage_Mode storage) {
+  switch (threading) {
+    case THREADING_SERIAL:
+      return select_storage<Dedup, ThreadingSerial>(storage);
+    case THREADING_PER_THREAD:
+      return select_storage<Dedup, ThreadingPerThread>(storage);
+    case THREADING_MASTER:
+    default:
+      return select_storage<Dedup, ThreadingMasterOnly>(storage);
+  }
+}
 
-    uint64_t get_stack_identifier_fast() {
-      uint64_t identifier = 0;
-      bool even = true;
-      auto it = this->_scope_stack.begin();
-      while (it != this->_scope_stack.end()) {
-        if (even)
-          identifier += *it;
-        else
-          identifier -= *it;
-        even = !even;
-        ++it;
-      }
-      return identifier;
-    }
+struct Runtime_Mode {
+  Dedup_Mode dedup;
+  size_t stack_id;
+  Threading_Mode threading;
+  Storage_Mode storage;
+  Transport_Mode transport;
+};
 
-    bool already_recorded(uint64_t call_id) {
-      auto it = this->_recorded_calls.find(call_id);
-#if CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_FAST
-      uint64_t stack_id = this->get_stack_identifier_fast();
-#elif CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
-      uint64_t stack_id = this->stack_id;
-#else
-      auto stack_id = this->get_stack_identifier();
-#endif
-      if (it == this->_recorded_calls.end()) {
-#if CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_FAST || CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
-        this->_recorded_calls[call_id] = std::unordered_set<uint64_t>();
-        this->_recorded_calls[call_id].insert(stack_id);
-#else
-        this->_recorded_calls[call_id] = std::vector<std::string>();
-        this->_recorded_calls[call_id].push_back(stack_id);
-#endif
-        return false;
-      } else {
-#if CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_FAST || CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
-        auto sid_id = it->second.find(stack_id);
-        if (sid_id != it->second.end())
-          return true;
-        it->second.insert(stack_id);
-#else
-        auto val = it->second;
-        for (auto &v : val) {
-          if (v == stack_id) {
-            return true;
-          }
-        }
-        it->second.push_back(stack_id);
-#endif
-      }
-      return false;
-    }
+// Reads the trace mode from the environment:
+//   CATS_DEDUP     stack (default) | none
+//   CATS_STACK_ID  default | fast | very_fast
+//   CATS_THREADING master (default) | serial | per_thread
+//   CATS_STORAGE   deque (default) | ring | none
+//   CATS_TRANSPORT local (default) | shm
+static Runtime_Mode read_mode() {
+  static const char *const dedup_modes[] = {"stack", "none"};
+  static const char *const stack_id_modes[] = {
+    "default", "fast", "very_fast"
+  };
+  static const char *const threading_modes[] = {
+    "master", "serial", "per_thread"
+  };
+  static const char *const storage_modes[] = {"deque", "ring", "none"};
+  static const char *const transport_modes[] = {"local", "shm"};
+
+  Runtime_Mode mode;
+  mode.dedup = (Dedup_Mode) config::get_choice(
+    "CATS_DEDUP", dedup_modes, 2, DEDUP_STACK
+  );
+  mode.stack_id = config::get_choice(
+    "CATS_STACK_ID", stack_id_modes, 3, CATS_STACK_IDENTIFIER_STRATEGY
+  );
+  mode.threading = (Threading_Mode) config::get_choice(
+    "CATS_THREADING", threading_modes, 3, THREADING_MASTER
+  );
+  mode.storage = (Storage_Mode) config::get_choice(
+    "CATS_STORAGE", storage_modes, 3, STORAGE_DEQUE
+  );
+  mode.transport = (Transport_Mode) config::get_choice(
+    "CATS_TRANSPORT", transport_modes, 2, TRANSPORT_LOCAL
+  );
+  return mode;
+}
 
-    void record_event(uint64_t call_id, uint32_t event_type, const void *args,
-                      const char *funcname, const char *filename,
-                      uint32_t line, uint32_t col) {
-      CATS_Event *event = (CATS_Event *) malloc(sizeof(CATS_Event));
-#if CATS_RUNTIME_DEBUG
-      event->call_id = call_id;
-#endif
-      event->event_type = event_type;
-      event->args = args;
+// Instantiates the trace matching `mode` and returns its hook table.
+static const CATS_Dispatch *select_trace(const Runtime_Mode &mode) {
+  if (mode.dedup == DEDUP_NONE)
+    return select_threading<DedupNone>(mode.threading, mode.storage);
 
-      if (!funcname || !*funcname)
-        funcname = "$UNKNOWN$";
-      strncpy(
-        event->debug_info.funcname, funcname, CATS_TRACE_FUNC_NAME_SIZE - 1
+  switch (mode.stack_id) {
+    case CATS_STACK_IDENTIFIER_STRATEGY_DEFAULT:
+      return select_threading<DedupPerStack<StackIdString>>(
+        mode.threading, mode.storage
       );
-      event->debug_info.funcname[CATS_TRACE_FUNC_NAME_SIZE - 1] = '\0';
-
-      if (!filename || !*filename)
-        filename = "$UNKNOWN$";
-      strncpy(
-        event->debug_info.filename, filename, CATS_TRACE_FILE_NAME_SIZE - 1
+    case CATS_STACK_IDENTIFIER_STRATEGY_FAST:
+      return select_threading<DedupPerStack<StackIdFast>>(
+        mode.threading, mode.storage
       );
-      event->debug_info.filename[CATS_TRACE_FILE_NAME_SIZE - 1] = '\0';
+    case CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST:
+    default:
+      return select_threading<DedupPerStack<StackIdVeryFast>>(
+        mode.threading, mode.storage
+      );
+  }
+}
 
-      event->debug_info.line = line;
-      event->debug_info.col = col;
-      this->_events.push_back(event);
+// Hands every event to the analysis plugins before forwarding it to the
+// selected trace. Installed in front of the trace table if CATS_PLUGINS
+// names at least one plugin.
+struct Plugin_Dispatch {
+  static const CATS_Dispatch *trace;
 
-#if CATS_RUNTIME_DEBUG
-      if (this->_events.size() % 1'000'000 == 0) {
-        std::cout << "Recorded " << this->_events.size() << " events"
-                  << std::endl;
-      }
-#endif
-    }
+  static void reset() {
+    trace->reset();
+  }
 
-public:
-  CATS_Trace() {}
+  static void alloc(
+    uint64_t call_id, const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_ALLOCATION;
+    event.address = (uint64_t) address;
+    event.size = size;
+    plugin_event(
+      event, call_id, buffer_name ? buffer_name : "$UNKNOWN$",
+      funcname, filename, line, col
+    );
+    trace->alloc(
+      call_id, buffer_name, address, size, funcname, filename, line, col
+    );
+  }
 
-  ~CATS_Trace() {
-    this->reset();
+  static void dealloc(
+    uint64_t call_id, void *address,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_DEALLOCATION;
+    event.address = (uint64_t) address;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->dealloc(call_id, address, funcname, filename, line, col);
   }
 
-  void reset() {
-    std::lock_guard<std::mutex> guard(this->_mutex);
-    for (auto &event : this->_events) {
-      free((void *) event->args);
-      free(event);
-    }
-    this->_events.clear();
-    this->_allocations.clear();
-    this->_scope_ids.clear();
-    this->_scope_stack.clear();
-    this->_recorded_calls.clear();
+  static void access(
+    uint64_t call_id, void *address, size_t size, bool is_write,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_ACCESS;
+    event.address = (uint64_t) address;
+    event.size = size;
+    event.is_write = is_write;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->access(
+      call_id, address, size, is_write, funcname, filename, line, col
+    );
   }
 
-  void instrument_alloc(
-    uint64_t call_id,
-    const char *buffer_name, void *address, size_t size,
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
     const char *funcname, const char *filename, uint32_t line, uint32_t col
   ) {
-    if (omp_in_parallel() && omp_get_thread_num() != 0) {
-      // If we are in a parallel region, only the master thread should exit
-      // the scope, so we skip this call.
-      return;
-    }
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_SCOPE_ENTRY;
+    event.scope_id = scope_id;
+    event.scope_type = scope_type;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
 
-    std::lock_guard<std::mutex> guard(this->_mutex);
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_SCOPE_EXIT;
+    event.scope_id = scope_id;
+    event.scope_type = scope_type;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
 
-    if (this->already_recorded(call_id)) {
-      // If this call has already been recorded, skip the allocation
-      return;
-    }
+  static void io(
+    uint64_t call_id, uint8_t op, int32_t fd, void *stream, void *address,
+    int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_IO;
+    event.address = (uint64_t) address;
+    event.size = (uint64_t) bytes;
+    event.scope_id = (uint64_t) (int64_t) fd;
+    event.scope_type = op;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->io(
+      call_id, op, fd, stream, address, bytes, funcname, filename, line, col
+    );
+  }
 
-    Allocation_Event_Args *args = (Allocation_Event_Args *) malloc(
-      sizeof(Allocation_Event_Args)
+  static void atomic(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_ATOMIC;
+    event.address = (uint64_t) address;
+    event.size = size;
+    event.scope_type = op;
+    event.is_write = success;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->atomic(
+      call_id, address, size, op, success, funcname, filename, line, col
     );
+  }
 
-    if (!buffer_name || !*buffer_name)
-      buffer_name = "$UNKNOWN$";
+  static void sync(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_SYNC;
+    event.address = (uint64_t) object;
+    event.size = duration;
+    event.scope_type = kind;
+    event.is_write = phase;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->sync(
+      call_id, kind, phase, object, duration, funcname, filename, line,
+      col
+    );
+  }
 
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ALLOCATIONS
-    std::cout << "Allocating " << buffer_name <<
-              << " at " << address << " in " << funcname << " (" << size
-              << " bytes)" << std::endl;
-#endif
+  static void workshare(
+    uint64_t call_id, uint8_t schedule, int64_t lower, int64_t upper,
+    int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    cats_plugin_event event = {};
+    event.event_type = CATS_EVENT_TYPE_WORKSHARE;
+    event.address = (uint64_t) lower;
+    event.size = (uint64_t) upper;
+    event.scope_id = (uint64_t) stride;
+    event.scope_type = schedule;
+    plugin_event(event, call_id, nullptr, funcname, filename, line, col);
+    trace->workshare(
+      call_id, schedule, lower, upper, stride, funcname, filename, line,
+      col
+    );
+  }
+
+  static void parallel_begin() {
+    trace->parallel_begin();
+  }
+
+  static void parallel_end() {
+    trace->parallel_end();
+  }
+
+  static void loop_trips(uint64_t scope_id, uint64_t trips) {
+    trace->loop_trips(scope_id, trips);
+  }
+
+  static void flops(uint64_t flops) {
+    trace->flops(flops);
+  }
+
+  static void save(const char *filepath) {
+    finish_plugins();
+    trace->save(filepath);
+  }
+
+  static void dump(const char *filepath) {
+    trace->dump(filepath);
+  }
 
-    strncpy(
-      args->buffer_name, buffer_name, CATS_TRACE_BUFFER_NAME_SIZE - 1
+  static void crash_dump(const char *filepath) {
+    trace->crash_dump(filepath);
+  }
+
+  static void checkpoint(const char *filepath) {
+    trace->checkpoint(filepath);
+  }
+};
+
+const CATS_Dispatch *Plugin_Dispatch::trace = nullptr;
+
+static const CATS_Dispatch g_plugin_dispatch = {
+  Plugin_Dispatch::reset,
+  Plugin_Dispatch::alloc,
+  Plugin_Dispatch::dealloc,
+  Plugin_Dispatch::access,
+  Plugin_Dispatch::scope_entry,
+  Plugin_Dispatch::scope_exit,
+  Plugin_Dispatch::io,
+  Plugin_Dispatch::atomic,
+  Plugin_Dispatch::sync,
+  Plugin_Dispatch::workshare,
+  Plugin_Dispatch::parallel_begin,
+  Plugin_Dispatch::parallel_end,
+  Plugin_Dispatch::loop_trips,
+  Plugin_Dispatch::flops,
+  Plugin_Dispatch::save,
+  Plugin_Dispatch::dump,
+  Plugin_Dispatch::crash_dump,
+  Plugin_Dispatch::checkpoint,
+};
+
+// Publishes every event to the introspection server before forwarding it to
+// the next table. Installed if CATS_INTROSPECT_SOCKET is set.
+struct Introspect_Dispatch {
+  static const CATS_Dispatch *next;
+
+  static void reset() {
+    next->reset();
+  }
+
+  static void alloc(
+    uint64_t call_id, const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_alloc(
+      call_id, buffer_name, address, size, funcname, filename, line, col
+    );
+    next->alloc(
+      call_id, buffer_name, address, size, funcname, filename, line, col
     );
-    args->buffer_name[CATS_TRACE_BUFFER_NAME_SIZE - 1] = '\0';
+  }
 
-    args->size = size;
-    args->buffer_id = (size_t) address;
-    this->record_event(
-      call_id, CATS_EVENT_TYPE_ALLOCATION, args, funcname, filename, line, col
+  static void dealloc(
+    uint64_t call_id, void *address,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_dealloc(call_id, address, funcname, filename, line, col);
+    next->dealloc(call_id, address, funcname, filename, line, col);
+  }
+
+  static void access(
+    uint64_t call_id, void *address, size_t size, bool is_write,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_access(call_id, funcname, filename, line, col);
+    next->access(
+      call_id, address, size, is_write, funcname, filename, line, col
     );
+  }
 
-    CATS_Alloc_Info alloc_info;
-    strncpy(
-      alloc_info.buffer_name, buffer_name, CATS_TRACE_BUFFER_NAME_SIZE - 1
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+    next->scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
     );
-    alloc_info.buffer_name[CATS_TRACE_BUFFER_NAME_SIZE - 1] = '\0';
-    alloc_info.buffer_id = (size_t) address;
-    alloc_info.size = size;
-    this->_allocations[address] = alloc_info;
   }
 
-  void instrument_dealloc(
-    uint64_t call_id,
-    void *address, const char *funcname, const char *filename,
-    uint32_t line, uint32_t col
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
   ) {
-    if (omp_in_parallel() && omp_get_thread_num() != 0) {
-      // If we are in a parallel region, only the master thread should exit
-      // the scope, so we skip this call.
-      return;
-    }
+    introspect_scope_exit(call_id, scope_id, funcname, filename, line, col);
+    next->scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
 
-    std::lock_guard<std::mutex> guard(this->_mutex);
+  static void io(
+    uint64_t call_id, uint8_t op, int32_t fd, void *stream, void *address,
+    int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_io(call_id, op, address, bytes, funcname, filename, line, col);
+    next->io(
+      call_id, op, fd, stream, address, bytes, funcname, filename, line, col
+    );
+  }
 
-    if (this->already_recorded(call_id)) {
-      // If this call has already been recorded, skip the allocation
-      return;
-    }
+  static void atomic(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_event(
+      call_id, CATS_EVENT_TYPE_ATOMIC, funcname, filename, line, col
+    );
+    next->atomic(
+      call_id, address, size, op, success, funcname, filename, line, col
+    );
+  }
 
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ALLOCATIONS
-    std::cout << "Deallocating at " << address
-              << " in " << funcname << std::endl;
-#endif
+  static void sync(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_event(
+      call_id, CATS_EVENT_TYPE_SYNC, funcname, filename, line, col
+    );
+    next->sync(
+      call_id, kind, phase, object, duration, funcname, filename, line,
+      col
+    );
+  }
 
-    auto it = this->_allocations.find(address);
-    if (it != this->_allocations.end()) {
-      Deallocation_Event_Args *args = (Deallocation_Event_Args *) malloc(
-        sizeof(Deallocation_Event_Args)
-      );
-      strncpy(
-        args->buffer_name, it->second.buffer_name,
-        CATS_TRACE_BUFFER_NAME_SIZE - 1
-      );
-      args->buffer_id = it->second.buffer_id;
-      args->buffer_name[CATS_TRACE_BUFFER_NAME_SIZE - 1] = '\0';
+  static void workshare(
+    uint64_t call_id, uint8_t schedule, int64_t lower, int64_t upper,
+    int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    introspect_event(
+      call_id, CATS_EVENT_TYPE_WORKSHARE, funcname, filename, line, col
+    );
+    next->workshare(
+      call_id, schedule, lower, upper, stride, funcname, filename, line,
+      col
+    );
+  }
 
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ALLOCATIONS
-      std::cout << "Deallocating " << it->second.buffer_name
-                << std::endl;
-#endif
+  static void parallel_begin() {
+    next->parallel_begin();
+  }
 
-      this->record_event(
-        call_id, CATS_EVENT_TYPE_DEALLOCATION, args, funcname, filename, line,
-        col
-      );
-      this->_allocations.erase(it);
-    }
+  static void parallel_end() {
+    next->parallel_end();
   }
 
-  void instrument_access(
-    uint64_t call_id,
-    void *address, bool is_write, const char *funcname,
-    const char *filename, uint32_t line, uint32_t col
-  ) {
-    if (omp_in_parallel() && omp_get_thread_num() != 0) {
-      // If we are in a parallel region, only the master thread should exit
-      // the scope, so we skip this call.
-      return;
-    }
+  static void loop_trips(uint64_t scope_id, uint64_t trips) {
+    next->loop_trips(scope_id, trips);
+  }
 
-    std::lock_guard<std::mutex> guard(this->_mutex);
+  static void flops(uint64_t flops) {
+    next->flops(flops);
+  }
 
-    if (this->already_recorded(call_id)) {
-      // If this call has already been recorded, skip the allocation
-      return;
-    }
+  static void save(const char *filepath) {
+    stop_introspection();
+    next->save(filepath);
+  }
 
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ACCESSES
-    std::cout << "Accessing " << (is_write ? "write" : "read")
-              << " at " << address << " in " << funcname
-              << std::endl;
-#endif
+  static void dump(const char *filepath) {
+    next->dump(filepath);
+  }
 
-    char *buffer_name = nullptr;
-    uint64_t buffer_id = 0;
-    auto it = this->_allocations.lower_bound(address);
-    if (it != this->_allocations.end() && it->first == address) {
-      buffer_name = it->second.buffer_name;
-      buffer_id = it->second.buffer_id;
-    } else if (it != this->_allocations.begin()) {
-      --it;
-      if (address <= ((char *) it->first) + it->second.size) {
-        buffer_name = it->second.buffer_name;
-        buffer_id = it->second.buffer_id;
-      }
-    }
+  static void crash_dump(const char *filepath) {
+    next->crash_dump(filepath);
+  }
 
-    const char *actual_buffer_name = buffer_name;
-    if (!buffer_name || !*buffer_name)
-      actual_buffer_name = "$UNKNOWN$";
+  static void checkpoint(const char *filepath) {
+    next->checkpoint(filepath);
+  }
+};
 
-    if (buffer_id != 0) {
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ACCESSES
-      std::cout << "Accessing " << actual_buffer_name << std::endl;
-#endif
+const CATS_Dispatch *Introspect_Dispatch::next = nullptr;
+
+static const CATS_Dispatch g_introspect_dispatch = {
+  Introspect_Dispatch::reset,
+  Introspect_Dispatch::alloc,
+  Introspect_Dispatch::dealloc,
+  Introspect_Dispatch::access,
+  Introspect_Dispatch::scope_entry,
+  Introspect_Dispatch::scope_exit,
+  Introspect_Dispatch::io,
+  Introspect_Dispatch::atomic,
+  Introspect_Dispatch::sync,
+  Introspect_Dispatch::workshare,
+  Introspect_Dispatch::parallel_begin,
+  Introspect_Dispatch::parallel_end,
+  Introspect_Dispatch::loop_trips,
+  Introspect_Dispatch::flops,
+  Introspect_Dispatch::save,
+  Introspect_Dispatch::dump,
+  Introspect_Dispatch::crash_dump,
+  Introspect_Dispatch::checkpoint,
+};
 
-      Access_Event_Args *args = (Access_Event_Args *) malloc(
-        sizeof(Access_Event_Args)
-      );
-      strncpy(
-        args->buffer_name, actual_buffer_name, CATS_TRACE_BUFFER_NAME_SIZE - 1
-      );
-      args->buffer_name[CATS_TRACE_BUFFER_NAME_SIZE - 1] = '\0';
-      args->buffer_id = buffer_id;
-      args->is_write = is_write;
+// ---------------------------------------------------------------------------
+// Profile layers
+//
+// The profiles are installed as layers in front of the trace, each only if
+// it is enabled, so that disabled profiles cost nothing on the event path. A
+// layer table starts as a copy of the next table and replaces the hooks its
+// profile needs; the other hooks skip it.
+// ---------------------------------------------------------------------------
+
+template <class Layer>
+static const CATS_Dispatch *install_layer(const CATS_Dispatch *next) {
+  static CATS_Dispatch table;
+  Layer::next = next;
+  table = *next;
+  Layer::install(table);
+  return &table;
+}
 
-      this->record_event(
-        call_id, CATS_EVENT_TYPE_ACCESS, args, funcname, filename, line, col
-      );
-    }
+// Live memory, see cats_memory.hpp. Installed outside of the allocation-site
+// filter, which drops small buffers that still count towards the total.
+struct Memory_Layer {
+  static const CATS_Dispatch *next;
+
+  static void alloc(
+    uint64_t call_id, const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    memory_alloc(call_id, buffer_name, address, size);
+    next->alloc(
+      call_id, buffer_name, address, size, funcname, filename, line, col
+    );
   }
 
-  void instrument_read(
-    uint64_t call_id,
-    void *address, const char *funcname, const char *filename,
-    uint32_t line, uint32_t col
+  static void dealloc(
+    uint64_t call_id, void *address,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    memory_dealloc(address);
+    next->dealloc(call_id, address, funcname, filename, line, col);
+  }
+
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
   ) {
-    this->instrument_access(
-      call_id, address, false, funcname, filename, line, col
+    memory_scope_entry(scope_id, scope_type, funcname, line);
+    next->scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
     );
   }
 
-  void instrument_write(
-    uint64_t call_id,
-    void *address, const char *funcname, const char *filename,
-    uint32_t line, uint32_t col
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
   ) {
-    this->instrument_access(
-      call_id, address, true, funcname, filename, line, col
+    next->scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
     );
+    memory_scope_exit(scope_id);
+  }
+
+  static void install(CATS_Dispatch &table) {
+    table.alloc = alloc;
+    table.dealloc = dealloc;
+    table.scope_entry = scope_entry;
+    table.scope_exit = scope_exit;
   }
+};
 
-  void instrument_scope_entry(
-    uint64_t call_id,
-    uint64_t scope_id, uint8_t type, const char *funcname,
-    const char *filename, uint32_t line, uint32_t col
+const CATS_Dispatch *Memory_Layer::next = nullptr;
+
+// Allocation sites, see cats_alloc_sites.hpp. Buffers below the minimum
+// size are counted and not handed on.
+struct Alloc_Sites_Layer {
+  static const CATS_Dispatch *next;
+
+  static void alloc(
+    uint64_t call_id, const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
   ) {
-    if (omp_in_parallel() && omp_get_thread_num() != 0) {
-      // If we are in a parallel region, only the master thread should exit
-      // the scope, so we skip this call.
+    if (!alloc_sites_alloc(call_id, buffer_name, address, size, funcname,
+                           filename, line))
       return;
-    }
+    next->alloc(
+      call_id, buffer_name, address, size, funcname, filename, line, col
+    );
+  }
 
-    std::lock_guard<std::mutex> guard(this->_mutex);
+  static void dealloc(
+    uint64_t call_id, void *address,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (!alloc_sites_dealloc(address))
+      return;
+    next->dealloc(call_id, address, funcname, filename, line, col);
+  }
 
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_SCOPES
-    std::cout << "Entering scope " << scope_id
-              << " of type " << (int) type
-              << " in " << funcname << std::endl;
-#endif
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    alloc_sites_scope_entry(scope_id, scope_type);
+    next->scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
 
-    // The scope must be entered regardless of whether it has been
-    // recorded before, so we push it onto the stack
-    this->_scope_stack.push_back(scope_id);
-    this->_scope_ids.insert(scope_id);
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    next->scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+    alloc_sites_scope_exit(scope_id);
+  }
 
-#if CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
-    this->stack_id = 0;
-    for (auto &id : this->_scope_stack)
-      this->stack_id += id;
-#endif
+  static void install(CATS_Dispatch &table) {
+    table.alloc = alloc;
+    table.dealloc = dealloc;
+    table.scope_entry = scope_entry;
+    table.scope_exit = scope_exit;
+  }
+};
 
-    if (this->already_recorded(call_id)) {
-      // If this call has already been recorded, skip the allocation
-      return;
-    }
+const CATS_Dispatch *Alloc_Sites_Layer::next = nullptr;
+
+// Contention of atomics and synchronization calls, see cats_sync.hpp.
+struct Sync_Layer {
+  static const CATS_Dispatch *next;
 
-    Scope_Entry_Event_Args *args = (Scope_Entry_Event_Args *) malloc(
-      sizeof(Scope_Entry_Event_Args)
+  static void atomic(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    atomic_executed(call_id, op, success, funcname, filename, line);
+    next->atomic(
+      call_id, address, size, op, success, funcname, filename, line, col
     );
-    args->scope_id = scope_id;
-    args->type = type;
-    this->record_event(
-      call_id, CATS_EVENT_TYPE_SCOPE_ENTRY, args, funcname, filename, line, col
+  }
+
+  static void sync(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    sync_executed(call_id, kind, phase, duration, funcname, filename, line);
+    next->sync(
+      call_id, kind, phase, object, duration, funcname, filename, line,
+      col
     );
   }
 
-  void instrument_scope_exit(
-    uint64_t call_id,
-    uint64_t scope_id, uint8_t scope_type, const char *funcname,
-    const char *filename, uint32_t line, uint32_t col
+  static void install(CATS_Dispatch &table) {
+    table.atomic = atomic;
+    table.sync = sync;
+  }
+};
+
+const CATS_Dispatch *Sync_Layer::next = nullptr;
+
+// Load imbalance of parallel regions, see cats_parallel.hpp.
+struct Parallel_Layer {
+  static const CATS_Dispatch *next;
+
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
   ) {
-    if (omp_in_parallel() && omp_get_thread_num() != 0) {
-      // If we are in a parallel region, only the master thread should exit
-      // the scope, so we skip this call.
-      return;
-    }
+    if (scope_type == CATS_SCOPE_TYPE_PARALLEL)
+      parallel_region_begin(scope_id, funcname, filename, line);
+    next->scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
 
-    std::lock_guard<std::mutex> guard(this->_mutex);
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    next->scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+    if (scope_type == CATS_SCOPE_TYPE_PARALLEL)
+      parallel_region_end(scope_id);
+  }
 
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_SCOPES
-    std::cout << "Exiting scope " << scope_id
-              << " in " << funcname << std::endl;
-#endif
+  static void sync(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (kind == CATS_SYNC_BARRIER)
+      parallel_barrier_wait(duration);
+    next->sync(
+      call_id, kind, phase, object, duration, funcname, filename, line,
+      col
+    );
+  }
 
-    if (this->_scope_ids.erase(scope_id) == 0) {
-#if CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
-        std::cout << "Warning: Scope " << scope_id;
-        std::cout << " not found." << std::endl;
-#endif
-        return;
-    }
+  static void parallel_begin() {
+    parallel_thread_begin();
+    next->parallel_begin();
+  }
 
-    bool recorded = false;
-    if (this->already_recorded(call_id)) {
-      // If this call has already been recorded, skip the allocation
-      recorded = true;
-    }
+  static void parallel_end() {
+    parallel_thread_end();
+    next->parallel_end();
+  }
 
-    if (!recorded) {
-      Scope_Exit_Event_Args *args = (Scope_Exit_Event_Args *) malloc(
-        sizeof(Scope_Exit_Event_Args)
-      );
-      args->scope_id = scope_id;
-      this->record_event(
-        call_id, CATS_EVENT_TYPE_SCOPE_EXIT, args, funcname, filename, line, col
+  static void install(CATS_Dispatch &table) {
+    table.scope_entry = scope_entry;
+    table.scope_exit = scope_exit;
+    table.sync = sync;
+    table.parallel_begin = parallel_begin;
+    table.parallel_end = parallel_end;
+  }
+};
+
+const CATS_Dispatch *Parallel_Layer::next = nullptr;
+
+// Floating-point operations and bytes of function and loop scopes, see
+// cats_roofline.hpp.
+struct Roofline_Layer {
+  static const CATS_Dispatch *next;
+
+  static bool profiled(uint8_t scope_type) {
+    return scope_type == CATS_SCOPE_TYPE_FUNCTION ||
+           scope_type == CATS_SCOPE_TYPE_LOOP;
+  }
+
+  static void access(
+    uint64_t call_id, void *address, size_t size, bool is_write,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    roofline_bytes(size);
+    next->access(
+      call_id, address, size, is_write, funcname, filename, line, col
+    );
+  }
+
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (profiled(scope_type))
+      roofline_scope_entry(
+        call_id, scope_id, scope_type, funcname, filename, line
       );
-    }
+    next->scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
 
-    while (!this->_scope_stack.empty() &&
-           this->_scope_stack.back() != scope_id) {
-      auto top = this->_scope_stack.back();
-
-      if (!recorded) {
-        Scope_Exit_Event_Args *inferred = (Scope_Exit_Event_Args *) malloc(
-          sizeof(Scope_Exit_Event_Args)
-        );
-        inferred->scope_id = top;
-        this->record_event(
-          call_id, CATS_EVENT_TYPE_SCOPE_EXIT, inferred, funcname, filename,
-          line, col
-        );
-      }
-
-#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_SCOPES
-    std::cout << " -> Exiting scope " << top
-              << " as a consequence" << std::endl;
-#endif
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    next->scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+    if (profiled(scope_type))
+      roofline_scope_exit(scope_id);
+  }
 
-      this->_scope_stack.pop_back();
-      if (this->_scope_ids.erase(top) == 0) {
-#if CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
-        std::cout << "Warning: Scope " << scope_id;
-        std::cout << " not found." << std::endl;
-#endif
-      }
-#if CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
-      this->stack_id = 0;
-      for (auto &id : this->_scope_stack)
-        this->stack_id += id;
-#endif
+  static void atomic(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    roofline_bytes(size);
+    next->atomic(
+      call_id, address, size, op, success, funcname, filename, line, col
+    );
+  }
+
+  static void loop_trips(uint64_t scope_id, uint64_t trips) {
+    roofline_loop_trips(scope_id, trips);
+    next->loop_trips(scope_id, trips);
+  }
+
+  static void flops(uint64_t flops) {
+    roofline_flops(flops);
+    next->flops(flops);
+  }
+
+  static void install(CATS_Dispatch &table) {
+    table.access = access;
+    table.scope_entry = scope_entry;
+    table.scope_exit = scope_exit;
+    table.atomic = atomic;
+    table.loop_trips = loop_trips;
+    table.flops = flops;
+  }
+};
+
+const CATS_Dispatch *Roofline_Layer::next = nullptr;
+
+// The profiles are written with the in-process trace, the collector of the
+// shared-memory transport never receives them. The filter is applied by the
+// in-process trace too.
+static void warn_shm_profiles() {
+  const struct {
+    const char *variable;
+    bool enabled;
+  } profiles[] = {
+    {"CATS_PARALLEL_PROFILE", parallel_profile_enabled()},
+    {"CATS_SYNC_PROFILE", sync_profile_enabled()},
+    {"CATS_ROOFLINE", roofline_enabled()},
+    {"CATS_ALLOC_SITES", alloc_sites_enabled()},
+    {"CATS_MEMORY_PROFILE", memory_profile_enabled()},
+    {"CATS_HEATMAP", heatmap_enabled()},
+    {"CATS_FILTER", config::get_string("CATS_FILTER", nullptr) != nullptr},
+  };
+  for (const auto &profile : profiles) {
+    if (profile.enabled) {
+      std::cerr << "CATS: " << profile.variable << " is ignored with "
+                << "CATS_TRANSPORT=shm" << std::endl;
     }
+  }
+}
 
-    if (this->_scope_stack.empty() || this->_scope_stack.back() != scope_id) {
-#if CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
-      if (scope_type != CATS_SCOPE_TYPE_PARALLEL) {
-        // We suppress the warning for parallel scopes since there can be
-        // multiple exits from parallel regions.
-        // TODO: This is a workaround, we should handle parallel scopes
-        // differently and correctly insert only one exit.
-        std::cout << "Warning: Exiting scope " << scope_id << " not found. ";
-        std::cout << "This is likely an error leading to an incorrect trace. ";
-        std::cout << "(Scope type:" << (int) scope_type << ")";
-        std::cout << std::endl;
-      }
-#endif
+static const CATS_Dispatch *select_dispatch() {
+  Runtime_Mode mode = read_mode();
+  const CATS_Dispatch *selected = nullptr;
+  if (mode.transport == TRANSPORT_SHM) {
+    if (Shm_Transport::open()) {
+      selected = Dispatch_For<Shm_Transport>::create();
     } else {
-      this->_scope_stack.pop_back();
-#if CATS_STACK_IDENTIFIER_STRATEGY == CATS_STACK_IDENTIFIER_STRATEGY_VERY_FAST
-      this->stack_id = 0;
-      for (auto &id : this->_scope_stack)
-        this->stack_id += id;
-#endif
+      std::cerr << "CATS: Falling back to the in-process trace" << std::endl;
     }
   }
+  bool in_process = !selected;
+  if (in_process) {
+    selected = select_trace(mode);
+    if (mode.storage == STORAGE_RING)
+      install_flight_recorder(selected->dump, selected->crash_dump);
+  } else {
+    warn_shm_profiles();
+  }
+  if (in_process && parallel_profile_enabled())
+    selected = install_layer<Parallel_Layer>(selected);
+  if (in_process && sync_profile_enabled())
+    selected = install_layer<Sync_Layer>(selected);
+  if (in_process && roofline_enabled())
+    selected = install_layer<Roofline_Layer>(selected);
+  if (load_plugins()) {
+    Plugin_Dispatch::trace = selected;
+    selected = &g_plugin_dispatch;
+  }
+  if (start_introspection()) {
+    Introspect_Dispatch::next = selected;
+    selected = &g_introspect_dispatch;
+  }
+  // Filtered allocations are hidden from the plugins and the introspection
+  // server, but not from the memory profile.
+  if (in_process && alloc_sites_enabled())
+    selected = install_layer<Alloc_Sites_Layer>(selected);
+  if (in_process && memory_profile_enabled())
+    selected = install_layer<Memory_Layer>(selected);
+  return selected;
+}
 
-  void save(const char *filepath) {
-    std::lock_guard<std::mutex> guard(this->_mutex);
+static const CATS_Dispatch *dispatch();
 
-    std::stringstream ss;
-    ss << "cats_trace.cats";
+// Until a mode has been selected the hooks point at this table, which
+// performs the selection and forwards the first call.
+struct Bootstrap_Dispatch {
+  static void reset() {
+    dispatch()->reset();
+  }
 
-    {
-      std::ofstream ofs(ss.str(), std::ios::binary);
+  static void alloc(
+    uint64_t call_id, const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->alloc(
+      call_id, buffer_name, address, size, funcname, filename, line, col
+    );
+  }
 
-      ofs << "{" << std::endl;
-      ofs << "  \"events\": [" << std::endl;
-      auto it = this->_events.begin();
-      while (it != this->_events.end()) {
-        CATS_Event *event = *it;
-        if (it != this->_events.begin()) {
-          ofs << "," << std::endl;
-        }
-        ++it;
-        ofs << "    {";
-#if CATS_RUNTIME_DEBUG
-        ofs << "\"call_id\": " << event->call_id << ", ";
-#endif
-        ofs << "\"funcname\": \"";
-        ofs << event->debug_info.funcname << "\", ";
-        ofs << "\"filename\": \"";
-        ofs << event->debug_info.filename << "\", ";
-        ofs << "\"line\": " << event->debug_info.line << ", ";
-        ofs << "\"col\": " << event->debug_info.col;
-        switch (event->event_type) {
-          case CATS_EVENT_TYPE_ALLOCATION: {
-            Allocation_Event_Args *args = (Allocation_Event_Args *) event->args;
-            ofs << ", \"type\": \"allocation\", ";
-            ofs << "\"buffer_name\": \"";
-            ofs << args->buffer_name << "\", ";
-            ofs << "\"buffer_id\": " << args->buffer_id << ", ";
-            ofs << "\"size\": " << args->size;
-            break;
-          }
-          case CATS_EVENT_TYPE_DEALLOCATION: {
-            Deallocation_Event_Args *args =
-              (Deallocation_Event_Args *) event->args;
-            ofs << ", \"type\": \"deallocation\", ";
-            ofs << "\"buffer_name\": \"";
-            ofs << args->buffer_name << "\", ";
-            ofs << "\"buffer_id\": " << args->buffer_id;
-            break;
-          }
-          case CATS_EVENT_TYPE_ACCESS: {
-            Access_Event_Args *args = (Access_Event_Args *) event->args;
-            ofs << ", \"type\": \"access\", ";
-            ofs << "\"mode\": ";
-            ofs << (args->is_write ? "\"w\"" : "\"r\"") << ", ";
-            ofs << "\"buffer_name\": \"";
-            ofs << args->buffer_name << "\", ";
-            ofs << "\"buffer_id\": " << args->buffer_id;
-            break;
-          }
-          case CATS_EVENT_TYPE_SCOPE_ENTRY: {
-            Scope_Entry_Event_Args*args =
-              (Scope_Entry_Event_Args *) event->args;
-            ofs << ", \"type\": \"scope_entry\", ";
-            switch (args->type) {
-              case CATS_SCOPE_TYPE_FUNCTION:
-                ofs << "\"scope_type\": \"func\", ";
-                break;
-              case CATS_SCOPE_TYPE_LOOP:
-                ofs << "\"scope_type\": \"loop\", ";
-                break;
-              case CATS_SCOPE_TYPE_CONDITIONAL:
-                ofs << "\"scope_type\": \"cond\", ";
-                break;
-              case CATS_SCOPE_TYPE_PARALLEL:
-                ofs << "\"scope_type\": \"para\", ";
-                break;
-              case CATS_SCOPE_TYPE_UNSTRUCTURED:
-                ofs << "\"scope_type\": \"unst\", ";
-                break;
-              default:
-                ofs << "\"scope_type\": \"n/a\", ";
-            }
-            ofs << "\"id\": " << args->scope_id;
-            break;
-          }
-          case CATS_EVENT_TYPE_SCOPE_EXIT: {
-            Scope_Exit_Event_Args *args = (Scope_Exit_Event_Args *) event->args;
-            ofs << ", \"type\": \"scope_exit\", ";
-            ofs << "\"id\": " << args->scope_id;
-            break;
-          }
-        }
-        ofs << "}";
-      }
-
-      ofs << std::endl << "  ]" << std::endl;
-      ofs << "}" << std::endl;
-    }
+  static void dealloc(
+    uint64_t call_id, void *address,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->dealloc(call_id, address, funcname, filename, line, col);
+  }
+
+  static void access(
+    uint64_t call_id, void *address, size_t size, bool is_write,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->access(
+      call_id, address, size, is_write, funcname, filename, line, col
+    );
+  }
+
+  static void scope_entry(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->scope_entry(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
   }
 
+  static void scope_exit(
+    uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->scope_exit(
+      call_id, scope_id, scope_type, funcname, filename, line, col
+    );
+  }
+
+  static void io(
+    uint64_t call_id, uint8_t op, int32_t fd, void *stream, void *address,
+    int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->io(
+      call_id, op, fd, stream, address, bytes, funcname, filename, line, col
+    );
+  }
+
+  static void atomic(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->atomic(
+      call_id, address, size, op, success, funcname, filename, line, col
+    );
+  }
+
+  static void sync(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->sync(
+      call_id, kind, phase, object, duration, funcname, filename, line,
+      col
+    );
+  }
+
+  static void workshare(
+    uint64_t call_id, uint8_t schedule, int64_t lower, int64_t upper,
+    int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    dispatch()->workshare(
+      call_id, schedule, lower, upper, stride, funcname, filename, line,
+      col
+    );
+  }
+
+  static void parallel_begin() {
+    dispatch()->parallel_begin();
+  }
+
+  static void parallel_end() {
+    dispatch()->parallel_end();
+  }
+
+  static void loop_trips(uint64_t scope_id, uint64_t trips) {
+    dispatch()->loop_trips(scope_id, trips);
+  }
+
+  static void flops(uint64_t flops) {
+    dispatch()->flops(flops);
+  }
+
+  static void save(const char *filepath) {
+    dispatch()->save(filepath);
+  }
+
+  static void dump(const char *filepath) {
+    dispatch()->dump(filepath);
+  }
+
+  static void crash_dump(const char *filepath) {
+    dispatch()->crash_dump(filepath);
+  }
+
+  static void checkpoint(const char *filepath) {
+    dispatch()->checkpoint(filepath);
+  }
 };
 
-} // namespace cats
+static const CATS_Dispatch g_bootstrap_dispatch = {
+  Bootstrap_Dispatch::reset,
+  Bootstrap_Dispatch::alloc,
+  Bootstrap_Dispatch::dealloc,
+  Bootstrap_Dispatch::access,
+  Bootstrap_Dispatch::scope_entry,
+  Bootstrap_Dispatch::scope_exit,
+  Bootstrap_Dispatch::io,
+  Bootstrap_Dispatch::atomic,
+  Bootstrap_Dispatch::sync,
+  Bootstrap_Dispatch::workshare,
+  Bootstrap_Dispatch::parallel_begin,
+  Bootstrap_Dispatch::parallel_end,
+  Bootstrap_Dispatch::loop_trips,
+  Bootstrap_Dispatch::flops,
+  Bootstrap_Dispatch::save,
+  Bootstrap_Dispatch::dump,
+  Bootstrap_Dispatch::crash_dump,
+  Bootstrap_Dispatch::checkpoint,
+};
 
-#undef CATS_TRACE_BUFFER_SIZE
+static std::atomic<const CATS_Dispatch *> g_dispatch(&g_bootstrap_dispatch);
 
-extern "C" {
+static const CATS_Dispatch *dispatch() {
+  static std::once_flag once;
+  static const CATS_Dispatch *selected = nullptr;
+  std::call_once(once, []() {
+    selected = select_dispatch();
+    g_dispatch.store(selected, std::memory_order_release);
+  });
+  return selected;
+}
 
-// Global CATS_Trace instance
-static cats::CATS_Trace g_cats_trace;
+// Select the mode when the library is loaded so that the first hook does not
+// pay for it.
+[[maybe_unused]] static const bool g_dispatch_selected = (dispatch(), true);
+
+static inline const CATS_Dispatch *hooks() {
+  return g_dispatch.load(std::memory_order_acquire);
+}
+
+} // namespace cats
+
+extern "C" {
 
 void cats_trace_reset() {
-  g_cats_trace.reset();
+  cats::hooks()->reset();
 }
 
 void cats_trace_instrument_alloc(
   uint64_t call_id, const char *buffer_name, void *address, size_t size,
   const char *funcname, const char *filename, uint32_t line, uint32_t col
 ) {
-  g_cats_trace.instrument_alloc(
+  cats::hooks()->alloc(
     call_id, buffer_name, address, size, funcname, filename, line, col
   );
 }
@@ -694,7 +1274,7 @@ void cats_trace_instrument_dealloc(
   uint64_t call_id, void *address,
   const char *funcname, const char *filename, uint32_t line, uint32_t col
 ) {
-  g_cats_trace.instrument_dealloc(
+  cats::hooks()->dealloc(
     call_id, address, funcname, filename, line, col
   );
 }
@@ -703,8 +1283,17 @@ void cats_trace_instrument_access(
   uint64_t call_id, void *address, bool is_write,
   const char *funcname, const char *filename, uint32_t line, uint32_t col
 ) {
-  g_cats_trace.instrument_access(
-    call_id, address, is_write, funcname, filename, line, col
+  cats::hooks()->access(
+    call_id, address, 0, is_write, funcname, filename, line, col
+  );
+}
+
+void cats_trace_instrument_access_sized(
+  uint64_t call_id, void *address, size_t size, bool is_write,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  cats::hooks()->access(
+    call_id, address, size, is_write, funcname, filename, line, col
   );
 }
 
@@ -712,8 +1301,8 @@ void cats_trace_instrument_read(
   uint64_t call_id, void *address,
   const char *funcname, const char *filename, uint32_t line, uint32_t col
 ) {
-  g_cats_trace.instrument_read(
-    call_id, address, funcname, filename, line, col
+  cats::hooks()->access(
+    call_id, address, 0, false, funcname, filename, line, col
   );
 }
 
@@ -721,8 +1310,8 @@ void cats_trace_instrument_write(
   uint64_t call_id, void *address,
   const char *funcname, const char *filename, uint32_t line, uint32_t col
 ) {
-  g_cats_trace.instrument_write(
-    call_id, address, funcname, filename, line, col
+  cats::hooks()->access(
+    call_id, address, 0, true, funcname, filename, line, col
   );
 }
 
@@ -730,7 +1319,7 @@ void cats_trace_instrument_scope_entry(
   uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
   const char *funcname, const char *filename, uint32_t line, uint32_t col
 ) {
-  g_cats_trace.instrument_scope_entry(
+  cats::hooks()->scope_entry(
     call_id, scope_id, scope_type,
     funcname, filename, line, col
   );
@@ -740,13 +1329,95 @@ void cats_trace_instrument_scope_exit(
   uint64_t call_id, uint64_t scope_id, uint8_t scope_type,
   const char *funcname, const char *filename, uint32_t line, uint32_t col
 ) {
-  g_cats_trace.instrument_scope_exit(
+  cats::hooks()->scope_exit(
     call_id, scope_id, scope_type, funcname, filename, line, col
   );
 }
 
+void cats_trace_instrument_io(
+  uint64_t call_id, uint8_t op, int32_t fd, void *stream, void *address,
+  int64_t bytes,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  if (op == CATS_IO_OPEN || op == CATS_IO_CLOSE) {
+    if (stream && fd < 0)
+      fd = fileno((FILE *) stream);
+    cats::forget_fd_path(fd);
+    return;
+  }
+  cats::hooks()->io(
+    call_id, op, fd, stream, address, bytes, funcname, filename, line, col
+  );
+}
+
+void cats_trace_instrument_atomic(
+  uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  cats::hooks()->atomic(
+    call_id, address, size, op, success, funcname, filename, line, col
+  );
+}
+
+void cats_trace_instrument_sync_begin(uint64_t call_id) {
+  (void) call_id;
+  cats::sync_begin();
+}
+
+void cats_trace_instrument_sync_end(
+  uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  uint64_t duration = cats::sync_end(kind, phase, object);
+  cats::hooks()->sync(
+    call_id, kind, phase, object, duration, funcname, filename, line, col
+  );
+}
+
+void cats_trace_instrument_parallel_begin() {
+  cats::hooks()->parallel_begin();
+}
+
+void cats_trace_instrument_parallel_end() {
+  cats::hooks()->parallel_end();
+}
+
+void cats_trace_instrument_workshare(
+  uint64_t call_id, uint8_t schedule, int64_t lower, int64_t upper,
+  int64_t stride,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  cats::hooks()->workshare(
+    call_id, schedule, lower, upper, stride, funcname, filename, line, col
+  );
+}
+
+void cats_trace_instrument_loop_trips(uint64_t scope_id, uint64_t trips) {
+  cats::hooks()->loop_trips(scope_id, trips);
+}
+
+void cats_trace_instrument_flops(uint64_t flops) {
+  cats::hooks()->flops(flops);
+}
+
+void cats_trace_register_sites(const cats_site_info *sites, size_t count) {
+  cats::register_sites(sites, count);
+}
+
+void cats_trace_register_site_tables(const cats_site_table *tables) {
+  cats::register_site_tables(tables);
+}
+
 void cats_trace_save(const char *filepath) {
-  g_cats_trace.save(filepath);
+  cats::hooks()->save(filepath);
+}
+
+void cats_trace_dump(const char *filepath) {
+  cats::hooks()->dump(filepath);
+}
+
+void cats_trace_checkpoint(const char *filepath) {
+  cats::hooks()->checkpoint(filepath);
 }
 
 } // extern "C"
@@ -25,6 +25,10 @@ extern "C" {
 #define CATS_EVENT_TYPE_ACCESS          2
 #define CATS_EVENT_TYPE_SCOPE_ENTRY     3
 #define CATS_EVENT_TYPE_SCOPE_EXIT      4
+#define CATS_EVENT_TYPE_IO              5
+#define CATS_EVENT_TYPE_ATOMIC          6
+#define CATS_EVENT_TYPE_SYNC            7
+#define CATS_EVENT_TYPE_WORKSHARE       8
 
 #define CATS_SCOPE_TYPE_FUNCTION        0
 #define CATS_SCOPE_TYPE_LOOP            1
@@ -32,6 +36,92 @@ extern "C" {
 #define CATS_SCOPE_TYPE_PARALLEL        3
 #define CATS_SCOPE_TYPE_UNSTRUCTURED    4
 
+#define CATS_IO_READ                    0
+#define CATS_IO_WRITE                   1
+#define CATS_IO_PREAD                   2
+#define CATS_IO_PWRITE                  3
+#define CATS_IO_FREAD                   4
+#define CATS_IO_FWRITE                  5
+#define CATS_IO_MMAP                    6
+#define CATS_IO_MUNMAP                  7
+#define CATS_IO_OPEN                    8
+#define CATS_IO_CLOSE                   9
+
+#define CATS_ATOMIC_CMPXCHG             0
+#define CATS_ATOMIC_XCHG                1
+#define CATS_ATOMIC_ADD                 2
+#define CATS_ATOMIC_SUB                 3
+#define CATS_ATOMIC_AND                 4
+#define CATS_ATOMIC_OR                  5
+#define CATS_ATOMIC_XOR                 6
+#define CATS_ATOMIC_MIN                 7
+#define CATS_ATOMIC_MAX                 8
+#define CATS_ATOMIC_OTHER               9
+
+#define CATS_SYNC_CRITICAL              0
+#define CATS_SYNC_BARRIER               1
+#define CATS_SYNC_REDUCE                2
+#define CATS_SYNC_MUTEX                 3
+
+#define CATS_SYNC_ACQUIRE               0
+#define CATS_SYNC_RELEASE               1
+
+#define CATS_WORKSHARE_STATIC           0
+#define CATS_WORKSHARE_DYNAMIC          1
+
+// Innermost loop walks the last, contiguous dimension, only outer strided
+// dimensions, or none
+#define CATS_TRAVERSAL_UNKNOWN          0
+#define CATS_TRAVERSAL_ROW              1
+#define CATS_TRAVERSAL_COLUMN           2
+#define CATS_TRAVERSAL_INVARIANT        3
+
+
+// Static instruction mix of a scope: the instructions of a function outside
+// of its loops, or of one iteration of a loop outside of its inner loops.
+// Vector operations are also counted in their category.
+typedef struct cats_instruction_mix {
+  uint32_t loads;
+  uint32_t stores;
+  uint32_t fp_ops;
+  uint32_t int_ops;
+  uint32_t branches;
+  uint32_t calls;
+  uint32_t vector_ops;
+} cats_instruction_mix;
+
+// Static information about an instrumented site, registered once per module
+// by a constructor that the passes emit.
+typedef struct cats_site_info {
+  uint64_t call_id;
+  // Struct field accessed through a GEP with constant field indices, NULL
+  // for other sites
+  const char *struct_name;
+  uint32_t struct_size;
+  uint32_t field_index;
+  uint32_t field_offset;
+  uint32_t field_size;
+  // Multi-dimensional array access recovered by delinearization, NULL
+  // otherwise: the dimension sizes in elements ("[*][%n]"), the subscripts
+  // in terms of the induction variables Ld of the loops at depth d
+  // ("[L1][L3]") and how the innermost loop walks the array
+  const char *shape;
+  const char *subscripts;
+  uint32_t element_size;
+  uint32_t traversal;           // CATS_TRAVERSAL_*
+  // Instruction mix of the scope entered by a scope entry site, NULL for
+  // other sites
+  const cats_instruction_mix *mix;
+} cats_site_info;
+
+// Site tables of a module, chained by the passes so that the module
+// registers all of them with one call.
+typedef struct cats_site_table {
+  const struct cats_site_table *next;
+  const cats_site_info *sites;
+  uint64_t count;
+} cats_site_table;
+
 
 CATS_RUNTIME_API void cats_trace_reset();
 
@@ -50,6 +140,11 @@ CATS_RUNTIME_API void cats_trace_instrument_access(
     const char *funcname, const char *filename, uint32_t line, uint32_t col
 );
 
+CATS_RUNTIME_API void cats_trace_instrument_access_sized(
+    uint64_t call_id, void *address, size_t size, bool is_write,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+);
+
 CATS_RUNTIME_API void cats_trace_instrument_read(
     uint64_t call_id, void *address,
     const char *funcname, const char *filename, uint32_t line, uint32_t col
@@ -70,8 +165,90 @@ CATS_RUNTIME_API void cats_trace_instrument_scope_exit(
     const char *funcname, const char *filename, uint32_t line, uint32_t col
 );
 
+// File I/O through `fd` or, for fread/fwrite, the FILE pointer `stream`.
+// `address` is the user buffer or the mapped region and `bytes` the number
+// of bytes transferred or mapped. Mapped regions are traced like
+// allocations named after the file. Opening and closing a descriptor
+// (CATS_IO_OPEN and CATS_IO_CLOSE, with the new or closing `fd` or
+// `stream`) is not traced, it only refreshes the cached path of `fd`.
+CATS_RUNTIME_API void cats_trace_instrument_io(
+    uint64_t call_id, uint8_t op, int32_t fd, void *stream, void *address,
+    int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+);
+
+// Atomic read-modify-write or compare-exchange. `success` is false for a
+// compare-exchange that failed, which is counted as contention.
+CATS_RUNTIME_API void cats_trace_instrument_atomic(
+    uint64_t call_id, void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+);
+
+// Brackets a blocking synchronization call (lock, barrier, reduction) on
+// the calling thread. The time in between is reported as wait time, the
+// time from acquiring to releasing `object` as hold time. Release calls
+// only call cats_trace_instrument_sync_end.
+CATS_RUNTIME_API void cats_trace_instrument_sync_begin(uint64_t call_id);
+
+CATS_RUNTIME_API void cats_trace_instrument_sync_end(
+    uint64_t call_id, uint8_t kind, uint8_t phase, void *object,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+);
+
+// Entry and exit of the outlined region of an OpenMP parallel scope on every
+// team thread. The time between them, less the barrier waits reported with
+// cats_trace_instrument_sync_end, is the thread's busy time in the
+// load-imbalance profile of the scope.
+CATS_RUNTIME_API void cats_trace_instrument_parallel_begin();
+
+CATS_RUNTIME_API void cats_trace_instrument_parallel_end();
+
+// Iterations [lower, upper) of a worksharing loop assigned to the calling
+// thread by the OpenMP runtime. For static schedules this is the first
+// chunk and `stride` the distance to the thread's next chunk (0 if there is
+// only one). Empty ranges are ignored. Recorded from every thread and never
+// deduplicated.
+CATS_RUNTIME_API void cats_trace_instrument_workshare(
+    uint64_t call_id, uint8_t schedule, int64_t lower, int64_t upper,
+    int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+);
+
+// Number of iterations of the loop scope just entered, if the pass could
+// compute it at the loop entry. Weights the instruction mix of the loop.
+CATS_RUNTIME_API void cats_trace_instrument_loop_trips(
+    uint64_t scope_id, uint64_t trips
+);
+
+// Floating-point operations of an instrumented basic block, each vector
+// lane counting as one operation and a fused multiply-add as two. Credited
+// to the function and loop scopes open on the calling thread.
+CATS_RUNTIME_API void cats_trace_instrument_flops(uint64_t flops);
+
+// Registers the static information of `count` sites. The array must stay
+// valid while the module is loaded.
+CATS_RUNTIME_API void cats_trace_register_sites(
+    const cats_site_info *sites, size_t count
+);
+
+// Registers the sites of all tables in the chain starting at `tables`. The
+// tables must stay valid while the module is loaded.
+CATS_RUNTIME_API void cats_trace_register_site_tables(
+    const cats_site_table *tables
+);
+
 CATS_RUNTIME_API void cats_trace_save(const char *filepath);
 
+// Writes the events recorded so far to `filepath` while tracing continues.
+// With CATS_STORAGE=ring this dumps the flight recorder and is safe to call
+// at any time.
+CATS_RUNTIME_API void cats_trace_dump(const char *filepath);
+
+// Writes all events recorded since the previous checkpoint to a new segment
+// file and releases them; tracing continues. Segments are chained in the
+// index file named by CATS_SEGMENT_INDEX (default cats_trace.segments).
+CATS_RUNTIME_API void cats_trace_checkpoint(const char *filepath);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
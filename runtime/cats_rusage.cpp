@@ -0,0 +1,94 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_rusage.hpp"
+#include "cats_config.hpp"
+#include "cats_runtime.h"
+
+#include <chrono>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+namespace cats {
+
+struct Rusage_Config {
+  bool enabled = false;
+  uint64_t interval_ns = 0;
+  // Kept open, /proc files are re-read from offset 0 by pread
+  int statm_fd = -1;
+  uint64_t page_kb = 4;
+};
+
+static const Rusage_Config &rusage_config() {
+  static const Rusage_Config config = []() {
+    Rusage_Config c;
+    c.enabled = config::get_bool("CATS_RUSAGE", false);
+    c.interval_ns = config::get_u64("CATS_RUSAGE_INTERVAL_US", 0) * 1000;
+    if (c.enabled) {
+      c.statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC);
+      long page_size = sysconf(_SC_PAGESIZE);
+      if (page_size > 0)
+        c.page_kb = (uint64_t) page_size / 1024;
+    }
+    return c;
+  }();
+  return config;
+}
+
+// Time of the last sample of the thread
+static thread_local uint64_t t_last_sample = 0;
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+bool rusage_enabled() {
+  return rusage_config().enabled;
+}
+
+void rusage_sample(bool process, Rusage_Sample &sample) {
+  const Rusage_Config &c = rusage_config();
+  sample.rss_kb = 0;
+  if (c.statm_fd >= 0) {
+    // size resident shared text lib data dt, in pages
+    char buffer[128];
+    ssize_t n = pread(c.statm_fd, buffer, sizeof(buffer) - 1, 0);
+    if (n > 0) {
+      buffer[n] = '\0';
+      char *resident = nullptr;
+      std::strtoull(buffer, &resident, 10);
+      sample.rss_kb = std::strtoull(resident, nullptr, 10) * c.page_kb;
+    }
+  }
+  struct rusage usage;
+  if (getrusage(process ? RUSAGE_SELF : RUSAGE_THREAD, &usage) == 0) {
+    sample.minor_faults = (uint64_t) usage.ru_minflt;
+    sample.major_faults = (uint64_t) usage.ru_majflt;
+  } else {
+    sample.minor_faults = 0;
+    sample.major_faults = 0;
+  }
+  sample.process = process;
+  sample.valid = true;
+}
+
+void rusage_sample_entry(uint8_t scope_type, Rusage_Sample &sample) {
+  sample.valid = false;
+  const Rusage_Config &c = rusage_config();
+  if (!c.enabled || (scope_type != CATS_SCOPE_TYPE_FUNCTION &&
+                     scope_type != CATS_SCOPE_TYPE_PARALLEL))
+    return;
+  if (c.interval_ns) {
+    uint64_t now = now_ns();
+    if (t_last_sample && now - t_last_sample < c.interval_ns)
+      return;
+    t_last_sample = now;
+  }
+  rusage_sample(scope_type == CATS_SCOPE_TYPE_PARALLEL, sample);
+}
+
+} // namespace cats
@@ -0,0 +1,39 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_RUSAGE_HPP__
+#define __CATS_RUSAGE_HPP__
+
+#include <cstdint>
+
+namespace cats {
+
+// Resident set size of the process (from /proc/self/statm) and page faults,
+// sampled at the entry and exit of function and parallel scopes when
+// CATS_RUSAGE=1 so that scope exits can report what the scope instance
+// faulted in. Functions count the faults of the calling thread
+// (getrusage(RUSAGE_THREAD)), parallel scopes those of the process
+// (RUSAGE_SELF), since their workers take most of them.
+// CATS_RUSAGE_INTERVAL_US rate-limits the samples of each thread: a scope
+// entered less than the interval after the previous sample of its thread is
+// not sampled.
+struct Rusage_Sample {
+  uint64_t rss_kb;
+  uint64_t minor_faults;
+  uint64_t major_faults;
+  // Faults of the whole process rather than of the thread
+  bool process;
+  bool valid;
+};
+
+bool rusage_enabled();
+
+// Samples at the entry of a scope of the given type, subject to the scope
+// type and the rate limit. Leaves `sample.valid` false if not sampled.
+void rusage_sample_entry(uint8_t scope_type, Rusage_Sample &sample);
+
+// Samples unconditionally, for the exit of a sampled scope.
+void rusage_sample(bool process, Rusage_Sample &sample);
+
+} // namespace cats
+
+#endif // __CATS_RUSAGE_HPP__
@@ -0,0 +1,151 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_SHM_HPP__
+#define __CATS_SHM_HPP__
+
+// Layout of the shared-memory segment used by CATS_TRANSPORT=shm. The
+// application creates the segment and every recording thread claims one
+// single-producer/single-consumer ring in it. cats-collectd attaches to the
+// segment, drains the rings and writes the trace.
+//
+// Producers never wait for the collector: if a ring is full the event is
+// dropped and counted, so the application survives a slow, missing or
+// crashed collector.
+//
+// Segment: [Header][Ring x n_rings][Event x ring_capacity x n_rings]
+//          [Site x max_sites][strings]
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace cats {
+namespace shm {
+
+static const uint64_t MAGIC = 0x314d485353544143ull; // "CATSSHM1"
+static const uint32_t VERSION = 2;
+
+// Sites are published before the first event referring to them, strings are
+// referenced by their offset into the string area, 0 is the empty string.
+struct Site {
+  uint64_t call_id;
+  uint32_t funcname;
+  uint32_t filename;
+  uint32_t buffer_name;
+  uint32_t line;
+  uint32_t col;
+  uint32_t reserved;
+};
+
+struct Event {
+  uint64_t timestamp;
+  uint32_t site;
+  uint8_t event_type;
+  uint8_t scope_type;
+  uint8_t is_write;
+  uint8_t reserved;
+  // Buffer address or scope ID.
+  uint64_t address;
+  uint64_t size;
+};
+
+// Ring states. A thread claims a free ring and releases it when it exits;
+// the collector frees a released ring once it has drained it, so that a
+// later thread can claim it.
+static const uint32_t RING_FREE = 0;
+static const uint32_t RING_IN_USE = 1;
+static const uint32_t RING_RELEASED = 2;
+static const uint32_t RING_CLAIMING = 3;
+
+struct alignas(64) Ring {
+  std::atomic<uint32_t> in_use;
+  // Set while claiming, before the ring is in use
+  uint32_t thread;
+  alignas(64) std::atomic<uint64_t> head;
+  std::atomic<uint64_t> dropped;
+  alignas(64) std::atomic<uint64_t> tail;
+};
+
+struct alignas(64) Header {
+  uint64_t magic;
+  uint32_t version;
+  int32_t producer_pid;
+  uint32_t n_rings;
+  uint32_t ring_capacity;
+  uint32_t max_sites;
+  uint32_t string_bytes;
+  std::atomic<int32_t> collector_pid;
+  std::atomic<uint32_t> finished;
+  std::atomic<uint32_t> n_threads;
+  std::atomic<uint32_t> n_sites;
+  std::atomic<uint32_t> strings_used;
+  // Events of threads that found no free ring.
+  std::atomic<uint64_t> unclaimed_dropped;
+};
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+              std::atomic<uint64_t>::is_always_lock_free,
+              "shared-memory atomics must be lock free");
+
+inline size_t rings_offset() {
+  return sizeof(Header);
+}
+
+inline size_t events_offset(uint32_t n_rings) {
+  return rings_offset() + n_rings * sizeof(Ring);
+}
+
+inline size_t sites_offset(uint32_t n_rings, uint32_t ring_capacity) {
+  return events_offset(n_rings) +
+         (size_t) n_rings * ring_capacity * sizeof(Event);
+}
+
+inline size_t strings_offset(uint32_t n_rings, uint32_t ring_capacity,
+                             uint32_t max_sites) {
+  return sites_offset(n_rings, ring_capacity) + max_sites * sizeof(Site);
+}
+
+inline size_t segment_size(uint32_t n_rings, uint32_t ring_capacity,
+                           uint32_t max_sites, uint32_t string_bytes) {
+  return strings_offset(n_rings, ring_capacity, max_sites) + string_bytes;
+}
+
+// Typed views of a mapped segment.
+struct Segment {
+  Header *header;
+  Ring *rings;
+  Event *events;
+  Site *sites;
+  char *strings;
+
+  explicit Segment(void *base = nullptr) { this->attach(base); }
+
+  void attach(void *base) {
+    char *bytes = (char *) base;
+    this->header = (Header *) bytes;
+    if (!bytes) {
+      this->rings = nullptr;
+      this->events = nullptr;
+      this->sites = nullptr;
+      this->strings = nullptr;
+      return;
+    }
+    uint32_t n_rings = this->header->n_rings;
+    uint32_t capacity = this->header->ring_capacity;
+    this->rings = (Ring *) (bytes + rings_offset());
+    this->events = (Event *) (bytes + events_offset(n_rings));
+    this->sites = (Site *) (bytes + sites_offset(n_rings, capacity));
+    this->strings = bytes + strings_offset(
+      n_rings, capacity, this->header->max_sites
+    );
+  }
+
+  Event *ring_events(uint32_t ring) const {
+    return this->events + (size_t) ring * this->header->ring_capacity;
+  }
+};
+
+} // namespace shm
+} // namespace cats
+
+#endif // __CATS_SHM_HPP__
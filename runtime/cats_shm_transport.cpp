@@ -0,0 +1,411 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_shm_transport.hpp"
+#include "cats_config.hpp"
+#include "cats_runtime.h"
+#include "cats_trace.hpp"
+
+#include <cerrno>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#ifndef CATS_SHM_DEFAULT_THREADS
+#define CATS_SHM_DEFAULT_THREADS                    64
+#endif
+#ifndef CATS_SHM_DEFAULT_EVENTS
+#define CATS_SHM_DEFAULT_EVENTS                     65536
+#endif
+#ifndef CATS_SHM_DEFAULT_SITES
+#define CATS_SHM_DEFAULT_SITES                      65536
+#endif
+#ifndef CATS_SHM_DEFAULT_STRINGS
+#define CATS_SHM_DEFAULT_STRINGS                    (4 << 20)
+#endif
+
+namespace cats {
+
+// Plain pointers only: open() runs from a static initializer of another
+// translation unit.
+static shm::Segment *g_segment = nullptr;
+static char g_name[256];
+static std::chrono::steady_clock::time_point *g_start = nullptr;
+
+struct Thread_Ring {
+  shm::Ring *ring = nullptr;
+  shm::Event *events = nullptr;
+  uint64_t mask = 0;
+  bool unclaimed = false;
+  std::unordered_map<uint64_t, uint32_t> sites;
+
+  // Hands the ring back when the thread exits. Events pushed later, from
+  // other thread-local destructors, are counted as unclaimed.
+  ~Thread_Ring() {
+    if (!this->ring)
+      return;
+    this->ring->in_use.store(shm::RING_RELEASED, std::memory_order_release);
+    this->ring = nullptr;
+    this->unclaimed = true;
+  }
+};
+
+static thread_local Thread_Ring t_ring;
+
+static uint32_t round_up_pow2(uint64_t n) {
+  uint32_t p = 1;
+  while (p < n && p < (1u << 31))
+    p <<= 1;
+  return p;
+}
+
+static bool claim_ring(Thread_Ring &local) {
+  shm::Header *header = g_segment->header;
+  for (uint32_t i = 0; i < header->n_rings; ++i) {
+    shm::Ring &ring = g_segment->rings[i];
+    uint32_t expected = shm::RING_FREE;
+    if (ring.in_use.compare_exchange_strong(expected, shm::RING_CLAIMING)) {
+      // The drop count of a reused ring carries on, the collector splits
+      // it by thread.
+      ring.thread = header->n_threads.fetch_add(1);
+      ring.in_use.store(shm::RING_IN_USE, std::memory_order_release);
+      local.ring = &ring;
+      local.events = g_segment->ring_events(i);
+      local.mask = header->ring_capacity - 1;
+      return true;
+    }
+  }
+  std::cerr << "CATS: No free ring in " << g_name
+            << ", increase CATS_SHM_THREADS" << std::endl;
+  local.unclaimed = true;
+  return false;
+}
+
+bool Shm_Transport::open() {
+  uint32_t n_rings = (uint32_t) config::get_u64(
+    "CATS_SHM_THREADS", CATS_SHM_DEFAULT_THREADS
+  );
+  uint32_t capacity = round_up_pow2(config::get_u64(
+    "CATS_SHM_EVENTS", CATS_SHM_DEFAULT_EVENTS
+  ));
+  uint32_t max_sites = (uint32_t) config::get_u64(
+    "CATS_SHM_SITES", CATS_SHM_DEFAULT_SITES
+  );
+  uint32_t string_bytes = (uint32_t) config::get_u64(
+    "CATS_SHM_STRINGS", CATS_SHM_DEFAULT_STRINGS
+  );
+  if (n_rings == 0)
+    n_rings = 1;
+
+  const char *name = config::get_string("CATS_SHM_NAME", nullptr);
+  if (name)
+    snprintf(g_name, sizeof(g_name), "%s", name);
+  else
+    snprintf(g_name, sizeof(g_name), "/cats.%ld", (long) getpid());
+
+  size_t size = shm::segment_size(n_rings, capacity, max_sites, string_bytes);
+  int fd = shm_open(g_name, O_CREAT | O_EXCL | O_RDWR, 0600);
+  if (fd < 0) {
+    std::cerr << "CATS: Cannot create shared memory " << g_name << ": "
+              << strerror(errno) << std::endl;
+    return false;
+  }
+  if (ftruncate(fd, (off_t) size) != 0) {
+    std::cerr << "CATS: Cannot size shared memory " << g_name << ": "
+              << strerror(errno) << std::endl;
+    close(fd);
+    shm_unlink(g_name);
+    return false;
+  }
+  void *base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED) {
+    std::cerr << "CATS: Cannot map shared memory " << g_name << ": "
+              << strerror(errno) << std::endl;
+    shm_unlink(g_name);
+    return false;
+  }
+
+  // The segment is zero filled, which is the initial state of all atomics.
+  shm::Header *header = (shm::Header *) base;
+  header->version = shm::VERSION;
+  header->producer_pid = (int32_t) getpid();
+  header->n_rings = n_rings;
+  header->ring_capacity = capacity;
+  header->max_sites = max_sites;
+  header->string_bytes = string_bytes;
+  // Offset 0 is reserved for the empty string.
+  header->strings_used.store(1, std::memory_order_relaxed);
+  // Collectors only attach once the magic is visible.
+  std::atomic_thread_fence(std::memory_order_release);
+  header->magic = shm::MAGIC;
+
+  g_segment = new shm::Segment(base);
+  g_start = new std::chrono::steady_clock::time_point(
+    std::chrono::steady_clock::now()
+  );
+  std::cerr << "CATS: Streaming events to " << g_name << std::endl;
+  return true;
+}
+
+uint32_t Shm_Transport::intern_string(const char *str) {
+  if (!str || !*str)
+    return 0;
+  auto it = this->_string_ids.find(str);
+  if (it != this->_string_ids.end())
+    return it->second;
+
+  shm::Header *header = g_segment->header;
+  size_t length = strlen(str) + 1;
+  uint32_t offset = header->strings_used.load(std::memory_order_relaxed);
+  if (offset + length > header->string_bytes)
+    return 0;
+  memcpy(g_segment->strings + offset, str, length);
+  header->strings_used.store(
+    (uint32_t) (offset + length), std::memory_order_relaxed
+  );
+  this->_string_ids.emplace(str, offset);
+  return offset;
+}
+
+uint32_t Shm_Transport::intern_site(uint64_t call_id,
+                                    const char *buffer_name,
+                                    const char *funcname,
+                                    const char *filename,
+                                    uint32_t line, uint32_t col) {
+  std::lock_guard<std::mutex> guard(this->_sites_mutex);
+  auto it = this->_site_ids.find(call_id);
+  if (it != this->_site_ids.end())
+    return it->second;
+
+  shm::Header *header = g_segment->header;
+  uint32_t id = header->n_sites.load(std::memory_order_relaxed);
+  if (id >= header->max_sites)
+    return UINT32_MAX;
+
+  shm::Site &site = g_segment->sites[id];
+  site.call_id = call_id;
+  site.funcname = this->intern_string(funcname);
+  site.filename = this->intern_string(filename);
+  site.buffer_name = this->intern_string(buffer_name);
+  site.line = line;
+  site.col = col;
+  // Publishes the site and its strings.
+  header->n_sites.store(id + 1, std::memory_order_release);
+  this->_site_ids.emplace(call_id, id);
+  return id;
+}
+
+void Shm_Transport::push(uint64_t call_id, uint8_t event_type,
+                         const char *buffer_name, const char *funcname,
+                         const char *filename, uint32_t line, uint32_t col,
+                         uint64_t address, uint64_t size, uint8_t scope_type,
+                         bool is_write) {
+  Thread_Ring &local = t_ring;
+  if (!local.ring) {
+    if (local.unclaimed || !claim_ring(local)) {
+      g_segment->header->unclaimed_dropped.fetch_add(
+        1, std::memory_order_relaxed
+      );
+      return;
+    }
+  }
+  shm::Ring &ring = *local.ring;
+
+  uint64_t head = ring.head.load(std::memory_order_relaxed);
+  uint64_t tail = ring.tail.load(std::memory_order_acquire);
+  if (head - tail > local.mask) {
+    // Never wait for the collector.
+    ring.dropped.store(
+      ring.dropped.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed
+    );
+    return;
+  }
+
+  auto it = local.sites.find(call_id);
+  if (it == local.sites.end()) {
+    it = local.sites.emplace(call_id, this->intern_site(
+      call_id, buffer_name, funcname, filename, line, col
+    )).first;
+  }
+  if (it->second == UINT32_MAX) {
+    ring.dropped.store(
+      ring.dropped.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed
+    );
+    return;
+  }
+
+  shm::Event &event = local.events[head & local.mask];
+  event.timestamp = std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now() - *g_start
+  ).count();
+  event.site = it->second;
+  event.event_type = event_type;
+  event.scope_type = scope_type;
+  event.is_write = is_write;
+  event.address = address;
+  event.size = size;
+  ring.head.store(head + 1, std::memory_order_release);
+}
+
+void Shm_Transport::instrument_alloc(
+  uint64_t call_id,
+  const char *buffer_name, void *address, size_t size,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  if (!buffer_name || !*buffer_name)
+    buffer_name = "$UNKNOWN$";
+  this->push(
+    call_id, CATS_EVENT_TYPE_ALLOCATION, buffer_name, funcname, filename,
+    line, col, (uint64_t) address, size, 0, false
+  );
+}
+
+void Shm_Transport::instrument_dealloc(
+  uint64_t call_id,
+  void *address, const char *funcname, const char *filename,
+  uint32_t line, uint32_t col
+) {
+  this->push(
+    call_id, CATS_EVENT_TYPE_DEALLOCATION, nullptr, funcname, filename,
+    line, col, (uint64_t) address, 0, 0, false
+  );
+}
+
+void Shm_Transport::instrument_access(
+  uint64_t call_id,
+  void *address, size_t size, bool is_write, const char *funcname,
+  const char *filename, uint32_t line, uint32_t col
+) {
+  this->push(
+    call_id, CATS_EVENT_TYPE_ACCESS, nullptr, funcname, filename, line, col,
+    (uint64_t) address, size, 0, is_write
+  );
+}
+
+void Shm_Transport::instrument_scope_entry(
+  uint64_t call_id,
+  uint64_t scope_id, uint8_t type, const char *funcname,
+  const char *filename, uint32_t line, uint32_t col
+) {
+  this->push(
+    call_id, CATS_EVENT_TYPE_SCOPE_ENTRY, nullptr, funcname, filename, line,
+    col, scope_id, 0, type, false
+  );
+}
+
+void Shm_Transport::instrument_scope_exit(
+  uint64_t call_id,
+  uint64_t scope_id, uint8_t type, const char *funcname,
+  const char *filename, uint32_t line, uint32_t col
+) {
+  this->push(
+    call_id, CATS_EVENT_TYPE_SCOPE_EXIT, nullptr, funcname, filename, line,
+    col, scope_id, 0, type, false
+  );
+}
+
+void Shm_Transport::instrument_io(
+  uint64_t call_id,
+  uint8_t op, int32_t fd, void *stream, void *address, int64_t bytes,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  if (stream && fd < 0)
+    fd = fileno((FILE *) stream);
+  const char *path = fd_path(fd);
+  uint32_t path_offset;
+  {
+    std::lock_guard<std::mutex> guard(this->_sites_mutex);
+    auto it = this->_path_ids.find(path);
+    if (it == this->_path_ids.end()) {
+      char name[CATS_TRACE_BUFFER_NAME_SIZE];
+      copy_path(name, path, sizeof(name));
+      it = this->_path_ids.emplace(path, this->intern_string(name)).first;
+    }
+    path_offset = it->second;
+  }
+  this->push(
+    call_id, CATS_EVENT_TYPE_IO, nullptr, funcname, filename, line, col,
+    ((uint64_t) (uint32_t) fd << 32) | path_offset, (uint64_t) bytes, op,
+    false
+  );
+  // Mapped regions are traced like allocations, under their own call ID.
+  if (op == CATS_IO_MMAP && address != MAP_FAILED) {
+    char name[CATS_TRACE_BUFFER_NAME_SIZE];
+    copy_path(name, *path ? path : "mmap", sizeof(name));
+    this->instrument_alloc(
+      ~call_id, name, address, (size_t) bytes, funcname, filename, line, col
+    );
+  } else if (op == CATS_IO_MUNMAP) {
+    this->instrument_dealloc(~call_id, address, funcname, filename, line, col);
+  }
+}
+
+void Shm_Transport::instrument_atomic(
+  uint64_t call_id,
+  void *address, size_t size, uint8_t op, bool success,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  this->push(
+    call_id, CATS_EVENT_TYPE_ATOMIC, nullptr, funcname, filename, line, col,
+    (uint64_t) address, size, op, success
+  );
+}
+
+void Shm_Transport::instrument_sync(
+  uint64_t call_id,
+  uint8_t kind, uint8_t phase, void *object, uint64_t duration,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  this->push(
+    call_id, CATS_EVENT_TYPE_SYNC, nullptr, funcname, filename, line, col,
+    (uint64_t) object, duration, kind, phase
+  );
+}
+
+void Shm_Transport::instrument_workshare(
+  uint64_t call_id,
+  uint8_t schedule, int64_t lower, int64_t upper, int64_t stride,
+  const char *funcname, const char *filename, uint32_t line, uint32_t col
+) {
+  (void) stride;
+  if (upper <= lower)
+    return;
+  this->push(
+    call_id, CATS_EVENT_TYPE_WORKSHARE, nullptr, funcname, filename, line,
+    col, (uint64_t) lower, (uint64_t) upper, schedule, false
+  );
+}
+
+void Shm_Transport::save(const char *filepath) {
+  (void) filepath;
+  shm::Header *header = g_segment->header;
+  if (header->finished.exchange(1))
+    return;
+
+  uint64_t dropped = header->unclaimed_dropped.load();
+  for (uint32_t i = 0; i < header->n_rings; ++i)
+    dropped += g_segment->rings[i].dropped.load();
+  if (dropped) {
+    std::cerr << "CATS: " << dropped << " events were dropped because the "
+              << "collector did not keep up" << std::endl;
+  }
+
+  // The collector removes the segment after draining it. Without a live
+  // collector nobody would, so remove it here.
+  int32_t collector = header->collector_pid.load();
+  if (collector == 0 || (kill(collector, 0) != 0 && errno == ESRCH)) {
+    std::cerr << "CATS: No collector attached to " << g_name
+              << ", events are discarded" << std::endl;
+    shm_unlink(g_name);
+  }
+}
+
+} // namespace cats
@@ -0,0 +1,123 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_SHM_TRANSPORT_HPP__
+#define __CATS_SHM_TRANSPORT_HPP__
+
+#include "cats_shm.hpp"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+
+namespace cats {
+
+// Producer side of CATS_TRANSPORT=shm. Has the hook interface of CATS_Trace
+// but only appends the raw events to the ring of the calling thread; the
+// scope stacks, deduplication and output are handled by cats-collectd.
+//   CATS_SHM_NAME     name of the segment (default /cats.<pid>)
+//   CATS_SHM_THREADS  number of rings, i.e., recording threads
+//   CATS_SHM_EVENTS   capacity of each ring
+//   CATS_SHM_SITES    number of distinct instrumentation sites
+//   CATS_SHM_STRINGS  bytes for function, file and buffer names
+class Shm_Transport {
+public:
+  // Creates the segment. Returns false if that failed, the caller should
+  // fall back to an in-process trace then.
+  static bool open();
+
+  void reset() {}
+
+  void instrument_alloc(
+    uint64_t call_id,
+    const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+
+  void instrument_dealloc(
+    uint64_t call_id,
+    void *address, const char *funcname, const char *filename,
+    uint32_t line, uint32_t col
+  );
+
+  void instrument_access(
+    uint64_t call_id,
+    void *address, size_t size, bool is_write, const char *funcname,
+    const char *filename, uint32_t line, uint32_t col
+  );
+
+  void instrument_scope_entry(
+    uint64_t call_id,
+    uint64_t scope_id, uint8_t type, const char *funcname,
+    const char *filename, uint32_t line, uint32_t col
+  );
+
+  void instrument_scope_exit(
+    uint64_t call_id,
+    uint64_t scope_id, uint8_t type, const char *funcname,
+    const char *filename, uint32_t line, uint32_t col
+  );
+
+  // The file descriptor and the interned path share the address field,
+  // the operation is stored as the scope type. Mapped regions are pushed as
+  // allocations as well.
+  void instrument_io(
+    uint64_t call_id,
+    uint8_t op, int32_t fd, void *stream, void *address, int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+
+  // The operation or kind is stored as the scope type, the success flag or
+  // phase as is_write and the wait or hold time as the size.
+  void instrument_atomic(
+    uint64_t call_id,
+    void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+
+  void instrument_sync(
+    uint64_t call_id,
+    uint8_t kind, uint8_t phase, void *object, uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+
+  // The bounds are stored as address and size, the stride is not
+  // transported.
+  void instrument_workshare(
+    uint64_t call_id,
+    uint8_t schedule, int64_t lower, int64_t upper, int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  );
+
+  // Marks the stream as complete. The collector writes the trace; if none
+  // is attached the segment is removed.
+  void save(const char *filepath);
+
+  // The events live in the collector, there is nothing to dump or
+  // checkpoint in the application.
+  void dump(const char *) {}
+  void crash_dump(const char *) {}
+  void checkpoint(const char *) {}
+
+private:
+  void push(uint64_t call_id, uint8_t event_type, const char *buffer_name,
+            const char *funcname, const char *filename, uint32_t line,
+            uint32_t col, uint64_t address, uint64_t size,
+            uint8_t scope_type, bool is_write);
+
+  uint32_t intern_site(uint64_t call_id, const char *buffer_name,
+                       const char *funcname, const char *filename,
+                       uint32_t line, uint32_t col);
+  uint32_t intern_string(const char *str);
+
+  std::mutex _sites_mutex;
+  std::unordered_map<uint64_t, uint32_t> _site_ids;
+  std::unordered_map<std::string, uint32_t> _string_ids;
+  // Interned offsets of the paths returned by fd_path
+  std::unordered_map<const char *, uint32_t> _path_ids;
+};
+
+} // namespace cats
+
+#endif // __CATS_SHM_TRANSPORT_HPP__
@@ -0,0 +1,63 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_sites.hpp"
+
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+namespace cats {
+
+struct Site_Table {
+  std::unordered_map<uint64_t, const cats_site_info *> sites;
+  bool fields = false;
+};
+
+// Replaced tables are never freed, a lookup may still be reading them.
+static std::atomic<const Site_Table *> g_sites{nullptr};
+static std::atomic<bool> g_field_sites{false};
+static std::mutex g_register_mutex;
+
+static void add_sites(Site_Table &table, const cats_site_info *sites,
+                      size_t count) {
+  for (size_t i = 0; i < count; ++i) {
+    table.sites[sites[i].call_id] = &sites[i];
+    table.fields = table.fields || sites[i].struct_name;
+  }
+}
+
+static void publish(Site_Table *table) {
+  g_sites.store(table, std::memory_order_release);
+  g_field_sites.store(table->fields, std::memory_order_release);
+}
+
+void register_sites(const cats_site_info *sites, size_t count) {
+  std::lock_guard<std::mutex> guard(g_register_mutex);
+  const Site_Table *current = g_sites.load(std::memory_order_acquire);
+  Site_Table *table = current ? new Site_Table(*current) : new Site_Table();
+  add_sites(*table, sites, count);
+  publish(table);
+}
+
+void register_site_tables(const cats_site_table *tables) {
+  std::lock_guard<std::mutex> guard(g_register_mutex);
+  const Site_Table *current = g_sites.load(std::memory_order_acquire);
+  Site_Table *table = current ? new Site_Table(*current) : new Site_Table();
+  for (const cats_site_table *it = tables; it; it = it->next)
+    add_sites(*table, it->sites, it->count);
+  publish(table);
+}
+
+bool field_sites_registered() {
+  return g_field_sites.load(std::memory_order_relaxed);
+}
+
+const cats_site_info *find_site(uint64_t call_id) {
+  const Site_Table *table = g_sites.load(std::memory_order_acquire);
+  if (!table)
+    return nullptr;
+  auto it = table->sites.find(call_id);
+  return it == table->sites.end() ? nullptr : it->second;
+}
+
+} // namespace cats
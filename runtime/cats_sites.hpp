@@ -0,0 +1,28 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_SITES_HPP__
+#define __CATS_SITES_HPP__
+
+#include "cats_runtime.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace cats {
+
+// Static site information registered by the instrumented modules. Lookups
+// do not lock; each registration publishes a new copy of the table, so
+// modules should register all their sites at once.
+void register_sites(const cats_site_info *sites, size_t count);
+void register_site_tables(const cats_site_table *tables);
+
+// Whether any registered site is a struct field access. Accesses only need
+// to look up their site before deduplication if there is one.
+bool field_sites_registered();
+
+// The registered information of a site, nullptr if there is none.
+const cats_site_info *find_site(uint64_t call_id);
+
+} // namespace cats
+
+#endif // __CATS_SITES_HPP__
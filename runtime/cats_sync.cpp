@@ -0,0 +1,306 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#include "cats_sync.hpp"
+#include "cats_config.hpp"
+#include "cats_names.hpp"
+#include "cats_runtime.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#ifndef CATS_SYNC_MAX_HELD
+#define CATS_SYNC_MAX_HELD                          64
+#endif
+
+namespace cats {
+
+struct Sync_Stats {
+  const char *funcname = nullptr;
+  const char *filename = nullptr;
+  uint32_t line = 0;
+  uint8_t event_type = 0;
+  // Atomic operation or synchronization kind
+  uint8_t op = 0;
+  uint8_t phase = 0;
+  uint64_t threads = 0;
+  uint64_t count = 0;
+  uint64_t failed = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+};
+
+// Executions of an atomic site on one thread. The counters are only written
+// by the thread and read while the profile is written out. The thread does
+// not take the lock to count, so a segment cannot reset them, it reports
+// the difference to the counts it released last.
+struct Atomic_Counts {
+  Sync_Stats stats;
+  std::atomic<uint64_t> count{0};
+  std::atomic<uint64_t> failed{0};
+  // Guarded by the profile mutex
+  uint64_t released_count = 0;
+  uint64_t released_failed = 0;
+};
+
+struct Held_Object {
+  void *object;
+  uint64_t since_ns;
+  uint8_t kind;
+};
+
+// Profile of one thread. The mutex is only contended while the profile is
+// written out. Atomic sites are looked up and counted without it, it only
+// guards their insertion.
+struct Thread_Sync {
+  std::mutex mutex;
+  std::unordered_map<uint64_t, Sync_Stats> sites;
+  std::unordered_map<uint64_t, Atomic_Counts> atomics;
+  uint64_t begin_ns = 0;
+  // Objects acquired by this thread and the time they were acquired
+  std::vector<Held_Object> held;
+};
+
+struct Sync_State {
+  std::mutex threads_mutex;
+  std::vector<std::unique_ptr<Thread_Sync>> threads;
+};
+
+static Sync_State &state() {
+  return leaked_instance<Sync_State>();
+}
+
+static thread_local Thread_Sync *t_profile = nullptr;
+
+static Thread_Sync &thread_sync() {
+  if (!t_profile) {
+    Sync_State &s = state();
+    std::lock_guard<std::mutex> guard(s.threads_mutex);
+    s.threads.emplace_back(new Thread_Sync());
+    t_profile = s.threads.back().get();
+  }
+  return *t_profile;
+}
+
+static uint64_t now_ns() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+    std::chrono::steady_clock::now().time_since_epoch()
+  ).count();
+}
+
+static Sync_Stats &site_stats(Thread_Sync &profile, uint64_t call_id,
+                              uint8_t event_type, uint8_t op, uint8_t phase,
+                              const char *funcname, const char *filename,
+                              uint32_t line) {
+  auto it = profile.sites.find(call_id);
+  if (it == profile.sites.end()) {
+    it = profile.sites.emplace(call_id, Sync_Stats()).first;
+    Sync_Stats &stats = it->second;
+    stats.funcname = funcname;
+    stats.filename = filename;
+    stats.line = line;
+    stats.event_type = event_type;
+    stats.op = op;
+    stats.phase = phase;
+    stats.threads = 1;
+  }
+  return it->second;
+}
+
+bool sync_profile_enabled() {
+  static const bool enabled = config::get_bool("CATS_SYNC_PROFILE", false);
+  return enabled;
+}
+
+static void drop_held(Thread_Sync &profile, uint8_t kind, void *object) {
+  profile.held.erase(
+    std::remove_if(profile.held.begin(), profile.held.end(),
+                   [&](const Held_Object &held) {
+      return held.kind == kind && held.object == object;
+    }),
+    profile.held.end()
+  );
+}
+
+void sync_begin() {
+  thread_sync().begin_ns = now_ns();
+}
+
+uint64_t sync_end(uint8_t kind, uint8_t phase, void *object) {
+  Thread_Sync &profile = thread_sync();
+  uint64_t now = now_ns();
+  uint64_t duration = 0;
+  if (phase == CATS_SYNC_ACQUIRE) {
+    if (profile.begin_ns)
+      duration = now - profile.begin_ns;
+    profile.begin_ns = 0;
+    if (kind == CATS_SYNC_BARRIER || !object)
+      return duration;
+    // A reduction that took the atomic path has no release call, a new
+    // one on the same lock replaces its entry.
+    if (kind == CATS_SYNC_REDUCE)
+      drop_held(profile, CATS_SYNC_REDUCE, object);
+    if (profile.held.size() >= CATS_SYNC_MAX_HELD)
+      profile.held.erase(profile.held.begin());
+    profile.held.push_back({object, now, kind});
+  } else {
+    for (auto it = profile.held.rbegin(); it != profile.held.rend(); ++it) {
+      if (it->object == object) {
+        duration = now - it->since_ns;
+        profile.held.erase(std::next(it).base());
+        break;
+      }
+    }
+    // __kmpc_end_reduce* ends every reduction on the lock
+    if (kind == CATS_SYNC_REDUCE)
+      drop_held(profile, CATS_SYNC_REDUCE, object);
+  }
+  return duration;
+}
+
+void sync_executed(uint64_t call_id, uint8_t kind, uint8_t phase,
+                   uint64_t duration, const char *funcname,
+                   const char *filename, uint32_t line) {
+  Thread_Sync &profile = thread_sync();
+  std::lock_guard<std::mutex> guard(profile.mutex);
+  Sync_Stats &stats = site_stats(
+    profile, call_id, CATS_EVENT_TYPE_SYNC, kind, phase, funcname, filename,
+    line
+  );
+  ++stats.count;
+  stats.total_ns += duration;
+  stats.max_ns = std::max(stats.max_ns, duration);
+}
+
+void atomic_executed(uint64_t call_id, uint8_t op, bool success,
+                     const char *funcname, const char *filename,
+                     uint32_t line) {
+  Thread_Sync &profile = thread_sync();
+  auto it = profile.atomics.find(call_id);
+  if (it == profile.atomics.end()) {
+    std::lock_guard<std::mutex> guard(profile.mutex);
+    it = profile.atomics.emplace(
+      std::piecewise_construct, std::forward_as_tuple(call_id),
+      std::forward_as_tuple()
+    ).first;
+    Sync_Stats &stats = it->second.stats;
+    stats.funcname = funcname;
+    stats.filename = filename;
+    stats.line = line;
+    stats.event_type = CATS_EVENT_TYPE_ATOMIC;
+    stats.op = op;
+    stats.threads = 1;
+  }
+  // Only this thread writes the counters
+  Atomic_Counts &counts = it->second;
+  counts.count.store(
+    counts.count.load(std::memory_order_relaxed) + 1,
+    std::memory_order_relaxed
+  );
+  if (!success) {
+    counts.failed.store(
+      counts.failed.load(std::memory_order_relaxed) + 1,
+      std::memory_order_relaxed
+    );
+  }
+}
+
+static void merge_stats(std::map<uint64_t, Sync_Stats> &merged,
+                        uint64_t call_id, const Sync_Stats &site) {
+  auto it = merged.find(call_id);
+  if (it == merged.end()) {
+    merged.emplace(call_id, site);
+    return;
+  }
+  Sync_Stats &stats = it->second;
+  stats.threads += 1;
+  stats.count += site.count;
+  stats.failed += site.failed;
+  stats.total_ns += site.total_ns;
+  stats.max_ns = std::max(stats.max_ns, site.max_ns);
+}
+
+void write_sync_profile(std::ostream &os, bool release) {
+  std::map<uint64_t, Sync_Stats> merged;
+  Sync_State &s = state();
+  {
+    std::lock_guard<std::mutex> threads_guard(s.threads_mutex);
+    for (auto &profile : s.threads) {
+      std::lock_guard<std::mutex> guard(profile->mutex);
+      for (const auto &site : profile->sites)
+        merge_stats(merged, site.first, site.second);
+      if (release)
+        profile->sites.clear();
+      for (auto &site : profile->atomics) {
+        Atomic_Counts &counts = site.second;
+        uint64_t count = counts.count.load(std::memory_order_relaxed);
+        uint64_t failed = counts.failed.load(std::memory_order_relaxed);
+        if (count == counts.released_count)
+          continue;
+        Sync_Stats stats = counts.stats;
+        stats.count = count - counts.released_count;
+        stats.failed = failed - counts.released_failed;
+        merge_stats(merged, site.first, stats);
+        if (release) {
+          counts.released_count = count;
+          counts.released_failed = failed;
+        }
+      }
+    }
+  }
+  if (merged.empty())
+    return;
+
+  // Most contended sites first
+  std::vector<std::pair<uint64_t, const Sync_Stats *>> sites;
+  for (const auto &site : merged)
+    sites.emplace_back(site.first, &site.second);
+  std::stable_sort(sites.begin(), sites.end(), [](const auto &a,
+                                                  const auto &b) {
+    if (a.second->total_ns != b.second->total_ns)
+      return a.second->total_ns > b.second->total_ns;
+    return a.second->failed > b.second->failed;
+  });
+
+  os << "," << std::endl;
+  os << "  \"sync\": [" << std::endl;
+  for (size_t i = 0; i < sites.size(); ++i) {
+    const Sync_Stats &stats = *sites[i].second;
+    os << "    {\"call_id\": " << sites[i].first << ", ";
+    os << "\"funcname\": \"" << (stats.funcname ? stats.funcname : "")
+       << "\", ";
+    os << "\"filename\": \"" << (stats.filename ? stats.filename : "")
+       << "\", ";
+    os << "\"line\": " << stats.line << ", ";
+    if (stats.event_type == CATS_EVENT_TYPE_ATOMIC) {
+      os << "\"type\": \"atomic\", ";
+      os << "\"op\": \"" << atomic_op_name(stats.op) << "\", ";
+    } else {
+      const char *time = stats.phase == CATS_SYNC_ACQUIRE ? "wait" : "hold";
+      os << "\"type\": \"sync\", ";
+      os << "\"kind\": \"" << sync_kind_name(stats.op) << "\", ";
+      os << "\"phase\": \"" << sync_phase_name(stats.phase) << "\", ";
+      os << "\"" << time << "_ns\": " << stats.total_ns << ", ";
+      os << "\"max_" << time << "_ns\": " << stats.max_ns << ", ";
+    }
+    os << "\"threads\": " << stats.threads << ", ";
+    os << "\"count\": " << stats.count;
+    if (stats.event_type == CATS_EVENT_TYPE_ATOMIC)
+      os << ", \"failed\": " << stats.failed;
+    os << "}";
+    if (i + 1 < sites.size())
+      os << ",";
+    os << std::endl;
+  }
+  os << "  ]";
+}
+
+} // namespace cats
@@ -0,0 +1,44 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_SYNC_HPP__
+#define __CATS_SYNC_HPP__
+
+#include <cstdint>
+#include <ostream>
+
+namespace cats {
+
+// Contention profile of atomics and synchronization calls, enabled with
+// CATS_SYNC_PROFILE=1. The trace events of these sites are deduplicated like
+// all others; the profile counts every execution on every thread so that
+// contention is not lost. The durations of synchronization calls are always
+// measured, the trace events carry them.
+
+bool sync_profile_enabled();
+
+// Starts timing a blocking synchronization call on the calling thread.
+void sync_begin();
+
+// Ends a synchronization call and returns its duration in ns: the wait
+// since sync_begin for CATS_SYNC_ACQUIRE, the time `object` was held by
+// this thread for CATS_SYNC_RELEASE.
+uint64_t sync_end(uint8_t kind, uint8_t phase, void *object);
+
+// Counts a synchronization call that took `duration` ns in the profile.
+void sync_executed(uint64_t call_id, uint8_t kind, uint8_t phase,
+                   uint64_t duration, const char *funcname,
+                   const char *filename, uint32_t line);
+
+void atomic_executed(uint64_t call_id, uint8_t op, bool success,
+                     const char *funcname, const char *filename,
+                     uint32_t line);
+
+// Appends the "sync" section of the trace, a record per site with the
+// totals of all threads. With `release` the written totals are reset, so
+// that each segment only counts the executions since the previous one.
+// Writes nothing if no atomic or synchronization site was executed.
+void write_sync_profile(std::ostream &os, bool release);
+
+} // namespace cats
+
+#endif // __CATS_SYNC_HPP__
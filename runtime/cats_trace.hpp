@@ -0,0 +1,1754 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_TRACE_HPP__
+#define __CATS_TRACE_HPP__
+
+#include "cats_runtime.h"
+#include "cats_config.hpp"
+#include "cats_filter.hpp"
+#include "cats_fd_paths.hpp"
+#include "cats_fields.hpp"
+#include "cats_heatmap.hpp"
+#include "cats_alloc_sites.hpp"
+#include "cats_memory.hpp"
+#include "cats_names.hpp"
+#include "cats_parallel.hpp"
+#include "cats_roofline.hpp"
+#include "cats_rusage.hpp"
+#include "cats_sites.hpp"
+#include "cats_sync.hpp"
+#include "cats_flight_recorder.hpp"
+
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <omp.h>
+#include <unistd.h>
+
+#ifndef CATS_RUNTIME_DEBUG
+#define CATS_RUNTIME_DEBUG                          0
+#endif
+#ifndef CATS_RUNTIME_PRINT_ALLOCATIONS
+#define CATS_RUNTIME_PRINT_ALLOCATIONS              0
+#endif
+#ifndef CATS_RUNTIME_PRINT_ACCESSES
+#define CATS_RUNTIME_PRINT_ACCESSES                 0
+#endif
+#ifndef CATS_RUNTIME_PRINT_SCOPES
+#define CATS_RUNTIME_PRINT_SCOPES                   0
+#endif
+
+#ifndef CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
+#define CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND   0
+#endif
+
+#ifndef CATS_TRACE_FILE_NAME_SIZE
+#define CATS_TRACE_FILE_NAME_SIZE                   256
+#endif
+#ifndef CATS_TRACE_FUNC_NAME_SIZE
+#define CATS_TRACE_FUNC_NAME_SIZE                   64
+#endif
+#ifndef CATS_TRACE_BUFFER_NAME_SIZE
+#define CATS_TRACE_BUFFER_NAME_SIZE                 64
+#endif
+
+namespace cats {
+
+// Value of MAP_FAILED, without pulling in sys/mman.h.
+static void *const MAP_FAILED_ADDRESS = (void *) -1;
+
+struct CATS_Debug_Info {
+  char funcname[CATS_TRACE_FUNC_NAME_SIZE];
+  char filename[CATS_TRACE_FILE_NAME_SIZE];
+  uint32_t line;
+  uint32_t col;
+};
+
+struct Allocation_Event_Args {
+  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
+  uint64_t buffer_id;
+  size_t size;
+};
+
+struct Deallocation_Event_Args {
+  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
+  uint64_t buffer_id;
+};
+
+struct Access_Event_Args {
+  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
+  uint64_t buffer_id;
+  // Offset of the accessed address into the buffer
+  uint64_t offset;
+  size_t size;
+  bool is_write;
+  // Registered site of the access, nullptr if the pass emitted none
+  const cats_site_info *site;
+};
+
+// The resource usage fields are only set if `has_rusage`, see
+// cats_rusage.hpp. Exits carry the page faults of the thread and the change
+// of the resident set size since the entry.
+struct Scope_Entry_Event_Args {
+  uint64_t scope_id;
+  uint8_t type;
+  bool has_rusage;
+  uint64_t rss_kb;
+};
+
+struct Scope_Exit_Event_Args {
+  uint64_t scope_id;
+  bool has_rusage;
+  uint64_t rss_kb;
+  int64_t rss_delta_kb;
+  uint64_t minor_faults;
+  uint64_t major_faults;
+};
+
+// `path` keeps the end of the file path if it is too long.
+struct Io_Event_Args {
+  char path[CATS_TRACE_BUFFER_NAME_SIZE];
+  uint64_t buffer_id;
+  int64_t bytes;
+  int32_t fd;
+  uint8_t op;
+};
+
+struct Atomic_Event_Args {
+  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
+  uint64_t buffer_id;
+  uint64_t size;
+  uint8_t op;
+};
+
+struct Workshare_Event_Args {
+  uint64_t parallel_scope_id;
+  int64_t lower;
+  int64_t upper;
+  int64_t stride;
+  uint32_t omp_thread;
+  uint8_t schedule;
+};
+
+struct Sync_Event_Args {
+  uint64_t object;
+  // Wait time for acquire, hold time for release
+  uint64_t duration;
+  uint8_t kind;
+  uint8_t phase;
+};
+
+struct CATS_Event {
+#if CATS_RUNTIME_DEBUG
+  uint64_t call_id;
+#endif
+  uint8_t event_type;
+  uint32_t thread;
+  uint64_t timestamp;
+  CATS_Debug_Info debug_info;
+  union {
+    Allocation_Event_Args alloc;
+    Deallocation_Event_Args dealloc;
+    Access_Event_Args access;
+    Scope_Entry_Event_Args scope_entry;
+    Scope_Exit_Event_Args scope_exit;
+    Io_Event_Args io;
+    Atomic_Event_Args atomic;
+    Sync_Event_Args sync;
+    Workshare_Event_Args workshare;
+  } args;
+};
+
+struct CATS_Alloc_Info {
+  char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE];
+  uint64_t buffer_id;
+  size_t size;
+};
+
+typedef std::deque<uint64_t> Scope_Stack;
+
+// Source information of a scope that is currently open, kept so that a new
+// trace segment can start with the scopes it is nested in. `traced` is false
+// if the entry was rejected by the event filter, its exit is dropped as well.
+struct Open_Scope {
+  uint64_t scope_id;
+  uint8_t type;
+  const char *funcname;
+  const char *filename;
+  uint32_t line;
+  uint32_t col;
+  bool traced;
+  // Resource usage at the entry, if sampled
+  Rusage_Sample rusage;
+};
+
+struct Segment_Info {
+  std::string path;
+  uint64_t n_events;
+  uint64_t ts_begin;
+  uint64_t ts_end;
+};
+
+inline void copy_name(char *dst, const char *src, size_t size) {
+  strncpy(dst, src, size - 1);
+  dst[size - 1] = '\0';
+}
+
+// Copies the end of `path` if it is too long, the file name is more telling
+// than the leading directories.
+inline void copy_path(char *dst, const char *path, size_t size) {
+  size_t length = strlen(path);
+  copy_name(dst, length >= size ? path + length - (size - 1) : path, size);
+}
+
+// Formats into a fixed buffer and writes it to a file descriptor with
+// write(2). Takes no locks and allocates nothing, so it can be used from a
+// signal handler. Supports the subset of std::ostream the event writer uses.
+class Raw_Writer {
+public:
+  explicit Raw_Writer(int fd) : _fd(fd) {}
+
+  ~Raw_Writer() { this->flush(); }
+
+  Raw_Writer &operator<<(const char *text) {
+    for (; *text; ++text)
+      this->put(*text);
+    return *this;
+  }
+
+  Raw_Writer &operator<<(char c) {
+    this->put(c);
+    return *this;
+  }
+
+  template <class T, class = typename std::enable_if<
+    std::is_integral<T>::value
+  >::type>
+  Raw_Writer &operator<<(T value) {
+    char digits[24];
+    size_t n = 0;
+    bool negative = value < 0;
+    uint64_t magnitude = negative ? 0 - (uint64_t) value : (uint64_t) value;
+    do {
+      digits[n++] = (char) ('0' + magnitude % 10);
+      magnitude /= 10;
+    } while (magnitude);
+    if (negative)
+      this->put('-');
+    while (n)
+      this->put(digits[--n]);
+    return *this;
+  }
+
+  void flush() {
+    size_t done = 0;
+    while (done < this->_size) {
+      ssize_t n = write(this->_fd, this->_buffer + done, this->_size - done);
+      if (n <= 0)
+        break;
+      done += (size_t) n;
+    }
+    this->_size = 0;
+  }
+
+private:
+  void put(char c) {
+    if (this->_size == sizeof(this->_buffer))
+      this->flush();
+    this->_buffer[this->_size++] = c;
+  }
+
+  int _fd;
+  size_t _size = 0;
+  char _buffer[4096];
+};
+
+// Array shape of an access site inferred by the pass. Column traversal of a
+// row-major array strides through memory, hence the transposition hint.
+template <class Out>
+void write_array_shape(Out &os, const cats_site_info &site) {
+  static const char *const traversals[] = {
+    "unknown", "row", "column", "invariant"
+  };
+  os << ", \"shape\": \"" << site.shape << "\", ";
+  os << "\"subscripts\": \"" << (site.subscripts ? site.subscripts : "")
+     << "\", ";
+  os << "\"element_size\": " << site.element_size << ", ";
+  os << "\"traversal\": \""
+     << (site.traversal < 4 ? traversals[site.traversal] : "unknown") << "\"";
+  if (site.traversal == CATS_TRAVERSAL_COLUMN)
+    os << ", \"hint\": \"transpose\"";
+}
+
+// ---------------------------------------------------------------------------
+// Stack identifier policies
+//
+// A stack identifier condenses the current scope stack into a key used for
+// deduplicating events. They are listed from most to least precise.
+// ---------------------------------------------------------------------------
+
+// Comma separated list of all scope IDs on the stack. Exact, but slow.
+struct StackIdString {
+  typedef std::string key_type;
+
+  void push(uint64_t) {}
+  void pop(uint64_t) {}
+  void clear() {}
+
+  key_type get(const Scope_Stack &stack) const {
+    std::stringstream ss;
+    auto it = stack.begin();
+    while (it != stack.end()) {
+      ss << *it;
+      ++it;
+      if (it != stack.end()) {
+        ss << ",";
+      }
+    }
+    return ss.str();
+  }
+};
+
+// Alternating sum of the scope IDs, recomputed on each lookup.
+struct StackIdFast {
+  typedef uint64_t key_type;
+
+  void push(uint64_t) {}
+  void pop(uint64_t) {}
+  void clear() {}
+
+  key_type get(const Scope_Stack &stack) const {
+    uint64_t identifier = 0;
+    bool even = true;
+    for (auto id : stack) {
+      if (even)
+        identifier += id;
+      else
+        identifier -= id;
+      even = !even;
+    }
+    return identifier;
+  }
+};
+
+// Sum of the scope IDs, maintained incrementally on scope entry and exit.
+struct StackIdVeryFast {
+  typedef uint64_t key_type;
+
+  uint64_t value = 0;
+
+  void push(uint64_t scope_id) { this->value += scope_id; }
+  void pop(uint64_t scope_id) { this->value -= scope_id; }
+  void clear() { this->value = 0; }
+
+  key_type get(const Scope_Stack &) const { return this->value; }
+};
+
+// ---------------------------------------------------------------------------
+// Deduplication policies
+// ---------------------------------------------------------------------------
+
+// Record every event.
+struct DedupNone {
+  void push(uint64_t) {}
+  void pop(uint64_t) {}
+  void clear() {}
+
+  bool already_recorded(uint64_t, const Scope_Stack &) { return false; }
+};
+
+// Record each call site only once per distinct scope stack.
+template <class StackId>
+struct DedupPerStack {
+  StackId stack_id;
+  std::unordered_map<
+    uint64_t, std::unordered_set<typename StackId::key_type>
+  > recorded_calls;
+
+  void push(uint64_t scope_id) { this->stack_id.push(scope_id); }
+  void pop(uint64_t scope_id) { this->stack_id.pop(scope_id); }
+  void clear() {
+    this->stack_id.clear();
+    this->recorded_calls.clear();
+  }
+
+  bool already_recorded(uint64_t call_id, const Scope_Stack &stack) {
+    return !this->recorded_calls[call_id].insert(
+      this->stack_id.get(stack)
+    ).second;
+  }
+};
+
+// ---------------------------------------------------------------------------
+// Storage policies
+// ---------------------------------------------------------------------------
+
+// A storage policy hands out the slot for the next event with `next()`,
+// `commit()` marks it complete once it has been filled in.
+// `for_each` visits the stored events in recording order and may only be used
+// while the owning thread is not recording, `snapshot` may be used
+// concurrently with recording where the policy supports it.
+
+struct NullMutex {
+  void lock() {}
+  void unlock() {}
+};
+
+// Unbounded in-memory event log. Growing the deque may move its block map,
+// so a snapshot holds `Mutex` against new slots and only visits committed
+// events, which the recording thread no longer writes. `Mutex` is a
+// NullMutex where the hook mutex already keeps snapshots and recording
+// apart.
+template <class Mutex>
+struct DequeStorage {
+  std::deque<CATS_Event> events;
+  mutable Mutex mutex;
+  std::atomic<size_t> committed{0};
+
+  CATS_Event &next() {
+    std::lock_guard<Mutex> guard(this->mutex);
+    this->events.emplace_back();
+    return this->events.back();
+  }
+
+  void commit() {
+    this->committed.store(this->events.size(), std::memory_order_release);
+  }
+
+  size_t size() const { return this->events.size(); }
+
+  template <class F>
+  void for_each(F f) const {
+    for (auto &event : this->events)
+      f(event);
+  }
+
+  template <class F>
+  void snapshot(F f) const {
+    std::lock_guard<Mutex> guard(this->mutex);
+    size_t n = this->committed.load(std::memory_order_acquire);
+    for (size_t i = 0; i < n; ++i)
+      f(this->events[i]);
+  }
+
+  void clear() {
+    std::lock_guard<Mutex> guard(this->mutex);
+    this->events.clear();
+    this->committed.store(0, std::memory_order_release);
+  }
+};
+
+// Keeps nothing. For runs where the events are only consumed by analysis
+// plugins.
+struct DiscardStorage {
+  CATS_Event scratch;
+
+  CATS_Event &next() { return this->scratch; }
+
+  void commit() {}
+
+  size_t size() const { return 0; }
+
+  template <class F>
+  void for_each(F) const {}
+
+  template <class F>
+  void snapshot(F) const {}
+
+  void clear() {}
+};
+
+// Flight recorder: a fixed-size ring keeping the last CATS_RING_EVENTS events
+// (optionally only those of the last CATS_RING_SECONDS). All memory is
+// allocated up front. Every slot carries a sequence number that is odd while
+// the slot is being written, so a dumper thread can copy the ring without
+// stopping the recording thread and discard slots it raced with.
+struct RingStorage {
+  struct Slot {
+    std::atomic<uint64_t> seq{0};
+    CATS_Event event;
+  };
+
+  size_t capacity;
+  uint64_t window_ns;
+  std::unique_ptr<Slot[]> slots;
+  std::atomic<uint64_t> written{0};
+
+  RingStorage()
+    : capacity(ring_config().capacity), window_ns(ring_config().window_ns),
+      slots(new Slot[ring_config().capacity]) {}
+
+  CATS_Event &next() {
+    uint64_t n = this->written.load(std::memory_order_relaxed);
+    Slot &slot = this->slots[n % this->capacity];
+    slot.seq.store(
+      slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed
+    );
+    std::atomic_thread_fence(std::memory_order_release);
+    this->written.store(n + 1, std::memory_order_release);
+    return slot.event;
+  }
+
+  void commit() {
+    uint64_t n = this->written.load(std::memory_order_relaxed);
+    Slot &slot = this->slots[(n - 1) % this->capacity];
+    slot.seq.store(
+      slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release
+    );
+  }
+
+  size_t size() const {
+    uint64_t n = this->written.load(std::memory_order_acquire);
+    return n < this->capacity ? n : this->capacity;
+  }
+
+  template <class F>
+  void for_each(F f) const {
+    uint64_t n = this->written.load(std::memory_order_acquire);
+    uint64_t first = n > this->capacity ? n - this->capacity : 0;
+    uint64_t cutoff = this->cutoff(n);
+    for (uint64_t i = first; i < n; ++i) {
+      const CATS_Event &event = this->slots[i % this->capacity].event;
+      if (event.timestamp >= cutoff)
+        f(event);
+    }
+  }
+
+  template <class F>
+  void snapshot(F f) const {
+    uint64_t n = this->written.load(std::memory_order_acquire);
+    uint64_t first = n > this->capacity ? n - this->capacity : 0;
+    uint64_t cutoff = this->cutoff(n);
+    CATS_Event copy;
+    for (uint64_t i = first; i < n; ++i) {
+      const Slot &slot = this->slots[i % this->capacity];
+      // Generation g of a slot is complete once its sequence number is 2g.
+      uint64_t expected = 2 * (i / this->capacity + 1);
+      if (slot.seq.load(std::memory_order_acquire) != expected)
+        continue;
+      memcpy((void *) &copy, (const void *) &slot.event, sizeof(CATS_Event));
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (slot.seq.load(std::memory_order_relaxed) != expected)
+        continue;
+      if (copy.timestamp >= cutoff)
+        f(copy);
+    }
+  }
+
+  void clear() {
+    for (size_t i = 0; i < this->capacity; ++i)
+      this->slots[i].seq.store(0, std::memory_order_relaxed);
+    this->written.store(0, std::memory_order_release);
+  }
+
+private:
+  uint64_t cutoff(uint64_t n) const {
+    if (!this->window_ns || n == 0)
+      return 0;
+    uint64_t newest = this->slots[(n - 1) % this->capacity].event.timestamp;
+    return newest > this->window_ns ? newest - this->window_ns : 0;
+  }
+};
+
+// ---------------------------------------------------------------------------
+// Threading policies
+// ---------------------------------------------------------------------------
+
+// Per-thread recording state: the scope stack, deduplication state and the
+// events recorded by one thread.
+template <class Dedup, class Storage>
+struct CATS_Thread_State {
+  uint32_t thread = 0;
+  Scope_Stack scope_stack;
+  std::vector<Open_Scope> open_scopes;
+  std::unordered_set<uint64_t> scope_ids;
+  Dedup dedup;
+  Storage events;
+
+  void clear() {
+    this->scope_stack.clear();
+    this->open_scopes.clear();
+    this->scope_ids.clear();
+    this->dedup.clear();
+    this->events.clear();
+  }
+};
+
+// Single shared state holder for the serial threading policies.
+template <class State>
+class Shared_State_Holder {
+public:
+  State &get() { return this->_state; }
+
+  template <class F>
+  void for_each(F f) { f(this->_state); }
+
+  template <class F>
+  void for_each_unlocked(F f) { f(this->_state); }
+
+private:
+  State _state;
+};
+
+// Only the master thread records. Events issued by other threads inside a
+// parallel region are dropped. This is the historic CATS behavior.
+struct ThreadingMasterOnly {
+  static constexpr bool per_thread = false;
+  typedef std::mutex hook_mutex;
+  typedef NullMutex shared_mutex;
+  typedef NullMutex storage_mutex;
+
+  template <class State>
+  using holder = Shared_State_Holder<State>;
+
+  static bool skip() {
+    return omp_in_parallel() && omp_get_thread_num() != 0;
+  }
+};
+
+// The application is single threaded: no locking, no OpenMP queries.
+struct ThreadingSerial {
+  static constexpr bool per_thread = false;
+  typedef NullMutex hook_mutex;
+  typedef NullMutex shared_mutex;
+  typedef NullMutex storage_mutex;
+
+  template <class State>
+  using holder = Shared_State_Holder<State>;
+
+  static bool skip() { return false; }
+};
+
+// Every thread records into its own state. Only the allocation table is
+// shared between threads.
+struct ThreadingPerThread {
+  static constexpr bool per_thread = true;
+  typedef NullMutex hook_mutex;
+  typedef std::mutex shared_mutex;
+  // Dumps run while the other threads record
+  typedef std::mutex storage_mutex;
+
+  template <class State>
+  class holder {
+  public:
+    State &get() {
+      if (!_local) {
+        std::lock_guard<std::mutex> guard(this->_mutex);
+        this->_states.emplace_back(new State());
+        _local = this->_states.back().get();
+        _local->thread = (uint32_t) (this->_states.size() - 1);
+      }
+      return *_local;
+    }
+
+    template <class F>
+    void for_each(F f) {
+      std::lock_guard<std::mutex> guard(this->_mutex);
+      for (auto &state : this->_states)
+        f(*state);
+    }
+
+    // For crash dumps only, which must not wait for a lock the crashing
+    // thread may hold.
+    template <class F>
+    void for_each_unlocked(F f) {
+      for (auto &state : this->_states)
+        f(*state);
+    }
+
+  private:
+    std::mutex _mutex;
+    std::vector<std::unique_ptr<State>> _states;
+    static thread_local State *_local;
+  };
+
+  static bool skip() { return false; }
+};
+
+template <class State>
+thread_local State *ThreadingPerThread::holder<State>::_local = nullptr;
+
+// ---------------------------------------------------------------------------
+// Trace
+// ---------------------------------------------------------------------------
+
+template <class Dedup, class Threading, class Storage>
+class CATS_Trace {
+protected:
+    typedef CATS_Thread_State<Dedup, Storage> State;
+
+    typename Threading::hook_mutex _mutex;
+    typename Threading::shared_mutex _alloc_mutex;
+    typename Threading::template holder<State> _states;
+
+    std::chrono::steady_clock::time_point _start;
+
+    std::map<const void *, CATS_Alloc_Info> _allocations;
+
+    Site_Filter _filter;
+
+    std::string _segment_index_path;
+    std::vector<Segment_Info> _segments;
+
+    // Innermost parallel scope opened by any thread. Worker threads do not
+    // see the parallel scope on their own stack with CATS_THREADING=per_thread.
+    std::atomic<uint64_t> _parallel_scope{0};
+
+    CATS_Event &record_event(State &state,
+                             uint64_t call_id, uint32_t event_type,
+                             const char *funcname, const char *filename,
+                             uint32_t line, uint32_t col) {
+      CATS_Event &event = state.events.next();
+#if CATS_RUNTIME_DEBUG
+      event.call_id = call_id;
+#else
+      (void) call_id;
+#endif
+      event.event_type = event_type;
+      event.thread = state.thread;
+      event.timestamp = this->now();
+
+      if (!funcname || !*funcname)
+        funcname = "$UNKNOWN$";
+      copy_name(
+        event.debug_info.funcname, funcname, CATS_TRACE_FUNC_NAME_SIZE
+      );
+
+      if (!filename || !*filename)
+        filename = "$UNKNOWN$";
+      copy_name(
+        event.debug_info.filename, filename, CATS_TRACE_FILE_NAME_SIZE
+      );
+
+      event.debug_info.line = line;
+      event.debug_info.col = col;
+
+#if CATS_RUNTIME_DEBUG
+      if (state.events.size() % 1'000'000 == 0) {
+        std::cout << "Recorded " << state.events.size() << " events"
+                  << std::endl;
+      }
+#endif
+      return event;
+    }
+
+    uint64_t now() const {
+      return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now() - this->_start
+      ).count();
+    }
+
+    void push_scope(State &state, uint64_t scope_id, uint8_t type,
+                    const char *funcname, const char *filename,
+                    uint32_t line, uint32_t col, bool traced) {
+      state.scope_stack.push_back(scope_id);
+      state.open_scopes.push_back(
+        {scope_id, type, funcname, filename, line, col, traced, {}}
+      );
+      state.dedup.push(scope_id);
+      if (type == CATS_SCOPE_TYPE_PARALLEL)
+        this->_parallel_scope.store(scope_id, std::memory_order_relaxed);
+    }
+
+    uint64_t loop_scope(const State &state) const {
+      for (auto it = state.open_scopes.rbegin();
+           it != state.open_scopes.rend(); ++it) {
+        if (it->type == CATS_SCOPE_TYPE_LOOP)
+          return it->scope_id;
+      }
+      return 0;
+    }
+
+    uint64_t parallel_scope(const State &state) const {
+      for (auto it = state.open_scopes.rbegin();
+           it != state.open_scopes.rend(); ++it) {
+        if (it->type == CATS_SCOPE_TYPE_PARALLEL)
+          return it->scope_id;
+      }
+      return 0;
+    }
+
+    Open_Scope *find_open_scope(State &state, uint64_t scope_id) {
+      for (auto it = state.open_scopes.rbegin();
+           it != state.open_scopes.rend(); ++it) {
+        if (it->scope_id == scope_id)
+          return &*it;
+      }
+      return nullptr;
+    }
+
+    // Sets the resource usage of the exit of `scope`, `now` is sampled on
+    // first use and again if the scope counts the faults of another scope.
+    void exit_rusage(Scope_Exit_Event_Args &args, const Open_Scope *scope,
+                     Rusage_Sample &now) {
+      args.has_rusage = scope && scope->rusage.valid;
+      if (!args.has_rusage)
+        return;
+      if (!now.valid || now.process != scope->rusage.process)
+        rusage_sample(scope->rusage.process, now);
+      args.rss_kb = now.rss_kb;
+      args.rss_delta_kb = (int64_t) now.rss_kb - (int64_t) scope->rusage.rss_kb;
+      args.minor_faults = now.minor_faults - scope->rusage.minor_faults;
+      args.major_faults = now.major_faults - scope->rusage.major_faults;
+    }
+
+    bool scope_traced(const State &state, uint64_t scope_id) const {
+      for (auto it = state.open_scopes.rbegin();
+           it != state.open_scopes.rend(); ++it) {
+        if (it->scope_id == scope_id)
+          return it->traced;
+      }
+      return true;
+    }
+
+    // Finds the allocation containing `address`.
+    bool find_allocation(const void *address, CATS_Alloc_Info &info) {
+      std::lock_guard<typename Threading::shared_mutex> alloc_guard(
+        this->_alloc_mutex
+      );
+      auto it = this->_allocations.lower_bound(address);
+      if (it != this->_allocations.end() && it->first == address) {
+        info = it->second;
+        return true;
+      }
+      if (it == this->_allocations.begin())
+        return false;
+      --it;
+      if (address > ((const char *) it->first) + it->second.size)
+        return false;
+      info = it->second;
+      return true;
+    }
+
+    void pop_scope(State &state) {
+      bool parallel = state.open_scopes.back().type == CATS_SCOPE_TYPE_PARALLEL;
+      state.dedup.pop(state.scope_stack.back());
+      state.scope_stack.pop_back();
+      state.open_scopes.pop_back();
+      if (parallel) {
+        this->_parallel_scope.store(
+          this->parallel_scope(state), std::memory_order_relaxed
+        );
+      }
+    }
+
+    template <class Out>
+    void write_event(Out &ofs, const CATS_Event &event) {
+      ofs << "    {";
+#if CATS_RUNTIME_DEBUG
+      ofs << "\"call_id\": " << event.call_id << ", ";
+#endif
+      if (Threading::per_thread)
+        ofs << "\"thread\": " << event.thread << ", ";
+      ofs << "\"funcname\": \"";
+      ofs << event.debug_info.funcname << "\", ";
+      ofs << "\"filename\": \"";
+      ofs << event.debug_info.filename << "\", ";
+      ofs << "\"line\": " << event.debug_info.line << ", ";
+      ofs << "\"col\": " << event.debug_info.col << ", ";
+      ofs << "\"ts\": " << event.timestamp;
+      switch (event.event_type) {
+        case CATS_EVENT_TYPE_ALLOCATION: {
+          const Allocation_Event_Args &args = event.args.alloc;
+          ofs << ", \"type\": \"allocation\", ";
+          ofs << "\"buffer_name\": \"";
+          ofs << args.buffer_name << "\", ";
+          ofs << "\"buffer_id\": " << args.buffer_id << ", ";
+          ofs << "\"size\": " << args.size;
+          break;
+        }
+        case CATS_EVENT_TYPE_DEALLOCATION: {
+          const Deallocation_Event_Args &args = event.args.dealloc;
+          ofs << ", \"type\": \"deallocation\", ";
+          ofs << "\"buffer_name\": \"";
+          ofs << args.buffer_name << "\", ";
+          ofs << "\"buffer_id\": " << args.buffer_id;
+          break;
+        }
+        case CATS_EVENT_TYPE_ACCESS: {
+          const Access_Event_Args &args = event.args.access;
+          ofs << ", \"type\": \"access\", ";
+          ofs << "\"mode\": ";
+          ofs << (args.is_write ? "\"w\"" : "\"r\"") << ", ";
+          ofs << "\"buffer_name\": \"";
+          ofs << args.buffer_name << "\", ";
+          ofs << "\"buffer_id\": " << args.buffer_id << ", ";
+          ofs << "\"offset\": " << args.offset << ", ";
+          ofs << "\"size\": " << args.size;
+          if (args.site && args.site->shape)
+            write_array_shape(ofs, *args.site);
+          break;
+        }
+        case CATS_EVENT_TYPE_SCOPE_ENTRY: {
+          const Scope_Entry_Event_Args &args = event.args.scope_entry;
+          ofs << ", \"type\": \"scope_entry\", ";
+          switch (args.type) {
+            case CATS_SCOPE_TYPE_FUNCTION:
+              ofs << "\"scope_type\": \"func\", ";
+              break;
+            case CATS_SCOPE_TYPE_LOOP:
+              ofs << "\"scope_type\": \"loop\", ";
+              break;
+            case CATS_SCOPE_TYPE_CONDITIONAL:
+              ofs << "\"scope_type\": \"cond\", ";
+              break;
+            case CATS_SCOPE_TYPE_PARALLEL:
+              ofs << "\"scope_type\": \"para\", ";
+              break;
+            case CATS_SCOPE_TYPE_UNSTRUCTURED:
+              ofs << "\"scope_type\": \"unst\", ";
+              break;
+            default:
+              ofs << "\"scope_type\": \"n/a\", ";
+          }
+          ofs << "\"id\": " << args.scope_id;
+          if (args.has_rusage)
+            ofs << ", \"rss_kb\": " << args.rss_kb;
+          break;
+        }
+        case CATS_EVENT_TYPE_SCOPE_EXIT: {
+          const Scope_Exit_Event_Args &args = event.args.scope_exit;
+          ofs << ", \"type\": \"scope_exit\", ";
+          ofs << "\"id\": " << args.scope_id;
+          if (args.has_rusage) {
+            ofs << ", \"rss_kb\": " << args.rss_kb << ", ";
+            ofs << "\"rss_delta_kb\": " << args.rss_delta_kb << ", ";
+            ofs << "\"minor_faults\": " << args.minor_faults << ", ";
+            ofs << "\"major_faults\": " << args.major_faults;
+          }
+          break;
+        }
+        case CATS_EVENT_TYPE_IO: {
+          const Io_Event_Args &args = event.args.io;
+          ofs << ", \"type\": \"io\", ";
+          ofs << "\"op\": \"" << io_op_name(args.op) << "\", ";
+          ofs << "\"fd\": " << args.fd << ", ";
+          ofs << "\"path\": \"" << args.path << "\", ";
+          ofs << "\"buffer_id\": " << args.buffer_id << ", ";
+          ofs << "\"bytes\": " << args.bytes;
+          break;
+        }
+        case CATS_EVENT_TYPE_ATOMIC: {
+          const Atomic_Event_Args &args = event.args.atomic;
+          ofs << ", \"type\": \"atomic\", ";
+          ofs << "\"op\": \"" << atomic_op_name(args.op) << "\", ";
+          ofs << "\"buffer_name\": \"" << args.buffer_name << "\", ";
+          ofs << "\"buffer_id\": " << args.buffer_id << ", ";
+          ofs << "\"size\": " << args.size;
+          break;
+        }
+        case CATS_EVENT_TYPE_WORKSHARE: {
+          const Workshare_Event_Args &args = event.args.workshare;
+          ofs << ", \"type\": \"workshare\", ";
+          ofs << "\"schedule\": \"" << (args.schedule == CATS_WORKSHARE_STATIC
+            ? "static" : "dynamic") << "\", ";
+          ofs << "\"omp_thread\": " << args.omp_thread << ", ";
+          ofs << "\"parallel_scope\": " << args.parallel_scope_id << ", ";
+          ofs << "\"lower\": " << args.lower << ", ";
+          ofs << "\"upper\": " << args.upper << ", ";
+          ofs << "\"stride\": " << args.stride;
+          break;
+        }
+        case CATS_EVENT_TYPE_SYNC: {
+          const Sync_Event_Args &args = event.args.sync;
+          ofs << ", \"type\": \"sync\", ";
+          ofs << "\"kind\": \"" << sync_kind_name(args.kind) << "\", ";
+          ofs << "\"phase\": \"" << sync_phase_name(args.phase) << "\", ";
+          ofs << "\"object\": " << args.object << ", ";
+          ofs << (args.phase == CATS_SYNC_ACQUIRE
+            ? "\"wait_ns\": " : "\"hold_ns\": ") << args.duration;
+          break;
+        }
+      }
+      ofs << "}";
+    }
+
+public:
+  CATS_Trace()
+    : _start(std::chrono::steady_clock::now()),
+      _segment_index_path(config::get_string(
+        "CATS_SEGMENT_INDEX", "cats_trace.segments"
+      )) {}
+
+  ~CATS_Trace() {
+    this->reset();
+  }
+
+  void reset() {
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    this->_states.for_each([](State &state) { state.clear(); });
+    {
+      std::lock_guard<typename Threading::shared_mutex> alloc_guard(
+        this->_alloc_mutex
+      );
+      this->_allocations.clear();
+    }
+    this->_segments.clear();
+    this->_start = std::chrono::steady_clock::now();
+  }
+
+  void instrument_alloc(
+    uint64_t call_id,
+    const char *buffer_name, void *address, size_t size,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (Threading::skip()) {
+      // If we are in a parallel region, only the master thread should exit
+      // the scope, so we skip this call.
+      return;
+    }
+
+    if (!buffer_name || !*buffer_name)
+      buffer_name = "$UNKNOWN$";
+
+    bool record = true;
+    if (this->_filter.enabled()) {
+      uint8_t site = this->_filter.site(
+        call_id, funcname, filename, -1, buffer_name
+      );
+      if (!(site & Site_Filter::SITE_BUFFER) ||
+          !this->_filter.accept_size(size)) {
+        // Buffers that are not traced are not registered either, so their
+        // accesses and deallocation are dropped.
+        return;
+      }
+      record = site & Site_Filter::SITE_RECORD;
+    }
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    State &state = this->_states.get();
+
+    if (state.dedup.already_recorded(call_id, state.scope_stack)) {
+      // If this call has already been recorded, skip the allocation
+      return;
+    }
+
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ALLOCATIONS
+    std::cout << "Allocating " << buffer_name
+              << " at " << address << " in " << funcname << " (" << size
+              << " bytes)" << std::endl;
+#endif
+
+    if (record && this->_filter.accept_depth(state.scope_stack.size())) {
+      CATS_Event &event = this->record_event(
+        state, call_id, CATS_EVENT_TYPE_ALLOCATION, funcname, filename, line,
+        col
+      );
+      Allocation_Event_Args &args = event.args.alloc;
+      copy_name(args.buffer_name, buffer_name, CATS_TRACE_BUFFER_NAME_SIZE);
+      args.size = size;
+      args.buffer_id = (size_t) address;
+      state.events.commit();
+    }
+
+    CATS_Alloc_Info alloc_info;
+    copy_name(
+      alloc_info.buffer_name, buffer_name, CATS_TRACE_BUFFER_NAME_SIZE
+    );
+    alloc_info.buffer_id = (size_t) address;
+    alloc_info.size = size;
+
+    std::lock_guard<typename Threading::shared_mutex> alloc_guard(
+      this->_alloc_mutex
+    );
+    this->_allocations[address] = alloc_info;
+  }
+
+  void instrument_dealloc(
+    uint64_t call_id,
+    void *address, const char *funcname, const char *filename,
+    uint32_t line, uint32_t col
+  ) {
+    if (Threading::skip()) {
+      // If we are in a parallel region, only the master thread should exit
+      // the scope, so we skip this call.
+      return;
+    }
+
+    // A rejected deallocation site must still release the buffer, otherwise
+    // a later allocation at the same address would be misattributed.
+    bool record = !this->_filter.enabled() || (
+      this->_filter.site(call_id, funcname, filename, -1, nullptr) &
+      Site_Filter::SITE_RECORD
+    );
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    State &state = this->_states.get();
+
+    if (state.dedup.already_recorded(call_id, state.scope_stack)) {
+      // If this call has already been recorded, skip the allocation
+      return;
+    }
+
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ALLOCATIONS
+    std::cout << "Deallocating at " << address
+              << " in " << funcname << std::endl;
+#endif
+
+    CATS_Alloc_Info alloc_info;
+    {
+      std::lock_guard<typename Threading::shared_mutex> alloc_guard(
+        this->_alloc_mutex
+      );
+      auto it = this->_allocations.find(address);
+      if (it == this->_allocations.end())
+        return;
+      alloc_info = it->second;
+      this->_allocations.erase(it);
+    }
+
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ALLOCATIONS
+    std::cout << "Deallocating " << alloc_info.buffer_name
+              << std::endl;
+#endif
+
+    if (!record || !this->_filter.accept_depth(state.scope_stack.size()))
+      return;
+
+    CATS_Event &event = this->record_event(
+      state, call_id, CATS_EVENT_TYPE_DEALLOCATION, funcname, filename, line,
+      col
+    );
+    Deallocation_Event_Args &args = event.args.dealloc;
+    copy_name(
+      args.buffer_name, alloc_info.buffer_name, CATS_TRACE_BUFFER_NAME_SIZE
+    );
+    args.buffer_id = alloc_info.buffer_id;
+    state.events.commit();
+  }
+
+  void instrument_access(
+    uint64_t call_id,
+    void *address, size_t size, bool is_write, const char *funcname,
+    const char *filename, uint32_t line, uint32_t col
+  ) {
+    // If we are in a parallel region, only the master thread should record
+    // the access. The heatmaps still count it.
+    bool skip = Threading::skip();
+    if (skip && !heatmap_enabled())
+      return;
+
+    if (this->_filter.enabled() &&
+        !(this->_filter.site(call_id, funcname, filename, -1, nullptr) &
+          Site_Filter::SITE_RECORD)) {
+      return;
+    }
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    if (skip) {
+      CATS_Alloc_Info alloc_info;
+      if (this->find_allocation(address, alloc_info)) {
+        heatmap_access(
+          alloc_info.buffer_id, alloc_info.buffer_name, alloc_info.size,
+          this->_parallel_scope.load(std::memory_order_relaxed),
+          (uint64_t) address - alloc_info.buffer_id, size, is_write
+        );
+      }
+      return;
+    }
+    State &state = this->_states.get();
+
+    if (!this->_filter.accept_depth(state.scope_stack.size()))
+      return;
+
+    // Field accesses and heatmaps are counted before deduplication. The
+    // site is only looked up here if field sites are registered, otherwise
+    // just for the events that are recorded.
+    bool site_known = field_sites_registered();
+    const cats_site_info *site = site_known ? find_site(call_id) : nullptr;
+    bool fields = site && site->struct_name;
+    if (fields || heatmap_enabled()) {
+      CATS_Alloc_Info alloc_info;
+      if (this->find_allocation(address, alloc_info)) {
+        if (fields) {
+          field_accessed(
+            *site, alloc_info.buffer_id, alloc_info.buffer_name,
+            this->loop_scope(state), is_write
+          );
+        }
+        if (heatmap_enabled()) {
+          heatmap_access(
+            alloc_info.buffer_id, alloc_info.buffer_name, alloc_info.size,
+            this->_parallel_scope.load(std::memory_order_relaxed),
+            (uint64_t) address - alloc_info.buffer_id, size, is_write
+          );
+        }
+      }
+    }
+
+    if (state.dedup.already_recorded(call_id, state.scope_stack)) {
+      // If this call has already been recorded, skip the allocation
+      return;
+    }
+
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ACCESSES
+    std::cout << "Accessing " << (is_write ? "write" : "read")
+              << " at " << address << " in " << funcname
+              << std::endl;
+#endif
+
+    char buffer_name[CATS_TRACE_BUFFER_NAME_SIZE] = {0};
+    uint64_t buffer_id = 0;
+    CATS_Alloc_Info alloc_info;
+    if (this->find_allocation(address, alloc_info)) {
+      copy_name(
+        buffer_name, alloc_info.buffer_name, CATS_TRACE_BUFFER_NAME_SIZE
+      );
+      buffer_id = alloc_info.buffer_id;
+    }
+
+    const char *actual_buffer_name = buffer_name;
+    if (!*buffer_name)
+      actual_buffer_name = "$UNKNOWN$";
+
+    if (buffer_id != 0) {
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_ACCESSES
+      std::cout << "Accessing " << actual_buffer_name << std::endl;
+#endif
+
+      CATS_Event &event = this->record_event(
+        state, call_id, CATS_EVENT_TYPE_ACCESS, funcname, filename, line, col
+      );
+      Access_Event_Args &args = event.args.access;
+      copy_name(
+        args.buffer_name, actual_buffer_name, CATS_TRACE_BUFFER_NAME_SIZE
+      );
+      args.buffer_id = buffer_id;
+      args.offset = (uint64_t) address - buffer_id;
+      args.size = size;
+      args.is_write = is_write;
+      args.site = site_known ? site : find_site(call_id);
+      state.events.commit();
+    }
+  }
+
+  void instrument_scope_entry(
+    uint64_t call_id,
+    uint64_t scope_id, uint8_t type, const char *funcname,
+    const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (Threading::skip()) {
+      // If we are in a parallel region, only the master thread should exit
+      // the scope, so we skip this call.
+      return;
+    }
+
+    bool record = !this->_filter.enabled() || (
+      this->_filter.site(call_id, funcname, filename, type, nullptr) &
+      Site_Filter::SITE_RECORD
+    );
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    State &state = this->_states.get();
+
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_SCOPES
+    std::cout << "Entering scope " << scope_id
+              << " of type " << (int) type
+              << " in " << funcname << std::endl;
+#endif
+
+    // The scope must be entered regardless of whether it has been
+    // recorded before, so we push it onto the stack
+    record = record && this->_filter.accept_depth(
+      state.scope_stack.size() + 1
+    );
+    this->push_scope(
+      state, scope_id, type, funcname, filename, line, col, record
+    );
+    state.scope_ids.insert(scope_id);
+
+    if (!record)
+      return;
+
+    if (state.dedup.already_recorded(call_id, state.scope_stack)) {
+      // If this call has already been recorded, skip the allocation
+      return;
+    }
+
+    // Only sampled for entries that are recorded, the exit reports the
+    // change if the sample is valid
+    Rusage_Sample &rusage = state.open_scopes.back().rusage;
+    rusage_sample_entry(type, rusage);
+
+    CATS_Event &event = this->record_event(
+      state, call_id, CATS_EVENT_TYPE_SCOPE_ENTRY, funcname, filename, line,
+      col
+    );
+    event.args.scope_entry.scope_id = scope_id;
+    event.args.scope_entry.type = type;
+    event.args.scope_entry.has_rusage = rusage.valid;
+    event.args.scope_entry.rss_kb = rusage.rss_kb;
+    state.events.commit();
+  }
+
+  void instrument_scope_exit(
+    uint64_t call_id,
+    uint64_t scope_id, uint8_t scope_type, const char *funcname,
+    const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (Threading::skip()) {
+      // If we are in a parallel region, only the master thread should exit
+      // the scope, so we skip this call.
+      return;
+    }
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    State &state = this->_states.get();
+
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_SCOPES
+    std::cout << "Exiting scope " << scope_id
+              << " in " << funcname << std::endl;
+#endif
+
+    if (state.scope_ids.erase(scope_id) == 0) {
+#if CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
+        std::cout << "Warning: Scope " << scope_id;
+        std::cout << " not found." << std::endl;
+#endif
+        return;
+    }
+
+    bool recorded = false;
+    if (state.dedup.already_recorded(call_id, state.scope_stack)) {
+      // If this call has already been recorded, skip the allocation
+      recorded = true;
+    }
+
+    Rusage_Sample rusage{};
+    if (!recorded && this->scope_traced(state, scope_id)) {
+      CATS_Event &event = this->record_event(
+        state, call_id, CATS_EVENT_TYPE_SCOPE_EXIT, funcname, filename, line,
+        col
+      );
+      event.args.scope_exit.scope_id = scope_id;
+      this->exit_rusage(
+        event.args.scope_exit, this->find_open_scope(state, scope_id), rusage
+      );
+      state.events.commit();
+    }
+
+    while (!state.scope_stack.empty() &&
+           state.scope_stack.back() != scope_id) {
+      auto top = state.scope_stack.back();
+
+      if (!recorded && state.open_scopes.back().traced) {
+        CATS_Event &inferred = this->record_event(
+          state, call_id, CATS_EVENT_TYPE_SCOPE_EXIT, funcname, filename,
+          line, col
+        );
+        inferred.args.scope_exit.scope_id = top;
+        this->exit_rusage(
+          inferred.args.scope_exit, &state.open_scopes.back(), rusage
+        );
+        state.events.commit();
+      }
+
+#if CATS_RUNTIME_DEBUG && CATS_RUNTIME_PRINT_SCOPES
+    std::cout << " -> Exiting scope " << top
+              << " as a consequence" << std::endl;
+#endif
+
+      this->pop_scope(state);
+      if (state.scope_ids.erase(top) == 0) {
+#if CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
+        std::cout << "Warning: Scope " << scope_id;
+        std::cout << " not found." << std::endl;
+#endif
+      }
+    }
+
+    if (state.scope_stack.empty() || state.scope_stack.back() != scope_id) {
+#if CATS_RUNTIME_WARN_ON_SCOPE_EXIT_NOT_FOUND
+      if (scope_type != CATS_SCOPE_TYPE_PARALLEL) {
+        // We suppress the warning for parallel scopes since there can be
+        // multiple exits from parallel regions.
+        // TODO: This is a workaround, we should handle parallel scopes
+        // differently and correctly insert only one exit.
+        std::cout << "Warning: Exiting scope " << scope_id << " not found. ";
+        std::cout << "This is likely an error leading to an incorrect trace. ";
+        std::cout << "(Scope type:" << (int) scope_type << ")";
+        std::cout << std::endl;
+      }
+#else
+      (void) scope_type;
+#endif
+    } else {
+      this->pop_scope(state);
+    }
+  }
+
+  void instrument_io(
+    uint64_t call_id,
+    uint8_t op, int32_t fd, void *stream, void *address, int64_t bytes,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (Threading::skip()) {
+      // If we are in a parallel region, only the master thread should exit
+      // the scope, so we skip this call.
+      return;
+    }
+
+    bool record = !this->_filter.enabled() || (
+      this->_filter.site(call_id, funcname, filename, -1, nullptr) &
+      Site_Filter::SITE_RECORD
+    );
+
+    if (stream && fd < 0)
+      fd = fileno((FILE *) stream);
+
+    // Only recorded events and mapped regions need the path
+    const char *path = "";
+    {
+      std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+      State &state = this->_states.get();
+
+      if (record && this->_filter.accept_depth(state.scope_stack.size()) &&
+          !state.dedup.already_recorded(call_id, state.scope_stack)) {
+        CATS_Event &event = this->record_event(
+          state, call_id, CATS_EVENT_TYPE_IO, funcname, filename, line, col
+        );
+        Io_Event_Args &args = event.args.io;
+        path = fd_path(fd);
+        copy_path(args.path, path, CATS_TRACE_BUFFER_NAME_SIZE);
+        args.fd = fd;
+        args.op = op;
+        args.bytes = bytes;
+        args.buffer_id = 0;
+        CATS_Alloc_Info alloc_info;
+        if (op == CATS_IO_MMAP) {
+          args.buffer_id = (size_t) address;
+        } else if (this->find_allocation(address, alloc_info)) {
+          args.buffer_id = alloc_info.buffer_id;
+        }
+        state.events.commit();
+      } else if (op == CATS_IO_MMAP) {
+        path = fd_path(fd);
+      }
+    }
+
+    // Mapped regions are traced like allocations. The allocation uses its
+    // own call ID, the I/O event has already been deduplicated under this
+    // one.
+    if (op == CATS_IO_MMAP && address != MAP_FAILED_ADDRESS) {
+      char name[CATS_TRACE_BUFFER_NAME_SIZE];
+      copy_path(name, *path ? path : "mmap", sizeof(name));
+      this->instrument_alloc(
+        ~call_id, name, address, (size_t) bytes, funcname, filename, line,
+        col
+      );
+    } else if (op == CATS_IO_MUNMAP) {
+      this->instrument_dealloc(
+        ~call_id, address, funcname, filename, line, col
+      );
+    }
+  }
+
+  // Failed compare-exchanges are only counted in the sync profile.
+  void instrument_atomic(
+    uint64_t call_id,
+    void *address, size_t size, uint8_t op, bool success,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    (void) success;
+    if (Threading::skip()) {
+      // If we are in a parallel region, only the master thread should exit
+      // the scope, so we skip this call.
+      return;
+    }
+
+    if (this->_filter.enabled() &&
+        !(this->_filter.site(call_id, funcname, filename, -1, nullptr) &
+          Site_Filter::SITE_RECORD)) {
+      return;
+    }
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    State &state = this->_states.get();
+
+    if (!this->_filter.accept_depth(state.scope_stack.size()))
+      return;
+
+    if (state.dedup.already_recorded(call_id, state.scope_stack))
+      return;
+
+    // Like accesses, atomics on buffers that are not traced are dropped.
+    CATS_Alloc_Info alloc_info;
+    if (!this->find_allocation(address, alloc_info))
+      return;
+
+    CATS_Event &event = this->record_event(
+      state, call_id, CATS_EVENT_TYPE_ATOMIC, funcname, filename, line, col
+    );
+    Atomic_Event_Args &args = event.args.atomic;
+    copy_name(
+      args.buffer_name, alloc_info.buffer_name, CATS_TRACE_BUFFER_NAME_SIZE
+    );
+    args.buffer_id = alloc_info.buffer_id;
+    args.size = size;
+    args.op = op;
+    state.events.commit();
+  }
+
+  void instrument_sync(
+    uint64_t call_id,
+    uint8_t kind, uint8_t phase, void *object, uint64_t duration,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (Threading::skip()) {
+      // If we are in a parallel region, only the master thread should exit
+      // the scope, so we skip this call.
+      return;
+    }
+
+    if (this->_filter.enabled() &&
+        !(this->_filter.site(call_id, funcname, filename, -1, nullptr) &
+          Site_Filter::SITE_RECORD)) {
+      return;
+    }
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    State &state = this->_states.get();
+
+    if (!this->_filter.accept_depth(state.scope_stack.size()))
+      return;
+
+    if (state.dedup.already_recorded(call_id, state.scope_stack))
+      return;
+
+    CATS_Event &event = this->record_event(
+      state, call_id, CATS_EVENT_TYPE_SYNC, funcname, filename, line, col
+    );
+    Sync_Event_Args &args = event.args.sync;
+    args.object = (size_t) object;
+    args.duration = duration;
+    args.kind = kind;
+    args.phase = phase;
+    state.events.commit();
+  }
+
+  // Recorded from all threads, even with CATS_THREADING=master, and never
+  // deduplicated: every chunk is distinct.
+  void instrument_workshare(
+    uint64_t call_id,
+    uint8_t schedule, int64_t lower, int64_t upper, int64_t stride,
+    const char *funcname, const char *filename, uint32_t line, uint32_t col
+  ) {
+    if (upper <= lower)
+      return;
+
+    if (this->_filter.enabled() &&
+        !(this->_filter.site(call_id, funcname, filename, -1, nullptr) &
+          Site_Filter::SITE_RECORD)) {
+      return;
+    }
+
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    State &state = this->_states.get();
+
+    uint64_t parallel_scope_id = this->parallel_scope(state);
+    if (!parallel_scope_id)
+      parallel_scope_id = this->_parallel_scope.load(std::memory_order_relaxed);
+
+    CATS_Event &event = this->record_event(
+      state, call_id, CATS_EVENT_TYPE_WORKSHARE, funcname, filename, line, col
+    );
+    Workshare_Event_Args &args = event.args.workshare;
+    args.parallel_scope_id = parallel_scope_id;
+    args.lower = lower;
+    args.upper = upper;
+    args.stride = stride;
+    args.omp_thread = (uint32_t) omp_get_thread_num();
+    args.schedule = schedule;
+    state.events.commit();
+  }
+
+  void save(const char *filepath) {
+    (void) filepath;
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    if (this->_segments.empty()) {
+      this->write_trace("cats_trace.cats", false);
+    } else {
+      // The trace was checkpointed before, the remainder becomes the last
+      // segment of the chain.
+      this->write_segment("cats_trace.cats");
+    }
+  }
+
+  // Writes the events recorded so far without disturbing the recording.
+  void dump(const char *filepath) {
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    this->write_trace(filepath ? filepath : "cats_trace.dump.cats", true);
+  }
+
+  // Last resort dump from a fatal signal handler. The hook mutex is not
+  // taken since the crashing thread may be holding it, and the events are
+  // formatted without allocating. The profiles take locks and are left out.
+  void crash_dump(const char *filepath) {
+    int fd = open(filepath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0)
+      return;
+    {
+      Raw_Writer out(fd);
+      out << "{\n  \"events\": [\n";
+      bool first = true;
+      this->_states.for_each_unlocked([&](State &state) {
+        state.events.snapshot([&](const CATS_Event &event) {
+          if (!first)
+            out << ",\n";
+          first = false;
+          this->write_event(out, event);
+        });
+      });
+      out << "\n  ]\n}\n";
+    }
+    close(fd);
+  }
+
+  // Writes all events since the previous checkpoint to a new segment file
+  // and releases them. Deduplication starts over, so every segment holds the
+  // complete structure of its phase, and it begins with entries for the
+  // scopes that are still open. Must not race with other recording threads,
+  // i.e., call it outside of parallel regions.
+  void checkpoint(const char *filepath) {
+    std::lock_guard<typename Threading::hook_mutex> guard(this->_mutex);
+    std::string path;
+    if (filepath && *filepath) {
+      path = filepath;
+    } else {
+      std::stringstream ss;
+      ss << "cats_trace." << this->_segments.size() << ".cats";
+      path = ss.str();
+    }
+    this->write_segment(path);
+
+    this->_states.for_each([&](State &state) {
+      state.events.clear();
+      state.dedup.clear();
+      for (auto &scope : state.scope_stack)
+        state.dedup.push(scope);
+      for (auto &scope : state.open_scopes) {
+        if (!scope.traced)
+          continue;
+        CATS_Event &event = this->record_event(
+          state, 0, CATS_EVENT_TYPE_SCOPE_ENTRY, scope.funcname,
+          scope.filename, scope.line, scope.col
+        );
+        event.args.scope_entry.scope_id = scope.scope_id;
+        event.args.scope_entry.type = scope.type;
+        event.args.scope_entry.has_rusage = false;
+        state.events.commit();
+      }
+    });
+  }
+
+protected:
+  void write_segment(const std::string &path) {
+    Segment_Info segment;
+    segment.path = path;
+    segment.ts_begin =
+      this->_segments.empty() ? 0 : this->_segments.back().ts_end;
+    segment.ts_end = this->now();
+    segment.n_events = 0;
+    this->_states.for_each([&](State &state) {
+      segment.n_events += state.events.size();
+    });
+
+    std::ofstream ofs(path, std::ios::binary);
+    ofs << "{" << std::endl;
+    ofs << "  \"segment\": [" << std::endl;
+    ofs << "    {\"index\": " << this->_segments.size() << ", ";
+    ofs << "\"previous\": \"";
+    if (!this->_segments.empty())
+      ofs << this->_segments.back().path;
+    ofs << "\", ";
+    ofs << "\"ts_begin\": " << segment.ts_begin << ", ";
+    ofs << "\"ts_end\": " << segment.ts_end << "}" << std::endl;
+    ofs << "  ]," << std::endl;
+    this->write_events(ofs, false);
+    write_sync_profile(ofs, true);
+    write_parallel_profile(ofs, true);
+    write_field_profile(ofs, true);
+    write_roofline_profile(ofs, true);
+    write_memory_profile(ofs, true);
+    write_heatmap_profile(ofs, true);
+    write_alloc_sites_profile(ofs, true);
+    ofs << std::endl << "}" << std::endl;
+
+    this->_segments.push_back(segment);
+    this->write_segment_index();
+  }
+
+  void write_segment_index() {
+    std::ofstream ofs(this->_segment_index_path, std::ios::binary);
+    ofs << "{" << std::endl;
+    ofs << "  \"segments\": [" << std::endl;
+    for (size_t i = 0; i < this->_segments.size(); ++i) {
+      const Segment_Info &segment = this->_segments[i];
+      ofs << "    {\"index\": " << i << ", ";
+      ofs << "\"path\": \"" << segment.path << "\", ";
+      ofs << "\"events\": " << segment.n_events << ", ";
+      ofs << "\"ts_begin\": " << segment.ts_begin << ", ";
+      ofs << "\"ts_end\": " << segment.ts_end << "}";
+      if (i + 1 < this->_segments.size())
+        ofs << ",";
+      ofs << std::endl;
+    }
+    ofs << "  ]" << std::endl;
+    ofs << "}" << std::endl;
+  }
+
+  void write_events(std::ostream &ofs, bool concurrent) {
+    ofs << "  \"events\": [" << std::endl;
+    bool first = true;
+    auto write = [&](const CATS_Event &event) {
+      if (!first) {
+        ofs << "," << std::endl;
+      }
+      first = false;
+      this->write_event(ofs, event);
+    };
+    this->_states.for_each([&](State &state) {
+      if (concurrent)
+        state.events.snapshot(write);
+      else
+        state.events.for_each(write);
+    });
+    ofs << std::endl << "  ]";
+  }
+
+  void write_trace(const char *filepath, bool concurrent) {
+    std::ofstream ofs(filepath, std::ios::binary);
+    ofs << "{" << std::endl;
+    this->write_events(ofs, concurrent);
+    write_sync_profile(ofs, false);
+    write_parallel_profile(ofs, false);
+    write_field_profile(ofs, false);
+    write_roofline_profile(ofs, false);
+    write_memory_profile(ofs, false);
+    write_heatmap_profile(ofs, false);
+    write_alloc_sites_profile(ofs, false);
+    ofs << std::endl << "}" << std::endl;
+  }
+
+};
+
+} // namespace cats
+
+#endif // __CATS_TRACE_HPP__
@@ -0,0 +1,59 @@
+# Runs a trace tool in a test (see CMakeLists.txt):
+#
+#   cmake -DTOOL=tool -DARGS="args" -DEXPECTED=file [-DOUTPUT=file]
+#         [-DCOMPILER=c++] -P check_tool.cmake
+#
+# Every line of EXPECTED is a regular expression that must match a whole
+# line of the standard output of the tool, or of OUTPUT if it names the file
+# the tool writes. With COMPILER, OUTPUT is a C++ program that is compiled
+# and run as well.
+
+separate_arguments(args UNIX_COMMAND "${ARGS}")
+execute_process(COMMAND ${TOOL} ${args}
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE error
+)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${TOOL} failed (${result}):\n${error}")
+endif()
+if (OUTPUT)
+    file(READ ${OUTPUT} output)
+endif()
+
+# The lines are split by hand, fold's stacks hold `;`.
+file(READ ${EXPECTED} expected)
+while (NOT expected STREQUAL "")
+    string(FIND "${expected}" "\n" end)
+    if (end EQUAL -1)
+        set(line "${expected}")
+        set(expected "")
+    else()
+        string(SUBSTRING "${expected}" 0 ${end} line)
+        math(EXPR end "${end} + 1")
+        string(SUBSTRING "${expected}" ${end} -1 expected)
+    endif()
+    if (NOT line STREQUAL "")
+        string(REGEX MATCH "(^|\n)${line}(\n|$)" found "${output}")
+        if (NOT found)
+            message(FATAL_ERROR "No line matches '${line}' in:\n${output}")
+        endif()
+    endif()
+endwhile()
+
+if (COMPILER)
+    execute_process(COMMAND ${COMPILER} -std=c++17 -O1 ${OUTPUT} -o proxy
+        RESULT_VARIABLE result
+        ERROR_VARIABLE error
+    )
+    if (NOT result EQUAL 0)
+        message(FATAL_ERROR "Compiling ${OUTPUT} failed:\n${error}")
+    endif()
+    execute_process(COMMAND ./proxy
+        RESULT_VARIABLE result
+        OUTPUT_VARIABLE output
+    )
+    if (NOT result EQUAL 0 OR NOT output MATCHES "^time ")
+        message(FATAL_ERROR "The proxy failed (${result}):\n${output}")
+    endif()
+endif()
@@ -1,57 +1,900 @@
 // Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
 
+// Behavior checks of the runtime. The mode is selected from the environment
+// when the library is loaded, so every case runs in a process of its own,
+// started by CTest with the environment of the case (see CMakeLists.txt) in
+// a directory of its own, and checks the trace it wrote:
+//
+//   test_cats_runtime <case>
+
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <omp.h>
+#include <pthread.h>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "../runtime/cats_runtime.h"
 
-int main() {
-  cats_trace_reset();
+static int failures = 0;
 
-  // Simulate a function scope
-  cats_trace_instrument_scope_entry(
-    1, 0, CATS_SCOPE_TYPE_FUNCTION, __func__, __FILE__, __LINE__, 0
-  );
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, \
+              #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+// Contents of `path`, NULL if it cannot be read. Never freed.
+static char *read_file(const char *path) {
+  FILE *file = fopen(path, "rb");
+  if (!file)
+    return NULL;
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+  char *text = (char *) malloc(size + 1);
+  size_t n = fread(text, 1, size, file);
+  text[n] = '\0';
+  fclose(file);
+  return text;
+}
+
+// Number of occurrences of `needle` in `text`.
+static int count(const char *text, const char *needle) {
+  int n = 0;
+  if (!text)
+    return 0;
+  for (const char *it = strstr(text, needle); it;
+       it = strstr(it + 1, needle))
+    ++n;
+  return n;
+}
+
+// The section `name` of a trace, an empty string if there is none. Never
+// freed.
+static char *section(const char *trace, const char *name) {
+  char key[64];
+  snprintf(key, sizeof(key), "\"%s\": [", name);
+  const char *begin = trace ? strstr(trace, key) : NULL;
+  if (!begin)
+    return (char *) calloc(1, 1);
+  const char *end = strstr(begin, "\n  ]");
+  size_t length = end ? (size_t) (end - begin) : strlen(begin);
+  char *copy = (char *) malloc(length + 1);
+  memcpy(copy, begin, length);
+  copy[length] = '\0';
+  return copy;
+}
+
+// Saves the trace and returns its contents.
+static char *save_trace(void) {
+  cats_trace_save(NULL);
+  char *trace = read_file("cats_trace.cats");
+  CHECK(trace != NULL);
+  return trace;
+}
+
+#define ENTER(call_id, scope_id, type) \
+  cats_trace_instrument_scope_entry( \
+    call_id, scope_id, type, __func__, __FILE__, __LINE__, 0 \
+  )
+#define EXIT(call_id, scope_id, type) \
+  cats_trace_instrument_scope_exit( \
+    call_id, scope_id, type, __func__, __FILE__, __LINE__, 0 \
+  )
+
+// A function with a loop of ten iterations that writes and reads the first
+// element of an array.
+static void run_loop(void) {
+  ENTER(1, 0, CATS_SCOPE_TYPE_FUNCTION);
 
-  // Simulate an allocation
-  int *arr = (int*)malloc(10 * sizeof(int));
+  int *arr = (int *) malloc(10 * sizeof(int));
   cats_trace_instrument_alloc(
     2, "arr", arr, 10 * sizeof(int), __func__, __FILE__, __LINE__, 0
   );
 
-  // Simulate entering a loop
-  cats_trace_instrument_scope_entry(
-    1, 1, CATS_SCOPE_TYPE_LOOP, __func__, __FILE__, __LINE__, 0
-  );
-
+  ENTER(3, 1, CATS_SCOPE_TYPE_LOOP);
   for (int i = 0; i < 10; i++) {
-    // Simulate a write
     arr[0] = 42;
-    cats_trace_instrument_write(3, arr, __func__, __FILE__, __LINE__, 0);
+    cats_trace_instrument_write(4, arr, __func__, __FILE__, __LINE__, 0);
+    volatile int x = arr[0];
+    (void) x;
+    cats_trace_instrument_read(5, arr, __func__, __FILE__, __LINE__, 0);
+  }
+  EXIT(6, 1, CATS_SCOPE_TYPE_LOOP);
+
+  cats_trace_instrument_dealloc(7, arr, __func__, __FILE__, __LINE__, 0);
+  free(arr);
+
+  EXIT(8, 0, CATS_SCOPE_TYPE_FUNCTION);
+}
 
-    // Simulate a read
-    int x = arr[0];
-    cats_trace_instrument_read(4, arr, __func__, __FILE__, __LINE__, 0);
+// A parallel scope whose threads update a counter atomically and in a
+// critical section, then meet at a barrier.
+static void run_parallel(void) {
+  static int counter;
+  ENTER(10, 3, CATS_SCOPE_TYPE_PARALLEL);
+#pragma omp parallel num_threads(2)
+  {
+    cats_trace_instrument_parallel_begin();
+    __atomic_fetch_add(&counter, 1, __ATOMIC_RELAXED);
+    cats_trace_instrument_atomic(
+      11, &counter, sizeof(counter), CATS_ATOMIC_ADD, 1,
+      __func__, __FILE__, __LINE__, 0
+    );
+    cats_trace_instrument_sync_begin(12);
+#pragma omp critical
+    {
+      cats_trace_instrument_sync_end(
+        12, CATS_SYNC_CRITICAL, CATS_SYNC_ACQUIRE, &counter,
+        __func__, __FILE__, __LINE__, 0
+      );
+      ++counter;
+      cats_trace_instrument_sync_end(
+        13, CATS_SYNC_CRITICAL, CATS_SYNC_RELEASE, &counter,
+        __func__, __FILE__, __LINE__, 0
+      );
+    }
+    cats_trace_instrument_sync_begin(14);
+#pragma omp barrier
+    cats_trace_instrument_sync_end(
+      14, CATS_SYNC_BARRIER, CATS_SYNC_ACQUIRE, NULL,
+      __func__, __FILE__, __LINE__, 0
+    );
+    cats_trace_instrument_parallel_end();
   }
+  EXIT(15, 3, CATS_SCOPE_TYPE_PARALLEL);
+}
 
-  // Simulate exiting the loop
-  cats_trace_instrument_scope_exit(
-    5, 1, CATS_SCOPE_TYPE_LOOP, __func__, __FILE__, __LINE__, 0
+// Default mode: accesses are recorded once per call site and scope stack,
+// and no profile is kept.
+static void test_basic(void) {
+  run_loop();
+  run_parallel();
+  char *full = save_trace();
+  CHECK(count(full, "\"sync\": [") == 0);
+  CHECK(count(full, "\"parallel\": [") == 0);
+  CHECK(count(full, "\"memory\": [") == 0);
+  CHECK(count(full, "\"scope_profiles\": [") == 0);
+  char *trace = section(full, "events");
+  CHECK(count(trace, "\"type\": \"allocation\"") == 1);
+  CHECK(count(trace, "\"type\": \"deallocation\"") == 1);
+  CHECK(count(trace, "\"type\": \"scope_entry\"") == 3);
+  CHECK(count(trace, "\"type\": \"scope_exit\"") == 3);
+  CHECK(count(trace, "\"mode\": \"w\"") == 1);
+  CHECK(count(trace, "\"mode\": \"r\"") == 1);
+  CHECK(count(trace, "\"buffer_name\": \"arr\"") == 4);
+  CHECK(count(trace, "\"thread\": ") == 0);
+  CHECK(count(trace, "\"type\": \"sync\"") == 3);
+}
+
+// CATS_SYNC_PROFILE=1 CATS_PARALLEL_PROFILE=1 CATS_MEMORY_PROFILE=1: the
+// profiles count every execution on every thread.
+static void test_profiles(void) {
+  run_loop();
+  run_parallel();
+  char *trace = save_trace();
+  char *sync = section(trace, "sync");
+  CHECK(count(sync, "\"type\": \"atomic\"") == 1);
+  CHECK(count(sync, "\"type\": \"sync\"") == 3);
+  CHECK(count(sync, "\"count\": 2") == 4);
+  CHECK(count(section(trace, "parallel"), "\"scope_id\": 3") == 1);
+  CHECK(count(section(trace, "memory"), "\"peak_bytes\": 40") == 1);
+}
+
+// CATS_SYNC_PROFILE=1: failed atomics are counted, and a reduction that
+// took the atomic path leaves no held lock behind.
+static void test_sync_counts(void) {
+  static int counter;
+  static int lock;
+  for (int i = 0; i < 3; ++i) {
+    cats_trace_instrument_atomic(
+      30, &counter, sizeof(counter), CATS_ATOMIC_CMPXCHG, i != 1,
+      __func__, __FILE__, __LINE__, 0
+    );
+  }
+  cats_trace_instrument_sync_end(
+    31, CATS_SYNC_REDUCE, CATS_SYNC_ACQUIRE, &lock, __func__, __FILE__,
+    __LINE__, 0
   );
+  cats_trace_instrument_sync_end(
+    31, CATS_SYNC_REDUCE, CATS_SYNC_ACQUIRE, &lock, __func__, __FILE__,
+    __LINE__, 0
+  );
+  cats_trace_instrument_sync_end(
+    32, CATS_SYNC_REDUCE, CATS_SYNC_RELEASE, &lock, __func__, __FILE__,
+    __LINE__, 0
+  );
+  // Nothing is held on the lock anymore
+  cats_trace_instrument_sync_end(
+    33, CATS_SYNC_MUTEX, CATS_SYNC_RELEASE, &lock, __func__, __FILE__,
+    __LINE__, 0
+  );
+  char *sync = section(save_trace(), "sync");
+  CHECK(count(sync, "\"count\": 3, \"failed\": 1") == 1);
+  CHECK(count(sync, "\"call_id\": 31,") == 1);
+  CHECK(count(sync, "\"hold_ns\": 0,") == 1);
+}
 
-  // Simulate deallocation
-  cats_trace_instrument_dealloc(5, arr, __func__, __FILE__, __LINE__, 0);
-  free(arr);
+#define IO(call_id, op, fd) \
+  cats_trace_instrument_io( \
+    call_id, op, fd, NULL, NULL, 0, __func__, __FILE__, __LINE__, 0 \
+  )
+
+// A descriptor reused for another file is reported with the new path.
+static void test_io_paths(void) {
+  int fd = open("first.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  IO(40, CATS_IO_OPEN, fd);
+  IO(41, CATS_IO_WRITE, fd);
+  IO(42, CATS_IO_CLOSE, fd);
+  close(fd);
+  int reused = open("second.txt", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(reused == fd);
+  IO(40, CATS_IO_OPEN, reused);
+  IO(43, CATS_IO_WRITE, reused);
+  IO(42, CATS_IO_CLOSE, reused);
+  close(reused);
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"type\": \"io\"") == 2);
+  CHECK(count(trace, "/first.txt\"") == 1);
+  CHECK(count(trace, "/second.txt\"") == 1);
+}
+
+// Each thread of a parallel scope records the chunk of a static loop of
+// 100 iterations it was assigned, with the id of the scope. Empty chunks
+// are dropped.
+static void test_workshare(void) {
+  ENTER(120, 30, CATS_SCOPE_TYPE_PARALLEL);
+#pragma omp parallel num_threads(2)
+  {
+    cats_trace_instrument_parallel_begin();
+    int64_t lower = omp_get_thread_num() * 50;
+    cats_trace_instrument_workshare(
+      121, CATS_WORKSHARE_STATIC, lower, lower + 50, 0,
+      __func__, __FILE__, __LINE__, 0
+    );
+    cats_trace_instrument_workshare(
+      122, CATS_WORKSHARE_STATIC, lower, lower, 0,
+      __func__, __FILE__, __LINE__, 0
+    );
+    cats_trace_instrument_parallel_end();
+  }
+  EXIT(123, 30, CATS_SCOPE_TYPE_PARALLEL);
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"type\": \"workshare\"") == 2);
+  CHECK(count(trace, "\"omp_thread\": 0, \"parallel_scope\": 30, "
+                     "\"lower\": 0, \"upper\": 50,") == 1);
+  CHECK(count(trace, "\"omp_thread\": 1, \"parallel_scope\": 30, "
+                     "\"lower\": 50, \"upper\": 100,") == 1);
+}
+
+// CATS_HEATMAP=1 CATS_HEATMAP_MIN_SIZE=1: the bins follow the pages from
+// the one holding the first byte, and every thread of a parallel region is
+// counted although only the master thread is traced.
+static void test_heatmap(void) {
+  char *page = (char *) aligned_alloc(4096, 3 * 4096);
+  char *buffer = page + 100;
+  cats_trace_instrument_alloc(
+    60, "buffer", buffer, 8192, __func__, __FILE__, __LINE__, 0
+  );
+  cats_trace_instrument_read(61, buffer, __func__, __FILE__, __LINE__, 0);
+  cats_trace_instrument_read(
+    62, buffer + 8191, __func__, __FILE__, __LINE__, 0
+  );
+#pragma omp parallel num_threads(2)
+  cats_trace_instrument_read(
+    63, buffer + 4096, __func__, __FILE__, __LINE__, 0
+  );
+  char *heatmaps = section(save_trace(), "heatmaps");
+  char base[64];
+  snprintf(base, sizeof(base), "\"base_address\": %llu,",
+           (unsigned long long) (uintptr_t) page);
+  CHECK(count(heatmaps, base) == 1);
+  CHECK(count(heatmaps, "\"read_bins\": [1, 2, 1]") == 1);
+  cats_trace_instrument_dealloc(64, buffer, __func__, __FILE__, __LINE__, 0);
+  free(page);
+}
+
+// CATS_RUSAGE=1: a parallel scope counts the page faults of its workers.
+static void test_rusage(void) {
+  size_t bytes = 32 << 20;
+  char *pages = (char *) mmap(NULL, bytes, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  CHECK(pages != MAP_FAILED);
+  // One fault per page
+  madvise(pages, bytes, MADV_NOHUGEPAGE);
+  ENTER(70, 7, CATS_SCOPE_TYPE_PARALLEL);
+#pragma omp parallel num_threads(2)
+  if (omp_get_thread_num() == 1)
+    memset(pages, 1, bytes);
+  EXIT(71, 7, CATS_SCOPE_TYPE_PARALLEL);
+  munmap(pages, bytes);
+  for (int i = 0; i < 2; i++) {
+    ENTER(72, 8, CATS_SCOPE_TYPE_FUNCTION);
+    EXIT(73, 8, CATS_SCOPE_TYPE_FUNCTION);
+  }
+
+  char *events = section(save_trace(), "events");
+  const char *faults = strstr(events, "\"minor_faults\": ");
+  CHECK(faults != NULL);
+  if (faults)
+    CHECK(strtoull(faults + strlen("\"minor_faults\": "), NULL, 10) >=
+          bytes / (size_t) sysconf(_SC_PAGESIZE) / 2);
+  CHECK(count(events, "\"rss_kb\": ") == 4);
+}
+
+// CATS_DEDUP=none
+static void test_dedup_none(void) {
+  run_loop();
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"mode\": \"w\"") == 10);
+  CHECK(count(trace, "\"mode\": \"r\"") == 10);
+}
+
+// CATS_STACK_ID=default: same trace as the default stack identifier.
+static void test_stack_id_string(void) {
+  run_loop();
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"mode\": \"w\"") == 1);
+  CHECK(count(trace, "\"type\": \"scope_exit\"") == 2);
+}
+
+// CATS_THREADING=per_thread: events carry their recording thread.
+static void test_per_thread(void) {
+  run_loop();
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"thread\": 0") == 8);
+}
+
+#define DUMP_THREADS 4
+#define DUMP_WRITES 20000
+
+static int *dump_buffer;
+static int dump_running;
+
+// A thread that writes DUMP_WRITES times to the shared buffer.
+static void *run_writes(void *arg) {
+  (void) arg;
+  for (int i = 0; i < DUMP_WRITES; i++) {
+    cats_trace_instrument_write(
+      30, &dump_buffer[i % 64], __func__, __FILE__, __LINE__, 0
+    );
+  }
+  __atomic_fetch_sub(&dump_running, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+// CATS_THREADING=per_thread CATS_DEDUP=none: the trace can be dumped while
+// other threads are recording.
+static void test_per_thread_dump(void) {
+  dump_buffer = (int *) malloc(64 * sizeof(int));
+  cats_trace_instrument_alloc(
+    31, "shared", dump_buffer, 64 * sizeof(int), __func__, __FILE__,
+    __LINE__, 0
+  );
+  pthread_t threads[DUMP_THREADS];
+  dump_running = DUMP_THREADS;
+  for (int i = 0; i < DUMP_THREADS; i++)
+    pthread_create(&threads[i], NULL, run_writes, NULL);
+  int dumps = 0;
+  while (__atomic_load_n(&dump_running, __ATOMIC_ACQUIRE) > 0) {
+    cats_trace_dump("dump.cats");
+    ++dumps;
+  }
+  for (int i = 0; i < DUMP_THREADS; i++)
+    pthread_join(threads[i], NULL);
+  CHECK(dumps > 0);
+
+  cats_trace_dump("dump.cats");
+  char *events = section(read_file("dump.cats"), "events");
+  CHECK(count(events, "\"mode\": \"w\"") == DUMP_THREADS * DUMP_WRITES);
+  CHECK(count(events, "\"type\": \"allocation\"") == 1);
+}
+
+// Site tables chained by a module: field accesses are counted for every
+// access, array shapes are attached to the recorded accesses.
+static void test_site_tables(void) {
+  static const cats_site_info field_sites[] = {
+    {20, "struct.pair", 8, 1, 4, 4, NULL, NULL, 0, 0, NULL},
+  };
+  static const cats_site_info shape_sites[] = {
+    {21, NULL, 0, 0, 0, 0, "[*][4]", "[L1][L2]", 4, CATS_TRAVERSAL_ROW, NULL},
+  };
+  static const cats_site_table shape_table = {NULL, shape_sites, 1};
+  static const cats_site_table field_table = {&shape_table, field_sites, 1};
+  cats_trace_register_site_tables(&field_table);
+
+  ENTER(1, 0, CATS_SCOPE_TYPE_FUNCTION);
+  int *pairs = (int *) malloc(8 * sizeof(int));
+  cats_trace_instrument_alloc(
+    2, "pairs", pairs, 8 * sizeof(int), __func__, __FILE__, __LINE__, 0
+  );
+  ENTER(3, 1, CATS_SCOPE_TYPE_LOOP);
+  for (int i = 0; i < 4; i++) {
+    cats_trace_instrument_read(
+      20, &pairs[2 * i + 1], __func__, __FILE__, __LINE__, 0
+    );
+    cats_trace_instrument_write(21, &pairs[i], __func__, __FILE__, __LINE__, 0);
+  }
+  EXIT(6, 1, CATS_SCOPE_TYPE_LOOP);
+  cats_trace_instrument_dealloc(7, pairs, __func__, __FILE__, __LINE__, 0);
+  free(pairs);
+  EXIT(8, 0, CATS_SCOPE_TYPE_FUNCTION);
+
+  char *trace = save_trace();
+  char *fields = section(trace, "fields");
+  CHECK(count(fields, "\"struct\": \"struct.pair\"") == 1);
+  CHECK(count(fields, "\"reads\": 4") == 1);
+  char *events = section(trace, "events");
+  CHECK(count(events, "\"shape\": \"[*][4]\"") == 1);
+  CHECK(count(events, "\"traversal\": \"row\"") == 1);
+}
+
+// CATS_STORAGE=ring: a dump holds every event up to the last one.
+static void test_ring_dump(void) {
+  run_loop();
+  cats_trace_dump("dump.cats");
+  char *trace = section(read_file("dump.cats"), "events");
+  CHECK(count(trace, "\"type\": \"scope_entry\"") == 2);
+  CHECK(count(trace, "\"type\": \"scope_exit\"") == 2);
+  CHECK(count(trace, "\"type\": \"deallocation\"") == 1);
+}
+
+// CATS_STORAGE=ring: by default a crashing process writes its events and
+// still dies of the signal.
+static void test_ring_crash(void) {
+  pid_t child = fork();
+  if (child == 0) {
+    run_loop();
+    ENTER(9, 2, CATS_SCOPE_TYPE_FUNCTION);
+    raise(SIGSEGV);
+    _exit(0);
+  }
+  int status = 0;
+  CHECK(waitpid(child, &status, 0) == child);
+  CHECK(WIFSIGNALED(status) && WTERMSIG(status) == SIGSEGV);
+
+  // The path was chosen when the handler was installed, in this process.
+  char path[64];
+  snprintf(path, sizeof(path), "cats_trace.%ld.crash.cats", (long) getpid());
+  char *trace = section(read_file(path), "events");
+  CHECK(count(trace, "\"type\": \"scope_entry\"") == 3);
+  CHECK(count(trace, "\"type\": \"scope_exit\"") == 2);
+  CHECK(count(trace, "\"buffer_name\": \"arr\"") == 4);
+}
+
+// CATS_MEMORY_PROFILE=1 CATS_ALLOC_SITES=1 CATS_ALLOC_SITES_MIN_SIZE=1024:
+// buffers below the minimum size are not traced but still count towards the
+// memory peak.
+static void test_memory_filtered(void) {
+  ENTER(1, 0, CATS_SCOPE_TYPE_FUNCTION);
+  char *small[3];
+  for (int i = 0; i < 3; i++) {
+    small[i] = (char *) malloc(100);
+    cats_trace_instrument_alloc(
+      2, "small", small[i], 100, __func__, __FILE__, __LINE__, 0
+    );
+  }
+  char *large = (char *) malloc(4096);
+  cats_trace_instrument_alloc(
+    3, "large", large, 4096, __func__, __FILE__, __LINE__, 0
+  );
+  for (int i = 0; i < 3; i++) {
+    cats_trace_instrument_dealloc(4, small[i], __func__, __FILE__, __LINE__, 0);
+    free(small[i]);
+  }
+  cats_trace_instrument_dealloc(5, large, __func__, __FILE__, __LINE__, 0);
+  free(large);
+  EXIT(6, 0, CATS_SCOPE_TYPE_FUNCTION);
+
+  char *trace = save_trace();
+  CHECK(count(section(trace, "memory"), "\"peak_bytes\": 4396") == 1);
+  CHECK(count(section(trace, "events"), "\"buffer_name\": \"small\"") == 0);
+}
+
+// CATS_FILTER=scope=loop: only loop scopes are recorded, and scopes of a
+// type beyond the mask are dropped as well.
+static void test_filter_scopes(void) {
+  run_loop();
+  run_parallel();
+  ENTER(90, 9, 40);
+  EXIT(91, 9, 40);
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"type\": \"scope_entry\"") == 1);
+  CHECK(count(trace, "\"type\": \"scope_exit\"") == 1);
+  CHECK(count(trace, "\"scope_type\": \"loop\"") == 1);
+  CHECK(count(trace, "\"mode\": \"w\"") == 1);
+}
+
+// CATS_FILTER=depth=1: the loop and its accesses are two scopes deep.
+static void test_filter_depth(void) {
+  run_loop();
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"type\": \"scope_entry\"") == 1);
+  CHECK(count(trace, "\"type\": \"scope_exit\"") == 1);
+  CHECK(count(trace, "\"type\": \"allocation\"") == 1);
+  CHECK(count(trace, "\"type\": \"deallocation\"") == 1);
+  CHECK(count(trace, "\"type\": \"access\"") == 0);
+}
+
+// CATS_FILTER=func=run_*: only the events of run_loop are recorded.
+static void test_filter_sites(void) {
+  static int value;
+  run_loop();
+  ENTER(92, 9, CATS_SCOPE_TYPE_FUNCTION);
+  cats_trace_instrument_write(93, &value, __func__, __FILE__, __LINE__, 0);
+  EXIT(94, 9, CATS_SCOPE_TYPE_FUNCTION);
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"type\": \"scope_entry\"") == 2);
+  CHECK(count(trace, "\"mode\": \"w\"") == 1);
+  CHECK(count(trace, "\"buffer_name\": \"arr\"") == 4);
+  CHECK(count(trace, "test_filter_sites") == 0);
+}
+
+// CATS_SYNC_PROFILE=1 CATS_MEMORY_PROFILE=1 CATS_ALLOC_SITES=1: the profiles
+// of a segment only count what happened since the previous checkpoint.
+static void test_checkpoint_profiles(void) {
+  run_loop();
+  run_parallel();
+  cats_trace_checkpoint("segment0.cats");
+  char *first = read_file("segment0.cats");
+  CHECK(count(section(first, "sync"), "\"count\": 2") == 4);
+  CHECK(count(section(first, "memory"), "\"peak_bytes\": 40") == 1);
+  CHECK(count(section(first, "alloc_sites"), "\"count\": 1") == 1);
+
+  run_parallel();
+  run_parallel();
+  char *second = save_trace();
+  CHECK(count(section(second, "sync"), "\"count\": 4") == 4);
+  CHECK(count(section(second, "memory"), "\"peak_bytes\": 0") == 1);
+  CHECK(count(second, "\"alloc_sites\": [") == 0);
+}
+
+// Checkpoints while a function and its loop are open: each segment names
+// the previous one, the index lists both, and the second segment starts by
+// re-entering the open scopes.
+static void test_checkpoint_segments(void) {
+  ENTER(80, 0, CATS_SCOPE_TYPE_FUNCTION);
+  int *value = (int *) malloc(sizeof(int));
+  cats_trace_instrument_alloc(
+    81, "value", value, sizeof(int), __func__, __FILE__, __LINE__, 0
+  );
+  ENTER(82, 1, CATS_SCOPE_TYPE_LOOP);
+  cats_trace_instrument_write(83, value, __func__, __FILE__, __LINE__, 0);
+  cats_trace_checkpoint("segment0.cats");
+  cats_trace_instrument_write(84, value, __func__, __FILE__, __LINE__, 0);
+  cats_trace_checkpoint("segment1.cats");
+  EXIT(85, 1, CATS_SCOPE_TYPE_LOOP);
+  cats_trace_instrument_dealloc(86, value, __func__, __FILE__, __LINE__, 0);
+  free(value);
+  EXIT(87, 0, CATS_SCOPE_TYPE_FUNCTION);
+
+  char *first = read_file("segment0.cats");
+  CHECK(count(first, "{\"index\": 0, \"previous\": \"\",") == 1);
+  CHECK(count(first, "\"type\": \"scope_entry\"") == 2);
+  CHECK(count(first, "\"mode\": \"w\"") == 1);
+
+  char *second = read_file("segment1.cats");
+  CHECK(count(second, "{\"index\": 1, "
+                      "\"previous\": \"segment0.cats\",") == 1);
+  char *events = section(second, "events");
+  const char *func = strstr(events, "\"scope_type\": \"func\", \"id\": 0}");
+  const char *loop = strstr(events, "\"scope_type\": \"loop\", \"id\": 1}");
+  const char *write = strstr(events, "\"mode\": \"w\"");
+  CHECK(func && loop && write && func < loop && loop < write);
+  CHECK(count(events, "\"type\": \"scope_entry\"") == 2);
+  CHECK(count(events, "\"type\": \"scope_exit\"") == 0);
+
+  char *index = read_file("cats_trace.segments");
+  CHECK(count(index, "\"path\": \"segment0.cats\"") == 1);
+  CHECK(count(index, "{\"index\": 1, \"path\": \"segment1.cats\"") == 1);
+}
+
+// CATS_ROOFLINE=1: scopes are credited with the operations and bytes of
+// their instances, nested scopes included, and loops with their trips.
+static void test_roofline(void) {
+  double data[8] = {0};
+  for (int instance = 0; instance < 2; instance++) {
+    ENTER(1, 0, CATS_SCOPE_TYPE_FUNCTION);
+    ENTER(2, 1, CATS_SCOPE_TYPE_LOOP);
+    cats_trace_instrument_loop_trips(1, 8);
+    for (int i = 0; i < 8; i++) {
+      cats_trace_instrument_flops(2);
+      cats_trace_instrument_access_sized(
+        3, &data[i], sizeof(double), 1, __func__, __FILE__, __LINE__, 0
+      );
+    }
+    EXIT(4, 1, CATS_SCOPE_TYPE_LOOP);
+    EXIT(5, 0, CATS_SCOPE_TYPE_FUNCTION);
+  }
+  char *profiles = section(save_trace(), "scope_profiles");
+  CHECK(count(
+    profiles, "\"count\": 2, \"flops\": 32, \"bytes\": 128"
+  ) == 2);
+  CHECK(count(profiles, "\"scope_type\": \"loop\"") == 1);
+}
+
+// A thread that enters and leaves a function.
+static void *run_scope(void *arg) {
+  (void) arg;
+  ENTER(50, 5, CATS_SCOPE_TYPE_FUNCTION);
+  EXIT(51, 5, CATS_SCOPE_TYPE_FUNCTION);
+  return NULL;
+}
+
+// CATS_TRANSPORT=shm CATS_SHM_THREADS=1, collected by the cats-collectd at
+// CATS_COLLECTD: the ring of an exited thread is reused by the next one.
+static void test_shm_threads(void) {
+  char pid[32];
+  snprintf(pid, sizeof(pid), "%ld", (long) getpid());
+  pid_t collector = fork();
+  if (collector == 0) {
+    execl(getenv("CATS_COLLECTD"), "cats-collectd", "--wait", "5", pid,
+          (char *) NULL);
+    _exit(2);
+  }
+  for (int i = 0; i < 2; i++) {
+    pthread_t thread;
+    pthread_create(&thread, NULL, run_scope, NULL);
+    pthread_join(thread, NULL);
+    // Give the collector time to drain and free the ring
+    usleep(200000);
+  }
+  cats_trace_save(NULL);
+  int status = 0;
+  waitpid(collector, &status, 0);
+  CHECK(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  char *trace = read_file("cats_trace.cats");
+  char *events = section(trace, "events");
+  CHECK(count(events, "{\"thread\": 0,") == 2);
+  CHECK(count(events, "{\"thread\": 1,") == 2);
+  CHECK(count(section(trace, "transport"), "\"dropped\": 0}") == 2);
+}
+
+static char **self_argv;
+
+// The mode is selected when the library is loaded. A case that has to
+// prepare something first does so and runs itself again with `name` set to
+// `value`.
+static void run_again_with(const char *name, const char *value) {
+  if (getenv(name))
+    return;
+  setenv(name, value, 1);
+  execv("/proc/self/exe", self_argv);
+  perror("execv");
+  exit(2);
+}
+
+// A file at CATS_INTROSPECT_SOCKET that is not a socket is left alone.
+static void test_introspect_file(void) {
+  if (!getenv("CATS_INTROSPECT_SOCKET")) {
+    unlink("introspect.sock");
+    FILE *file = fopen("introspect.sock", "w");
+    fputs("data", file);
+    fclose(file);
+  }
+  run_again_with("CATS_INTROSPECT_SOCKET", "introspect.sock");
+  run_loop();
+  save_trace();
+  struct stat st;
+  CHECK(lstat("introspect.sock", &st) == 0 && S_ISREG(st.st_mode));
+  CHECK(count(read_file("introspect.sock"), "data") == 1);
+}
+
+// A socket at CATS_INTROSPECT_SOCKET that nobody listens on is replaced.
+static void test_introspect_stale(void) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, "introspect.sock");
+  if (!getenv("CATS_INTROSPECT_SOCKET")) {
+    unlink(addr.sun_path);
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    CHECK(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    close(fd);
+  }
+  run_again_with("CATS_INTROSPECT_SOCKET", "introspect.sock");
+  int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(connect(probe, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  close(probe);
+  run_loop();
+  save_trace();
+}
+
+// CATS_PLUGINS with the test plugin: the plugin sees every event of every
+// thread, including those still batched when the trace is saved.
+static void test_plugin(void) {
+  unlink("plugin.txt");
+  run_loop();
+  run_parallel();
+  save_trace();
+  char *counts = read_file("plugin.txt");
+  CHECK(count(counts, "accesses 20\n") == 1);
+  CHECK(count(counts, "run_loop 20\n") == 1);
+  CHECK(count(counts, "scope_entries 3\n") == 1);
+  CHECK(count(counts, "threads 2\n") == 1);
+}
+
+// CATS_PLUGINS with a plugin of an unknown mode: the plugin is not loaded.
+static void test_plugin_rejected(void) {
+  unlink("plugin.txt");
+  run_loop();
+  save_trace();
+  CHECK(read_file("plugin.txt") == NULL);
+}
+
+// Sends `request` to the introspection socket and returns the replies.
+// Never freed.
+static char *query(const char *request) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, "introspect.sock");
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  CHECK(connect(fd, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+  CHECK(write(fd, request, strlen(request)) == (ssize_t) strlen(request));
+  shutdown(fd, SHUT_WR);
+  size_t size = 0, capacity = 4096;
+  char *reply = (char *) malloc(capacity);
+  ssize_t n;
+  while ((n = read(fd, reply + size, capacity - size - 1)) > 0) {
+    size += n;
+    if (capacity - size < 2)
+      reply = (char *) realloc(reply, capacity *= 2);
+  }
+  reply[size] = '\0';
+  close(fd);
+  return reply;
+}
+
+static char *moved_buffer;
 
-  // Simulate function scope exit
-  cats_trace_instrument_scope_exit(
-    6, 0, CATS_SCOPE_TYPE_FUNCTION, __func__, __FILE__, __LINE__, 0
+// A thread that allocates a buffer that the main thread frees.
+static void *run_alloc(void *arg) {
+  (void) arg;
+  moved_buffer = (char *) malloc(100);
+  cats_trace_instrument_alloc(
+    41, "moved", moved_buffer, 100, __func__, __FILE__, __LINE__, 0
+  );
+  return NULL;
+}
+
+// CATS_INTROSPECT_SOCKET: the queries report the counts, the open scopes,
+// the live allocations of all threads and the busiest sites.
+static void test_introspect_queries(void) {
+  run_again_with("CATS_INTROSPECT_SOCKET", "introspect.sock");
+  ENTER(40, 7, CATS_SCOPE_TYPE_FUNCTION);
+  char *live = (char *) malloc(1000);
+  cats_trace_instrument_alloc(
+    42, "live", live, 1000, __func__, __FILE__, __LINE__, 0
+  );
+  for (int i = 0; i < 3; i++)
+    cats_trace_instrument_write(43, &live[i], __func__, __FILE__, __LINE__, 0);
+  pthread_t thread;
+  pthread_create(&thread, NULL, run_alloc, NULL);
+  pthread_join(thread, NULL);
+  CHECK(count(query("allocations\n"), "\"count\": 2") == 1);
+  cats_trace_instrument_dealloc(
+    44, moved_buffer, __func__, __FILE__, __LINE__, 0
+  );
+  free(moved_buffer);
+
+  char *replies = query("counts\nstacks\nallocations 5\ntop 1\nfoo\n");
+  CHECK(count(replies, "\n") == 5);
+  CHECK(count(replies, "\"total\": {\"allocation\": 2, "
+                       "\"deallocation\": 1, \"access\": 3, "
+                       "\"scope_entry\": 1,") == 1);
+  CHECK(count(replies, "\"depth\": 1, \"consistent\": true, \"stack\": "
+                       "[{\"id\": 7, \"scope_type\": \"func\"") == 1);
+  CHECK(count(replies, "{\"count\": 1, \"bytes\": 1000, \"allocations\": "
+                       "[{\"buffer_name\": \"live\"") == 1);
+  CHECK(count(replies, "\"sites\": [{\"call_id\": 43, "
+                       "\"type\": \"access\"") == 1);
+  CHECK(count(replies, "\"error\": \"unknown query 'foo'\"") == 1);
+
+  EXIT(45, 7, CATS_SCOPE_TYPE_FUNCTION);
+  cats_trace_instrument_dealloc(46, live, __func__, __FILE__, __LINE__, 0);
+  free(live);
+  save_trace();
+}
+
+// The trace the tools are tested on (see CMakeLists.txt): a function whose
+// first loop writes `a` and whose second loop reads `a` and writes `b`,
+// recorded with CATS_DEDUP=none.
+static void test_tool_trace(void) {
+  ENTER(100, 20, CATS_SCOPE_TYPE_FUNCTION);
+  double *a = (double *) malloc(64 * sizeof(double));
+  cats_trace_instrument_alloc(
+    101, "a", a, 64 * sizeof(double), __func__, __FILE__, __LINE__, 0
+  );
+  double *b = (double *) malloc(64 * sizeof(double));
+  cats_trace_instrument_alloc(
+    102, "b", b, 64 * sizeof(double), __func__, __FILE__, __LINE__, 0
   );
+  ENTER(103, 21, CATS_SCOPE_TYPE_LOOP);
+  for (int i = 0; i < 64; i++) {
+    a[i] = i;
+    cats_trace_instrument_access_sized(
+      104, &a[i], sizeof(double), 1, __func__, __FILE__, __LINE__, 0
+    );
+  }
+  EXIT(105, 21, CATS_SCOPE_TYPE_LOOP);
+  ENTER(106, 22, CATS_SCOPE_TYPE_LOOP);
+  for (int i = 0; i < 64; i++) {
+    b[i] = 2 * a[i];
+    cats_trace_instrument_access_sized(
+      107, &a[i], sizeof(double), 0, __func__, __FILE__, __LINE__, 0
+    );
+    cats_trace_instrument_access_sized(
+      108, &b[i], sizeof(double), 1, __func__, __FILE__, __LINE__, 0
+    );
+  }
+  EXIT(109, 22, CATS_SCOPE_TYPE_LOOP);
+  cats_trace_instrument_dealloc(110, a, __func__, __FILE__, __LINE__, 0);
+  free(a);
+  cats_trace_instrument_dealloc(111, b, __func__, __FILE__, __LINE__, 0);
+  free(b);
+  EXIT(112, 20, CATS_SCOPE_TYPE_FUNCTION);
+  char *trace = section(save_trace(), "events");
+  CHECK(count(trace, "\"type\": \"access\"") == 192);
+}
 
-  // Save the trace
-  cats_trace_save("cats_trace_test.cats");
+static const struct {
+  const char *name;
+  void (*run)(void);
+} cases[] = {
+  {"basic", test_basic},
+  {"profiles", test_profiles},
+  {"sync_counts", test_sync_counts},
+  {"roofline", test_roofline},
+  {"heatmap", test_heatmap},
+  {"rusage", test_rusage},
+  {"io_paths", test_io_paths},
+  {"workshare", test_workshare},
+  {"dedup_none", test_dedup_none},
+  {"stack_id_string", test_stack_id_string},
+  {"per_thread", test_per_thread},
+  {"per_thread_dump", test_per_thread_dump},
+  {"site_tables", test_site_tables},
+  {"ring_dump", test_ring_dump},
+  {"ring_crash", test_ring_crash},
+  {"memory_filtered", test_memory_filtered},
+  {"filter_scopes", test_filter_scopes},
+  {"filter_depth", test_filter_depth},
+  {"filter_sites", test_filter_sites},
+  {"checkpoint_profiles", test_checkpoint_profiles},
+  {"checkpoint_segments", test_checkpoint_segments},
+  {"shm_threads", test_shm_threads},
+  {"plugin_inline", test_plugin},
+  {"plugin_consumer", test_plugin},
+  {"plugin_rejected", test_plugin_rejected},
+  {"introspect_file", test_introspect_file},
+  {"introspect_stale", test_introspect_stale},
+  {"introspect_queries", test_introspect_queries},
+  {"tool_trace", test_tool_trace},
+};
 
-  printf("Test trace written to cats_trace_test.cats\n");
-  return 0;
+int main(int argc, char *argv[]) {
+  const char *name = argc > 1 ? argv[1] : "basic";
+  self_argv = argv;
+  for (size_t i = 0; i < sizeof(cases) / sizeof(cases[0]); ++i) {
+    if (strcmp(cases[i].name, name) == 0) {
+      cases[i].run();
+      return failures ? 1 : 0;
+    }
+  }
+  fprintf(stderr, "Unknown test case %s\n", name);
+  return 2;
 }
@@ -0,0 +1,75 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// Analysis plugin for the plugin cases of test_cats_runtime. It counts the
+// events it receives and writes the counts to plugin.txt when it is
+// finished. The mode is chosen with TEST_PLUGIN_MODE when it is built.
+
+#include <stdio.h>
+#include <string.h>
+
+#include "../runtime/cats_plugin.h"
+
+#ifndef TEST_PLUGIN_MODE
+#define TEST_PLUGIN_MODE CATS_PLUGIN_MODE_INLINE
+#endif
+
+static const cats_plugin_host *g_host;
+static uint64_t g_accesses;
+static uint64_t g_scope_entries;
+// Accesses whose site names run_loop
+static uint64_t g_loop_accesses;
+// Highest thread index seen plus one
+static uint32_t g_threads;
+
+static void *init(const cats_plugin_host *host) {
+  g_host = host;
+  return NULL;
+}
+
+static void process(void *state, const cats_plugin_event *events,
+                    size_t n_events) {
+  (void) state;
+  for (size_t i = 0; i < n_events; ++i) {
+    const cats_plugin_event *event = &events[i];
+    uint32_t threads = __atomic_load_n(&g_threads, __ATOMIC_RELAXED);
+    while (event->thread >= threads &&
+           !__atomic_compare_exchange_n(&g_threads, &threads,
+                                        event->thread + 1, 0,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+      ;
+    if (event->event_type == CATS_EVENT_TYPE_SCOPE_ENTRY)
+      __atomic_fetch_add(&g_scope_entries, 1, __ATOMIC_RELAXED);
+    if (event->event_type != CATS_EVENT_TYPE_ACCESS)
+      continue;
+    __atomic_fetch_add(&g_accesses, 1, __ATOMIC_RELAXED);
+    const cats_plugin_site *site = g_host->site(event->site);
+    if (site && strcmp(site->funcname, "run_loop") == 0)
+      __atomic_fetch_add(&g_loop_accesses, 1, __ATOMIC_RELAXED);
+  }
+}
+
+static void finish(void *state) {
+  (void) state;
+  FILE *file = fopen("plugin.txt", "w");
+  if (!file)
+    return;
+  fprintf(file, "accesses %llu\n", (unsigned long long) g_accesses);
+  fprintf(file, "scope_entries %llu\n", (unsigned long long) g_scope_entries);
+  fprintf(file, "run_loop %llu\n", (unsigned long long) g_loop_accesses);
+  fprintf(file, "threads %u\n", g_threads);
+  fclose(file);
+}
+
+static const cats_plugin plugin = {
+  CATS_PLUGIN_ABI_VERSION,
+  "test",
+  TEST_PLUGIN_MODE,
+  init,
+  process,
+  finish,
+};
+
+__attribute__((visibility("default")))
+const cats_plugin *cats_plugin_entry(void) {
+  return &plugin;
+}
@@ -0,0 +1,697 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// cats-collectd: out-of-process collector for CATS_TRANSPORT=shm. Attaches to
+// the shared-memory segment of an instrumented application, drains the
+// per-thread event rings and writes the trace once the application has
+// called cats_trace_save (or has died).
+
+#include "cats_names.hpp"
+#include "cats_runtime.h"
+#include "cats_shm.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <set>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace shm = cats::shm;
+
+struct Site_Info {
+  uint64_t call_id;
+  std::string funcname;
+  std::string filename;
+  std::string buffer_name;
+  uint32_t line;
+  uint32_t col;
+};
+
+struct Pending_Event {
+  uint32_t thread;
+  shm::Event event;
+};
+
+struct Output_Event {
+  uint32_t thread;
+  uint32_t site;
+  uint8_t event_type;
+  uint8_t scope_type;
+  uint8_t is_write;
+  uint64_t timestamp;
+  // Buffer ID or scope ID.
+  uint64_t id;
+  // Offset of an access into the buffer.
+  uint64_t offset;
+  uint64_t size;
+  // Allocation site naming the buffer.
+  uint32_t buffer_site;
+  // Enclosing parallel scope of a workshare event.
+  uint64_t parallel_scope;
+};
+
+// Totals of an atomic or synchronization site over all executions, as in
+// the sync section of the in-process trace.
+struct Sync_Stats {
+  uint8_t event_type;
+  uint8_t op;
+  uint8_t phase;
+  std::set<uint32_t> threads;
+  uint64_t count = 0;
+  uint64_t failed = 0;
+  uint64_t total_ns = 0;
+  uint64_t max_ns = 0;
+};
+
+struct Alloc_Info {
+  uint64_t size;
+  uint32_t site;
+};
+
+// Scope stack and deduplication state of one application thread, following
+// the in-process trace with CATS_STACK_ID=very_fast.
+struct Thread_State {
+  std::vector<uint64_t> scope_stack;
+  uint64_t stack_id = 0;
+  std::unordered_set<uint64_t> scope_ids;
+  std::unordered_map<uint64_t, std::unordered_set<uint64_t>> recorded_calls;
+};
+
+class Collector {
+public:
+  Collector(const shm::Segment &segment, bool dedup)
+    : _segment(segment), _dedup(dedup) {}
+
+  // Moves all events published so far out of the rings. Returns the number
+  // of events collected.
+  size_t drain() {
+    shm::Header *header = this->_segment.header;
+    std::vector<Pending_Event> pending;
+    for (uint32_t i = 0; i < header->n_rings; ++i) {
+      shm::Ring &ring = this->_segment.rings[i];
+      uint32_t state = ring.in_use.load(std::memory_order_acquire);
+      if (state != shm::RING_IN_USE && state != shm::RING_RELEASED)
+        continue;
+      uint64_t head = ring.head.load(std::memory_order_acquire);
+      uint64_t tail = ring.tail.load(std::memory_order_relaxed);
+      const shm::Event *events = this->_segment.ring_events(i);
+      uint64_t mask = header->ring_capacity - 1;
+      for (uint64_t n = tail; n < head; ++n)
+        pending.push_back({ring.thread, events[n & mask]});
+      ring.tail.store(head, std::memory_order_release);
+      // The thread of a released ring has exited after its last event, the
+      // ring is empty now and can be handed to a new thread.
+      if (state == shm::RING_RELEASED) {
+        uint64_t dropped = ring.dropped.load(std::memory_order_relaxed);
+        this->_exited.push_back({ring.thread, dropped - this->_dropped[i]});
+        this->_dropped[i] = dropped;
+        ring.in_use.store(shm::RING_FREE, std::memory_order_release);
+      }
+    }
+    if (pending.empty())
+      return 0;
+
+    this->sync_sites();
+    // Keep the threads roughly in order so that allocations are seen before
+    // accesses from other threads.
+    std::stable_sort(
+      pending.begin(), pending.end(),
+      [](const Pending_Event &a, const Pending_Event &b) {
+        return a.event.timestamp < b.event.timestamp;
+      }
+    );
+    for (auto &entry : pending)
+      this->process(entry.thread, entry.event);
+    this->_received += pending.size();
+    return pending.size();
+  }
+
+  void write(std::ostream &ofs) const {
+    shm::Header *header = this->_segment.header;
+    ofs << "{" << std::endl;
+    ofs << "  \"events\": [" << std::endl;
+    for (size_t i = 0; i < this->_events.size(); ++i) {
+      if (i)
+        ofs << "," << std::endl;
+      this->write_event(ofs, this->_events[i]);
+    }
+    ofs << std::endl << "  ]," << std::endl;
+    this->write_sync(ofs);
+    ofs << "  \"transport\": [" << std::endl;
+    std::vector<std::pair<uint32_t, uint64_t>> threads = this->_exited;
+    for (uint32_t i = 0; i < header->n_rings; ++i) {
+      const shm::Ring &ring = this->_segment.rings[i];
+      uint32_t state = ring.in_use.load();
+      if (state != shm::RING_IN_USE && state != shm::RING_RELEASED)
+        continue;
+      auto base = this->_dropped.find(i);
+      threads.push_back({ring.thread, ring.dropped.load() - (
+        base == this->_dropped.end() ? 0 : base->second
+      )});
+    }
+    std::sort(threads.begin(), threads.end());
+    for (size_t i = 0; i < threads.size(); ++i) {
+      if (i)
+        ofs << "," << std::endl;
+      ofs << "    {\"thread\": " << threads[i].first << ", ";
+      ofs << "\"dropped\": " << threads[i].second << "}";
+    }
+    ofs << std::endl << "  ]" << std::endl;
+    ofs << "}" << std::endl;
+  }
+
+  uint64_t received() const { return this->_received; }
+  size_t recorded() const { return this->_events.size(); }
+
+private:
+  void sync_sites() {
+    shm::Header *header = this->_segment.header;
+    uint32_t n_sites = header->n_sites.load(std::memory_order_acquire);
+    while (this->_sites.size() < n_sites) {
+      const shm::Site &site = this->_segment.sites[this->_sites.size()];
+      Site_Info info;
+      info.call_id = site.call_id;
+      info.funcname = this->string(site.funcname, "$UNKNOWN$");
+      info.filename = this->string(site.filename, "$UNKNOWN$");
+      info.buffer_name = this->string(site.buffer_name, "$UNKNOWN$");
+      info.line = site.line;
+      info.col = site.col;
+      this->_sites.push_back(info);
+    }
+  }
+
+  std::string string(uint32_t offset, const char *fallback) const {
+    if (offset == 0 || offset >= this->_segment.header->string_bytes)
+      return fallback;
+    return this->_segment.strings + offset;
+  }
+
+  bool already_recorded(Thread_State &state, uint32_t site) {
+    if (!this->_dedup)
+      return false;
+    return !state.recorded_calls[site].insert(state.stack_id).second;
+  }
+
+  Output_Event &record(uint32_t thread, const shm::Event &event,
+                       uint8_t event_type) {
+    this->_events.emplace_back();
+    Output_Event &out = this->_events.back();
+    out.thread = thread;
+    out.site = event.site;
+    out.event_type = event_type;
+    out.scope_type = event.scope_type;
+    out.is_write = event.is_write;
+    out.timestamp = event.timestamp;
+    out.id = event.address;
+    out.offset = 0;
+    out.size = event.size;
+    out.buffer_site = event.site;
+    out.parallel_scope = 0;
+    return out;
+  }
+
+  bool find_buffer(uint64_t address, uint64_t &buffer_id,
+                   uint32_t &buffer_site) const {
+    auto it = this->_allocations.lower_bound(address);
+    if (it != this->_allocations.end() && it->first == address) {
+      buffer_id = it->first;
+      buffer_site = it->second.site;
+      return true;
+    }
+    if (it == this->_allocations.begin())
+      return false;
+    --it;
+    if (address > it->first + it->second.size)
+      return false;
+    buffer_id = it->first;
+    buffer_site = it->second.site;
+    return true;
+  }
+
+  void count_sync(uint32_t thread, const shm::Event &event) {
+    Sync_Stats &stats = this->_sync[event.site];
+    stats.event_type = event.event_type;
+    stats.op = event.scope_type;
+    stats.phase = event.is_write;
+    stats.threads.insert(thread);
+    ++stats.count;
+    if (event.event_type == CATS_EVENT_TYPE_ATOMIC) {
+      if (!event.is_write)
+        ++stats.failed;
+    } else {
+      stats.total_ns += event.size;
+      stats.max_ns = std::max(stats.max_ns, event.size);
+    }
+  }
+
+  void write_sync(std::ostream &ofs) const {
+    if (this->_sync.empty())
+      return;
+    std::vector<std::pair<uint32_t, const Sync_Stats *>> sites;
+    for (const auto &site : this->_sync)
+      sites.emplace_back(site.first, &site.second);
+    std::stable_sort(sites.begin(), sites.end(), [](const auto &a,
+                                                    const auto &b) {
+      if (a.second->total_ns != b.second->total_ns)
+        return a.second->total_ns > b.second->total_ns;
+      return a.second->failed > b.second->failed;
+    });
+    ofs << "  \"sync\": [" << std::endl;
+    for (size_t i = 0; i < sites.size(); ++i) {
+      const Site_Info &site = this->_sites[sites[i].first];
+      const Sync_Stats &stats = *sites[i].second;
+      ofs << "    {\"call_id\": " << site.call_id << ", ";
+      ofs << "\"funcname\": \"" << site.funcname << "\", ";
+      ofs << "\"filename\": \"" << site.filename << "\", ";
+      ofs << "\"line\": " << site.line << ", ";
+      if (stats.event_type == CATS_EVENT_TYPE_ATOMIC) {
+        ofs << "\"type\": \"atomic\", ";
+        ofs << "\"op\": \"" << cats::atomic_op_name(stats.op) << "\", ";
+      } else {
+        const char *time =
+          stats.phase == CATS_SYNC_ACQUIRE ? "wait" : "hold";
+        ofs << "\"type\": \"sync\", ";
+        ofs << "\"kind\": \"" << cats::sync_kind_name(stats.op) << "\", ";
+        ofs << "\"phase\": \"" << cats::sync_phase_name(stats.phase)
+            << "\", ";
+        ofs << "\"" << time << "_ns\": " << stats.total_ns << ", ";
+        ofs << "\"max_" << time << "_ns\": " << stats.max_ns << ", ";
+      }
+      ofs << "\"threads\": " << stats.threads.size() << ", ";
+      ofs << "\"count\": " << stats.count;
+      if (stats.event_type == CATS_EVENT_TYPE_ATOMIC)
+        ofs << ", \"failed\": " << stats.failed;
+      ofs << "}";
+      if (i + 1 < sites.size())
+        ofs << ",";
+      ofs << std::endl;
+    }
+    ofs << "  ]," << std::endl;
+  }
+
+  void process(uint32_t thread, const shm::Event &event) {
+    if (event.site >= this->_sites.size())
+      return;
+    Thread_State &state = this->_threads[thread];
+
+    switch (event.event_type) {
+      case CATS_EVENT_TYPE_ALLOCATION: {
+        if (this->already_recorded(state, event.site))
+          return;
+        this->record(thread, event, CATS_EVENT_TYPE_ALLOCATION);
+        this->_allocations[event.address] = {event.size, event.site};
+        break;
+      }
+      case CATS_EVENT_TYPE_DEALLOCATION: {
+        if (this->already_recorded(state, event.site))
+          return;
+        auto it = this->_allocations.find(event.address);
+        if (it == this->_allocations.end())
+          return;
+        Output_Event &out = this->record(
+          thread, event, CATS_EVENT_TYPE_DEALLOCATION
+        );
+        out.buffer_site = it->second.site;
+        this->_allocations.erase(it);
+        break;
+      }
+      case CATS_EVENT_TYPE_ACCESS: {
+        if (this->already_recorded(state, event.site))
+          return;
+        uint64_t buffer_id;
+        uint32_t buffer_site;
+        if (!this->find_buffer(event.address, buffer_id, buffer_site))
+          return;
+        Output_Event &out = this->record(
+          thread, event, CATS_EVENT_TYPE_ACCESS
+        );
+        out.id = buffer_id;
+        out.offset = event.address - buffer_id;
+        out.buffer_site = buffer_site;
+        break;
+      }
+      case CATS_EVENT_TYPE_IO: {
+        if (this->already_recorded(state, event.site))
+          return;
+        this->record(thread, event, CATS_EVENT_TYPE_IO);
+        break;
+      }
+      case CATS_EVENT_TYPE_ATOMIC: {
+        // Counted before deduplication, like the in-process profile.
+        this->count_sync(thread, event);
+        if (this->already_recorded(state, event.site))
+          return;
+        uint64_t buffer_id;
+        uint32_t buffer_site;
+        if (!this->find_buffer(event.address, buffer_id, buffer_site))
+          return;
+        Output_Event &out = this->record(
+          thread, event, CATS_EVENT_TYPE_ATOMIC
+        );
+        out.id = buffer_id;
+        out.buffer_site = buffer_site;
+        break;
+      }
+      case CATS_EVENT_TYPE_SYNC: {
+        this->count_sync(thread, event);
+        if (this->already_recorded(state, event.site))
+          return;
+        this->record(thread, event, CATS_EVENT_TYPE_SYNC);
+        break;
+      }
+      case CATS_EVENT_TYPE_WORKSHARE: {
+        // Every chunk is kept, workers do not have the parallel scope on
+        // their own stack.
+        Output_Event &out = this->record(
+          thread, event, CATS_EVENT_TYPE_WORKSHARE
+        );
+        if (!this->_parallel_scopes.empty())
+          out.parallel_scope = this->_parallel_scopes.back();
+        break;
+      }
+      case CATS_EVENT_TYPE_SCOPE_ENTRY: {
+        uint64_t scope_id = event.address;
+        if (event.scope_type == CATS_SCOPE_TYPE_PARALLEL)
+          this->_parallel_scopes.push_back(scope_id);
+        state.scope_stack.push_back(scope_id);
+        state.stack_id += scope_id;
+        state.scope_ids.insert(scope_id);
+        if (this->already_recorded(state, event.site))
+          return;
+        this->record(thread, event, CATS_EVENT_TYPE_SCOPE_ENTRY);
+        break;
+      }
+      case CATS_EVENT_TYPE_SCOPE_EXIT: {
+        uint64_t scope_id = event.address;
+        auto parallel = std::find(
+          this->_parallel_scopes.begin(), this->_parallel_scopes.end(),
+          scope_id
+        );
+        if (parallel != this->_parallel_scopes.end())
+          this->_parallel_scopes.erase(parallel);
+        if (state.scope_ids.erase(scope_id) == 0)
+          return;
+        bool recorded = this->already_recorded(state, event.site);
+        if (!recorded)
+          this->record(thread, event, CATS_EVENT_TYPE_SCOPE_EXIT);
+        // Exits of inner scopes that were skipped are inferred.
+        while (!state.scope_stack.empty() &&
+               state.scope_stack.back() != scope_id) {
+          uint64_t top = state.scope_stack.back();
+          if (!recorded) {
+            Output_Event &inferred = this->record(
+              thread, event, CATS_EVENT_TYPE_SCOPE_EXIT
+            );
+            inferred.id = top;
+          }
+          state.scope_stack.pop_back();
+          state.stack_id -= top;
+          state.scope_ids.erase(top);
+        }
+        if (!state.scope_stack.empty()) {
+          state.scope_stack.pop_back();
+          state.stack_id -= scope_id;
+        }
+        break;
+      }
+    }
+  }
+
+  void write_event(std::ostream &ofs, const Output_Event &event) const {
+    const Site_Info &site = this->_sites[event.site];
+    ofs << "    {\"thread\": " << event.thread << ", ";
+    ofs << "\"funcname\": \"" << site.funcname << "\", ";
+    ofs << "\"filename\": \"" << site.filename << "\", ";
+    ofs << "\"line\": " << site.line << ", ";
+    ofs << "\"col\": " << site.col << ", ";
+    ofs << "\"ts\": " << event.timestamp;
+    const std::string &buffer_name = this->_sites[event.buffer_site].buffer_name;
+    switch (event.event_type) {
+      case CATS_EVENT_TYPE_ALLOCATION:
+        ofs << ", \"type\": \"allocation\", ";
+        ofs << "\"buffer_name\": \"" << buffer_name << "\", ";
+        ofs << "\"buffer_id\": " << event.id << ", ";
+        ofs << "\"size\": " << event.size;
+        break;
+      case CATS_EVENT_TYPE_DEALLOCATION:
+        ofs << ", \"type\": \"deallocation\", ";
+        ofs << "\"buffer_name\": \"" << buffer_name << "\", ";
+        ofs << "\"buffer_id\": " << event.id;
+        break;
+      case CATS_EVENT_TYPE_ACCESS:
+        ofs << ", \"type\": \"access\", ";
+        ofs << "\"mode\": " << (event.is_write ? "\"w\"" : "\"r\"") << ", ";
+        ofs << "\"buffer_name\": \"" << buffer_name << "\", ";
+        ofs << "\"buffer_id\": " << event.id << ", ";
+        ofs << "\"offset\": " << event.offset << ", ";
+        ofs << "\"size\": " << event.size;
+        break;
+      case CATS_EVENT_TYPE_SCOPE_ENTRY:
+        ofs << ", \"type\": \"scope_entry\", ";
+        switch (event.scope_type) {
+          case CATS_SCOPE_TYPE_FUNCTION:
+            ofs << "\"scope_type\": \"func\", ";
+            break;
+          case CATS_SCOPE_TYPE_LOOP:
+            ofs << "\"scope_type\": \"loop\", ";
+            break;
+          case CATS_SCOPE_TYPE_CONDITIONAL:
+            ofs << "\"scope_type\": \"cond\", ";
+            break;
+          case CATS_SCOPE_TYPE_PARALLEL:
+            ofs << "\"scope_type\": \"para\", ";
+            break;
+          case CATS_SCOPE_TYPE_UNSTRUCTURED:
+            ofs << "\"scope_type\": \"unst\", ";
+            break;
+          default:
+            ofs << "\"scope_type\": \"n/a\", ";
+        }
+        ofs << "\"id\": " << event.id;
+        break;
+      case CATS_EVENT_TYPE_SCOPE_EXIT:
+        ofs << ", \"type\": \"scope_exit\", ";
+        ofs << "\"id\": " << event.id;
+        break;
+      case CATS_EVENT_TYPE_IO: {
+        // The producer packs the descriptor and the interned path into the
+        // ID and does not resolve the user buffer.
+        ofs << ", \"type\": \"io\", ";
+        ofs << "\"op\": \"" << cats::io_op_name(event.scope_type)
+            << "\", ";
+        ofs << "\"fd\": " << (int32_t) (event.id >> 32) << ", ";
+        ofs << "\"path\": \"" << this->string((uint32_t) event.id, "")
+            << "\", ";
+        ofs << "\"buffer_id\": 0, ";
+        ofs << "\"bytes\": " << (int64_t) event.size;
+        break;
+      }
+      case CATS_EVENT_TYPE_ATOMIC:
+        ofs << ", \"type\": \"atomic\", ";
+        ofs << "\"op\": \"" << cats::atomic_op_name(event.scope_type)
+            << "\", ";
+        ofs << "\"buffer_name\": \"" << buffer_name << "\", ";
+        ofs << "\"buffer_id\": " << event.id << ", ";
+        ofs << "\"size\": " << event.size;
+        break;
+      case CATS_EVENT_TYPE_WORKSHARE:
+        ofs << ", \"type\": \"workshare\", ";
+        ofs << "\"schedule\": \"";
+        ofs << (event.scope_type == CATS_WORKSHARE_STATIC
+          ? "static" : "dynamic") << "\", ";
+        ofs << "\"parallel_scope\": " << event.parallel_scope << ", ";
+        ofs << "\"lower\": " << (int64_t) event.id << ", ";
+        ofs << "\"upper\": " << (int64_t) event.size << ", ";
+        ofs << "\"stride\": 0";
+        break;
+      case CATS_EVENT_TYPE_SYNC:
+        ofs << ", \"type\": \"sync\", ";
+        ofs << "\"kind\": \"" << cats::sync_kind_name(event.scope_type)
+            << "\", ";
+        ofs << "\"phase\": \"" << cats::sync_phase_name(event.is_write)
+            << "\", ";
+        ofs << "\"object\": " << event.id << ", ";
+        ofs << (event.is_write == CATS_SYNC_ACQUIRE
+          ? "\"wait_ns\": " : "\"hold_ns\": ") << event.size;
+        break;
+    }
+    ofs << "}";
+  }
+
+  const shm::Segment &_segment;
+  bool _dedup;
+  std::vector<Site_Info> _sites;
+  std::map<uint32_t, Thread_State> _threads;
+  std::map<uint64_t, Alloc_Info> _allocations;
+  std::map<uint32_t, Sync_Stats> _sync;
+  std::vector<uint64_t> _parallel_scopes;
+  std::vector<Output_Event> _events;
+  // Threads whose rings were freed, with their dropped events
+  std::vector<std::pair<uint32_t, uint64_t>> _exited;
+  // Drop count of each reused ring when it was freed
+  std::map<uint32_t, uint64_t> _dropped;
+  uint64_t _received = 0;
+};
+
+static bool process_alive(int32_t pid) {
+  return pid > 0 && (kill(pid, 0) == 0 || errno != ESRCH);
+}
+
+// Maps the segment, waiting up to `timeout` seconds for the application to
+// create it.
+static void *attach(const std::string &name, double timeout, size_t &size) {
+  auto deadline = std::chrono::steady_clock::now() +
+    std::chrono::milliseconds((long) (timeout * 1000));
+  while (true) {
+    int fd = shm_open(name.c_str(), O_RDWR, 0);
+    if (fd >= 0) {
+      struct stat st;
+      if (fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(shm::Header)) {
+        size = st.st_size;
+        void *base = mmap(
+          nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0
+        );
+        close(fd);
+        if (base == MAP_FAILED)
+          return nullptr;
+        const shm::Header *header = (const shm::Header *) base;
+        if (header->magic == shm::MAGIC) {
+          std::atomic_thread_fence(std::memory_order_acquire);
+          // The layout is only known for this version, and a truncated
+          // segment would be read past its end
+          if (header->version != shm::VERSION) {
+            std::cerr << name << " has layout version "
+                      << header->version << ", expected " << shm::VERSION
+                      << std::endl;
+            munmap(base, size);
+            return nullptr;
+          }
+          if (shm::segment_size(header->n_rings, header->ring_capacity,
+                                header->max_sites, header->string_bytes) >
+              size) {
+            std::cerr << name << " is smaller than its layout" << std::endl;
+            munmap(base, size);
+            return nullptr;
+          }
+          return base;
+        }
+        munmap(base, size);
+      } else {
+        close(fd);
+      }
+    }
+    if (std::chrono::steady_clock::now() >= deadline)
+      return nullptr;
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+}
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--dedup stack|none] [--wait seconds] [-o output]"
+            << " pid|/segment-name" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  bool dedup = true;
+  double timeout = 30.0;
+  const char *target = nullptr;
+  const char *output = "cats_trace.cats";
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--dedup") && i + 1 < argc) {
+      const char *mode = argv[++i];
+      if (!strcmp(mode, "stack")) {
+        dedup = true;
+      } else if (!strcmp(mode, "none")) {
+        dedup = false;
+      } else {
+        std::cerr << "Unknown deduplication mode: " << mode << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--wait") && i + 1 < argc) {
+      timeout = atof(argv[++i]);
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      target = argv[i];
+    }
+  }
+  if (!target) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  std::string name = target;
+  if (name[0] != '/')
+    name = "/cats." + name;
+
+  size_t size = 0;
+  void *base = attach(name, timeout, size);
+  if (!base) {
+    std::cerr << "Cannot attach to " << name << std::endl;
+    return 1;
+  }
+  shm::Segment segment(base);
+  shm::Header *header = segment.header;
+
+  int32_t previous = header->collector_pid.load();
+  if (process_alive(previous) ||
+      !header->collector_pid.compare_exchange_strong(previous, getpid())) {
+    std::cerr << "Another collector is attached to " << name << std::endl;
+    return 1;
+  }
+  std::cerr << "Collecting from " << name << " (pid "
+            << header->producer_pid << ")" << std::endl;
+
+  Collector collector(segment, dedup);
+  while (true) {
+    // Read the state before draining, so the last events are not missed.
+    bool finished = header->finished.load(std::memory_order_acquire);
+    bool alive = process_alive(header->producer_pid);
+    if (collector.drain() > 0)
+      continue;
+    if (finished || !alive) {
+      if (!finished) {
+        std::cerr << "Application exited without cats_trace_save, "
+                  << "writing the events received so far" << std::endl;
+      }
+      break;
+    }
+    std::this_thread::sleep_for(std::chrono::microseconds(200));
+  }
+
+  std::ofstream ofs(output, std::ios::binary);
+  if (!ofs.good()) {
+    std::cerr << "Cannot open output " << output << std::endl;
+    return 1;
+  }
+  collector.write(ofs);
+
+  uint64_t dropped = header->unclaimed_dropped.load();
+  for (uint32_t i = 0; i < header->n_rings; ++i)
+    dropped += segment.rings[i].dropped.load();
+  std::cerr << "Received " << collector.received() << " events, recorded "
+            << collector.recorded() << ", dropped " << dropped << std::endl;
+
+  munmap(base, size);
+  shm_unlink(name.c_str());
+  return 0;
+}
@@ -0,0 +1,146 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// cats-fold: turns the scope nesting of a CATS trace into folded stacks
+// (`main;gemm;loop@12;loop@14 <weight>`) that can be fed directly to
+// flamegraph.pl, speedscope or inferno.
+
+#include "cats_trace_reader.hpp"
+
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+
+using cats::tools::FoldedStack;
+using cats::tools::TraceReader;
+using cats::tools::TraceRecord;
+using cats::tools::frame_name;
+
+enum class Weight {
+  EVENTS,
+  BYTES,
+  TIME,
+  ALLOC,
+};
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--weight events|bytes|time|alloc] [-o output] trace.cats"
+            << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  Weight weight = Weight::EVENTS;
+  const char *input = nullptr;
+  const char *output = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if ((!strcmp(argv[i], "--weight") || !strcmp(argv[i], "-w")) &&
+        i + 1 < argc) {
+      const char *w = argv[++i];
+      if (!strcmp(w, "events")) {
+        weight = Weight::EVENTS;
+      } else if (!strcmp(w, "bytes")) {
+        weight = Weight::BYTES;
+      } else if (!strcmp(w, "time")) {
+        weight = Weight::TIME;
+      } else if (!strcmp(w, "alloc")) {
+        weight = Weight::ALLOC;
+      } else {
+        std::cerr << "Unknown weight: " << w << std::endl;
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      input = argv[i];
+    }
+  }
+  if (!input) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  TraceReader reader(input);
+  if (!reader.good()) {
+    std::cerr << "Cannot open trace " << input << std::endl;
+    return 1;
+  }
+
+  // Single streaming pass: maintain the scope stack per thread and add each
+  // event's weight to the folded stack it occurred in.
+  std::map<uint64_t, FoldedStack> stacks;
+  std::map<std::string, uint64_t> folded;
+  std::map<uint64_t, std::pair<uint64_t, std::string>> last_seen;
+  TraceRecord record;
+  while (reader.next(record)) {
+    if (record.section() != "events")
+      continue;
+
+    uint64_t thread = record.u64("thread");
+    FoldedStack &stack = stacks[thread];
+    std::string type = record.str("type");
+    uint64_t ts = record.u64("ts");
+
+    if (weight == Weight::TIME) {
+      // The time since the previous event of this thread is spent in the
+      // stack that was current at that event.
+      auto prev = last_seen.find(thread);
+      if (prev != last_seen.end() && ts > prev->second.first &&
+          !prev->second.second.empty())
+        folded[prev->second.second] += ts - prev->second.first;
+    }
+
+    if (type == "scope_entry") {
+      stack.push(record.u64("id"), frame_name(record));
+    } else if (type == "scope_exit") {
+      stack.pop(record.u64("id"));
+    }
+
+    std::string current = stack.folded();
+    if (current.empty())
+      current = record.str("funcname", "[unknown]");
+
+    uint64_t value = 0;
+    switch (weight) {
+      case Weight::EVENTS:
+        value = 1;
+        break;
+      case Weight::BYTES:
+        if (type == "access")
+          value = record.u64("size");
+        break;
+      case Weight::ALLOC:
+        if (type == "allocation")
+          value = record.u64("size");
+        break;
+      case Weight::TIME:
+        last_seen[thread] = std::make_pair(ts, current);
+        break;
+    }
+    if (value)
+      folded[current] += value;
+  }
+
+  std::ofstream ofs;
+  if (output) {
+    ofs.open(output);
+    if (!ofs.good()) {
+      std::cerr << "Cannot open output " << output << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &os = output ? ofs : std::cout;
+  for (auto &entry : folded) {
+    if (entry.second)
+      os << entry.first << " " << entry.second << "\n";
+  }
+
+  return 0;
+}
@@ -0,0 +1,331 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// cats-fusion: builds the data reuse graph of the sibling loop scopes of a
+// CATS trace. Nodes are loops, edges connect loops that run one after the
+// other in the same enclosing scope instance and are weighted by the buffers
+// both access and by the buffers the first writes and the second reads.
+// Adjacent pairs are ranked by the bytes that fusing them would keep in
+// cache, as a list of fusion candidates.
+
+#include "cats_trace_reader.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using cats::tools::TraceReader;
+using cats::tools::TraceRecord;
+
+// Enclosing scopes with more distinct child loops only pair the first ones
+static const size_t MAX_CHILD_LOOPS = 64;
+
+// Buffers accessed by all instances of a loop, including nested scopes.
+struct Loop {
+  std::string funcname;
+  std::string filename;
+  uint64_t line = 0;
+  uint64_t instances = 0;
+  std::set<uint64_t> reads;
+  std::set<uint64_t> writes;
+};
+
+struct Frame {
+  uint64_t id;
+  bool loop;
+  // Child loops in the order they were entered, 0 for other child scopes
+  std::vector<uint64_t> children;
+};
+
+struct Edge {
+  uint64_t siblings = 0;
+  uint64_t adjacent = 0;
+  // Filled in from the loops once the trace is read
+  std::vector<uint64_t> shared;
+  std::vector<uint64_t> raw;
+  uint64_t shared_bytes = 0;
+  uint64_t raw_bytes = 0;
+};
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0 << " [--top N] [--json] [-o output] "
+            << "trace.cats" << std::endl;
+}
+
+// Loops on the same line (e.g. in a macro or in different inlined copies)
+// are told apart by their scope ID.
+static std::string label(uint64_t scope_id, const Loop &loop) {
+  return loop.funcname + ":loop@" + std::to_string(loop.line) + " (scope " +
+         std::to_string(scope_id) + ")";
+}
+
+// Records the sibling relations of the child loops of a closed frame: every
+// pair in order of first entry, and as adjacent when the second was entered
+// right after the first. Re-entering the first loop after the second (the
+// next iteration of an enclosing loop) is not adjacency.
+static void close_frame(const Frame &frame,
+                        std::map<std::pair<uint64_t, uint64_t>, Edge> &edges) {
+  std::vector<uint64_t> order;
+  std::unordered_map<uint64_t, size_t> first;
+  for (uint64_t child : frame.children) {
+    if (child && !first.count(child) && order.size() < MAX_CHILD_LOOPS) {
+      first[child] = order.size();
+      order.push_back(child);
+    }
+  }
+  for (size_t i = 0; i < order.size(); ++i) {
+    for (size_t j = i + 1; j < order.size(); ++j)
+      ++edges[std::make_pair(order[i], order[j])].siblings;
+  }
+  for (size_t i = 0; i + 1 < frame.children.size(); ++i) {
+    uint64_t a = frame.children[i];
+    uint64_t b = frame.children[i + 1];
+    if (!a || !b || a == b || !first.count(a) || !first.count(b) ||
+        first[a] > first[b])
+      continue;
+    ++edges[std::make_pair(a, b)].adjacent;
+  }
+}
+
+static std::string buffer_list(
+  const std::vector<uint64_t> &ids,
+  const std::unordered_map<uint64_t, std::string> &names
+) {
+  std::string list;
+  for (uint64_t id : ids) {
+    auto it = names.find(id);
+    if (!list.empty())
+      list += ", ";
+    list += (it != names.end() ? it->second : "$UNKNOWN$") + "#" +
+            std::to_string(id);
+  }
+  return list;
+}
+
+static void write_ids(std::ostream &os, const std::vector<uint64_t> &ids) {
+  os << "[";
+  for (size_t i = 0; i < ids.size(); ++i)
+    os << (i ? ", " : "") << ids[i];
+  os << "]";
+}
+
+int main(int argc, char *argv[]) {
+  size_t top = 20;
+  bool json = false;
+  const char *input = nullptr;
+  const char *output = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--top") && i + 1 < argc) {
+      top = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--json")) {
+      json = true;
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      input = argv[i];
+    }
+  }
+  if (!input) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  TraceReader reader(input);
+  if (!reader.good()) {
+    std::cerr << "Cannot open trace " << input << std::endl;
+    return 1;
+  }
+
+  // The buffers of a loop are the union over its instances, so that the
+  // instances whose accesses were deduplicated are still covered.
+  std::map<uint64_t, Loop> loops;
+  std::map<std::pair<uint64_t, uint64_t>, Edge> edges;
+  std::unordered_map<uint64_t, uint64_t> sizes;
+  std::unordered_map<uint64_t, std::string> names;
+  std::map<uint64_t, std::vector<Frame>> stacks;
+  TraceRecord record;
+  while (reader.next(record)) {
+    if (record.section() != "events")
+      continue;
+
+    std::vector<Frame> &stack = stacks[record.u64("thread")];
+    if (stack.empty())
+      stack.push_back({0, false, {}});
+    std::string type = record.str("type");
+
+    if (type == "scope_entry") {
+      uint64_t id = record.u64("id");
+      bool loop = record.str("scope_type") == "loop";
+      stack.back().children.push_back(loop ? id : 0);
+      stack.push_back({id, loop, {}});
+      if (loop) {
+        Loop &info = loops[id];
+        if (info.instances++ == 0) {
+          info.funcname = record.str("funcname");
+          info.filename = record.str("filename");
+          info.line = record.u64("line");
+        }
+      }
+    } else if (type == "scope_exit") {
+      // Scopes left without their exit are closed with the enclosing one
+      uint64_t id = record.u64("id");
+      auto it = std::find_if(stack.rbegin(), stack.rend() - 1,
+                             [id](const Frame &frame) {
+        return frame.id == id;
+      });
+      if (it == stack.rend() - 1)
+        continue;
+      while (true) {
+        Frame frame = std::move(stack.back());
+        stack.pop_back();
+        close_frame(frame, edges);
+        if (frame.id == id)
+          break;
+      }
+    } else if (type == "allocation") {
+      uint64_t &size = sizes[record.u64("buffer_id")];
+      size = std::max(size, record.u64("size"));
+      names[record.u64("buffer_id")] = record.str("buffer_name");
+    } else if (type == "access") {
+      uint64_t buffer = record.u64("buffer_id");
+      bool write = record.str("mode") == "w";
+      for (const Frame &frame : stack) {
+        if (!frame.loop)
+          continue;
+        Loop &loop = loops[frame.id];
+        (write ? loop.writes : loop.reads).insert(buffer);
+      }
+    }
+  }
+  for (auto &stack : stacks) {
+    while (!stack.second.empty()) {
+      close_frame(stack.second.back(), edges);
+      stack.second.pop_back();
+    }
+  }
+
+  // Buffers both loops access, and buffers the first writes and the second
+  // reads: fusing keeps them in cache between the two
+  std::vector<std::pair<std::pair<uint64_t, uint64_t>, Edge *>> ranked;
+  for (auto &entry : edges) {
+    const Loop &a = loops[entry.first.first];
+    const Loop &b = loops[entry.first.second];
+    std::set<uint64_t> accessed_a(a.reads);
+    accessed_a.insert(a.writes.begin(), a.writes.end());
+    std::set<uint64_t> accessed_b(b.reads);
+    accessed_b.insert(b.writes.begin(), b.writes.end());
+    Edge &edge = entry.second;
+    std::set_intersection(accessed_a.begin(), accessed_a.end(),
+                          accessed_b.begin(), accessed_b.end(),
+                          std::back_inserter(edge.shared));
+    std::set_intersection(a.writes.begin(), a.writes.end(),
+                          b.reads.begin(), b.reads.end(),
+                          std::back_inserter(edge.raw));
+    for (uint64_t buffer : edge.shared)
+      edge.shared_bytes += sizes[buffer];
+    for (uint64_t buffer : edge.raw)
+      edge.raw_bytes += sizes[buffer];
+    if (edge.adjacent && !edge.shared.empty())
+      ranked.emplace_back(entry.first, &edge);
+  }
+  std::stable_sort(ranked.begin(), ranked.end(), [](const auto &a,
+                                                    const auto &b) {
+    uint64_t kept_a = a.second->shared_bytes * a.second->adjacent;
+    uint64_t kept_b = b.second->shared_bytes * b.second->adjacent;
+    if (kept_a != kept_b)
+      return kept_a > kept_b;
+    return a.second->raw_bytes > b.second->raw_bytes;
+  });
+
+  std::ofstream ofs;
+  if (output) {
+    ofs.open(output);
+    if (!ofs.good()) {
+      std::cerr << "Cannot open output " << output << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &os = output ? ofs : std::cout;
+
+  if (json) {
+    os << "{" << std::endl;
+    os << "  \"loops\": [" << std::endl;
+    size_t n = 0;
+    for (const auto &entry : loops) {
+      const Loop &loop = entry.second;
+      os << "    {\"id\": " << entry.first << ", ";
+      os << "\"funcname\": \"" << loop.funcname << "\", ";
+      os << "\"filename\": \"" << loop.filename << "\", ";
+      os << "\"line\": " << loop.line << ", ";
+      os << "\"instances\": " << loop.instances << ", ";
+      os << "\"reads\": ";
+      write_ids(os, std::vector<uint64_t>(loop.reads.begin(),
+                                          loop.reads.end()));
+      os << ", \"writes\": ";
+      write_ids(os, std::vector<uint64_t>(loop.writes.begin(),
+                                          loop.writes.end()));
+      os << "}" << (++n < loops.size() ? "," : "") << std::endl;
+    }
+    os << "  ]," << std::endl;
+    os << "  \"edges\": [" << std::endl;
+    n = 0;
+    for (const auto &entry : edges) {
+      const Edge &edge = entry.second;
+      os << "    {\"first\": " << entry.first.first << ", ";
+      os << "\"second\": " << entry.first.second << ", ";
+      os << "\"siblings\": " << edge.siblings << ", ";
+      os << "\"adjacent\": " << edge.adjacent << ", ";
+      os << "\"shared\": ";
+      write_ids(os, edge.shared);
+      os << ", \"shared_bytes\": " << edge.shared_bytes << ", ";
+      os << "\"raw\": ";
+      write_ids(os, edge.raw);
+      os << ", \"raw_bytes\": " << edge.raw_bytes << "}";
+      os << (++n < edges.size() ? "," : "") << std::endl;
+    }
+    os << "  ]," << std::endl;
+    os << "  \"candidates\": [" << std::endl;
+    for (size_t i = 0; i < ranked.size(); ++i) {
+      const Edge &edge = *ranked[i].second;
+      os << "    {\"first\": " << ranked[i].first.first << ", ";
+      os << "\"second\": " << ranked[i].first.second << ", ";
+      os << "\"kept_bytes\": " << edge.shared_bytes * edge.adjacent << ", ";
+      os << "\"raw_bytes\": " << edge.raw_bytes << "}";
+      os << (i + 1 < ranked.size() ? "," : "") << std::endl;
+    }
+    os << "  ]" << std::endl;
+    os << "}" << std::endl;
+    return 0;
+  }
+
+  os << "Loops: " << loops.size() << ", sibling pairs: " << edges.size()
+     << std::endl;
+  os << std::endl << "Fusion candidates (adjacent loops sharing data):"
+     << std::endl;
+  for (size_t i = 0; i < ranked.size() && i < top; ++i) {
+    const Loop &a = loops[ranked[i].first.first];
+    const Loop &b = loops[ranked[i].first.second];
+    const Edge &edge = *ranked[i].second;
+    os << "  " << label(ranked[i].first.first, a) << " + "
+       << label(ranked[i].first.second, b) << ": "
+       << edge.shared_bytes * edge.adjacent << " bytes kept in cache ("
+       << edge.shared_bytes << " bytes shared x " << edge.adjacent
+       << " times)" << std::endl;
+    os << "    shared: " << buffer_list(edge.shared, names) << std::endl;
+    if (!edge.raw.empty())
+      os << "    read after write: " << buffer_list(edge.raw, names) << " ("
+         << edge.raw_bytes << " bytes)" << std::endl;
+  }
+  return 0;
+}
@@ -0,0 +1,327 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// cats-liveness: computes the live range of every buffer of a CATS trace
+// (allocation, first access, last access and free, with the scopes they
+// happened in) and advises on reducing the memory footprint: buffers held
+// long after their last use, buffers that are never accessed and groups of
+// buffers whose live ranges never overlap, so that they could share storage.
+
+#include "cats_trace_reader.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using cats::tools::FoldedStack;
+using cats::tools::TraceReader;
+using cats::tools::TraceRecord;
+using cats::tools::frame_name;
+
+struct Buffer {
+  uint64_t id = 0;
+  std::string name;
+  uint64_t size = 0;
+  uint64_t accesses = 0;
+  bool freed = false;
+  uint64_t alloc_ts = 0;
+  uint64_t first_ts = 0;
+  uint64_t last_ts = 0;
+  uint64_t free_ts = 0;
+  std::string alloc_scope;
+  std::string first_scope;
+  std::string last_scope;
+  std::string free_scope;
+};
+
+// Largest buffers considered for storage sharing
+static const size_t MAX_SHARING_CANDIDATES = 10000;
+
+// Buffers with disjoint live ranges, stored in `size` bytes. The buffers
+// are ordered by their first access.
+struct Slot {
+  uint64_t size = 0;
+  std::map<uint64_t, const Buffer *> buffers;
+
+  bool fits(const Buffer &buffer) const {
+    auto next = this->buffers.lower_bound(buffer.first_ts);
+    if (next != this->buffers.end() &&
+        next->second->first_ts <= buffer.last_ts)
+      return false;
+    if (next != this->buffers.begin() &&
+        std::prev(next)->second->last_ts >= buffer.first_ts)
+      return false;
+    return true;
+  }
+};
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0
+            << " [--top N] [--idle FRACTION] [-o output] trace.cats"
+            << std::endl;
+}
+
+static std::string label(const Buffer &buffer) {
+  return buffer.name + "#" + std::to_string(buffer.id);
+}
+
+static std::string scope(const std::string &folded) {
+  return folded.empty() ? "[top]" : folded;
+}
+
+// Highest sum of sizes over the given [begin, end] intervals.
+static std::pair<uint64_t, uint64_t> peak(
+  std::vector<std::pair<uint64_t, int64_t>> &deltas
+) {
+  // Releases before acquisitions at the same time stamp
+  std::sort(deltas.begin(), deltas.end());
+  int64_t current = 0;
+  int64_t max = 0;
+  uint64_t max_ts = 0;
+  for (auto &delta : deltas) {
+    current += delta.second;
+    if (current > max) {
+      max = current;
+      max_ts = delta.first;
+    }
+  }
+  return std::make_pair((uint64_t) max, max_ts);
+}
+
+int main(int argc, char *argv[]) {
+  size_t top = 20;
+  double idle_fraction = 0.5;
+  const char *input = nullptr;
+  const char *output = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--top") && i + 1 < argc) {
+      top = std::strtoull(argv[++i], nullptr, 10);
+    } else if (!strcmp(argv[i], "--idle") && i + 1 < argc) {
+      idle_fraction = std::strtod(argv[++i], nullptr);
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      input = argv[i];
+    }
+  }
+  if (!input) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  TraceReader reader(input);
+  if (!reader.good()) {
+    std::cerr << "Cannot open trace " << input << std::endl;
+    return 1;
+  }
+
+  // Single streaming pass: the buffer IDs are addresses and may be reused
+  // after a free, so each allocation starts a new buffer.
+  std::vector<Buffer> buffers;
+  std::unordered_map<uint64_t, size_t> live;
+  std::map<uint64_t, FoldedStack> stacks;
+  uint64_t end_ts = 0;
+  TraceRecord record;
+  while (reader.next(record)) {
+    if (record.section() != "events")
+      continue;
+
+    FoldedStack &stack = stacks[record.u64("thread")];
+    std::string type = record.str("type");
+    uint64_t ts = record.u64("ts");
+    end_ts = std::max(end_ts, ts);
+
+    if (type == "scope_entry") {
+      stack.push(record.u64("id"), frame_name(record));
+    } else if (type == "scope_exit") {
+      stack.pop(record.u64("id"));
+    } else if (type == "allocation") {
+      Buffer buffer;
+      buffer.id = record.u64("buffer_id");
+      buffer.name = record.str("buffer_name");
+      buffer.size = record.u64("size");
+      buffer.alloc_ts = ts;
+      buffer.alloc_scope = stack.folded();
+      live[buffer.id] = buffers.size();
+      buffers.push_back(std::move(buffer));
+    } else if (type == "access") {
+      auto it = live.find(record.u64("buffer_id"));
+      if (it == live.end())
+        continue;
+      Buffer &buffer = buffers[it->second];
+      if (buffer.accesses++ == 0) {
+        buffer.first_ts = ts;
+        buffer.first_scope = stack.folded();
+      }
+      buffer.last_ts = ts;
+      buffer.last_scope = stack.folded();
+    } else if (type == "deallocation") {
+      auto it = live.find(record.u64("buffer_id"));
+      if (it == live.end())
+        continue;
+      Buffer &buffer = buffers[it->second];
+      buffer.freed = true;
+      buffer.free_ts = ts;
+      buffer.free_scope = stack.folded();
+      live.erase(it);
+    }
+  }
+  // Buffers that are never freed are held until the end of the trace
+  for (Buffer &buffer : buffers) {
+    if (!buffer.freed)
+      buffer.free_ts = end_ts;
+  }
+
+  std::ofstream ofs;
+  if (output) {
+    ofs.open(output);
+    if (!ofs.good()) {
+      std::cerr << "Cannot open output " << output << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &os = output ? ofs : std::cout;
+
+  // Footprint as allocated and if every buffer were only held from its
+  // first to its last access
+  std::vector<std::pair<uint64_t, int64_t>> allocated;
+  std::vector<std::pair<uint64_t, int64_t>> used;
+  for (const Buffer &buffer : buffers) {
+    allocated.emplace_back(buffer.alloc_ts, (int64_t) buffer.size);
+    allocated.emplace_back(buffer.free_ts + 1, -(int64_t) buffer.size);
+    if (buffer.accesses) {
+      used.emplace_back(buffer.first_ts, (int64_t) buffer.size);
+      used.emplace_back(buffer.last_ts + 1, -(int64_t) buffer.size);
+    }
+  }
+  std::pair<uint64_t, uint64_t> allocated_peak = peak(allocated);
+  std::pair<uint64_t, uint64_t> used_peak = peak(used);
+
+  os << "Buffers: " << buffers.size() << std::endl;
+  os << "Peak allocated: " << allocated_peak.first << " bytes at ts "
+     << allocated_peak.second << std::endl;
+  os << "Peak if held only from first to last access: " << used_peak.first
+     << " bytes at ts " << used_peak.second << std::endl;
+  if (allocated_peak.first > 0) {
+    uint64_t saved = allocated_peak.first - std::min(used_peak.first,
+                                                     allocated_peak.first);
+    os << "Potential peak reduction: " << saved << " bytes ("
+       << 100.0 * saved / allocated_peak.first << "%)" << std::endl;
+  }
+
+  // Buffers held long after their last use, largest idle bytes first
+  std::vector<std::pair<double, const Buffer *>> idle;
+  std::vector<const Buffer *> unused;
+  for (const Buffer &buffer : buffers) {
+    if (!buffer.accesses) {
+      unused.push_back(&buffer);
+      continue;
+    }
+    uint64_t lifetime = buffer.free_ts - buffer.alloc_ts;
+    uint64_t tail = buffer.free_ts - buffer.last_ts;
+    if (lifetime > 0 && (double) tail / lifetime >= idle_fraction)
+      idle.emplace_back((double) tail * buffer.size, &buffer);
+  }
+  std::stable_sort(idle.begin(), idle.end(), [](const auto &a,
+                                                const auto &b) {
+    return a.first > b.first;
+  });
+  std::stable_sort(unused.begin(), unused.end(), [](const Buffer *a,
+                                                    const Buffer *b) {
+    return a->size > b->size;
+  });
+
+  os << std::endl << "Held after last use:" << std::endl;
+  for (size_t i = 0; i < idle.size() && i < top; ++i) {
+    const Buffer &buffer = *idle[i].second;
+    uint64_t lifetime = buffer.free_ts - buffer.alloc_ts;
+    uint64_t tail = buffer.free_ts - buffer.last_ts;
+    os << "  " << label(buffer) << ": " << buffer.size << " bytes, idle "
+       << tail << " ns (" << 100.0 * tail / lifetime << "% of its lifetime)"
+       << std::endl;
+    os << "    allocated in " << scope(buffer.alloc_scope) << std::endl;
+    os << "    first used in " << scope(buffer.first_scope) << std::endl;
+    os << "    last used in " << scope(buffer.last_scope) << std::endl;
+    os << "    " << (buffer.freed ? "freed in " + scope(buffer.free_scope)
+                                  : std::string("never freed"))
+       << std::endl;
+  }
+
+  os << std::endl << "Never accessed:" << std::endl;
+  for (size_t i = 0; i < unused.size() && i < top; ++i) {
+    const Buffer &buffer = *unused[i];
+    os << "  " << label(buffer) << ": " << buffer.size
+       << " bytes, allocated in " << scope(buffer.alloc_scope) << std::endl;
+  }
+
+  // Greedy assignment of the largest buffers to shared storage slots
+  std::vector<const Buffer *> candidates;
+  for (const Buffer &buffer : buffers) {
+    if (buffer.accesses)
+      candidates.push_back(&buffer);
+  }
+  std::stable_sort(candidates.begin(), candidates.end(),
+                   [](const Buffer *a, const Buffer *b) {
+    return a->size > b->size;
+  });
+  if (candidates.size() > MAX_SHARING_CANDIDATES)
+    candidates.resize(MAX_SHARING_CANDIDATES);
+  std::vector<Slot> slots;
+  for (const Buffer *buffer : candidates) {
+    Slot *fit = nullptr;
+    for (Slot &slot : slots) {
+      if (slot.fits(*buffer)) {
+        fit = &slot;
+        break;
+      }
+    }
+    if (!fit) {
+      slots.emplace_back();
+      fit = &slots.back();
+      fit->size = buffer->size;
+    }
+    fit->buffers.emplace(buffer->first_ts, buffer);
+  }
+
+  std::vector<std::pair<uint64_t, const Slot *>> shared;
+  for (const Slot &slot : slots) {
+    if (slot.buffers.size() < 2)
+      continue;
+    uint64_t total = 0;
+    for (auto &member : slot.buffers)
+      total += member.second->size;
+    shared.emplace_back(total - slot.size, &slot);
+  }
+  std::stable_sort(shared.begin(), shared.end(), [](const auto &a,
+                                                    const auto &b) {
+    return a.first > b.first;
+  });
+
+  os << std::endl << "Storage sharing (live ranges never overlap):"
+     << std::endl;
+  for (size_t i = 0; i < shared.size() && i < top; ++i) {
+    const Slot &slot = *shared[i].second;
+    os << "  " << slot.size << " bytes shared by " << slot.buffers.size()
+       << " buffers, saving " << shared[i].first << " bytes:" << std::endl;
+    for (auto &member : slot.buffers) {
+      const Buffer *buffer = member.second;
+      os << "    " << label(*buffer) << ": " << buffer->size
+         << " bytes, used in " << scope(buffer->first_scope);
+      if (buffer->last_scope != buffer->first_scope)
+        os << " .. " << scope(buffer->last_scope);
+      os << std::endl;
+    }
+  }
+
+  return 0;
+}
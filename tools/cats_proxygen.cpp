@@ -0,0 +1,547 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// cats-proxygen: generates a standalone C++ proxy benchmark from a CATS
+// trace. The proxy allocates buffers of the traced sizes and replays the
+// scope nesting of the trace as nested blocks and loops, in which every
+// recorded access site becomes a load or store that walks its buffer with
+// the stride derived from the site's delinearized traversal and over the
+// range its heatmap shows to be touched. The proxy contains no code of the
+// original program, only its structure and memory behavior.
+
+#include "cats_trace_reader.hpp"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+using cats::tools::TraceReader;
+using cats::tools::TraceRecord;
+
+// Upper bound of an estimated loop trip count
+static const uint64_t MAX_ESTIMATED_TRIPS = 1 << 24;
+
+struct Buffer {
+  std::string name;
+  uint64_t size = 0;
+  // Touched range from the heatmaps, the whole buffer without them
+  uint64_t begin = 0;
+  uint64_t end = 0;
+  bool heatmap = false;
+  // Currently held by a traced allocation
+  bool live = false;
+};
+
+struct Site {
+  std::string funcname;
+  uint64_t line = 0;
+  uint64_t col = 0;
+  bool write = false;
+  size_t buffer = 0;
+  uint64_t events = 0;
+  // Bytes of a sized access, 0 otherwise
+  uint64_t size = 0;
+  uint64_t element_size = 0;
+  std::string shape;
+  std::string traversal;
+};
+
+typedef std::tuple<std::string, uint64_t, uint64_t, bool, size_t> Site_Key;
+
+struct Node {
+  uint64_t scope_id = 0;
+  std::string type;
+  std::string funcname;
+  std::string filename;
+  uint64_t line = 0;
+  uint64_t instances = 0;
+  std::vector<std::unique_ptr<Node>> children;
+  std::unordered_map<uint64_t, Node *> by_id;
+  std::map<Site_Key, Site> sites;
+
+  Node *child(uint64_t id) {
+    auto it = this->by_id.find(id);
+    if (it != this->by_id.end())
+      return it->second;
+    this->children.emplace_back(new Node());
+    Node *node = this->children.back().get();
+    node->scope_id = id;
+    this->by_id[id] = node;
+    return node;
+  }
+};
+
+// Scope profile written by the runtime, counted before deduplication
+struct Profile {
+  uint64_t count = 0;
+  uint64_t iterations = 0;
+  bool has_iterations = false;
+};
+
+struct Generator {
+  std::ostream &os;
+  const std::vector<Buffer> &buffers;
+  const std::map<uint64_t, Profile> &profiles;
+  const Node &root;
+  // Nodes of each scope ID, more than one if it is entered in several
+  // contexts
+  const std::unordered_map<uint64_t, size_t> &contexts;
+  bool anonymize;
+  size_t next_scope = 0;
+  size_t next_site = 0;
+
+  std::string indent(int depth) const {
+    return std::string(2 * depth + 2, ' ');
+  }
+
+  static uint64_t access_bytes(const Site &site) {
+    if (site.element_size)
+      return site.element_size;
+    return site.size ? site.size : 8;
+  }
+
+  // Distance between the accesses of consecutive iterations
+  uint64_t stride(const Site &site) const {
+    uint64_t element = access_bytes(site);
+    if (site.traversal == "invariant")
+      return 0;
+    if (site.traversal != "column")
+      return element;
+    // The row length is the innermost extent if it is a constant, and that
+    // of a square array otherwise
+    size_t open = site.shape.rfind('[');
+    if (open != std::string::npos) {
+      uint64_t extent = std::strtoull(site.shape.c_str() + open + 1,
+                                      nullptr, 10);
+      if (extent)
+        return extent * element;
+    }
+    const Buffer &buffer = this->buffers[site.buffer];
+    uint64_t elements = buffer.size / std::max<uint64_t>(element, 1);
+    return std::max<uint64_t>(1, (uint64_t) std::sqrt((double) elements)) *
+           element;
+  }
+
+  bool single_context(const Node &node) const {
+    auto it = this->contexts.find(node.scope_id);
+    return it != this->contexts.end() && it->second == 1;
+  }
+
+  // Instances of `node` per instance of its parent. The scope profiles are
+  // counted before deduplication but over all contexts of a scope, so they
+  // are only used if both scopes have a single context; otherwise the
+  // entries in the trace are.
+  uint64_t repetitions(const Node &node, const Node &parent) const {
+    auto it = this->profiles.find(node.scope_id);
+    if (it != this->profiles.end() && it->second.count &&
+        this->single_context(node)) {
+      uint64_t parent_count = 0;
+      if (&parent == &this->root) {
+        parent_count = 1;
+      } else if (this->single_context(parent)) {
+        auto parent_it = this->profiles.find(parent.scope_id);
+        if (parent_it != this->profiles.end())
+          parent_count = parent_it->second.count;
+      }
+      if (parent_count)
+        return std::max<uint64_t>(1, it->second.count / parent_count);
+    }
+    return std::max<uint64_t>(1, node.instances /
+                                 std::max<uint64_t>(1, parent.instances));
+  }
+
+  // Iterations of one instance of a loop: reported by the runtime, else the
+  // accesses of its busiest site per instance, else enough to sweep the
+  // range of its widest site once
+  uint64_t trips(const Node &node) const {
+    auto it = this->profiles.find(node.scope_id);
+    if (it != this->profiles.end() && it->second.has_iterations &&
+        it->second.count)
+      return std::max<uint64_t>(1, it->second.iterations / it->second.count);
+    uint64_t instances = std::max<uint64_t>(1, node.instances);
+    uint64_t events = 0;
+    uint64_t sweep = 1;
+    for (const auto &entry : node.sites) {
+      const Site &site = entry.second;
+      events = std::max(events, site.events / instances);
+      uint64_t step = this->stride(site);
+      const Buffer &buffer = this->buffers[site.buffer];
+      if (step)
+        sweep = std::max(sweep, (buffer.end - buffer.begin) / step);
+    }
+    if (events > 1)
+      return events;
+    return std::min(sweep, MAX_ESTIMATED_TRIPS);
+  }
+
+  std::string describe(const Node &node) const {
+    std::string what = node.type == "func" ? "function" :
+                       node.type == "loop" ? "loop" :
+                       node.type == "para" ? "parallel region" :
+                       node.type == "cond" ? "conditional" : "scope";
+    if (this->anonymize)
+      return what;
+    return what + " " + node.funcname + " (" + node.filename + ":" +
+           std::to_string(node.line) + ")";
+  }
+
+  // Emits the access of a site, `index` is the iteration of the enclosing
+  // loop, or "0" outside of loops.
+  void emit_site(const Site &site, size_t counter, uint64_t step,
+                 uint64_t outer, const std::string &index, int depth) {
+    const Buffer &buffer = this->buffers[site.buffer];
+    uint64_t bytes = access_bytes(site);
+    uint64_t range = buffer.end - buffer.begin;
+    uint64_t span = range >= bytes ? range - bytes + 1 : 1;
+    std::string offset = std::to_string(buffer.begin) + " + (c" +
+                         std::to_string(counter) + " * " +
+                         std::to_string(outer) + " + " + index + " * " +
+                         std::to_string(step) + ") % " +
+                         std::to_string(span);
+    std::string call = site.write ? "store" : "sum += load";
+    this->os << this->indent(depth) << call << "(b" << site.buffer
+             << ".data(), " << offset << ", " << std::min(bytes, range)
+             << ");";
+    if (!this->anonymize)
+      this->os << " // " << site.funcname << ":" << site.line << ":"
+               << site.col;
+    this->os << std::endl;
+  }
+
+  void emit(const Node &node, const Node &parent, int depth) {
+    uint64_t reps = this->repetitions(node, parent);
+    bool loop = node.type == "loop";
+    uint64_t n = loop ? this->trips(node) : 1;
+    size_t id = this->next_scope++;
+
+    this->os << this->indent(depth) << "// " << this->describe(node);
+    if (reps > 1)
+      this->os << ", " << reps << " times";
+    if (loop)
+      this->os << ", " << n << " iterations";
+    this->os << std::endl;
+    if (reps > 1)
+      this->os << this->indent(depth) << "for (uint64_t r" << id << " = 0; r"
+               << id << " < " << reps << "; ++r" << id << ") {" << std::endl;
+    else
+      this->os << this->indent(depth) << "{" << std::endl;
+    int inner = depth + 1;
+
+    std::vector<size_t> counters;
+    std::string index = "0";
+    int body = inner;
+    if (loop) {
+      index = "i" + std::to_string(id);
+      this->os << this->indent(inner) << "for (uint64_t " << index
+               << " = 0; " << index << " < " << n << "; ++" << index << ") {"
+               << std::endl;
+      ++body;
+    }
+    this->emit_body(node, loop, n, index, body, counters);
+    if (loop)
+      this->os << this->indent(inner) << "}" << std::endl;
+    for (size_t counter : counters)
+      this->os << this->indent(inner) << "++c" << counter << ";" << std::endl;
+    this->os << this->indent(depth) << "}" << std::endl;
+  }
+
+  // Emits the sites and the child scopes of `node`, the counters of the
+  // sites are appended to `counters`.
+  void emit_body(const Node &node, bool loop, uint64_t n,
+                 const std::string &index, int depth,
+                 std::vector<size_t> &counters) {
+    for (const auto &entry : node.sites) {
+      const Site &site = entry.second;
+      size_t counter = this->next_site++;
+      counters.push_back(counter);
+      uint64_t step = loop ? this->stride(site) : 0;
+      // Successive instances move on by a row for row-wise sweeps and by
+      // an element otherwise
+      uint64_t outer = site.traversal == "column" ||
+                       site.traversal == "invariant" || !loop
+        ? access_bytes(site) : n * step;
+      this->emit_site(site, counter, step, outer, index, depth);
+    }
+    for (const auto &child : node.children)
+      this->emit(*child, node, depth);
+  }
+
+  // Accesses outside of every scope run once, before the scopes
+  void emit_root() {
+    if (!this->root.sites.empty())
+      this->os << this->indent(0) << "// outside of any scope" << std::endl;
+    std::vector<size_t> counters;
+    this->emit_body(this->root, false, 1, "0", 0, counters);
+  }
+};
+
+static size_t count_sites(const Node &node) {
+  size_t n = node.sites.size();
+  for (const auto &child : node.children)
+    n += count_sites(*child);
+  return n;
+}
+
+static void count_contexts(const Node &node,
+                           std::unordered_map<uint64_t, size_t> &contexts) {
+  for (const auto &child : node.children) {
+    ++contexts[child->scope_id];
+    count_contexts(*child, contexts);
+  }
+}
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0 << " [--anonymize] [-o proxy.cpp] "
+            << "trace.cats" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  bool anonymize = false;
+  const char *input = nullptr;
+  const char *output = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--anonymize")) {
+      anonymize = true;
+    } else if (!strcmp(argv[i], "-o") && i + 1 < argc) {
+      output = argv[++i];
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      input = argv[i];
+    }
+  }
+  if (!input) {
+    usage(argv[0]);
+    return 1;
+  }
+
+  TraceReader reader(input);
+  if (!reader.good()) {
+    std::cerr << "Cannot open trace " << input << std::endl;
+    return 1;
+  }
+
+  // Instances of a scope in the same context are merged into one node, the
+  // threads share the tree. An allocation reuses the proxy buffer of an
+  // earlier one of the same name and size that has been freed, so that
+  // allocations in loops do not multiply the footprint.
+  Node root;
+  root.instances = 1;
+  std::vector<Buffer> buffers;
+  std::map<std::pair<std::string, uint64_t>, std::vector<size_t>>
+    buffer_index;
+  std::unordered_map<uint64_t, size_t> live;
+  std::map<uint64_t, std::vector<Node *>> stacks;
+  std::map<uint64_t, Profile> profiles;
+  // Buffer name, size and touched range of every heatmap
+  std::vector<std::tuple<std::string, uint64_t, uint64_t, uint64_t>>
+    heatmaps;
+  TraceRecord record;
+  while (reader.next(record)) {
+    if (record.section() == "scope_profiles") {
+      Profile &profile = profiles[record.u64("scope_id")];
+      profile.count = record.u64("count");
+      profile.has_iterations = record.has("iterations");
+      profile.iterations = record.u64("iterations");
+      continue;
+    }
+    if (record.section() == "heatmaps") {
+      // Touched range of the buffer
+      std::vector<uint64_t> reads = record.u64_array("read_bins");
+      std::vector<uint64_t> writes = record.u64_array("write_bins");
+      uint64_t first = UINT64_MAX, last = 0;
+      for (size_t i = 0; i < reads.size() && i < writes.size(); ++i) {
+        if (reads[i] || writes[i]) {
+          first = std::min<uint64_t>(first, i);
+          last = i;
+        }
+      }
+      if (first == UINT64_MAX)
+        continue;
+      // The bins start at the page of the first byte, up to a page before
+      // the buffer
+      uint64_t bin_size = record.u64("bin_size");
+      uint64_t lead = record.u64("buffer_id") - record.u64("base_address");
+      uint64_t begin = first * bin_size;
+      heatmaps.emplace_back(record.str("buffer_name"), record.u64("size"),
+                            begin - std::min(begin, lead),
+                            (last + 1) * bin_size - lead);
+      continue;
+    }
+    if (record.section() != "events")
+      continue;
+
+    std::vector<Node *> &stack = stacks[record.u64("thread")];
+    if (stack.empty())
+      stack.push_back(&root);
+    std::string type = record.str("type");
+
+    if (type == "scope_entry") {
+      Node *node = stack.back()->child(record.u64("id"));
+      if (node->instances++ == 0) {
+        node->type = record.str("scope_type");
+        node->funcname = record.str("funcname");
+        node->filename = record.str("filename");
+        node->line = record.u64("line");
+      }
+      stack.push_back(node);
+    } else if (type == "scope_exit") {
+      uint64_t id = record.u64("id");
+      auto it = std::find_if(stack.rbegin(), stack.rend() - 1,
+                             [id](const Node *node) {
+        return node->scope_id == id;
+      });
+      if (it != stack.rend() - 1)
+        stack.erase((it + 1).base(), stack.end());
+    } else if (type == "allocation") {
+      auto key = std::make_pair(record.str("buffer_name"),
+                                record.u64("size"));
+      std::vector<size_t> &candidates = buffer_index[key];
+      auto it = std::find_if(candidates.begin(), candidates.end(),
+                             [&buffers](size_t index) {
+        return !buffers[index].live;
+      });
+      size_t index;
+      if (it != candidates.end()) {
+        index = *it;
+      } else {
+        Buffer buffer;
+        buffer.name = key.first;
+        buffer.size = key.second;
+        buffer.end = key.second;
+        index = buffers.size();
+        candidates.push_back(index);
+        buffers.push_back(buffer);
+      }
+      uint64_t id = record.u64("buffer_id");
+      auto previous = live.find(id);
+      if (previous != live.end())
+        buffers[previous->second].live = false;
+      buffers[index].live = true;
+      live[id] = index;
+    } else if (type == "deallocation") {
+      auto it = live.find(record.u64("buffer_id"));
+      if (it == live.end())
+        continue;
+      buffers[it->second].live = false;
+      live.erase(it);
+    } else if (type == "access") {
+      auto it = live.find(record.u64("buffer_id"));
+      if (it == live.end() || buffers[it->second].size == 0)
+        continue;
+      bool write = record.str("mode") == "w";
+      Site_Key key(record.str("funcname"), record.u64("line"),
+                   record.u64("col"), write, it->second);
+      Site &site = stack.back()->sites[key];
+      if (site.events++ == 0) {
+        site.funcname = std::get<0>(key);
+        site.line = std::get<1>(key);
+        site.col = std::get<2>(key);
+        site.write = write;
+        site.buffer = it->second;
+        site.size = record.u64("size");
+        site.element_size = record.u64("element_size");
+        site.shape = record.str("shape");
+        site.traversal = record.str("traversal");
+      }
+    }
+  }
+
+  // Heatmaps name buffers by address, which is not kept after the trace is
+  // read, so the touched range of a heatmap applies to the proxy buffers of
+  // the same name and size
+  for (const auto &heatmap : heatmaps) {
+    auto it = buffer_index.find(std::make_pair(std::get<0>(heatmap),
+                                               std::get<1>(heatmap)));
+    if (it == buffer_index.end())
+      continue;
+    for (size_t index : it->second) {
+      Buffer &buffer = buffers[index];
+      uint64_t begin = std::get<2>(heatmap);
+      uint64_t end = std::min(buffer.size, std::get<3>(heatmap));
+      if (!buffer.heatmap) {
+        buffer.begin = begin;
+        buffer.end = end;
+        buffer.heatmap = true;
+      } else {
+        buffer.begin = std::min(buffer.begin, begin);
+        buffer.end = std::max(buffer.end, end);
+      }
+    }
+  }
+
+  std::ofstream ofs;
+  if (output) {
+    ofs.open(output);
+    if (!ofs.good()) {
+      std::cerr << "Cannot open output " << output << std::endl;
+      return 1;
+    }
+  }
+  std::ostream &os = output ? ofs : std::cout;
+
+  os << "// Proxy benchmark generated by cats-proxygen. It reproduces the"
+     << std::endl;
+  os << "// scope nesting, buffer sizes and access patterns of a CATS trace."
+     << std::endl << std::endl;
+  os << "#include <chrono>" << std::endl;
+  os << "#include <cstdint>" << std::endl;
+  os << "#include <cstdio>" << std::endl;
+  os << "#include <cstring>" << std::endl;
+  os << "#include <vector>" << std::endl << std::endl;
+  os << "static inline uint64_t load(const char *base, uint64_t offset, "
+     << "uint64_t bytes) {" << std::endl;
+  os << "  uint64_t sum = 0;" << std::endl;
+  os << "  for (uint64_t i = 0; i < bytes; i += sizeof(uint64_t)) {"
+     << std::endl;
+  os << "    uint64_t value = 0;" << std::endl;
+  os << "    std::memcpy(&value, base + offset + i, "
+     << "bytes - i < sizeof(value) ? bytes - i : sizeof(value));"
+     << std::endl;
+  os << "    sum += value;" << std::endl;
+  os << "  }" << std::endl;
+  os << "  return sum;" << std::endl;
+  os << "}" << std::endl << std::endl;
+  os << "static inline void store(char *base, uint64_t offset, "
+     << "uint64_t bytes) {" << std::endl;
+  os << "  std::memset(base + offset, (int) offset, bytes);" << std::endl;
+  os << "}" << std::endl << std::endl;
+  os << "int main() {" << std::endl;
+  for (size_t i = 0; i < buffers.size(); ++i) {
+    os << "  std::vector<char> b" << i << "(" << buffers[i].size << ");";
+    if (!anonymize)
+      os << " // " << buffers[i].name;
+    os << std::endl;
+  }
+  size_t sites = count_sites(root);
+  for (size_t i = 0; i < sites; ++i)
+    os << "  uint64_t c" << i << " = 0;" << std::endl;
+  os << "  uint64_t sum = 0;" << std::endl;
+  os << "  auto start = std::chrono::steady_clock::now();" << std::endl
+     << std::endl;
+
+  std::unordered_map<uint64_t, size_t> contexts;
+  count_contexts(root, contexts);
+  Generator generator{os, buffers, profiles, root, contexts, anonymize};
+  generator.emit_root();
+
+  os << std::endl;
+  os << "  double seconds = std::chrono::duration<double>(" << std::endl;
+  os << "    std::chrono::steady_clock::now() - start" << std::endl;
+  os << "  ).count();" << std::endl;
+  os << "  std::printf(\"time %f s (checksum %llu)\\n\", seconds, "
+     << "(unsigned long long) sum);" << std::endl;
+  os << "  return 0;" << std::endl;
+  os << "}" << std::endl;
+  return 0;
+}
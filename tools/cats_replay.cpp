@@ -0,0 +1,433 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+// cats-replay: replays the allocations, accesses and deallocations of a CATS
+// trace against real memory and reports the time they take. The allocator,
+// the page size and the NUMA placement of the buffers can be chosen, and the
+// accesses between two allocation events are split among a configurable
+// number of threads, so that layout and placement strategies can be
+// evaluated on the recorded access behavior without rebuilding the
+// application.
+
+#include "cats_trace_reader.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include <dirent.h>
+#include <linux/mempolicy.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+using cats::tools::TraceReader;
+using cats::tools::TraceRecord;
+
+// Phases with fewer accesses are replayed by the main thread alone
+static const size_t MIN_PARALLEL_ACCESSES = 4096;
+
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+enum Op_Kind : uint8_t {
+  OP_ALLOC,
+  OP_FREE,
+  OP_READ,
+  OP_WRITE
+};
+
+// `buffer` indexes the allocations of the replay in trace order
+struct Op {
+  uint8_t kind;
+  uint32_t buffer;
+  uint64_t offset;
+  uint64_t size;
+};
+
+enum Allocator {
+  ALLOCATOR_MALLOC,
+  ALLOCATOR_MMAP
+};
+
+enum Pages {
+  PAGES_DEFAULT,
+  PAGES_THP,
+  PAGES_HUGETLB
+};
+
+struct Options {
+  unsigned threads = 1;
+  unsigned repeat = 1;
+  Allocator allocator = ALLOCATOR_MALLOC;
+  Pages pages = PAGES_DEFAULT;
+  // MPOL_DEFAULT leaves the placement to first touch
+  int numa_mode = MPOL_DEFAULT;
+  unsigned long numa_mask = 0;
+};
+
+struct Buffer {
+  char *data = nullptr;
+  uint64_t size = 0;
+  // Length of the mapping, 0 if allocated with malloc
+  size_t mapped = 0;
+};
+
+// Mappings that got the requested pages and placement, and the error of the
+// last one that did not
+struct Applied {
+  uint64_t mappings = 0;
+  uint64_t pages = 0;
+  uint64_t placed = 0;
+  int pages_error = 0;
+  int numa_error = 0;
+};
+
+struct Timing {
+  double total = 0.0;
+  double access = 0.0;
+  double alloc = 0.0;
+};
+
+static void usage(const char *argv0) {
+  std::cerr << "Usage: " << argv0 << " [--threads N] [--repeat N] "
+            << "[--allocator malloc|mmap] [--pages default|thp|2M] "
+            << "[--numa default|interleave|bind=NODE|preferred=NODE] "
+            << "trace.cats" << std::endl;
+}
+
+static unsigned numa_nodes() {
+  unsigned nodes = 0;
+  DIR *dir = opendir("/sys/devices/system/node");
+  if (!dir)
+    return 1;
+  while (struct dirent *entry = readdir(dir)) {
+    if (!strncmp(entry->d_name, "node", 4) &&
+        entry->d_name[4] >= '0' && entry->d_name[4] <= '9')
+      ++nodes;
+  }
+  closedir(dir);
+  return std::max(nodes, 1u);
+}
+
+static bool parse_numa(const char *value, Options &options) {
+  if (!strcmp(value, "default")) {
+    options.numa_mode = MPOL_DEFAULT;
+    return true;
+  }
+  if (!strcmp(value, "interleave")) {
+    options.numa_mode = MPOL_INTERLEAVE;
+    unsigned nodes = std::min(numa_nodes(), 64u);
+    options.numa_mask = nodes == 64 ? ~0ul : (1ul << nodes) - 1;
+    return true;
+  }
+  const char *node = strchr(value, '=');
+  if (!node || node[1] < '0' || node[1] > '9')
+    return false;
+  unsigned long index = std::strtoul(node + 1, nullptr, 10);
+  if (index >= 64)
+    return false;
+  options.numa_mask = 1ul << index;
+  if (!strncmp(value, "bind=", 5))
+    options.numa_mode = MPOL_BIND;
+  else if (!strncmp(value, "preferred=", 10))
+    options.numa_mode = MPOL_PREFERRED;
+  else
+    return false;
+  return true;
+}
+
+static Buffer allocate(uint64_t size, const Options &options,
+                       Applied &applied) {
+  Buffer buffer;
+  buffer.size = size;
+  if (options.allocator == ALLOCATOR_MALLOC) {
+    buffer.data = (char *) std::malloc(std::max<uint64_t>(size, 1));
+    return buffer;
+  }
+
+  size_t align = options.pages == PAGES_DEFAULT
+    ? (size_t) sysconf(_SC_PAGESIZE) : HUGE_PAGE_SIZE;
+  size_t length = (std::max<uint64_t>(size, 1) + align - 1) / align * align;
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS;
+  void *data = MAP_FAILED;
+  bool pages = options.pages == PAGES_DEFAULT;
+  if (options.pages == PAGES_HUGETLB) {
+    data = mmap(nullptr, length, PROT_READ | PROT_WRITE,
+                flags | MAP_HUGETLB, -1, 0);
+    pages = data != MAP_FAILED;
+    if (!pages)
+      applied.pages_error = errno;
+  }
+  // Without reserved huge pages the buffer falls back to default pages
+  if (data == MAP_FAILED)
+    data = mmap(nullptr, length, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (data == MAP_FAILED)
+    return buffer;
+  if (options.pages == PAGES_THP) {
+    pages = madvise(data, length, MADV_HUGEPAGE) == 0;
+    if (!pages)
+      applied.pages_error = errno;
+  }
+  bool placed = options.numa_mode == MPOL_DEFAULT;
+  if (!placed) {
+    // The kernel reads one bit less than `maxnode`
+    placed = syscall(SYS_mbind, data, length, options.numa_mode,
+                     &options.numa_mask, sizeof(options.numa_mask) * 8 + 1,
+                     0) == 0;
+    if (!placed)
+      applied.numa_error = errno;
+  }
+  ++applied.mappings;
+  applied.pages += pages;
+  applied.placed += placed;
+  buffer.data = (char *) data;
+  buffer.mapped = length;
+  return buffer;
+}
+
+static void release(Buffer &buffer) {
+  if (!buffer.data)
+    return;
+  if (buffer.mapped)
+    munmap(buffer.data, buffer.mapped);
+  else
+    std::free(buffer.data);
+  buffer.data = nullptr;
+}
+
+// Replays the accesses [begin, end), returns a checksum of the loaded
+// values so that the loads are not optimized away.
+static uint64_t replay_accesses(const Op *begin, const Op *end,
+                                const std::vector<Buffer> &buffers) {
+  uint64_t sum = 0;
+  for (const Op *op = begin; op != end; ++op) {
+    const Buffer &buffer = buffers[op->buffer];
+    if (!buffer.data || op->offset >= buffer.size)
+      continue;
+    char *address = buffer.data + op->offset;
+    uint64_t size = std::min(op->size, buffer.size - op->offset);
+    if (op->kind == OP_WRITE) {
+      std::memset(address, (int) op->offset, size);
+      continue;
+    }
+    for (uint64_t i = 0; i < size; i += sizeof(uint64_t)) {
+      uint64_t value = 0;
+      std::memcpy(&value, address + i,
+                  std::min<uint64_t>(size - i, sizeof(value)));
+      sum += value;
+    }
+  }
+  return sum;
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double>(
+    std::chrono::steady_clock::now() - start
+  ).count();
+}
+
+static Timing replay(const std::vector<Op> &ops, size_t n_buffers,
+                     const Options &options, uint64_t &checksum,
+                     Applied &applied) {
+  Timing timing;
+  std::vector<Buffer> buffers(n_buffers);
+  auto start = std::chrono::steady_clock::now();
+  size_t i = 0;
+  while (i < ops.size()) {
+    const Op &op = ops[i];
+    if (op.kind == OP_ALLOC || op.kind == OP_FREE) {
+      auto alloc_start = std::chrono::steady_clock::now();
+      if (op.kind == OP_ALLOC)
+        buffers[op.buffer] = allocate(op.size, options, applied);
+      else
+        release(buffers[op.buffer]);
+      timing.alloc += seconds_since(alloc_start);
+      ++i;
+      continue;
+    }
+
+    // A phase of accesses, up to the next allocation event
+    size_t j = i;
+    while (j < ops.size() && ops[j].kind != OP_ALLOC &&
+           ops[j].kind != OP_FREE)
+      ++j;
+    auto access_start = std::chrono::steady_clock::now();
+    size_t n = j - i;
+    unsigned threads = n >= MIN_PARALLEL_ACCESSES ? options.threads : 1;
+    if (threads <= 1) {
+      checksum += replay_accesses(&ops[i], &ops[j], buffers);
+    } else {
+      // Contiguous chunks, like a static schedule
+      std::vector<std::thread> workers;
+      std::vector<uint64_t> sums(threads, 0);
+      for (unsigned t = 0; t < threads; ++t) {
+        const Op *begin = &ops[i] + n * t / threads;
+        const Op *end = &ops[i] + n * (t + 1) / threads;
+        workers.emplace_back([begin, end, &buffers, &sums, t]() {
+          sums[t] = replay_accesses(begin, end, buffers);
+        });
+      }
+      for (unsigned t = 0; t < threads; ++t) {
+        workers[t].join();
+        checksum += sums[t];
+      }
+    }
+    timing.access += seconds_since(access_start);
+    i = j;
+  }
+  for (Buffer &buffer : buffers)
+    release(buffer);
+  timing.total = seconds_since(start);
+  return timing;
+}
+
+int main(int argc, char *argv[]) {
+  Options options;
+  const char *input = nullptr;
+
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+      options.threads = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+      options.repeat = std::max(1ul, std::strtoul(argv[++i], nullptr, 10));
+    } else if (!strcmp(argv[i], "--allocator") && i + 1 < argc) {
+      const char *value = argv[++i];
+      if (!strcmp(value, "malloc")) {
+        options.allocator = ALLOCATOR_MALLOC;
+      } else if (!strcmp(value, "mmap")) {
+        options.allocator = ALLOCATOR_MMAP;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--pages") && i + 1 < argc) {
+      const char *value = argv[++i];
+      if (!strcmp(value, "default")) {
+        options.pages = PAGES_DEFAULT;
+      } else if (!strcmp(value, "thp")) {
+        options.pages = PAGES_THP;
+      } else if (!strcmp(value, "2M")) {
+        options.pages = PAGES_HUGETLB;
+      } else {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (!strcmp(argv[i], "--numa") && i + 1 < argc) {
+      if (!parse_numa(argv[++i], options)) {
+        usage(argv[0]);
+        return 1;
+      }
+    } else if (argv[i][0] == '-') {
+      usage(argv[0]);
+      return 1;
+    } else {
+      input = argv[i];
+    }
+  }
+  if (!input) {
+    usage(argv[0]);
+    return 1;
+  }
+  // Page sizes and placement are applied to mappings
+  if (options.pages != PAGES_DEFAULT || options.numa_mode != MPOL_DEFAULT)
+    options.allocator = ALLOCATOR_MMAP;
+
+  TraceReader reader(input);
+  if (!reader.good()) {
+    std::cerr << "Cannot open trace " << input << std::endl;
+    return 1;
+  }
+
+  // The threads of the trace are merged in the order of the events
+  std::vector<Op> ops;
+  std::unordered_map<uint64_t, uint32_t> live;
+  uint32_t n_buffers = 0;
+  uint64_t accesses = 0, bytes = 0, without_offset = 0;
+  TraceRecord record;
+  while (reader.next(record)) {
+    if (record.section() != "events")
+      continue;
+    std::string type = record.str("type");
+    if (type == "allocation") {
+      uint64_t id = record.u64("buffer_id");
+      // An address allocated twice without a free in between was released
+      // by an untraced call
+      auto it = live.find(id);
+      if (it != live.end())
+        ops.push_back({OP_FREE, it->second, 0, 0});
+      live[id] = n_buffers;
+      ops.push_back({OP_ALLOC, n_buffers++, 0, record.u64("size")});
+    } else if (type == "deallocation") {
+      auto it = live.find(record.u64("buffer_id"));
+      if (it == live.end())
+        continue;
+      ops.push_back({OP_FREE, it->second, 0, 0});
+      live.erase(it);
+    } else if (type == "access") {
+      auto it = live.find(record.u64("buffer_id"));
+      if (it == live.end())
+        continue;
+      if (!record.has("offset"))
+        ++without_offset;
+      // Accesses of unknown size are replayed as 8-byte accesses
+      uint64_t size = record.u64("size");
+      if (size == 0)
+        size = record.u64("element_size", 8);
+      uint8_t kind = record.str("mode") == "w" ? OP_WRITE : OP_READ;
+      ops.push_back({kind, it->second, record.u64("offset"), size});
+      ++accesses;
+      bytes += size;
+    }
+  }
+  if (without_offset)
+    std::cerr << without_offset << " accesses without an offset are "
+              << "replayed at the start of their buffer" << std::endl;
+
+  std::cout << "Buffers: " << n_buffers << ", accesses: " << accesses
+            << " (" << bytes << " bytes)" << std::endl;
+  std::cout << "Allocator: "
+            << (options.allocator == ALLOCATOR_MMAP ? "mmap" : "malloc")
+            << ", pages: "
+            << (options.pages == PAGES_THP ? "thp" :
+                options.pages == PAGES_HUGETLB ? "2M" : "default")
+            << ", NUMA: "
+            << (options.numa_mode == MPOL_INTERLEAVE ? "interleave" :
+                options.numa_mode == MPOL_BIND ? "bind" :
+                options.numa_mode == MPOL_PREFERRED ? "preferred" : "default")
+            << ", threads: " << options.threads << std::endl;
+
+  uint64_t checksum = 0;
+  Timing best;
+  Applied applied;
+  for (unsigned run = 0; run < options.repeat; ++run) {
+    Timing timing = replay(ops, n_buffers, options, checksum, applied);
+    std::cout << "Run " << run << ": " << timing.total << " s total, "
+              << timing.access << " s accesses, " << timing.alloc
+              << " s allocations" << std::endl;
+    if (run == 0 || timing.total < best.total)
+      best = timing;
+  }
+  if (applied.pages < applied.mappings) {
+    std::cout << "Applied pages: " << applied.pages << " of "
+              << applied.mappings << " mappings ("
+              << std::strerror(applied.pages_error) << ")" << std::endl;
+  }
+  if (applied.placed < applied.mappings) {
+    std::cout << "Applied NUMA policy: " << applied.placed << " of "
+              << applied.mappings << " mappings ("
+              << std::strerror(applied.numa_error) << ")" << std::endl;
+  }
+  if (best.access > 0) {
+    std::cout << "Best: " << best.total << " s, "
+              << accesses / best.access / 1e6 << " M accesses/s, "
+              << bytes / best.access / 1e9 << " GB/s" << std::endl;
+  }
+  std::cout << "Checksum: " << checksum << std::endl;
+  return 0;
+}
@@ -0,0 +1,262 @@
+// Copyright (c) ETH Zurich, the cats-llvm authors, and Lawrence Livermore National Security, LLC. All rights reserved.
+
+#ifndef __CATS_TRACE_READER_HPP__
+#define __CATS_TRACE_READER_HPP__
+
+#include <cstdint>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace cats {
+namespace tools {
+
+// A single flat record of a CATS trace file. The runtime writes one record
+// per line, so a record keeps its line and a list of (key, value) slices into
+// it. String values are stored without their quotes, arrays and objects are
+// kept verbatim.
+class TraceRecord {
+public:
+  const std::string &section() const { return this->_section; }
+
+  bool has(const std::string &key) const {
+    return this->find(key) != nullptr;
+  }
+
+  std::string str(const std::string &key,
+                  const std::string &fallback = "") const {
+    const std::pair<size_t, size_t> *value = this->find(key);
+    if (!value)
+      return fallback;
+    return this->_line.substr(value->first, value->second);
+  }
+
+  uint64_t u64(const std::string &key, uint64_t fallback = 0) const {
+    const std::pair<size_t, size_t> *value = this->find(key);
+    if (!value || value->second == 0)
+      return fallback;
+    return std::strtoull(this->_line.c_str() + value->first, nullptr, 10);
+  }
+
+  int64_t i64(const std::string &key, int64_t fallback = 0) const {
+    const std::pair<size_t, size_t> *value = this->find(key);
+    if (!value || value->second == 0)
+      return fallback;
+    return std::strtoll(this->_line.c_str() + value->first, nullptr, 10);
+  }
+
+  double f64(const std::string &key, double fallback = 0.0) const {
+    const std::pair<size_t, size_t> *value = this->find(key);
+    if (!value || value->second == 0)
+      return fallback;
+    return std::strtod(this->_line.c_str() + value->first, nullptr);
+  }
+
+  // Parses a flat JSON array of integers such as "[1, 2, 3]".
+  std::vector<uint64_t> u64_array(const std::string &key) const {
+    std::vector<uint64_t> values;
+    const std::pair<size_t, size_t> *value = this->find(key);
+    if (!value)
+      return values;
+    const char *it = this->_line.c_str() + value->first;
+    const char *end = it + value->second;
+    while (it < end) {
+      if (*it >= '0' && *it <= '9') {
+        char *next = nullptr;
+        values.push_back(std::strtoull(it, &next, 10));
+        it = next;
+      } else {
+        ++it;
+      }
+    }
+    return values;
+  }
+
+private:
+  friend class TraceReader;
+
+  std::string _section;
+  std::string _line;
+  std::vector<std::pair<std::string, std::pair<size_t, size_t>>> _fields;
+
+  const std::pair<size_t, size_t> *find(const std::string &key) const {
+    for (auto &field : this->_fields) {
+      if (field.first == key)
+        return &field.second;
+    }
+    return nullptr;
+  }
+
+  bool parse() {
+    this->_fields.clear();
+    size_t pos = this->_line.find('{');
+    if (pos == std::string::npos)
+      return false;
+    ++pos;
+    const size_t len = this->_line.size();
+    while (pos < len) {
+      // Key
+      size_t key_begin = this->_line.find('"', pos);
+      if (key_begin == std::string::npos)
+        break;
+      size_t key_end = this->_line.find('"', key_begin + 1);
+      if (key_end == std::string::npos)
+        return false;
+      std::string key = this->_line.substr(key_begin + 1,
+                                           key_end - key_begin - 1);
+      pos = this->_line.find(':', key_end);
+      if (pos == std::string::npos)
+        return false;
+      ++pos;
+      while (pos < len && this->_line[pos] == ' ')
+        ++pos;
+      if (pos >= len)
+        return false;
+
+      // Value
+      size_t value_begin = pos;
+      size_t value_end = pos;
+      if (this->_line[pos] == '"') {
+        value_begin = pos + 1;
+        value_end = value_begin;
+        while (value_end < len && this->_line[value_end] != '"') {
+          if (this->_line[value_end] == '\\')
+            ++value_end;
+          ++value_end;
+        }
+        pos = value_end + 1;
+      } else if (this->_line[pos] == '[' || this->_line[pos] == '{') {
+        int depth = 0;
+        while (value_end < len) {
+          char c = this->_line[value_end];
+          if (c == '[' || c == '{')
+            ++depth;
+          else if (c == ']' || c == '}')
+            --depth;
+          ++value_end;
+          if (depth == 0)
+            break;
+        }
+        pos = value_end;
+      } else {
+        while (value_end < len && this->_line[value_end] != ',' &&
+               this->_line[value_end] != '}')
+          ++value_end;
+        pos = value_end;
+      }
+      this->_fields.emplace_back(
+        std::move(key), std::make_pair(value_begin, value_end - value_begin)
+      );
+
+      pos = this->_line.find_first_of(",}", pos);
+      if (pos == std::string::npos || this->_line[pos] == '}')
+        break;
+      ++pos;
+    }
+    return true;
+  }
+};
+
+// Streams the records of a trace file written by cats_trace_save. Records
+// are returned in file order together with the name of the top level section
+// ("events", ...) they belong to, so tools can process arbitrarily large
+// traces in a single pass.
+class TraceReader {
+public:
+  explicit TraceReader(const std::string &path) : _ifs(path) {}
+
+  bool good() const { return this->_ifs.good(); }
+
+  bool next(TraceRecord &record) {
+    std::string line;
+    while (std::getline(this->_ifs, line)) {
+      size_t first = line.find_first_not_of(' ');
+      if (first == std::string::npos)
+        continue;
+      if (line[first] == '"') {
+        // Section header, e.g. `  "events": [`
+        size_t end = line.find('"', first + 1);
+        if (end != std::string::npos)
+          this->_section = line.substr(first + 1, end - first - 1);
+        continue;
+      }
+      if (line[first] != '{' || first == 0)
+        continue;
+      record._section = this->_section;
+      record._line = std::move(line);
+      if (record.parse())
+        return true;
+    }
+    return false;
+  }
+
+private:
+  std::ifstream _ifs;
+  std::string _section;
+};
+
+struct Frame {
+  uint64_t scope_id;
+  size_t prefix_length;
+};
+
+// Scope stack of a thread while a trace is streamed, folded into
+// `main;gemm;loop@12`. The folded representation of the current stack is
+// kept up to date incrementally so that attributing a weight never has to
+// re-join the frames.
+class FoldedStack {
+public:
+  void push(uint64_t scope_id, const std::string &frame) {
+    this->_frames.push_back({scope_id, this->_folded.size()});
+    if (!this->_folded.empty())
+      this->_folded += ';';
+    this->_folded += frame;
+  }
+
+  void pop(uint64_t scope_id) {
+    bool found = false;
+    for (auto &frame : this->_frames) {
+      if (frame.scope_id == scope_id) {
+        found = true;
+        break;
+      }
+    }
+    if (!found)
+      return;
+    while (!this->_frames.empty()) {
+      Frame top = this->_frames.back();
+      this->_frames.pop_back();
+      this->_folded.resize(top.prefix_length);
+      if (top.scope_id == scope_id)
+        break;
+    }
+  }
+
+  const std::string &folded() const { return this->_folded; }
+
+private:
+  std::vector<Frame> _frames;
+  std::string _folded;
+};
+
+// Name of the frame of a scope_entry record in folded stacks.
+inline std::string frame_name(const TraceRecord &record) {
+  std::string scope_type = record.str("scope_type");
+  if (scope_type == "func")
+    return record.str("funcname");
+  std::string line = std::to_string(record.u64("line"));
+  if (scope_type == "loop")
+    return "loop@" + line;
+  if (scope_type == "para")
+    return "parallel@" + line;
+  if (scope_type == "cond")
+    return "cond@" + line;
+  return "scope@" + line;
+}
+
+} // namespace tools
+} // namespace cats
+
+#endif // __CATS_TRACE_READER_HPP__